@@ -24,157 +24,305 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#if 0
+#include "Lgi.h"
+#include "Diff.h"
+#include "GProgressDlg.h"
+#include <bzlib.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAS_SSE2			1
+#else
+#define HAS_SSE2			0
+#endif
+
+#define DIFF_PROGRESS_STEPS	256			// Searches between checks of the time
+#define DIFF_UPDATE_MS		200
+#define SAIS_CHECK_MASK		0xfffff		// Sort steps between checks of the time
+
+// Suffix array construction by induced sorting (SA-IS, Nong, Zhang & Chan
+// 2009). Linear time, and apart from the caller's index array the working
+// set is a type bit per symbol plus the bucket table, the reduced problem is
+// solved in place inside the index array. Indices are 32-bit so the whole
+// thing costs a little over 4 bytes per input byte, where qsufsort needed 8.
+//
+// The texts below include the sentinel: position n-1 is a unique symbol
+// smaller than everything else. The top level maps bytes to 1..256 and
+// makes the sentinel 0 so that we never need a copy of the input.
+struct SaisBytes
+{
+	const uint8 *s;
+	int32 len;
 
-#include <sys/types.h>
+	int32 operator [](int32 i) const { return i < len ? (int32)s[i] + 1 : 0; }
+};
 
-#include <C:\Data\thunderbird 3.1.7\mozilla\modules\libbz2\src\bzlib.h>
-#include <fcntl.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+struct SaisInts
+{
+	const int32 *s;
 
-#define MIN(x,y) (((x) < (y)) ? (x) : (y))
+	int32 operator [](int32 i) const { return s[i]; }
+};
 
-static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
+struct SaisState
 {
-	off_t i,j,k,x,tmp,jj,kk;
+	int64 Cur, Peak;
+	GProgressDlg *Prog;
+	uint64 Ts;
+
+	SaisState(GProgressDlg *prog = NULL)
+	{
+		Cur = Peak = 0;
+		Prog = prog;
+		Ts = LgiCurrentTime();
+	}
 
-	if (len<16)
+	/// Called every so often during the sort, keeps the progress dialog
+	/// painting and returns false if it's been cancelled.
+	bool Check()
 	{
-		for(k=start;k<start+len;k+=j)
+		if (Prog && LgiCurrentTime() - Ts > DIFF_UPDATE_MS)
 		{
-			j=1;x=V[I[k]+h];
-			for(i=1;k+i<start+len;i++)
-			{
-				if(V[I[k+i]+h]<x)
-				{
-					x=V[I[k+i]+h];
-					j=0;
-				}
-				if(V[I[k+i]+h]==x)
-				{
-					tmp=I[k+j];I[k+j]=I[k+i];I[k+i]=tmp;
-					j++;
-				}
-			}
-			
-			for(i=0;i<j;i++)
-				V[I[k+i]]=k+j-1;
-			if(j==1)
-				I[k]=-1;
+			Ts = LgiCurrentTime();
+			LgiYield();
+			if (Prog->IsCancelled())
+				return false;
 		}
-		return;
+		return true;
 	}
 
-	x=V[I[start+len/2]+h];
-	jj=0;
-	kk=0;
-	for(i=start;i<start+len;i++)
+	void *Alloc(size_t Bytes)
 	{
-		if(V[I[i]+h]<x)
-			jj++;
-		if(V[I[i]+h]==x)
-			kk++;
+		void *p = malloc(Bytes);
+		if (p)
+		{
+			Cur += Bytes;
+			if (Cur > Peak)
+				Peak = Cur;
+		}
+		return p;
 	}
-	jj+=start;
-	kk+=jj;
 
-	i=start;
-	j=0;
-	k=0;
-	while (i<jj)
+	void Free(void *p, size_t Bytes)
 	{
-		if(V[I[i]+h]<x)
+		if (p)
 		{
-			i++;
+			free(p);
+			Cur -= Bytes;
 		}
-		else if(V[I[i]+h]==x)
+	}
+};
+
+#define SaisGetType(i)		((t[(i) >> 3] >> ((i) & 7)) & 1)
+#define SaisSetType(i, b)	if (b) t[(i) >> 3] |= 1 << ((i) & 7); else t[(i) >> 3] &= ~(1 << ((i) & 7))
+#define SaisIsLms(i)		((i) > 0 && SaisGetType(i) && !SaisGetType((i) - 1))
+
+template<typename Text>
+static void SaisBuckets(const Text &s, int32 *bkt, int32 n, int32 K, bool End)
+{
+	int32 i, Sum = 0;
+	for (i = 0; i <= K; i++)
+		bkt[i] = 0;
+	for (i = 0; i < n; i++)
+		bkt[s[i]]++;
+	for (i = 0; i <= K; i++)
+	{
+		Sum += bkt[i];
+		bkt[i] = End ? Sum : Sum - bkt[i];
+	}
+}
+
+// Returns false if the progress dialog was cancelled part way through
+template<typename Text>
+static bool SaisInduce(SaisState &St, const Text &s, const uint8 *t, int32 *SA, int32 *bkt, int32 n, int32 K)
+{
+	int32 i, j;
+
+	// L-type suffixes from the left, using the bucket heads
+	SaisBuckets(s, bkt, n, K, false);
+	for (i = 0; i < n; i++)
+	{
+		if (!(i & SAIS_CHECK_MASK) && !St.Check())
+			return false;
+		j = SA[i] - 1;
+		if (j >= 0 && !SaisGetType(j))
+			SA[bkt[s[j]]++] = j;
+	}
+
+	// S-type suffixes from the right, using the bucket tails
+	SaisBuckets(s, bkt, n, K, true);
+	for (i = n - 1; i >= 0; i--)
+	{
+		if (!(i & SAIS_CHECK_MASK) && !St.Check())
+			return false;
+		j = SA[i] - 1;
+		if (j >= 0 && SaisGetType(j))
+			SA[--bkt[s[j]]] = j;
+	}
+
+	return true;
+}
+
+// 'Spare' is an unused stretch of the caller's index array, if the bucket
+// table fits there we don't need to allocate it.
+template<typename Text>
+static bool SaisSort(SaisState &St, const Text &s, int32 *SA, int32 n, int32 K, int32 *Spare = NULL, int32 SpareLen = 0)
+{
+	int32 i, j;
+	size_t TSize = (n >> 3) + 1;
+	size_t BSize = K + 1 <= SpareLen ? 0 : (K + 1) * sizeof(int32);
+	uint8 *t = (uint8*) St.Alloc(TSize);
+	int32 *bkt = BSize ? (int32*) St.Alloc(BSize) : Spare;
+	if (!t || !bkt)
+	{
+		St.Free(t, TSize);
+		if (BSize)
+			St.Free(bkt, BSize);
+		return false;
+	}
+
+	// Classify each suffix as S-type (1) or L-type (0)
+	SaisSetType(n - 1, 1);
+	if (n > 1)
+	{
+		SaisSetType(n - 2, 0);
+	}
+	bool Ok = true;
+	for (i = n - 3; Ok && i >= 0; i--)
+	{
+		if (!(i & SAIS_CHECK_MASK))
+			Ok = St.Check();
+		SaisSetType(i, s[i] < s[i+1] || (s[i] == s[i+1] && SaisGetType(i + 1)));
+	}
+
+	// Stage 1: sort the LMS substrings by placing the LMS positions at their
+	// bucket tails and inducing.
+	SaisBuckets(s, bkt, n, K, true);
+	for (i = 0; i < n; i++)
+		SA[i] = -1;
+	for (i = 1; Ok && i < n; i++)
+	{
+		if (!(i & SAIS_CHECK_MASK))
+			Ok = St.Check();
+		if (SaisIsLms(i))
+			SA[--bkt[s[i]]] = i;
+	}
+	if (!Ok || !SaisInduce(St, s, t, SA, bkt, n, K))
+	{
+		St.Free(t, TSize);
+		if (BSize)
+			St.Free(bkt, BSize);
+		return false;
+	}
+
+	// Compact the sorted LMS substrings into the front of SA
+	int32 n1 = 0;
+	for (i = 0; i < n; i++)
+		if (SaisIsLms(SA[i]))
+			SA[n1++] = SA[i];
+
+	// Name them, equal substrings get equal names. Every LMS position is at
+	// least two apart, so pos/2 gives each one its own slot in the back half.
+	for (i = n1; i < n; i++)
+		SA[i] = -1;
+	int32 Name = 0, Prev = -1;
+	for (i = 0; i < n1; i++)
+	{
+		int32 Pos = SA[i];
+		bool Diff = false;
+		for (int32 d = 0; d < n; d++)
 		{
-			tmp=I[i];I[i]=I[jj+j];I[jj+j]=tmp;
-			j++;
+			if (Prev < 0 ||
+				s[Pos + d] != s[Prev + d] ||
+				SaisGetType(Pos + d) != SaisGetType(Prev + d))
+			{
+				Diff = true;
+				break;
+			}
+			if (d > 0 && (SaisIsLms(Pos + d) || SaisIsLms(Prev + d)))
+				break;
 		}
-		else
+		if (Diff)
 		{
-			tmp=I[i];I[i]=I[kk+k];I[kk+k]=tmp;
-			k++;
+			Name++;
+			Prev = Pos;
 		}
+		SA[n1 + (Pos >> 1)] = Name - 1;
 	}
-
-	while(jj+j<kk)
+	for (i = j = n - 1; i >= n1; i--)
+		if (SA[i] >= 0)
+			SA[j--] = SA[i];
+
+	// Stage 2: sort the reduced string, recursing if the names aren't unique.
+	// The reduced string lives in the last n1 slots and its suffix array in
+	// the first n1, which never overlap as n1 <= n/2.
+	int32 *s1 = SA + n - n1;
+	if (Name < n1)
 	{
-		if(V[I[jj+j]+h]==x)
+		SaisInts Reduced = {s1};
+		if (!SaisSort(St, Reduced, SA, n1, Name - 1, SA + n1, n - n1 - n1))
 		{
-			j++;
+			St.Free(t, TSize);
+			if (BSize)
+				St.Free(bkt, BSize);
+			return false;
 		}
-		else
-		{
-			tmp=I[jj+j];I[jj+j]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		}
-	}
-
-	if (jj>start)
-		split(I,V,start,jj-start,h);
-
-	for(i=0;i<kk-jj;i++)
-		V[I[jj+i]]=kk-1;
-	if (jj==kk-1)
-		I[jj]=-1;
-
-	if (start+len>kk)
-		split(I,V,kk,start+len-kk,h);
-}
-
-static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
-{
-	off_t buckets[256];
-	off_t i,h,len;
-
-	for (i=0;i<256;i++)
-		buckets[i]=0;
-	for (i=0;i<oldsize;i++)
-		buckets[old[i]]++;
-	for (i=1;i<256;i++)
-		buckets[i]+=buckets[i-1];
-	for (i=255;i>0;i--)
-		buckets[i]=buckets[i-1];
-	buckets[0]=0;
-
-	for(i=0;i<oldsize;i++)
-		I[++buckets[old[i]]] = i;
-	I[0]=oldsize;
-	for(i=0;i<oldsize;i++)
-		V[i]=buckets[old[i]];
-	V[oldsize]=0;
-	for(i=1;i<256;i++)
-		if(buckets[i]==buckets[i-1]+1)
-			I[buckets[i]]=-1;
-	I[0]=-1;
-
-	for(h=1;I[0]!=-(oldsize+1);h+=h) {
-		len=0;
-		for(i=0;i<oldsize+1;) {
-			if(I[i]<0) {
-				len-=I[i];
-				i-=I[i];
-			} else {
-				if(len) I[i-len]=-len;
-				len=V[I[i]]+1-i;
-				split(I,V,i,len,h);
-				i+=len;
-				len=0;
-			};
-		};
-		if(len) I[i-len]=-len;
-	};
+	}
+	else
+	{
+		for (i = 0; i < n1; i++)
+			SA[s1[i]] = i;
+	}
+
+	// Stage 3: map the reduced ranks back to LMS positions, drop them into
+	// their buckets in order and induce the full array.
+	for (i = 1, j = 0; i < n; i++)
+		if (SaisIsLms(i))
+			s1[j++] = i;
+	for (i = 0; i < n1; i++)
+		SA[i] = s1[SA[i]];
+	for (i = n1; i < n; i++)
+		SA[i] = -1;
+	SaisBuckets(s, bkt, n, K, true);
+	for (i = n1 - 1; i >= 0; i--)
+	{
+		j = SA[i];
+		SA[i] = -1;
+		SA[--bkt[s[j]]] = j;
+	}
+	bool Status = SaisInduce(St, s, t, SA, bkt, n, K);
+
+	if (BSize)
+		St.Free(bkt, BSize);
+	St.Free(t, TSize);
+	return Status;
+}
+
+bool suffix_sort(int32 *I, const uint8 *buf, int32 len, int64 *PeakBytes, GProgressDlg *Prog)
+{
+	if (!I || !buf || len < 0 || len >= 0x7fffffff)
+		return false;
+
+	// The sentinel sorts first, so I[0] comes out as the empty suffix
+	SaisState St(Prog);
+	if (len == 0)
+	{
+		I[0] = 0;
+		if (PeakBytes)
+			*PeakBytes = sizeof(int32);
+		return true;
+	}
+
+	SaisBytes Text = {buf, len};
+	bool Status = SaisSort(St, Text, I, len + 1, 256);
+	if (PeakBytes)
+		*PeakBytes = St.Peak + ((int64)len + 1) * sizeof(int32);
 
-	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
+	return Status;
 }
 
-static off_t matchlen(u_char *old,off_t oldsize,u_char *New,off_t newsize)
+static int32 matchlen(const uint8 *old, int32 oldsize, const uint8 *New, int32 newsize)
 {
-	off_t i;
+	int32 i;
 
 	for (i=0; (i < oldsize) && (i < newsize); i++)
 		if (old[i] != New[i])
@@ -183,472 +331,2698 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *New,off_t newsize)
 	return i;
 }
 
-off_t search(off_t *I,
-			u_char *old,
-			off_t oldsize,
-			u_char *New,
-			off_t newsize,
-			off_t st,
-			off_t en,
-			off_t *pos)
+static int32 search(const int32 *I,
+					const uint8 *old,
+					int32 oldsize,
+					const uint8 *New,
+					int32 newsize,
+					int32 st,
+					int32 en,
+					int32 *pos)
+{
+	int32 x, y;
+
+	while (en - st >= 2)
+	{
+		x = st + (en - st) / 2;
+		if (memcmp(old + I[x], New, MIN(oldsize - I[x], newsize)) < 0)
+			st = x;
+		else
+			en = x;
+	}
+
+	x = matchlen(old+I[st], oldsize-I[st], New, newsize);
+	y = matchlen(old+I[en], oldsize-I[en], New, newsize);
+	if (x > y)
+	{
+		*pos = I[st];
+		return x;
+	}
+
+	*pos = I[en];
+	return y;
+}
+
+int64 binary_diff_memory(int oldsize, int newsize)
+{
+	// The suffix array, the type bits and buckets of the sort and the diff
+	// and extra bytes
+	return ((int64)oldsize + 1) * sizeof(int32) + oldsize / 8 + (1 << 10) + ((int64)newsize + 1) * 2;
+}
+
+static bool binary_diff_windowed(diff_info &di, uint8 *old, int oldsize, uint8 *New, int newsize, GProgressDlg *Prog, int64 MemLimit);
+static bool binary_diff_at(diff_info &di, uint8 *old, int oldsize, uint8 *New, int newsize, GProgressDlg *Prog, int64 ProgBase);
+
+bool binary_diff(diff_info &di, uint8 *old, int oldsize, uint8 *New, int newsize, GProgressDlg *Prog, int64 MemLimit)
+{
+	if (!old || oldsize < 1 || !New || newsize < 0)
+		return false;
+	if (MemLimit > 0 && binary_diff_memory(oldsize, newsize) > MemLimit)
+		return binary_diff_windowed(di, old, oldsize, New, newsize, Prog, MemLimit);
+
+	return binary_diff_at(di, old, oldsize, New, newsize, Prog, 0);
+}
+
+// The diff of two whole buffers. 'New' starts 'ProgBase' bytes into what
+// 'Prog' is showing the progress of.
+static bool binary_diff_at(diff_info &di, uint8 *old, int oldsize, uint8 *New, int newsize, GProgressDlg *Prog, int64 ProgBase)
 {
-	off_t x, y;
+	int32 *I = (int32*) malloc((oldsize+1) * sizeof(int32));
+	uint8 *db = (uint8*) malloc(newsize+1);
+	uint8 *eb = (uint8*) malloc(newsize+1);
+	size_t CtrlStart = di.ctrl.Length();
+	bool Status = false;
 
-	if (en - st < 2)
+	if (I && db && eb && suffix_sort(I, old, oldsize, NULL, Prog))
 	{
-		x = matchlen(old+I[st], oldsize-I[st], New, newsize);
-		y = matchlen(old+I[en], oldsize-I[en], New, newsize);
+		int32 dblen = 0, eblen = 0;
+		int32 scan = 0, pos = 0, len = 0;
+		int32 lastscan = 0, lastpos = 0, lastoffset = 0;
+		int32 oldscore, scsc;
+		int32 s, Sf, lenf, Sb, lenb;
+		int32 i;
+		int32 overlap, Ss, lens;
+		int32 Steps = DIFF_PROGRESS_STEPS - 1;
+		uint64 Ts = 0; // Check straight after the sort
+
+		Status = true;
+		while (Status && scan < newsize)
+		{
+			oldscore = 0;
+
+			for (scsc = scan += len; scan < newsize; scan++)
+			{
+				if (Prog && ++Steps >= DIFF_PROGRESS_STEPS)
+				{
+					// Checked every so many searches, the time only now and then
+					Steps = 0;
+					if (LgiCurrentTime() - Ts > DIFF_UPDATE_MS)
+					{
+						Ts = LgiCurrentTime();
+						Prog->Value(ProgBase + scan);
+						LgiYield();
+						if (Prog->IsCancelled())
+						{
+							Status = false;
+							break;
+						}
+					}
+				}
+
+				len = search(I, old, oldsize, New+scan, newsize-scan, 0, oldsize, &pos);
+
+				for (; scsc < scan+len; scsc++)
+					if ((scsc+lastoffset < oldsize) &&
+						(old[scsc+lastoffset] == New[scsc]))
+						oldscore++;
+
+				if (((len == oldscore) && (len != 0)) || (len > oldscore + 8))
+					break;
+
+				if ((scan+lastoffset < oldsize) &&
+					(old[scan+lastoffset] == New[scan]))
+					oldscore--;
+			}
+
+			if (Status && ((len != oldscore) || (scan == newsize)))
+			{
+				s=0; Sf=0; lenf=0;
+				for (i=0; (lastscan+i < scan) && (lastpos+i < oldsize); )
+				{
+					if (old[lastpos+i] == New[lastscan+i]) s++;
+					i++;
+					if (s*2-i > Sf*2-lenf) { Sf=s; lenf=i; }
+				}
+
+				lenb=0;
+				if (scan < newsize)
+				{
+					s=0; Sb=0;
+					for (i=1; (scan >= lastscan+i) && (pos >= i); i++)
+					{
+						if (old[pos-i] == New[scan-i]) s++;
+						if (s*2-i > Sb*2-lenb) { Sb=s; lenb=i; }
+					}
+				}
+
+				if (lastscan + lenf > scan - lenb)
+				{
+					overlap = (lastscan+lenf) - (scan-lenb);
+					s=0; Ss=0; lens=0;
+					for (i=0; i<overlap; i++)
+					{
+						if (New[lastscan+lenf-overlap+i] == old[lastpos+lenf-overlap+i]) s++;
+						if (New[scan-lenb+i] == old[pos-lenb+i]) s--;
+						if (s > Ss) { Ss=s; lens=i+1; }
+					}
+
+					lenf += lens-overlap;
+					lenb -= lens;
+				}
+
+				for (i=0; i<lenf; i++)
+					db[dblen+i] = New[lastscan+i] - old[lastpos+i];
+				for (i=0; i<(scan-lenb)-(lastscan+lenf); i++)
+					eb[eblen+i] = New[lastscan+lenf+i];
+
+				dblen += lenf;
+				eblen += (scan-lenb)-(lastscan+lenf);
+
+				ctrl_info &ci = di.ctrl.New();
+				ci.a[0] = lenf;
+				ci.a[1] = (scan-lenb)-(lastscan+lenf);
+				ci.a[2] = (pos-lenb)-(lastpos+lenf);
+
+				lastscan = scan - lenb;
+				lastpos = pos - lenb;
+				lastoffset = pos - scan;
+			}
+		}
 
-		if (x > y)
+		if (Status)
 		{
-			*pos=I[st];
-			return x;
+			di.db.Add(db, dblen);
+			di.eb.Add(eb, eblen);
 		}
 		else
 		{
-			*pos=I[en];
-			return y;
+			di.ctrl.Length(CtrlStart);
 		}
-	};
+	}
 
-	x = st + (en - st) / 2;
-	if (memcmp(old + I[x], New, MIN(oldsize - I[x], newsize)) < 0)
-		return search(I, old, oldsize, New, newsize, x, en, pos);
-	else
-		return search(I, old, oldsize, New, newsize, st, x, pos);
+	free(I);
+	free(db);
+	free(eb);
+
+	return Status;
 }
 
-void errx(int i, const char *s, ...)
+//////////////////////////////////////////////////////////////////////////////
+// Streaming diff
+//
+// The old stream is cut into content defined chunks: a gear hash rolls over
+// the bytes and a chunk ends wherever its top bits are all zero, so the cut
+// points move with the content rather than with the offsets and an insert
+// only changes the chunks around it. Each chunk is indexed by a hash of its
+// bytes. The new stream is chunked the same way, chunks found in the index
+// (and checked byte for byte) become anchors, and only the bytes between
+// anchors are handed to binary_diff. The chunk size grows with the file so
+// the index stays around a million entries.
+#define CDC_MIN_AVG			(8 << 10)
+#define CDC_MAX_AVG			(1 << 20)
+#define CDC_MIN_CHUNKS		(1 << 10)
+#define CDC_MAX_CHUNKS		(1 << 20)
+#define CDC_GAP_MIN			(64 << 10)
+#define CDC_GAP_MAX			(16 << 20)	// Largest stretch given to binary_diff
+
+// The gear hash's table, filled in by a static constructor so that it's
+// ready before any worker thread uses it.
+class GCdcGear
+{
+	uint64 Gear[256];
+
+public:
+	GCdcGear()
+	{
+		uint64 Seed = 0x9e3779b97f4a7c15ULL;
+		for (int i=0; i<256; i++)
+		{
+			// splitmix64
+			uint64 z = (Seed += 0x9e3779b97f4a7c15ULL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			Gear[i] = z ^ (z >> 31);
+		}
+	}
+
+	uint64 operator [](uint8 b) const { return Gear[b]; }
+};
+
+static GCdcGear CdcGear;
+
+static uint64 CdcHash(const uint8 *p, int32 Len)
 {
+	// FNV-1a, collisions only cost a failed compare
+	uint64 h = 0xcbf29ce484222325ULL;
+	for (int32 i=0; i<Len; i++)
+	{
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
 }
 
-void err(int i, const char *s, ...)
+static bool CdcReadAt(GStream *s, int64 Offset, uint8 *p, int64 Len)
 {
+	if (s->SetPos(Offset) != Offset)
+		return false;
+
+	while (Len > 0)
+	{
+		ssize_t r = s->Read(p, (ssize_t)MIN(Len, 1 << 30));
+		if (r <= 0)
+			return false;
+		p += r;
+		Len -= r;
+	}
+
+	return true;
 }
 
-static void offtout(off_t x,u_char *buf)
+/// Cuts a stream into content defined chunks, reading it front to back.
+class GCdcReader
 {
-	off_t y;
+	GStream *s;
+	GArray<uint8> Buf;
+	size_t Pos, End;
+	int64 BufOffset;
+	bool Eof;
+	int32 Min, Max;
+	uint64 Mask;
+
+public:
+	GCdcReader(GStream *stream, int32 Avg)
+	{
+		s = stream;
+		Pos = End = 0;
+		BufOffset = 0;
+		Eof = false;
+		Min = Avg >> 2;
+		Max = Avg << 2;
+
+		int Bits = 0;
+		while ((1 << Bits) < Avg)
+			Bits++;
+		Mask = ((((uint64)1) << Bits) - 1) << (64 - Bits);
+
+		Buf.Length(Max << 2);
+		s->SetPos(0);
+	}
+
+	/// Gets the next chunk, 'Ptr' is valid until the next call.
+	bool Next(const uint8 *&Ptr, int32 &Len, int64 &Offset)
+	{
+		if (End - Pos < (size_t)Max && !Eof)
+		{
+			// Slide what's left to the front and top up the buffer
+			memmove(&Buf[0], &Buf[Pos], End - Pos);
+			BufOffset += Pos;
+			End -= Pos;
+			Pos = 0;
+			while (End < Buf.Length())
+			{
+				ssize_t r = s->Read(&Buf[End], Buf.Length() - End);
+				if (r <= 0)
+				{
+					Eof = true;
+					break;
+				}
+				End += r;
+			}
+		}
 
-	if(x<0) y=-x; else y=x;
+		int32 Avail = (int32) (End - Pos);
+		if (Avail <= 0)
+			return false;
+
+		const uint8 *p = &Buf[Pos];
+		int32 Cut = MIN(Avail, Max);
+		if (Avail > Min)
+		{
+			uint64 h = 0;
+			for (int32 i=Min; i<Cut; i++)
+			{
+				h = (h << 1) + CdcGear[p[i]];
+				if (!(h & Mask))
+				{
+					Cut = i + 1;
+					break;
+				}
+			}
+		}
 
-		buf[0]=y%256;y-=buf[0];
-	y=y/256;buf[1]=y%256;y-=buf[1];
-	y=y/256;buf[2]=y%256;y-=buf[2];
-	y=y/256;buf[3]=y%256;y-=buf[3];
-	y=y/256;buf[4]=y%256;y-=buf[4];
-	y=y/256;buf[5]=y%256;y-=buf[5];
-	y=y/256;buf[6]=y%256;y-=buf[6];
-	y=y/256;buf[7]=y%256;
+		Ptr = p;
+		Len = Cut;
+		Offset = BufOffset + Pos;
+		Pos += Cut;
+		return true;
+	}
+};
 
-	if(x<0) buf[7]|=0x80;
+static int CdcCmp(GStreamDiff::Chunk *a, GStreamDiff::Chunk *b)
+{
+	if (a->Hash != b->Hash)
+		return a->Hash < b->Hash ? -1 : 1;
+	if (a->Offset != b->Offset)
+		return a->Offset < b->Offset ? -1 : 1;
+	return 0;
 }
 
-typedef unsigned char uint8;
-#include "Diff.h"
+GStreamDiff::GStreamDiff(GStream *old, GStream *New, GProgressDlg *prog)
+{
+	Old = old;
+	NewStream = New;
+	Prog = prog;
+	Sink = NULL;
+	GapMax = CDC_GAP_MAX;
+	MaxChunks = CDC_MAX_CHUNKS;
+	OldSize = 0;
+	OldEnd = 0;
+	NewDone = 0;
+	CtrlOldStart = 0;
+	CtrlAdd = CtrlExtra = 0;
+}
 
-bool binary_diff(diff_info &di, uint8 *old, int oldsize, uint8 *New, int newsize)
+void GStreamDiff::SetMemoryLimit(int64 Bytes)
 {
-	if (!old || oldsize < 1 || !New || newsize < 0)
-		return false;
+	// Each gap is diffed with binary_diff against as much old data, the
+	// chunk index gets a quarter.
+	GapMax = CDC_GAP_MAX;
+	while (GapMax > CDC_GAP_MIN && binary_diff_memory((int)GapMax, (int)GapMax) + GapMax * 2 > Bytes)
+		GapMax >>= 1;
+	MaxChunks = (int64) MAX(MIN(Bytes / 4 / (int64)sizeof(Chunk), CDC_MAX_CHUNKS), CDC_MIN_CHUNKS);
+}
 
-	off_t *I = NULL, *V = NULL;
-	u_char *db = NULL, *eb = NULL;
-	bool Status = false;
+GStreamDiff::Chunk *GStreamDiff::Find(uint64 Hash)
+{
+	// First chunk with this hash at or after 'OldEnd', so runs of identical
+	// chunks (zeros say) pair up in order. Otherwise the first one anywhere.
+	size_t Lo = 0, Hi = Index.Length();
+	while (Lo < Hi)
+	{
+		size_t Mid = (Lo + Hi) >> 1;
+		Chunk &c = Index[Mid];
+		if (c.Hash < Hash || (c.Hash == Hash && c.Offset < OldEnd))
+			Lo = Mid + 1;
+		else
+			Hi = Mid;
+	}
 
-	I = (off_t*) malloc((oldsize+1) * sizeof(off_t));
-	V = (off_t*) malloc((oldsize+1) * sizeof(off_t));
-	db = (u_char*) malloc(newsize+1);
-	eb = (u_char*) malloc(newsize+1);
-
-	if (!I || !V || !db || !eb)
-		goto diff_error;
-
-	qsufsort(I, V, old, oldsize);
-	
-	off_t dblen = 0, eblen = 0;
-	off_t scan = 0, pos = 0, len = 0;
-	off_t lastscan = 0, lastpos = 0, lastoffset = 0;
-	off_t oldscore, scsc;
-	off_t s,Sf,lenf,Sb,lenb;
-	off_t i;
-	off_t overlap,Ss,lens;
-
-	while (scan < oldsize)
-	{
-		oldscore = 0;
-
-		for (scsc = scan += len; scan < newsize; scan++)
-		{
-			len = search(I,
-						old,
-						oldsize,
-						New+scan,
-						newsize-scan,
-						0,
-						oldsize,
-						&pos);
-
-			for (;scsc<scan+len;scsc++)
-				if((scsc+lastoffset<oldsize) &&
-					(old[scsc+lastoffset] == New[scsc]))
-						oldscore++;
+	if (Lo < Index.Length() && Index[Lo].Hash == Hash)
+		return &Index[Lo];
 
-			if (((len==oldscore) && (len!=0)) || (len>oldscore+8))
-				break;
+	while (Lo > 0 && Index[Lo-1].Hash == Hash)
+		Lo--;
+	return Lo < Index.Length() && Index[Lo].Hash == Hash ? &Index[Lo] : NULL;
+}
 
-			if
-			(
-				(scan+lastoffset<oldsize)
-				&&
-				(old[scan+lastoffset] == New[scan])
-			)
-				oldscore--;
-		};
-
-		if ((len!=oldscore) || (scan==newsize))
-		{
-			s=0;Sf=0;lenf=0;
-			for (i=0;(lastscan+i<scan)&&(lastpos+i<oldsize);) {
-				if(old[lastpos+i]==New[lastscan+i]) s++;
-				i++;
-				if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
-			};
-
-			lenb=0;
-			if(scan<newsize) {
-				s=0;Sb=0;
-				for(i=1;(scan>=lastscan+i)&&(pos>=i);i++) {
-					if(old[pos-i]==New[scan-i]) s++;
-					if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
-				};
-			};
-
-			if (lastscan + lenf > scan - lenb)
-			{
-				overlap=(lastscan+lenf)-(scan-lenb);
-				s=0;Ss=0;lens=0;
-				for(i=0;i<overlap;i++) {
-					if(New[lastscan+lenf-overlap+i]==
-					   old[lastpos+lenf-overlap+i]) s++;
-					if(New[scan-lenb+i]==
-					   old[pos-lenb+i]) s--;
-					if(s>Ss) { Ss=s; lens=i+1; };
-				};
-
-				lenf+=lens-overlap;
-				lenb-=lens;
-			};
-
-			for(i=0;i<lenf;i++)
-				db[dblen+i]=New[lastscan+i]-old[lastpos+i];
-			for(i=0;i<(scan-lenb)-(lastscan+lenf);i++)
-				eb[eblen+i]=New[lastscan+lenf+i];
-
-			dblen+=lenf;
-			eblen+=(scan-lenb)-(lastscan+lenf);
-
-			ctrl_info &ci = di.ctrl.New();
-
-			ci.a[0] = lenf;
-			ci.a[1] = (scan-lenb)-(lastscan+lenf);
-			ci.a[2] = (pos-lenb)-(lastpos+lenf);
-
-			lastscan = scan - lenb;
-			lastpos = pos - lenb;
-			lastoffset = pos - scan;
-		};
-	};
+bool GStreamDiff::Copy(int64 OldOffset, int64 Len, const uint8 *DiffBytes)
+{
+	if (CtrlExtra > 0 || OldOffset != CtrlOldStart + CtrlAdd)
+	{
+		// Can't extend the current record, so seek to the new position
+		if (CtrlAdd || CtrlExtra || OldOffset != CtrlOldStart + CtrlAdd)
+		{
+			ctrl_info c;
+			c.a[0] = (NativeInt) CtrlAdd;
+			c.a[1] = (NativeInt) CtrlExtra;
+			c.a[2] = (NativeInt) (OldOffset - (CtrlOldStart + CtrlAdd));
+			if (!Sink->OnCtrl(c))
+				return false;
+		}
 
-	di.db.Add(db, dblen);
-	di.eb.Add(eb, eblen);
+		CtrlOldStart = OldOffset;
+		CtrlAdd = CtrlExtra = 0;
+	}
 
-	Status = true;
+	CtrlAdd += Len;
+	NewDone += Len;
+	return Sink->OnDiff(DiffBytes, Len);
+}
 
-diff_error:
-	free(I);
-	free(V);
-	free(db);
-	free(eb);
-	
+bool GStreamDiff::Insert(const uint8 *Bytes, int64 Len)
+{
+	CtrlExtra += Len;
+	NewDone += Len;
+	return Sink->OnExtra(Bytes, Len);
+}
+
+bool GStreamDiff::FlushGap(int64 Anchor)
+{
+	if (!Gap.Length())
+		return true;
+
+	// The old bytes to diff against: up to the next anchor if it's close
+	// ahead, otherwise the same length straight after the last match.
+	int64 OldLen;
+	if (Anchor >= OldEnd && Anchor - OldEnd <= GapMax)
+		OldLen = Anchor - OldEnd;
+	else
+		OldLen = MIN((int64)Gap.Length(), OldSize - OldEnd);
+
+	bool Status = false;
+	diff_info di;
+	int64 OldStart = OldEnd;
+	if (OldLen > 0 &&
+		OldBuf.Length((size_t)OldLen) &&
+		CdcReadAt(Old, OldStart, &OldBuf[0], OldLen) &&
+		binary_diff_at(di, &OldBuf[0], (int)OldLen, &Gap[0], (int)Gap.Length(), Prog, NewDone))
+	{
+		int64 Pos = 0, Db = 0, Eb = 0;
+		Status = true;
+		for (unsigned i=0; Status && i<di.ctrl.Length(); i++)
+		{
+			ctrl_info &c = di.ctrl[i];
+			if (c.a[0] > 0)
+			{
+				Status = Copy(OldStart + Pos, c.a[0], &di.db[(size_t)Db]);
+				Db += c.a[0];
+			}
+			if (Status && c.a[1] > 0)
+			{
+				Status = Insert(&di.eb[(size_t)Eb], c.a[1]);
+				Eb += c.a[1];
+			}
+			Pos += c.a[0] + c.a[2];
+		}
+		OldEnd = OldStart + OldLen;
+	}
+	else if (Prog && Prog->IsCancelled())
+	{
+		Status = false;
+	}
+	else
+	{
+		// Nothing to diff against, it's all new
+		Status = Insert(&Gap[0], Gap.Length());
+	}
+
+	Gap.Length(0);
 	return Status;
 }
 
-#include "io.h"
-
-int ftello(FILE *f)
-{
-	return fseek(f, 0, SEEK_CUR);
-}
-
-void WINAPI BZ2_bzWriteClose( 
-      int*          bzerror, 
-      BZFILE*       b, 
-      int           abandon, 
-      unsigned int* nbytes_in, 
-      unsigned int* nbytes_out 
-   )
-{
-}
-
-void WINAPI BZ2_bzWrite( 
-      int*    bzerror, 
-      BZFILE* b, 
-      void*   buf, 
-      int     len 
-   )
-{
-}
-
-BZFILE* WINAPI BZ2_bzWriteOpen( int*  bzerror,      
-                      FILE* f, 
-                      int   blockSize100k, 
-                      int   verbosity,
-                      int   workFactor )
-{
-	return NULL;
-}
-
-int main(int argc, char *argv[])
-{
-	int fd;
-	u_char *old,*New;
-	off_t oldsize,newsize;
-	off_t *I,*V;
-	off_t scan,pos,len;
-	off_t lastscan,lastpos,lastoffset;
-	off_t oldscore,scsc;
-	off_t s,Sf,lenf,Sb,lenb;
-	off_t overlap,Ss,lens;
-	off_t i;
-	off_t dblen,eblen;
-	u_char *db,*eb;
-	u_char buf[8];
-	u_char header[32];
-	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
-	char *oldfile = argv[1];
-	char *newfile = argv[2];
-	char *patchfile = argv[3];
-
-	if (argc!=4)
-		errx(1,"usage: %s oldfile newfile patchfile\n", argv[0]);
-
-	// Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-	//	that we never try to malloc(0) and get a NULL pointer
-	if
-	(
-		((fd = open(oldfile,O_RDONLY,0))<0)
-		||
-		((oldsize=lseek(fd,0,SEEK_END))==-1)
-		||
-		((old = (u_char *)malloc(oldsize+1))==NULL)
-		||
-		(lseek(fd,0,SEEK_SET)!=0)
-		||
-		(read(fd,old,oldsize)!=oldsize)
-		||
-		(close(fd)==-1)
-	)
-		err(1,"%s",oldfile);
-
-	if
-	(
-		((I = (off_t*)malloc((oldsize+1)*sizeof(off_t)))==NULL)
-		||
-		((V = (off_t*)malloc((oldsize+1)*sizeof(off_t)))==NULL)
-	)
-		err(1,NULL);
-
-	qsufsort(I, V, old, oldsize);
-
-	free(V);
-
-	// Allocate newsize+1 bytes instead of newsize bytes to ensure
-	//	that we never try to malloc(0) and get a NULL pointer
-	if
-	(
-		((fd=open(newfile,O_RDONLY,0))<0)
-		||
-		((newsize=lseek(fd,0,SEEK_END))==-1)
-		||
-		((New = (u_char*)malloc(newsize+1))==NULL)
-		||
-		(lseek(fd,0,SEEK_SET)!=0)
-		||
-		(read(fd,New,newsize)!=newsize)
-		||
-		(close(fd)==-1)
-	)
-		err(1,"%s",newfile);
-
-	if 
-	(
-		((db=(u_char*)malloc(newsize+1))==NULL)
-		||
-		((eb=(u_char*)malloc(newsize+1))==NULL)
-	)
-		err(1,NULL);
-	dblen=0;
-	eblen=0;
-
-	// Create the patch file
-	if ((pf = fopen(patchfile, "w")) == NULL)
-		err(1, "%s", patchfile);
+bool GStreamDiff::Diff(GDiffSink *sink)
+{
+	if (!Old || !NewStream || !(Sink = sink))
+		return false;
 
-	// Header is
-	//	0	8	 "BSDIFF40"
-	//	8	8	length of bzip2ed ctrl block
-	//	16	8	length of bzip2ed diff block
-	//	24	8	length of New file
-	// File is
-	//	0	32	Header
-	//	32	??	Bzip2ed ctrl block
-	//	??	??	Bzip2ed diff block
-	//	??	??	Bzip2ed extra block
-	memcpy(header,"BSDIFF40",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patchfile);
-
-	// Compute the differences, writing ctrl as we go
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	scan=0;len=0;
-	lastscan=0;lastpos=0;lastoffset=0;
-	while(scan<newsize) {
-		oldscore=0;
-
-		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,old,oldsize,New+scan,newsize-scan,
-					0,oldsize,&pos);
-
-			for(;scsc<scan+len;scsc++)
-			if((scsc+lastoffset<oldsize) &&
-				(old[scsc+lastoffset] == New[scsc]))
-				oldscore++;
-
-			if(((len==oldscore) && (len!=0)) || 
-				(len>oldscore+8)) break;
-
-			if((scan+lastoffset<oldsize) &&
-				(old[scan+lastoffset] == New[scan]))
-				oldscore--;
-		};
-
-		if((len!=oldscore) || (scan==newsize)) {
-			s=0;Sf=0;lenf=0;
-			for(i=0;(lastscan+i<scan)&&(lastpos+i<oldsize);) {
-				if(old[lastpos+i]==New[lastscan+i]) s++;
-				i++;
-				if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
-			};
-
-			lenb=0;
-			if(scan<newsize) {
-				s=0;Sb=0;
-				for(i=1;(scan>=lastscan+i)&&(pos>=i);i++) {
-					if(old[pos-i]==New[scan-i]) s++;
-					if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
-				};
-			};
-
-			if(lastscan+lenf>scan-lenb) {
-				overlap=(lastscan+lenf)-(scan-lenb);
-				s=0;Ss=0;lens=0;
-				for(i=0;i<overlap;i++) {
-					if(New[lastscan+lenf-overlap+i]==
-					   old[lastpos+lenf-overlap+i]) s++;
-					if(New[scan-lenb+i]==
-					   old[pos-lenb+i]) s--;
-					if(s>Ss) { Ss=s; lens=i+1; };
-				};
-
-				lenf+=lens-overlap;
-				lenb-=lens;
-			};
-
-			for(i=0;i<lenf;i++)
-				db[dblen+i]=New[lastscan+i]-old[lastpos+i];
-			for(i=0;i<(scan-lenb)-(lastscan+lenf);i++)
-				eb[eblen+i]=New[lastscan+lenf+i];
-
-			dblen+=lenf;
-			eblen+=(scan-lenb)-(lastscan+lenf);
-
-			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			lastscan=scan-lenb;
-			lastpos=pos-lenb;
-			lastoffset=pos-scan;
-		};
-	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	// Compute size of compressed ctrl data
-	if ((len = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(len-32, header + 8);
-
-	// Write compressed diff data
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	// Compute size of compressed diff data
-	if ((newsize = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(newsize - len, header + 16);
-
-	// Write compressed extra data
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	// Seek to the beginning, write the header, and close the file
-	if (fseek(pf, 0, SEEK_SET))
-		err(1, "fseeko");
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patchfile);
-	if (fclose(pf))
-		err(1, "fclose");
-
-	// Free the memory we used
-	free(db);
-	free(eb);
-	free(I);
-	free(old);
-	free(New);
+	OldSize = Old->GetSize();
+	if (OldSize < 0 || NewStream->GetSize() < 0)
+		return false;
 
-	return 0;
+	int32 Avg = CDC_MIN_AVG;
+	while (Avg < CDC_MAX_AVG && OldSize / Avg > MaxChunks)
+		Avg <<= 1;
+
+	// Index the old stream's chunks
+	Index.Length(0);
+	{
+		GCdcReader r(Old, Avg);
+		const uint8 *p;
+		int32 Len;
+		int64 Offset;
+		while (r.Next(p, Len, Offset))
+		{
+			Chunk &c = Index.New();
+			c.Hash = CdcHash(p, Len);
+			c.Offset = Offset;
+			c.Len = Len;
+		}
+	}
+	Index.Sort(CdcCmp);
+
+	// Walk the new stream looking for anchors
+	OldEnd = 0;
+	NewDone = 0;
+	CtrlOldStart = 0;
+	CtrlAdd = CtrlExtra = 0;
+	Gap.Length(0);
+
+	GArray<uint8> Check;
+	GCdcReader r(NewStream, Avg);
+	const uint8 *p;
+	int32 Len;
+	int64 Offset;
+	while (r.Next(p, Len, Offset))
+	{
+		Chunk *c = Find(CdcHash(p, Len));
+		if (c &&
+			c->Len == Len &&
+			Check.Length(Len) &&
+			CdcReadAt(Old, c->Offset, &Check[0], Len) &&
+			!memcmp(&Check[0], p, Len))
+		{
+			if (!FlushGap(c->Offset) ||
+				!Copy(c->Offset, Len, NULL))
+				return false;
+			OldEnd = c->Offset + Len;
+		}
+		else
+		{
+			size_t Cur = Gap.Length();
+			Gap.Length(Cur + Len);
+			memcpy(&Gap[Cur], p, Len);
+			if (Gap.Length() >= (size_t)GapMax &&
+				!FlushGap(-1))
+				return false;
+		}
+	}
+
+	if (!FlushGap(OldSize))
+		return false;
+
+	if (CtrlAdd || CtrlExtra)
+	{
+		ctrl_info c;
+		c.a[0] = (NativeInt) CtrlAdd;
+		c.a[1] = (NativeInt) CtrlExtra;
+		c.a[2] = 0;
+		if (!Sink->OnCtrl(c))
+			return false;
+	}
+
+	return true;
 }
 
-#endif
+bool GDiffInfoSink::OnDiff(const uint8 *Data, int64 Len)
+{
+	size_t Cur = di.db.Length();
+	if (!di.db.Length(Cur + (size_t)Len))
+		return false;
+	if (Data)
+		memcpy(&di.db[Cur], Data, (size_t)Len);
+	else
+		memset(&di.db[Cur], 0, (size_t)Len);
+	return true;
+}
+
+bool GDiffInfoSink::OnExtra(const uint8 *Data, int64 Len)
+{
+	return di.eb.Add((uint8*)Data, (size_t)Len);
+}
+
+bool GDiffInfoSink::OnCtrl(const ctrl_info &c)
+{
+	di.ctrl.Add(c);
+	return true;
+}
+
+// Reads a block of memory as a stream
+class GMemReadStream : public GStream
+{
+	const uint8 *Data;
+	int64 Size, Pos;
+
+public:
+	GMemReadStream(const uint8 *data, int64 size)
+	{
+		Data = data;
+		Size = size;
+		Pos = 0;
+	}
+
+	int64 GetSize() { return Size; }
+	int64 GetPos() { return Pos; }
+	int64 SetPos(int64 p) { return Pos = MAX(0, MIN(p, Size)); }
+	ssize_t Read(void *Ptr, ssize_t Len, int Flags = 0)
+	{
+		ssize_t r = (ssize_t) MIN(Len, Size - Pos);
+		if (r > 0)
+		{
+			memcpy(Ptr, Data + Pos, r);
+			Pos += r;
+		}
+		return r;
+	}
+	ssize_t Write(const void *Ptr, ssize_t Len, int Flags = 0) { return 0; }
+};
+
+// Passes a diff on, updating the progress with the new bytes covered
+class GDiffProgressSink : public GDiffSink
+{
+	GDiffSink *Out;
+	GProgressDlg *Prog;
+	int64 Done;
+	uint64 Ts;
+
+	bool OnProgress(int64 Len)
+	{
+		Done += Len;
+		if (Prog && LgiCurrentTime() - Ts > DIFF_UPDATE_MS)
+		{
+			Ts = LgiCurrentTime();
+			Prog->Value(Done);
+			LgiYield();
+			if (Prog->IsCancelled())
+				return false;
+		}
+		return true;
+	}
+
+public:
+	GDiffProgressSink(GDiffSink *out, GProgressDlg *prog)
+	{
+		Out = out;
+		Prog = prog;
+		Done = 0;
+		Ts = LgiCurrentTime();
+	}
+
+	bool OnDiff(const uint8 *Data, int64 Len) { return Out->OnDiff(Data, Len) && OnProgress(Len); }
+	bool OnExtra(const uint8 *Data, int64 Len) { return Out->OnExtra(Data, Len) && OnProgress(Len); }
+	bool OnCtrl(const ctrl_info &c) { return Out->OnCtrl(c); }
+};
+
+// Too big to diff in one go under the memory limit, so the streaming diff
+// breaks it into windows that are.
+static bool binary_diff_windowed(diff_info &di, uint8 *old, int oldsize, uint8 *New, int newsize, GProgressDlg *Prog, int64 MemLimit)
+{
+	GMemReadStream OldStream(old, oldsize), NewStream(New, newsize);
+	GDiffInfoSink Info(di);
+	GDiffProgressSink Sink(&Info, Prog);
+	size_t Lengths[3] = { di.ctrl.Length(), di.db.Length(), di.eb.Length() };
+
+	GStreamDiff d(&OldStream, &NewStream, Prog);
+	d.SetMemoryLimit(MemLimit);
+	if (!d.Diff(&Sink))
+	{
+		di.ctrl.Length(Lengths[0]);
+		di.db.Length(Lengths[1]);
+		di.eb.Length(Lengths[2]);
+		return false;
+	}
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Byte compares
+static int LowBit(uint32 m)
+{
+	int i = 0;
+	while (!(m & 1))
+	{
+		m >>= 1;
+		i++;
+	}
+	return i;
+}
+
+static int HighBit(uint32 m)
+{
+	int i = 31;
+	while (!(m & 0x80000000))
+	{
+		m <<= 1;
+		i--;
+	}
+	return i;
+}
+
+int64 mem_mismatch(const uint8 *a, const uint8 *b, int64 Len)
+{
+	int64 i = 0;
+
+	#if HAS_SSE2
+	for (; i + 16 <= Len; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+		uint32 Eq = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+		if (Eq != 0xffff)
+			return i + LowBit(~Eq & 0xffff);
+	}
+	#endif
+
+	for (; i < Len; i++)
+	{
+		if (a[i] != b[i])
+			return i;
+	}
+
+	return Len;
+}
+
+int64 mem_mismatch_rev(const uint8 *a, const uint8 *b, int64 Len)
+{
+	int64 i = Len;
+
+	#if HAS_SSE2
+	for (; i >= 16; i -= 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + i - 16));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b + i - 16));
+		uint32 Eq = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+		if (Eq != 0xffff)
+			return i - 16 + HighBit(~Eq & 0xffff);
+	}
+	#endif
+
+	while (i-- > 0)
+	{
+		if (a[i] != b[i])
+			return i;
+	}
+
+	return -1;
+}
+
+bool mem_diff_flags(const uint8 *a, const uint8 *b, int Len, uint8 *Flags)
+{
+	int i = 0;
+	bool Any = false;
+
+	#if HAS_SSE2
+	// Most blocks are the same, so only those with a difference are written
+	__m128i One = _mm_set1_epi8(1);
+	for (; i + 16 <= Len; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+		__m128i Eq = _mm_cmpeq_epi8(x, y);
+		if (_mm_movemask_epi8(Eq) == 0xffff)
+			continue;
+
+		__m128i f = _mm_loadu_si128((const __m128i*)(Flags + i));
+		_mm_storeu_si128((__m128i*)(Flags + i), _mm_or_si128(f, _mm_andnot_si128(Eq, One)));
+		Any = true;
+	}
+	#endif
+
+	for (; i < Len; i++)
+	{
+		if (a[i] != b[i])
+		{
+			Flags[i] = 1;
+			Any = true;
+		}
+	}
+
+	return Any;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Block difference map
+#define DIFF_MAX_THREADS	16
+#define DIFF_UNIT_BLOCKS	256		// Blocks handed to a worker at a time, a multiple of 32
+
+#define XXH_PRIME1			0x9E3779B185EBCA87ULL
+#define XXH_PRIME2			0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3			0x165667B19E3779F9ULL
+#define XXH_PRIME4			0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5			0x27D4EB2F165667C5ULL
+
+static inline uint64 XxRotl(uint64 x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+// Native byte order, the hashes are only ever compared with each other
+static inline uint64 XxRead64(const uint8 *p)
+{
+	uint64 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64 XxRound(uint64 Acc, uint64 In)
+{
+	Acc += In * XXH_PRIME2;
+	Acc = XxRotl(Acc, 31);
+	return Acc * XXH_PRIME1;
+}
+
+static inline uint64 XxMerge(uint64 Acc, uint64 Val)
+{
+	Acc ^= XxRound(0, Val);
+	return Acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static uint64 xxhash64(const uint8 *p, size_t Len, uint64 Seed = 0)
+{
+	const uint8 *End = p + Len;
+	uint64 h;
+
+	if (Len >= 32)
+	{
+		uint64 v1 = Seed + XXH_PRIME1 + XXH_PRIME2;
+		uint64 v2 = Seed + XXH_PRIME2;
+		uint64 v3 = Seed;
+		uint64 v4 = Seed - XXH_PRIME1;
+		for (; p + 32 <= End; p += 32)
+		{
+			v1 = XxRound(v1, XxRead64(p));
+			v2 = XxRound(v2, XxRead64(p + 8));
+			v3 = XxRound(v3, XxRead64(p + 16));
+			v4 = XxRound(v4, XxRead64(p + 24));
+		}
+
+		h = XxRotl(v1, 1) + XxRotl(v2, 7) + XxRotl(v3, 12) + XxRotl(v4, 18);
+		h = XxMerge(h, v1);
+		h = XxMerge(h, v2);
+		h = XxMerge(h, v3);
+		h = XxMerge(h, v4);
+	}
+	else h = Seed + XXH_PRIME5;
+
+	h += Len;
+	for (; p + 8 <= End; p += 8)
+	{
+		h ^= XxRound(0, XxRead64(p));
+		h = XxRotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+	}
+	if (p + 4 <= End)
+	{
+		uint32 v;
+		memcpy(&v, p, sizeof(v));
+		h ^= (uint64)v * XXH_PRIME1;
+		h = XxRotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+	}
+	for (; p < End; p++)
+	{
+		h ^= *p * XXH_PRIME5;
+		h = XxRotl(h, 11) * XXH_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+class GBlockDiffWorker : public GThread
+{
+	GBlockDiffMap *Map;
+
+public:
+	GBlockDiffWorker(GBlockDiffMap *map) : GThread("GBlockDiffWorker")
+	{
+		Map = map;
+	}
+
+	int Main()
+	{
+		GFile f[2];
+		GArray<uint8> Data[2];
+		for (int i=0; i<2; i++)
+		{
+			if (!f[i].Open(Map->File[i], O_READ) ||
+				!Data[i].Length(DIFF_BLOCK_SIZE))
+			{
+				LgiTrace("%s:%i - Can't open '%s'\n", _FL, Map->File[i].Get());
+				return -1;
+			}
+		}
+
+		uint32 Bits[DIFF_UNIT_BLOCKS / 32];
+		while (!Map->Cancelled)
+		{
+			Map->Lock(_FL);
+			int64 First = Map->NextBlock;
+			Map->NextBlock += DIFF_UNIT_BLOCKS;
+			Map->Unlock();
+			if (First >= Map->Blocks)
+				break;
+
+			// Each unit is read front to back so the disk sees long reads
+			int64 Count = MIN(DIFF_UNIT_BLOCKS, Map->Blocks - First);
+			memset(Bits, 0, sizeof(Bits));
+			for (int64 i=0; i<Count && !Map->Cancelled; i++)
+			{
+				int64 Pos = (First + i) * DIFF_BLOCK_SIZE;
+				ssize_t Len[2];
+				for (int n=0; n<2; n++)
+				{
+					Len[n] = (ssize_t) MAX(0, MIN(DIFF_BLOCK_SIZE, Map->Size[n] - Pos));
+					if (Len[n] > 0 &&
+						(f[n].SetPos(Pos) != Pos || f[n].Read(&Data[n][0], Len[n]) != Len[n]))
+						Len[n] = -1;
+				}
+
+				bool Differs = Len[0] != Len[1] ||
+								Len[0] < 0 ||
+								xxhash64(&Data[0][0], Len[0]) != xxhash64(&Data[1][0], Len[1]);
+				if (Differs)
+					Bits[i >> 5] |= 1U << (i & 31);
+			}
+			if (Map->Cancelled)
+				break;
+
+			Map->Lock(_FL);
+			for (int64 i=0; i<Count; i += 32)
+			{
+				int64 w = (First + i) >> 5;
+				Map->Differs[w] = Bits[i >> 5];
+				Map->Known[w] = Count - i >= 32 ? 0xffffffff : (1U << (Count - i)) - 1;
+			}
+			Map->Done += Count;
+			Map->Unlock();
+		}
+
+		return 0;
+	}
+};
+
+GBlockDiffMap::GBlockDiffMap(const char *FileA, const char *FileB) : GMutex("GBlockDiffMap")
+{
+	File[0] = FileA;
+	File[1] = FileB;
+	for (int i=0; i<2; i++)
+		Size[i] = MAX(LgiFileSize(File[i]), 0);
+	Blocks = (MAX(Size[0], Size[1]) + DIFF_BLOCK_SIZE - 1) / DIFF_BLOCK_SIZE;
+	NextBlock = 0;
+	Done = 0;
+	Cancelled = false;
+
+	size_t Words = (size_t) ((Blocks + 31) >> 5);
+	if (Known.Length(Words) && Differs.Length(Words))
+	{
+		memset(&Known[0], 0, Words * sizeof(uint32));
+		memset(&Differs[0], 0, Words * sizeof(uint32));
+	}
+}
+
+GBlockDiffMap::~GBlockDiffMap()
+{
+	Cancel();
+	while (IsRunning())
+		LgiSleep(10);
+	Workers.DeleteObjects();
+}
+
+bool GBlockDiffMap::Start(int Threads)
+{
+	if (Workers.Length() || !Blocks || Known.Length() != (size_t) ((Blocks + 31) >> 5))
+		return false;
+
+	if (Threads <= 0)
+		Threads = LgiGetCpuCount();
+	Threads = (int) MIN(Threads, (Blocks + DIFF_UNIT_BLOCKS - 1) / DIFF_UNIT_BLOCKS);
+	Threads = MAX(MIN(Threads, DIFF_MAX_THREADS), 1);
+
+	for (int i=0; i<Threads; i++)
+		Workers.Add(new GBlockDiffWorker(this));
+	for (unsigned i=0; i<Workers.Length(); i++)
+		Workers[i]->Run();
+
+	return true;
+}
+
+bool GBlockDiffMap::IsRunning()
+{
+	for (unsigned i=0; i<Workers.Length(); i++)
+	{
+		if (!Workers[i]->IsExited())
+			return true;
+	}
+
+	return false;
+}
+
+void GBlockDiffMap::Cancel()
+{
+	Cancelled = true;
+}
+
+GBlockDiffMap::BlockState GBlockDiffMap::GetState(int64 Block)
+{
+	if (Block < 0 || Block >= Blocks)
+		return BlockUnknown;
+
+	Lock(_FL);
+	size_t w = (size_t) (Block >> 5);
+	uint32 Bit = 1U << (Block & 31);
+	BlockState s = !(Known[w] & Bit) ? BlockUnknown : (Differs[w] & Bit ? BlockDiffers : BlockSame);
+	Unlock();
+	return s;
+}
+
+int64 GBlockDiffMap::Find(int64 Block, bool Forward)
+{
+	int64 Hit = -1;
+
+	Lock(_FL);
+	if (Forward)
+	{
+		for (int64 b = MAX(Block, 0); b < Blocks; )
+		{
+			// Skip whole words of blocks known to be the same
+			size_t w = (size_t) (b >> 5);
+			uint32 Interesting = ~Known[w] | Differs[w];
+			Interesting &= 0xffffffff << (b & 31);
+			if (Interesting)
+			{
+				Hit = MIN((int64)(w << 5) + LowBit(Interesting), Blocks - 1);
+				break;
+			}
+			b = (int64)(w + 1) << 5;
+		}
+	}
+	else
+	{
+		for (int64 b = MIN(Block, Blocks - 1); b >= 0; )
+		{
+			size_t w = (size_t) (b >> 5);
+			uint32 Interesting = ~Known[w] | Differs[w];
+			Interesting &= 0xffffffff >> (31 - (b & 31));
+			if (Interesting)
+			{
+				Hit = (int64)(w << 5) + HighBit(Interesting);
+				break;
+			}
+			b = ((int64)w << 5) - 1;
+		}
+	}
+	Unlock();
+
+	return Hit;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Moved blocks
+#define MOVE_MIN_AVG		(2 << 10)
+#define MOVE_MAX_CHUNKS		(4 << 20)
+#define MOVE_MAX_TRIES		64		// Chunks with the same hash looked at
+
+static bool IsUniform(const uint8 *p, int32 Len)
+{
+	for (int32 i=1; i<Len; i++)
+	{
+		if (p[i] != p[0])
+			return false;
+	}
+	return true;
+}
+
+static int MoveCmp0(GMoveMap::Move *a, GMoveMap::Move *b)
+{
+	return a->Offset[0] < b->Offset[0] ? -1 : a->Offset[0] > b->Offset[0];
+}
+
+class GMoveWorker : public GThread
+{
+	GMoveMap *Map;
+	GFile f[2];
+	GArray<uint8> Buf[2];
+
+	struct Chunk
+	{
+		uint64 Hash;
+		int64 Offset;
+		int32 Len;
+		int32 Next;			// Next chunk with the same hash, or -1
+	};
+
+	bool ReadBoth(int64 Off0, int64 Off1, int64 Len)
+	{
+		for (int i=0; i<2; i++)
+		{
+			int64 Off = i ? Off1 : Off0;
+			if (!Buf[i].Length((size_t)Len) ||
+				f[i].SetPos(Off) != Off ||
+				f[i].Read(&Buf[i][0], (ssize_t)Len) != Len)
+				return false;
+		}
+		return true;
+	}
+
+	// Grows each move over the equal bytes either side of it, up to the
+	// moves next to it in the second file.
+	void Extend(GArray<GMoveMap::Move> &Moves, int64 MaxLen)
+	{
+		for (unsigned i=0; i<Moves.Length() && !Map->Cancelled; i++)
+		{
+			GMoveMap::Move &m = Moves[i];
+			int64 Prev = i ? Moves[i-1].Offset[1] + Moves[i-1].Len : 0;
+			int64 Len = MIN(MIN(MaxLen, m.Offset[0]), m.Offset[1] - Prev);
+			if (Len > 0 && ReadBoth(m.Offset[0] - Len, m.Offset[1] - Len, Len))
+			{
+				int64 Same = Len - 1 - mem_mismatch_rev(&Buf[0][0], &Buf[1][0], Len);
+				m.Offset[0] -= Same;
+				m.Offset[1] -= Same;
+				m.Len += Same;
+			}
+
+			int64 Next = i < Moves.Length() - 1 ? Moves[i+1].Offset[1] : Map->Size[1];
+			int64 End0 = m.Offset[0] + m.Len, End1 = m.Offset[1] + m.Len;
+			Len = MIN(MIN(MaxLen, Map->Size[0] - End0), Next - End1);
+			if (Len > 0 && ReadBoth(End0, End1, Len))
+				m.Len += mem_mismatch(&Buf[0][0], &Buf[1][0], Len);
+		}
+	}
+
+	static void AddRun(GArray<GMoveMap::Move> &Moves, GMoveMap::Move &Run)
+	{
+		if (!Run.Len || Run.Offset[0] == Run.Offset[1])
+			return;
+
+		// Runs that grew into each other with the same delta are one move
+		GMoveMap::Move *Last = Moves.Length() ? &Moves.Last() : NULL;
+		if (Last &&
+			Last->Offset[1] + Last->Len == Run.Offset[1] &&
+			Last->Offset[0] + Last->Len == Run.Offset[0])
+			Last->Len += Run.Len;
+		else
+			Moves.Add(Run);
+	}
+
+public:
+	GMoveWorker(GMoveMap *map) : GThread("GMoveWorker")
+	{
+		Map = map;
+	}
+
+	int Main()
+	{
+		for (int i=0; i<2; i++)
+		{
+			if (!f[i].Open(Map->File[i], O_READ))
+			{
+				LgiTrace("%s:%i - Can't open '%s'\n", _FL, Map->File[i].Get());
+				return -1;
+			}
+		}
+
+		int32 Avg = MOVE_MIN_AVG;
+		while (Avg < CDC_MAX_AVG && MAX(Map->Size[0], Map->Size[1]) / Avg > MOVE_MAX_CHUNKS)
+			Avg <<= 1;
+
+		// Hash the chunks of the first file into an open addressed table,
+		// equal hashes are chained in file order.
+		GArray<Chunk> Chunks;
+		const uint8 *p;
+		int32 Len;
+		int64 Offset;
+		{
+			GCdcReader r(&f[0], Avg);
+			while (!Map->Cancelled && r.Next(p, Len, Offset))
+			{
+				Map->Done = Offset + Len;
+				if (IsUniform(p, Len))
+					continue; // Padding matches everywhere
+				Chunk &c = Chunks.New();
+				c.Hash = xxhash64(p, Len);
+				c.Offset = Offset;
+				c.Len = Len;
+				c.Next = -1;
+			}
+		}
+
+		size_t Slots = 16;
+		while (Slots < Chunks.Length() * 2)
+			Slots <<= 1;
+		GArray<int32> Table;
+		if (!Table.Length(Slots))
+			return -1;
+		memset(&Table[0], 0xff, Slots * sizeof(int32));
+		for (int32 i = (int32)Chunks.Length() - 1; i >= 0; i--)
+		{
+			size_t s = (size_t)Chunks[i].Hash & (Slots - 1);
+			while (Table[s] >= 0 && Chunks[Table[s]].Hash != Chunks[i].Hash)
+				s = (s + 1) & (Slots - 1);
+			Chunks[i].Next = Table[s];
+			Table[s] = i;
+		}
+
+		// Look up the chunks of the second file, joining runs that follow
+		// on in both files.
+		GArray<GMoveMap::Move> Moves;
+		GMoveMap::Move Run;
+		Run.Offset[0] = Run.Offset[1] = 0;
+		Run.Len = 0;
+		{
+			GCdcReader r(&f[1], Avg);
+			while (!Map->Cancelled && r.Next(p, Len, Offset))
+			{
+				Map->Done = Map->Size[0] + Offset + Len;
+
+				Chunk *Hit = NULL;
+				int64 Follows = Run.Offset[0] + Run.Len;
+				if (!IsUniform(p, Len))
+				{
+					uint64 h = xxhash64(p, Len);
+					size_t s = (size_t)h & (Slots - 1);
+					while (Table[s] >= 0 && Chunks[Table[s]].Hash != h)
+						s = (s + 1) & (Slots - 1);
+
+					int Tries = 0;
+					for (int32 i = Table[s]; i >= 0 && Tries++ < MOVE_MAX_TRIES; i = Chunks[i].Next)
+					{
+						Chunk &c = Chunks[i];
+						if (c.Len != Len)
+							continue;
+						if (!Hit)
+							Hit = &c;
+						if (Run.Len && c.Offset == Follows)
+						{
+							Hit = &c;
+							break;
+						}
+					}
+				}
+
+				if (Hit &&
+					Run.Len &&
+					Hit->Offset == Follows &&
+					Offset == Run.Offset[1] + Run.Len)
+				{
+					Run.Len += Len;
+				}
+				else
+				{
+					AddRun(Moves, Run);
+					Run.Len = 0;
+					if (Hit)
+					{
+						Run.Offset[0] = Hit->Offset;
+						Run.Offset[1] = Offset;
+						Run.Len = Len;
+					}
+				}
+			}
+		}
+		AddRun(Moves, Run);
+		if (Map->Cancelled)
+			return 0;
+
+		Extend(Moves, Avg << 2);
+
+		GArray<GMoveMap::Move> ByFirst;
+		ByFirst = Moves;
+		ByFirst.Sort(MoveCmp0);
+
+		// Moves can overlap in the first file, a later one can end before
+		// an earlier one does.
+		GArray<int64> Reach[2];
+		GArray<GMoveMap::Move> *Sides[2] = {&ByFirst, &Moves};
+		for (int s=0; s<2; s++)
+		{
+			int64 End = 0;
+			for (unsigned i=0; i<Sides[s]->Length(); i++)
+			{
+				GMoveMap::Move &m = (*Sides[s])[i];
+				End = MAX(End, m.Offset[s] + m.Len);
+				Reach[s].Add(End);
+			}
+		}
+
+		Map->Lock(_FL);
+		Map->Moves[0].Swap(ByFirst);
+		Map->Moves[1].Swap(Moves);
+		Map->Reach[0].Swap(Reach[0]);
+		Map->Reach[1].Swap(Reach[1]);
+		Map->Finished = true;
+		Map->Unlock();
+
+		return 0;
+	}
+};
+
+GMoveMap::GMoveMap(const char *FileA, const char *FileB) : GMutex("GMoveMap")
+{
+	File[0] = FileA;
+	File[1] = FileB;
+	for (int i=0; i<2; i++)
+		Size[i] = MAX(LgiFileSize(File[i]), 0);
+	Done = 0;
+	Cancelled = false;
+	Finished = false;
+}
+
+GMoveMap::~GMoveMap()
+{
+	Cancel();
+	while (IsRunning())
+		LgiSleep(10);
+}
+
+bool GMoveMap::Start()
+{
+	if (Worker || !Size[0] || !Size[1])
+		return false;
+
+	if (!Worker.Reset(new GMoveWorker(this)))
+		return false;
+	Worker->Run();
+	return true;
+}
+
+bool GMoveMap::IsRunning()
+{
+	return Worker && !Worker->IsExited();
+}
+
+void GMoveMap::Cancel()
+{
+	Cancelled = true;
+}
+
+int GMoveMap::GetProgress()
+{
+	int64 Total = Size[0] + Size[1];
+	return Total > 0 ? (int) (Done * 100 / Total) : 0;
+}
+
+size_t GMoveMap::Length()
+{
+	Lock(_FL);
+	size_t Len = Finished ? Moves[1].Length() : 0;
+	Unlock();
+	return Len;
+}
+
+size_t GMoveMap::First(int Side, int64 Offset)
+{
+	// The first move whose end, or the end of one before it, is past
+	// 'Offset'. Not just the last move starting at or before 'Offset', an
+	// earlier and longer one may still cover it.
+	GArray<int64> &r = Reach[Side];
+	size_t Lo = 0, Hi = r.Length();
+	while (Lo < Hi)
+	{
+		size_t Mid = (Lo + Hi) >> 1;
+		if (r[Mid] <= Offset)
+			Lo = Mid + 1;
+		else
+			Hi = Mid;
+	}
+	return Lo;
+}
+
+GMoveMap::Move *GMoveMap::Find(int Side, int64 Offset)
+{
+	Move *m = Get(Side, First(Side, Offset));
+	return m && Offset >= m->Offset[Side] && Offset < m->Offset[Side] + m->Len ? m : NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Relative offset between two files
+#define OFFSET_SAMPLES		256
+#define OFFSET_SAMPLE_LEN	32
+#define OFFSET_READ_SIZE	(1 << 20)
+#define OFFSET_MAX_VOTES	(1 << 20)
+#define OFFSET_HASH_MUL		0x100000001b3ULL
+#define OFFSET_UPDATE_MS	200
+
+struct OffsetSample
+{
+	uint64 Hash;
+	int64 Offset;
+	uint8 Data[OFFSET_SAMPLE_LEN];
+};
+
+static int SampleCmp(OffsetSample *a, OffsetSample *b)
+{
+	return a->Hash < b->Hash ? -1 : a->Hash > b->Hash;
+}
+
+static int DeltaCmp(int64 *a, int64 *b)
+{
+	return *a < *b ? -1 : *a > *b;
+}
+
+static uint64 SampleHash(const uint8 *p)
+{
+	uint64 h = 0;
+	for (int i=0; i<OFFSET_SAMPLE_LEN; i++)
+		h = h * OFFSET_HASH_MUL + p[i];
+	return h;
+}
+
+class GOffsetFinder
+{
+	GProgressDlg *Prog;
+	uint64 Ts;
+	int64 Done;
+	GArray<int64> Votes;
+
+	// Blocks spread evenly over 'In', each moved along a little if it
+	// starts in a run of one value as those match everywhere.
+	bool GetSamples(GStream *In, GArray<OffsetSample> &Out)
+	{
+		int64 Size = In->GetSize();
+		if (Size < OFFSET_SAMPLE_LEN)
+			return true;
+
+		uint8 Buf[OFFSET_SAMPLE_LEN * 4];
+		int64 Step = MAX((Size - OFFSET_SAMPLE_LEN) / OFFSET_SAMPLES, 1);
+		for (int64 Pos = 0; Pos + OFFSET_SAMPLE_LEN <= Size && Out.Length() < OFFSET_SAMPLES; Pos += Step)
+		{
+			int Len = (int) MIN((int64)sizeof(Buf), Size - Pos);
+			if (In->SetPos(Pos) != Pos ||
+				In->Read(Buf, Len) != Len)
+				return false;
+
+			for (int i = 0; i + OFFSET_SAMPLE_LEN <= Len; i += OFFSET_SAMPLE_LEN / 2)
+			{
+				if (!IsUniform(Buf + i, OFFSET_SAMPLE_LEN))
+				{
+					OffsetSample &s = Out.New();
+					s.Hash = SampleHash(Buf + i);
+					s.Offset = Pos + i;
+					memcpy(s.Data, Buf + i, OFFSET_SAMPLE_LEN);
+					break;
+				}
+			}
+		}
+
+		Out.Sort(SampleCmp);
+		return true;
+	}
+
+	// Rolls a hash over every window of 'In', each window that is one of the
+	// samples votes for the offset between them. 'InIsB' says which file
+	// 'In' is, the votes are always the offset in 'b' less that in 'a'.
+	bool Scan(GStream *In, GArray<OffsetSample> &Samples, bool InIsB)
+	{
+		if (!Samples.Length())
+			return true;
+
+		// A bit per top 16 bits of the hash skips most windows cheaply
+		GArray<uint32> Filter;
+		if (!Filter.Length(1 << 11))
+			return false;
+		memset(&Filter[0], 0, Filter.Length() * sizeof(uint32));
+		for (unsigned i=0; i<Samples.Length(); i++)
+		{
+			uint32 Top = (uint32) (Samples[i].Hash >> 48);
+			Filter[Top >> 5] |= 1U << (Top & 31);
+		}
+
+		uint64 Out = 1;
+		for (int i=1; i<OFFSET_SAMPLE_LEN; i++)
+			Out *= OFFSET_HASH_MUL;
+
+		GArray<uint8> Buf;
+		if (!Buf.Length(OFFSET_READ_SIZE + OFFSET_SAMPLE_LEN))
+			return false;
+
+		// Each read keeps the last window's bytes from the one before
+		int64 Size = In->GetSize();
+		int64 Pos = 0;
+		int Have = 0;
+		if (In->SetPos(0) != 0)
+			return false;
+		while (Pos + Have < Size)
+		{
+			int Len = (int) MIN((int64)OFFSET_READ_SIZE, Size - Pos - Have);
+			if (In->Read(&Buf[Have], Len) != Len)
+				return false;
+			Have += Len;
+
+			uint8 *p = &Buf[0];
+			if (Have >= OFFSET_SAMPLE_LEN)
+			{
+				uint64 h = SampleHash(p);
+				for (int i = 0; ; i++)
+				{
+					uint32 Top = (uint32) (h >> 48);
+					if (Filter[Top >> 5] & (1U << (Top & 31)))
+					{
+						size_t Lo = 0, Hi = Samples.Length();
+						while (Lo < Hi)
+						{
+							size_t Mid = (Lo + Hi) >> 1;
+							if (Samples[Mid].Hash < h)
+								Lo = Mid + 1;
+							else
+								Hi = Mid;
+						}
+						for (; Lo < Samples.Length() && Samples[Lo].Hash == h; Lo++)
+						{
+							OffsetSample &s = Samples[Lo];
+							if (Votes.Length() < OFFSET_MAX_VOTES &&
+								!memcmp(s.Data, p + i, OFFSET_SAMPLE_LEN))
+								Votes.Add(InIsB ? Pos + i - s.Offset : s.Offset - Pos - i);
+						}
+					}
+
+					if (i + OFFSET_SAMPLE_LEN >= Have)
+						break;
+					h = (h - p[i] * Out) * OFFSET_HASH_MUL + p[i + OFFSET_SAMPLE_LEN];
+				}
+			}
+
+			int Keep = MIN(Have, OFFSET_SAMPLE_LEN - 1);
+			memmove(p, p + Have - Keep, Keep);
+			Pos += Have - Keep;
+			Have = Keep;
+
+			Done += Len;
+			if (Prog && LgiCurrentTime() - Ts > OFFSET_UPDATE_MS)
+			{
+				Ts = LgiCurrentTime();
+				Prog->Value(Done);
+				LgiYield();
+				if (Prog->IsCancelled())
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+public:
+	GOffsetFinder(GProgressDlg *prog)
+	{
+		Prog = prog;
+		Ts = LgiCurrentTime();
+		Done = 0;
+	}
+
+	bool Find(GStream *a, GStream *b, int64 &Delta, int &Score)
+	{
+		// Samples of each file are looked for in the other, so it works
+		// whichever one holds the other.
+		GArray<OffsetSample> SamplesA, SamplesB;
+		if (!GetSamples(a, SamplesA) ||
+			!GetSamples(b, SamplesB) ||
+			!Scan(b, SamplesA, true) ||
+			!Scan(a, SamplesB, false))
+			return false;
+
+		// The offset with the most votes wins, the smaller one on a tie
+		Votes.Sort(DeltaCmp);
+		Score = 0;
+		for (size_t i=0; i<Votes.Length(); )
+		{
+			size_t e = i;
+			while (e < Votes.Length() && Votes[e] == Votes[i])
+				e++;
+			int Count = (int) (e - i);
+			if (Count > Score ||
+				(Count == Score && (Votes[i] < 0 ? -Votes[i] : Votes[i]) < (Delta < 0 ? -Delta : Delta)))
+			{
+				Score = Count;
+				Delta = Votes[i];
+			}
+			i = e;
+		}
+
+		return Score > 0;
+	}
+};
+
+bool find_offset(GStream *a, GStream *b, int64 &Delta, int &Score, GProgressDlg *Prog)
+{
+	Delta = 0;
+	Score = 0;
+	if (!a || !b)
+		return false;
+
+	GOffsetFinder f(Prog);
+	return f.Find(a, b, Delta, Score);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Suffix sort benchmark: iHex -sortbench [-size <MB>] [-path <file or folder>]
+//
+// Runs the sort over a set of synthetic inputs that stress different parts
+// of the algorithm and then over any real files given, printing the time,
+// throughput and peak working memory of each.
+enum SortBenchCorpus
+{
+	BenchRandom,
+	BenchDna,
+	BenchText,
+	BenchRepeats,
+	BenchZeros,
+	BenchMax
+};
+
+static const char *SortBenchNames[] =
+{
+	"random",
+	"dna",
+	"text",
+	"repeats",
+	"zeros",
+};
+
+static void SortBenchFill(uint8 *p, int32 Len, SortBenchCorpus Type)
+{
+	static const char *Words[] = {"the ", "of ", "and ", "a ", "to ", "in ", "is ", "you ", "that ", "it ",
+								"file ", "byte ", "offset ", "buffer ", "struct ", "header ", "\n", ". ", ", ", "0x"};
+	uint32 Seed = 0x1234567;
+	#define BenchRand()	(Seed = Seed * 1103515245 + 12345, Seed >> 8)
+
+	switch (Type)
+	{
+		case BenchRandom:
+		{
+			for (int32 i=0; i<Len; i++)
+				p[i] = (uint8)BenchRand();
+			break;
+		}
+		case BenchDna:
+		{
+			for (int32 i=0; i<Len; i++)
+				p[i] = "ACGT"[BenchRand() & 3];
+			break;
+		}
+		case BenchText:
+		{
+			int32 i = 0;
+			while (i < Len)
+			{
+				const char *w = Words[BenchRand() % CountOf(Words)];
+				while (*w && i < Len)
+					p[i++] = *w++;
+			}
+			break;
+		}
+		case BenchRepeats:
+		{
+			// A 64KB block over and over with the odd changed byte, the long
+			// common prefixes are the worst case for prefix doubling.
+			int32 Block = MIN(Len, 64 << 10);
+			for (int32 i=0; i<Block; i++)
+				p[i] = (uint8)BenchRand();
+			for (int32 i=Block; i<Len; i++)
+				p[i] = BenchRand() % 1000 ? p[i - Block] : (uint8)BenchRand();
+			break;
+		}
+		default:
+		{
+			memset(p, 0, Len);
+			break;
+		}
+	}
+
+	#undef BenchRand
+}
+
+static bool SortBenchRun(const char *Name, const uint8 *Buf, int32 Len)
+{
+	int32 *I = (int32*) malloc(((size_t)Len + 1) * sizeof(int32));
+	if (!I)
+	{
+		printf("%-24s out of memory\n", Name);
+		return false;
+	}
+
+	int64 Peak = 0;
+	uint64 Start = LgiCurrentTime();
+	bool Status = suffix_sort(I, Buf, Len, &Peak);
+	uint64 Time = LgiCurrentTime() - Start;
+	free(I);
+
+	if (Status)
+	{
+		double Mb = (double)Len / (1 << 20);
+		printf("%-24s %10.1f %9.2f %9.2f %11.1f %6.2f\n",
+			Name,
+			Mb,
+			(double)Time / 1000,
+			Time ? Mb * 1000 / Time : 0.0,
+			(double)Peak / (1 << 20),
+			Len ? (double)Peak / Len : 0.0);
+	}
+	else printf("%-24s failed\n", Name);
+
+	return Status;
+}
+
+int SuffixSortBenchmark()
+{
+	GAutoString Size, Path;
+	LgiApp->GetOption("size", Size);
+	LgiApp->GetOption("path", Path);
+
+	int Mb = Size ? atoi(Size) : 64;
+	if (Mb <= 0 || Mb > 2047)
+	{
+		fprintf(stderr, "Usage: iHex -sortbench [-size <MB>] [-path <file or folder>]\n"
+						"    -size     size of the synthetic inputs, default 64MB, max 2047MB\n"
+						"    -path     also sort these files\n");
+		return 2;
+	}
+
+	int32 Len = Mb << 20;
+	printf("%-24s %10s %9s %9s %11s %6s\n", "Input", "Size(MB)", "Time(s)", "MB/s", "Peak(MB)", "B/byte");
+
+	int Errors = 0;
+	uint8 *Buf = (uint8*) malloc(Len);
+	if (Buf)
+	{
+		for (int i=0; i<BenchMax; i++)
+		{
+			SortBenchFill(Buf, Len, (SortBenchCorpus)i);
+			if (!SortBenchRun(SortBenchNames[i], Buf, Len))
+				Errors++;
+		}
+		free(Buf);
+	}
+	else
+	{
+		fprintf(stderr, "Can't allocate %i bytes.\n", Len);
+		Errors++;
+	}
+
+	if (Path)
+	{
+		GArray<char*> Files;
+		if (DirExists(Path))
+			LgiRecursiveFileSearch(Path, NULL, &Files);
+		else
+			Files.Add(NewStr(Path));
+
+		for (unsigned i=0; i<Files.Length(); i++)
+		{
+			GFile f;
+			if (!f.Open(Files[i], O_READ))
+				continue;
+
+			char *Leaf = strrchr(Files[i], DIR_CHAR);
+			Leaf = Leaf ? Leaf + 1 : Files[i];
+
+			int64 FileSize = f.GetSize();
+			if (FileSize >= 0x7fffffff)
+			{
+				printf("%-24s too large\n", Leaf);
+				continue;
+			}
+
+			GArray<uint8> Data;
+			if (FileSize > 0 &&
+				Data.Length((uint32)FileSize) &&
+				f.Read(&Data[0], (int)FileSize) == FileSize)
+			{
+				if (!SortBenchRun(Leaf, &Data[0], (int32)FileSize))
+					Errors++;
+			}
+		}
+
+		Files.DeleteArrays();
+	}
+
+	return Errors ? 1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// bsdiff patches
+#define BZ_BLOCK_SIZE		(64 << 10)
+#define PATCH_UPDATE_MS		200
+
+static void offtout(int64 x, uint8 *buf)
+{
+	uint64 y = x < 0 ? -x : x;
+	for (int i=0; i<8; i++, y >>= 8)
+		buf[i] = (uint8) y;
+	if (x < 0)
+		buf[7] |= 0x80;
+}
+
+static int64 offtin(const uint8 *buf)
+{
+	int64 y = buf[7] & 0x7f;
+	for (int i=6; i>=0; i--)
+		y = (y << 8) | buf[i];
+	return buf[7] & 0x80 ? -y : y;
+}
+
+// Compresses a block of the patch into memory
+class GBzWriter
+{
+	bz_stream s;
+	bool Init, Ok;
+	uint8 Out[BZ_BLOCK_SIZE];
+
+	bool Run(int Action)
+	{
+		while (true)
+		{
+			s.next_out = (char*)Out;
+			s.avail_out = sizeof(Out);
+			int r = BZ2_bzCompress(&s, Action);
+			size_t Bytes = sizeof(Out) - s.avail_out;
+			if (Bytes && !Data.Add(Out, Bytes))
+				return false;
+
+			if (Action == BZ_RUN)
+			{
+				if (r != BZ_RUN_OK)
+					return false;
+				if (!s.avail_in)
+					return true;
+			}
+			else if (r == BZ_STREAM_END)
+				return true;
+			else if (r != BZ_FINISH_OK)
+				return false;
+		}
+	}
+
+public:
+	GArray<uint8> Data;
+
+	GBzWriter()
+	{
+		memset(&s, 0, sizeof(s));
+		Init = Ok = BZ2_bzCompressInit(&s, 9, 0, 0) == BZ_OK;
+	}
+
+	~GBzWriter()
+	{
+		if (Init)
+			BZ2_bzCompressEnd(&s);
+	}
+
+	/// 'p' is NULL for a run of zeros
+	bool Write(const uint8 *p, int64 Len)
+	{
+		static uint8 Zeros[BZ_BLOCK_SIZE] = {0};
+		while (Ok && Len > 0)
+		{
+			unsigned Part = (unsigned) MIN(Len, BZ_BLOCK_SIZE);
+			s.next_in = (char*) (p ? p : Zeros);
+			s.avail_in = Part;
+			Ok = Run(BZ_RUN);
+			if (p)
+				p += Part;
+			Len -= Part;
+		}
+		return Ok;
+	}
+
+	bool Finish()
+	{
+		return Ok = Ok && Run(BZ_FINISH);
+	}
+};
+
+// Decompresses one block of a patch, reading the compressed bytes as needed
+class GBzReader
+{
+	GStream *In;
+	int64 Pos, End;
+	bz_stream s;
+	bool Init, Ok, Ended;
+	uint8 Buf[BZ_BLOCK_SIZE];
+
+	bool Fill()
+	{
+		if (!s.avail_in && Pos < End)
+		{
+			ssize_t Rd = (ssize_t) MIN(End - Pos, (int64)sizeof(Buf));
+			if (In->SetPos(Pos) != Pos ||
+				In->Read(Buf, Rd) != Rd)
+				return false;
+			Pos += Rd;
+			s.next_in = (char*)Buf;
+			s.avail_in = (unsigned) Rd;
+		}
+		return true;
+	}
+
+public:
+	GBzReader(GStream *in, int64 Start, int64 Len)
+	{
+		In = in;
+		Pos = Start;
+		End = Start + Len;
+		Ended = false;
+		memset(&s, 0, sizeof(s));
+		Init = Ok = BZ2_bzDecompressInit(&s, 0, 0) == BZ_OK;
+	}
+
+	~GBzReader()
+	{
+		if (Init)
+			BZ2_bzDecompressEnd(&s);
+	}
+
+	/// Reads exactly 'Len' bytes, false on corrupt or short data.
+	bool Read(uint8 *p, int64 Len)
+	{
+		while (Ok && Len > 0)
+		{
+			if (Ended || !Fill())
+				return Ok = false;
+
+			unsigned Part = (unsigned) MIN(Len, 1 << 30);
+			s.next_out = (char*)p;
+			s.avail_out = Part;
+			int r = BZ2_bzDecompress(&s);
+			unsigned Got = Part - s.avail_out;
+			p += Got;
+			Len -= Got;
+
+			if (r == BZ_STREAM_END)
+				Ended = true;
+			else if (r != BZ_OK || (!Got && !s.avail_in && Pos >= End))
+				Ok = false;
+		}
+
+		return Ok;
+	}
+
+	/// True if the block ends here, bzip2 checks it's CRC at the end.
+	bool AtEnd()
+	{
+		uint8 Extra;
+		while (Ok && !Ended)
+		{
+			if (!Fill())
+				return Ok = false;
+
+			s.next_out = (char*)&Extra;
+			s.avail_out = 1;
+			int r = BZ2_bzDecompress(&s);
+			if (!s.avail_out)
+				Ok = false; // More data than the patch used
+			else if (r == BZ_STREAM_END)
+				Ended = true;
+			else if (r != BZ_OK || (!s.avail_in && Pos >= End))
+				Ok = false;
+		}
+
+		return Ok && Ended;
+	}
+};
+
+GBsdiffWriter::GBsdiffWriter(int64 newSize, GProgressDlg *prog)
+{
+	Ctrl.Reset(new GBzWriter);
+	Db.Reset(new GBzWriter);
+	Eb.Reset(new GBzWriter);
+	NewSize = newSize;
+	Done = 0;
+	Ts = LgiCurrentTime();
+	Prog = prog;
+}
+
+GBsdiffWriter::~GBsdiffWriter()
+{
+}
+
+bool GBsdiffWriter::OnProgress(int64 Len)
+{
+	Done += Len;
+	if (Prog && LgiCurrentTime() - Ts > PATCH_UPDATE_MS)
+	{
+		Ts = LgiCurrentTime();
+		Prog->Value(Done);
+		LgiYield();
+		if (Prog->IsCancelled())
+			return false;
+	}
+	return true;
+}
+
+bool GBsdiffWriter::OnDiff(const uint8 *Data, int64 Len)
+{
+	return Db->Write(Data, Len) && OnProgress(Len);
+}
+
+bool GBsdiffWriter::OnExtra(const uint8 *Data, int64 Len)
+{
+	return Eb->Write(Data, Len) && OnProgress(Len);
+}
+
+bool GBsdiffWriter::OnCtrl(const ctrl_info &c)
+{
+	uint8 Buf[24];
+	for (int i=0; i<3; i++)
+		offtout(c.a[i], Buf + (i << 3));
+	return Ctrl->Write(Buf, sizeof(Buf));
+}
+
+bool GBsdiffWriter::Write(GStream *Out)
+{
+	if (!Out ||
+		!Ctrl->Finish() ||
+		!Db->Finish() ||
+		!Eb->Finish())
+		return false;
+
+	// Header is
+	//	0	8	"BSDIFF40"
+	//	8	8	length of bzip2ed ctrl block
+	//	16	8	length of bzip2ed diff block
+	//	24	8	length of new file
+	uint8 Header[32];
+	memcpy(Header, "BSDIFF40", 8);
+	offtout(Ctrl->Data.Length(), Header + 8);
+	offtout(Db->Data.Length(), Header + 16);
+	offtout(NewSize, Header + 24);
+
+	GArray<uint8> *Block[] = { &Ctrl->Data, &Db->Data, &Eb->Data };
+	if (Out->Write(Header, sizeof(Header)) != sizeof(Header))
+		return false;
+	for (int i=0; i<CountOf(Block); i++)
+	{
+		ssize_t Len = Block[i]->Length();
+		if (Len && Out->Write(&(*Block[i])[0], Len) != Len)
+			return false;
+	}
+
+	return true;
+}
+
+bool bsdiff_create(GStream *Old, GStream *New, GStream *Patch, GProgressDlg *Prog)
+{
+	if (!Old || !New || !Patch)
+		return false;
+
+	GBsdiffWriter Writer(New->GetSize(), Prog);
+	GStreamDiff d(Old, New, Prog);
+	return d.Diff(&Writer) && Writer.Write(Patch);
+}
+
+GBspatch::GBspatch(GStream *patch)
+{
+	Patch = patch;
+	CtrlLen = DiffLen = NewSize = -1;
+}
+
+bool GBspatch::ReadHeader()
+{
+	uint8 Header[32];
+	if (!Patch ||
+		Patch->SetPos(0) != 0 ||
+		Patch->Read(Header, sizeof(Header)) != sizeof(Header) ||
+		memcmp(Header, "BSDIFF40", 8))
+		return false;
+
+	CtrlLen = offtin(Header + 8);
+	DiffLen = offtin(Header + 16);
+	NewSize = offtin(Header + 24);
+	return	CtrlLen >= 0 &&
+			DiffLen >= 0 &&
+			NewSize >= 0 &&
+			32 + CtrlLen + DiffLen <= Patch->GetSize();
+}
+
+bool GBspatch::Apply(GStream *Old, GStream *New, GProgressDlg *Prog)
+{
+	if (!Old || !New || !ReadHeader())
+		return false;
+
+	int64 DiffStart = 32 + CtrlLen, ExtraStart = DiffStart + DiffLen;
+	GBzReader Ctrl(Patch, 32, CtrlLen);
+	GBzReader Diff(Patch, DiffStart, DiffLen);
+	GBzReader Extra(Patch, ExtraStart, Patch->GetSize() - ExtraStart);
+
+	GArray<uint8> Buf, OldBuf;
+	if (!Buf.Length(BZ_BLOCK_SIZE) ||
+		!OldBuf.Length(BZ_BLOCK_SIZE))
+		return false;
+
+	int64 OldSize = Old->GetSize();
+	int64 NewPos = 0, OldPos = 0;
+	uint64 Ts = LgiCurrentTime();
+	while (NewPos < NewSize)
+	{
+		uint8 c[24];
+		if (!Ctrl.Read(c, sizeof(c)))
+			return false;
+		int64 Add = offtin(c), ExtraLen = offtin(c + 8), Seek = offtin(c + 16);
+		if (Add < 0 ||
+			ExtraLen < 0 ||
+			Add > NewSize - NewPos ||
+			ExtraLen > NewSize - NewPos - Add) // Not 'Add + ExtraLen', that can overflow
+			return false;
+
+		// Diff bytes added to the old bytes, where there are any
+		for (int64 i=0; i<Add; )
+		{
+			int Part = (int) MIN(Add - i, BZ_BLOCK_SIZE);
+			if (!Diff.Read(&Buf[0], Part))
+				return false;
+
+			int64 From = MAX(OldPos + i, 0);
+			int64 To = MIN(OldPos + i + Part, OldSize);
+			if (From < To)
+			{
+				ssize_t Len = (ssize_t) (To - From);
+				if (Old->SetPos(From) != From ||
+					Old->Read(&OldBuf[0], Len) != Len)
+					return false;
+
+				uint8 *d = &Buf[(size_t) (From - (OldPos + i))];
+				for (ssize_t n=0; n<Len; n++)
+					d[n] += OldBuf[n];
+			}
+
+			if (New->Write(&Buf[0], Part) != Part)
+				return false;
+			i += Part;
+		}
+		NewPos += Add;
+		OldPos += Add;
+
+		// Then bytes that are only in the new file
+		for (int64 i=0; i<ExtraLen; )
+		{
+			int Part = (int) MIN(ExtraLen - i, BZ_BLOCK_SIZE);
+			if (!Extra.Read(&Buf[0], Part) ||
+				New->Write(&Buf[0], Part) != Part)
+				return false;
+			i += Part;
+		}
+		NewPos += ExtraLen;
+		OldPos += Seek;
+
+		if (Prog && LgiCurrentTime() - Ts > PATCH_UPDATE_MS)
+		{
+			Ts = LgiCurrentTime();
+			Prog->Value(NewPos);
+			LgiYield();
+			if (Prog->IsCancelled())
+				return false;
+		}
+	}
+
+	return Ctrl.AtEnd() && Diff.AtEnd() && Extra.AtEnd();
+}
+
+int PatchCommandLine()
+{
+	GAutoString OldName, NewName, PatchName;
+	LgiApp->GetOption("old", OldName);
+	LgiApp->GetOption("new", NewName);
+	LgiApp->GetOption("patch", PatchName);
+
+	bool Create = LgiApp->GetOption("bsdiff");
+	if (!OldName || !NewName || !PatchName)
+	{
+		fprintf(stderr, "Usage: iHex -bsdiff -old <file> -new <file> -patch <file>\n"
+						"       iHex -bspatch -old <file> -patch <file> -new <file>\n"
+						"    -bsdiff   write a BSDIFF40 patch that turns 'old' into 'new'\n"
+						"    -bspatch  apply 'patch' to 'old', writing 'new'\n");
+		return 2;
+	}
+
+	GFile Old, New, Patch;
+	if (!Old.Open(OldName, O_READ))
+	{
+		fprintf(stderr, "Can't open '%s'.\n", OldName.Get());
+		return 1;
+	}
+	if (Create ? !New.Open(NewName, O_READ) : !Patch.Open(PatchName, O_READ))
+	{
+		fprintf(stderr, "Can't open '%s'.\n", Create ? NewName.Get() : PatchName.Get());
+		return 1;
+	}
+
+	// Written to a temporary file first, the output may be one of the inputs
+	GFile &Out = Create ? Patch : New;
+	GString OutName = Create ? PatchName.Get() : NewName.Get(), Tmp;
+	Tmp.Printf("%s.tmp", OutName.Get());
+	if (!Out.Open(Tmp, O_WRITE))
+	{
+		fprintf(stderr, "Can't create '%s'.\n", Tmp.Get());
+		return 1;
+	}
+	Out.SetSize(0);
+
+	uint64 Start = LgiCurrentTime();
+	bool Status;
+	if (Create)
+	{
+		Status = bsdiff_create(&Old, &New, &Patch);
+	}
+	else
+	{
+		GBspatch p(&Patch);
+		Status = p.Apply(&Old, &New);
+	}
+	int64 OutSize = Out.GetSize();
+	Old.Close();
+	New.Close();
+	Patch.Close();
+	if (!Status)
+	{
+		FileDev->Delete(Tmp, false);
+		fprintf(stderr, Create ? "Making the patch failed.\n" : "Applying the patch failed, it may be corrupt.\n");
+		return 1;
+	}
+	if (FileExists(OutName))
+		FileDev->Delete(OutName, false);
+	if (!FileDev->Move(Tmp, OutName))
+	{
+		fprintf(stderr, "Can't rename '%s' to '%s'.\n", Tmp.Get(), OutName.Get());
+		return 1;
+	}
+
+	double Sec = (double) (int64) (LgiCurrentTime() - Start) / 1000.0;
+	printf("%s: " LPrintfInt64 " bytes in %.2f seconds\n", OutName.Get(), OutSize, Sec);
+	return 0;
+}
+
+// A growable memory stream for the benchmark, so it times the patch and
+// not the disk.
+class GBenchStream : public GStream
+{
+	GArray<uint8> Data;
+	int64 Pos;
+
+public:
+	GBenchStream() { Pos = 0; }
+
+	uint8 *Get() { return Data.Length() ? &Data[0] : NULL; }
+	int64 GetSize() { return Data.Length(); }
+	int64 GetPos() { return Pos; }
+	int64 SetPos(int64 p) { return Pos = p; }
+
+	int64 SetSize(int64 s)
+	{
+		Data.Length((size_t)s);
+		Pos = MIN(Pos, s);
+		return Data.Length();
+	}
+
+	ssize_t Read(void *Ptr, ssize_t Len, int Flags = 0)
+	{
+		ssize_t Rd = (ssize_t) MAX(0, MIN(Len, (int64)Data.Length() - Pos));
+		if (Rd > 0)
+			memcpy(Ptr, &Data[(size_t)Pos], Rd);
+		Pos += Rd;
+		return Rd;
+	}
+
+	ssize_t Write(const void *Ptr, ssize_t Len, int Flags = 0)
+	{
+		if (Pos + Len > (int64)Data.Length() &&
+			!Data.Length((size_t) (Pos + Len)))
+			return 0;
+		memcpy(&Data[(size_t)Pos], Ptr, Len);
+		Pos += Len;
+		return Len;
+	}
+};
+
+static uint32 PatchBenchRand(uint32 &Seed)
+{
+	Seed = Seed * 1103515245 + 12345;
+	return Seed >> 8;
+}
+
+static bool PatchBenchRun(const char *Name, GBenchStream &Old, GBenchStream &New)
+{
+	GBenchStream Patch, Out;
+	double Mb = (double)New.GetSize() / (1 << 20);
+
+	uint64 t0 = LgiCurrentTime();
+	bool Status = bsdiff_create(&Old, &New, &Patch);
+	uint64 t1 = LgiCurrentTime();
+	if (Status)
+	{
+		GBspatch p(&Patch);
+		Status = p.Apply(&Old, &Out);
+	}
+	uint64 t2 = LgiCurrentTime();
+
+	if (!Status ||
+		Out.GetSize() != New.GetSize() ||
+		(New.GetSize() && memcmp(Out.Get(), New.Get(), (size_t)New.GetSize())))
+	{
+		printf("%-24s failed\n", Name);
+		return false;
+	}
+
+	double Create = (double) (int64) (t1 - t0) / 1000.0;
+	double Apply = (double) (int64) (t2 - t1) / 1000.0;
+	printf("%-24s %10.1f %10.1f %11.2f %10.1f %11.2f %10.1f\n",
+		Name,
+		Mb,
+		(double)Patch.GetSize() / 1024.0,
+		Create,
+		Create > 0 ? Mb / Create : 0.0,
+		Apply,
+		Apply > 0 ? Mb / Apply : 0.0);
+	return true;
+}
+
+int PatchBenchmark()
+{
+	GAutoString Size, OldName, NewName;
+	LgiApp->GetOption("size", Size);
+	LgiApp->GetOption("old", OldName);
+	LgiApp->GetOption("new", NewName);
+
+	int Mb = Size ? atoi(Size) : 16;
+	if (Mb <= 0 || Mb > 1024 || !OldName != !NewName)
+	{
+		fprintf(stderr, "Usage: iHex -patchbench [-size <MB>] [-old <file> -new <file>]\n"
+						"    -size     size of the synthetic inputs, default 16MB, max 1024MB\n"
+						"    -old/-new also time a patch between these files\n");
+		return 2;
+	}
+
+	printf("%-24s %10s %10s %11s %10s %11s %10s\n", "Input", "Size(MB)", "Patch(KB)", "Create(s)", "MB/s", "Apply(s)", "MB/s");
+
+	// An old file of text like data, and new versions of it with a few
+	// scattered byte edits, with blocks inserted and removed, and with a
+	// word changed in every 4KB as a relinked executable would have.
+	int Errors = 0;
+	GBenchStream Old;
+	int32 Len = Mb << 20;
+	if (Old.SetSize(Len) != Len)
+	{
+		fprintf(stderr, "Can't allocate %i bytes.\n", Len);
+		return 1;
+	}
+	SortBenchFill(Old.Get(), Len, BenchText);
+
+	uint32 Seed = 0x1234567;
+	for (int Type=0; Type<3; Type++)
+	{
+		GBenchStream New;
+		const char *Name = NULL;
+		if (Type == 0)
+		{
+			Name = "scattered edits";
+			New.Write(Old.Get(), Len);
+			for (int i=0; i<1000; i++)
+				New.Get()[PatchBenchRand(Seed) % Len] ^= 0x20;
+		}
+		else if (Type == 1)
+		{
+			Name = "inserts and removes";
+			uint8 Ins[4096];
+			for (int i=0; i<sizeof(Ins); i++)
+				Ins[i] = (uint8) PatchBenchRand(Seed);
+			for (int32 Pos = 0; Pos < Len; )
+			{
+				int32 Keep = MIN(Len - Pos, (int32) (PatchBenchRand(Seed) % (1 << 20)));
+				New.Write(Old.Get() + Pos, Keep);
+				Pos += Keep;
+				if (PatchBenchRand(Seed) & 1)
+					New.Write(Ins, 1 + PatchBenchRand(Seed) % sizeof(Ins));
+				else
+					Pos += PatchBenchRand(Seed) % 4096;
+			}
+		}
+		else
+		{
+			Name = "relinked";
+			New.Write(Old.Get(), Len);
+			for (int32 i=0; i + 4 <= Len; i += 4096)
+				*(uint32*)(New.Get() + i) += 0x100;
+		}
+
+		if (!PatchBenchRun(Name, Old, New))
+			Errors++;
+	}
+
+	if (OldName)
+	{
+		GBenchStream FileOld, FileNew;
+		GFile a, b;
+		int64 SizeA, SizeB;
+		if (!a.Open(OldName, O_READ) ||
+			!b.Open(NewName, O_READ) ||
+			(SizeA = a.GetSize()) < 0 ||
+			(SizeB = b.GetSize()) < 0 ||
+			FileOld.SetSize(SizeA) != SizeA ||
+			FileNew.SetSize(SizeB) != SizeB ||
+			a.Read(FileOld.Get(), (ssize_t)SizeA) != SizeA ||
+			b.Read(FileNew.Get(), (ssize_t)SizeB) != SizeB)
+		{
+			fprintf(stderr, "Can't read '%s' and '%s'.\n", OldName.Get(), NewName.Get());
+			Errors++;
+		}
+		else
+		{
+			char *Leaf = strrchr(NewName, DIR_CHAR);
+			if (!PatchBenchRun(Leaf ? Leaf + 1 : NewName.Get(), FileOld, FileNew))
+				Errors++;
+		}
+	}
+
+	return Errors ? 1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Diff report
+#define REPORT_READ_SIZE	(1 << 20)
+#define REPORT_UPDATE_MS	200
+
+static const char *RegionTypeNames[] =
+{
+	"changed",
+	"added",
+	"removed"
+};
+
+GDiffReport::GDiffReport(int64 gap, size_t maxRegions)
+{
+	Gap = gap;
+	MaxRegions = maxRegions;
+	Empty();
+}
+
+void GDiffReport::Empty()
+{
+	Size[0] = Size[1] = 0;
+	Changed = 0;
+	RegionCount = 0;
+	Regions.Length(0);
+	Open = false;
+}
+
+void GDiffReport::OnDiff(int64 Offset)
+{
+	Changed++;
+	if (Open && Offset - (Cur.Offset + Cur.Len) <= Gap)
+	{
+		Cur.Len = Offset + 1 - Cur.Offset;
+		Cur.Changed++;
+		return;
+	}
+
+	Close();
+	Cur.Type = RegionChanged;
+	Cur.Offset = Offset;
+	Cur.Len = 1;
+	Cur.Changed = 1;
+	Open = true;
+}
+
+void GDiffReport::Close()
+{
+	if (!Open)
+		return;
+
+	// Past the limit regions are still counted, just not kept
+	if (Regions.Length() < MaxRegions)
+		Regions.Add(Cur);
+	RegionCount++;
+	Open = false;
+}
+
+bool GDiffReport::Compare(GStream *a, GStream *b, GProgressDlg *Prog)
+{
+	Empty();
+	if (!a || !b)
+		return false;
+
+	Size[0] = a->GetSize();
+	Size[1] = b->GetSize();
+	if (Size[0] < 0 || Size[1] < 0)
+		return false;
+
+	GArray<uint8> Buf[2];
+	if (!Buf[0].Length(REPORT_READ_SIZE) ||
+		!Buf[1].Length(REPORT_READ_SIZE) ||
+		a->SetPos(0) != 0 ||
+		b->SetPos(0) != 0)
+		return false;
+
+	// One pass over both, mem_mismatch skips the runs that are the same
+	int64 Common = MIN(Size[0], Size[1]);
+	uint64 Ts = LgiCurrentTime();
+	for (int64 Pos = 0; Pos < Common; )
+	{
+		int Len = (int) MIN(Common - Pos, REPORT_READ_SIZE);
+		if (a->Read(&Buf[0][0], Len) != Len ||
+			b->Read(&Buf[1][0], Len) != Len)
+			return false;
+
+		for (int64 i = 0; i < Len; )
+		{
+			i += mem_mismatch(&Buf[0][(size_t)i], &Buf[1][(size_t)i], Len - i);
+			if (i < Len)
+				OnDiff(Pos + i++);
+		}
+		Pos += Len;
+
+		if (Prog && LgiCurrentTime() - Ts > REPORT_UPDATE_MS)
+		{
+			Ts = LgiCurrentTime();
+			Prog->Value(Pos);
+			LgiYield();
+			if (Prog->IsCancelled())
+				return false;
+		}
+	}
+	Close();
+
+	// Bytes past the end of the shorter file
+	if (Size[0] != Size[1])
+	{
+		Cur.Type = Size[1] > Size[0] ? RegionAdded : RegionRemoved;
+		Cur.Offset = Common;
+		Cur.Len = Cur.Changed = MAX(Size[0], Size[1]) - Common;
+		Changed += Cur.Len;
+		Open = true;
+		Close();
+	}
+
+	return true;
+}
+
+double GDiffReport::GetSimilarity()
+{
+	int64 Max = MAX(Size[0], Size[1]);
+	return Max ? (double) (Max - Changed) * 100.0 / (double) Max : 100.0;
+}
+
+double GDiffReport::GetSimilarity(Region &r)
+{
+	return r.Len ? (double) (r.Len - r.Changed) * 100.0 / (double) r.Len : 100.0;
+}
+
+static void PrintJsonString(GStream *Out, const char *s)
+{
+	Out->Print("\"");
+	for (const char *c = s; c && *c; c++)
+	{
+		if (*c == '\"' || *c == '\\')
+			Out->Print("\\%c", *c);
+		else if ((uint8)*c < ' ')
+			Out->Print("\\u%04x", (uint8)*c);
+		else
+			Out->Print("%c", *c);
+	}
+	Out->Print("\"");
+}
+
+bool GDiffReport::Write(GStream *Out, bool Json, const char *NameA, const char *NameB)
+{
+	if (!Out)
+		return false;
+
+	const char *Name[2] = { NameA ? NameA : "", NameB ? NameB : "" };
+	if (Json)
+	{
+		Out->Print("{\n");
+		for (int i=0; i<2; i++)
+		{
+			Out->Print("\t\"%s\": {\"file\": ", i ? "new" : "old");
+			PrintJsonString(Out, Name[i]);
+			Out->Print(", \"size\": " LPrintfInt64 "},\n", Size[i]);
+		}
+		Out->Print("\t\"changed\": " LPrintfInt64 ",\n"
+					"\t\"similarity\": %.2f,\n"
+					"\t\"regionCount\": " LPrintfInt64 ",\n"
+					"\t\"truncated\": %s,\n"
+					"\t\"regions\": [",
+					Changed,
+					GetSimilarity(),
+					RegionCount,
+					RegionCount > (int64)Regions.Length() ? "true" : "false");
+		for (unsigned i=0; i<Regions.Length(); i++)
+		{
+			Region &r = Regions[i];
+			Out->Print("%s\n\t\t{\"type\": \"%s\", \"offset\": " LPrintfInt64 ", \"length\": " LPrintfInt64 ", \"changed\": " LPrintfInt64 ", \"similarity\": %.2f}",
+						i ? "," : "",
+						RegionTypeNames[r.Type],
+						r.Offset,
+						r.Len,
+						r.Changed,
+						GetSimilarity(r));
+		}
+		Out->Print("%s]\n}\n", Regions.Length() ? "\n\t" : "");
+		return true;
+	}
+
+	for (int i=0; i<2; i++)
+		Out->Print("%s %s (" LPrintfInt64 " bytes)\n", i ? "New:" : "Old:", Name[i], Size[i]);
+	Out->Print("Changed: " LPrintfInt64 " bytes in " LPrintfInt64 " regions, %.2f%% similar\n",
+				Changed,
+				RegionCount,
+				GetSimilarity());
+	if (Regions.Length())
+	{
+		Out->Print("\n%-8s %-18s %12s %12s %10s\n", "Type", "Offset", "Length", "Changed", "Similarity");
+		for (unsigned i=0; i<Regions.Length(); i++)
+		{
+			Region &r = Regions[i];
+			GString Len, Changed;
+			Len.Printf(LPrintfInt64, r.Len);
+			Changed.Printf(LPrintfInt64, r.Changed);
+			Out->Print("%-8s 0x%016llx %12s %12s %9.2f%%\n",
+						RegionTypeNames[r.Type],
+						(unsigned long long)r.Offset,
+						Len.Get(),
+						Changed.Get(),
+						GetSimilarity(r));
+		}
+	}
+	if (RegionCount > (int64)Regions.Length())
+		Out->Print("... " LPrintfInt64 " more regions not listed\n", RegionCount - (int64)Regions.Length());
+
+	return true;
+}
+
+int DiffReportCommandLine()
+{
+	GAutoString OldName, NewName, OutName, Gap, Max;
+	LgiApp->GetOption("old", OldName);
+	LgiApp->GetOption("new", NewName);
+	LgiApp->GetOption("out", OutName);
+	LgiApp->GetOption("gap", Gap);
+	LgiApp->GetOption("max", Max);
+	bool Json = LgiApp->GetOption("json");
+	int64 GapLen = Gap ? atoi64(Gap) : REPORT_DEFAULT_GAP;
+	int64 MaxRegions = Max ? atoi64(Max) : REPORT_DEFAULT_MAX;
+
+	if (!OldName || !NewName || GapLen < 0 || MaxRegions <= 0)
+	{
+		fprintf(stderr, "Usage: iHex -diffreport -old <file> -new <file> [-json] [-out <file>] [-gap <n>] [-max <n>]\n"
+						"    -json     write JSON instead of text\n"
+						"    -out      write the report to a file instead of stdout\n"
+						"    -gap      join changes at most n equal bytes apart (default %i)\n"
+						"    -max      list at most n regions (default %i)\n",
+						REPORT_DEFAULT_GAP,
+						REPORT_DEFAULT_MAX);
+		return 2;
+	}
+
+	GFile Old, New;
+	if (!Old.Open(OldName, O_READ) ||
+		!New.Open(NewName, O_READ))
+	{
+		fprintf(stderr, "Can't open '%s'.\n", Old.IsOpen() ? NewName.Get() : OldName.Get());
+		return 2;
+	}
+
+	GDiffReport Report(GapLen, (size_t)MaxRegions);
+	if (!Report.Compare(&Old, &New))
+	{
+		fprintf(stderr, "Reading the files failed.\n");
+		return 2;
+	}
+
+	GStringPipe p;
+	Report.Write(&p, Json, OldName, NewName);
+	GString s = p.NewGStr();
+	if (OutName)
+	{
+		GFile Out;
+		if (!Out.Open(OutName, O_WRITE))
+		{
+			fprintf(stderr, "Can't create '%s'.\n", OutName.Get());
+			return 2;
+		}
+		Out.SetSize(0);
+		if (Out.Write(s.Get(), s.Length()) != (ssize_t)s.Length())
+		{
+			fprintf(stderr, "Writing '%s' failed.\n", OutName.Get());
+			return 2;
+		}
+	}
+	else
+	{
+		fwrite(s.Get(), 1, s.Length(), stdout);
+	}
+
+	// Like cmp: 0 if the files are the same, 1 if they differ, 2 on errors
+	return Report.GetChanged() ? 1 : 0;
+}
@@ -2,6 +2,9 @@
 #define _DIFF_H_
 
 #include "GArray.h"
+#include "GStream.h"
+#include "GThread.h"
+#include "GMutex.h"
 
 struct ctrl_info
 {
@@ -15,6 +18,313 @@ struct diff_info
 	GArray<uint8> eb;
 };
 
-extern bool binary_diff(diff_info &di, uint8 *old, int oldsize, uint8 *New, int newsize);
+/// Diffs 'New' against 'old', adding the result to 'di'. With 'Prog' it
+/// shows how much of 'New' is done and stops if cancelled. If 'MemLimit' is
+/// set and the diff would need more memory than that (see
+/// binary_diff_memory) the files are diffed in windows by GStreamDiff
+/// instead, which stays under it but may find fewer matches.
+extern bool binary_diff(diff_info &di, uint8 *old, int oldsize, uint8 *New, int newsize, class GProgressDlg *Prog = NULL, int64 MemLimit = 0);
+/// The working memory binary_diff needs to diff the whole of two buffers.
+extern int64 binary_diff_memory(int oldsize, int newsize);
+
+/// Receives a diff as it's made, in the same add/extra/seek form as
+/// diff_info. The 'add' and 'extra' bytes of a record arrive before the
+/// record itself. Return false from any of these to stop the diff.
+class GDiffSink
+{
+public:
+	virtual ~GDiffSink() {}
+
+	/// The old + diff bytes of an add, 'Data' is NULL for a run of zeros.
+	virtual bool OnDiff(const uint8 *Data, int64 Len) = 0;
+	/// New bytes not taken from the old file.
+	virtual bool OnExtra(const uint8 *Data, int64 Len) = 0;
+	/// A finished control record.
+	virtual bool OnCtrl(const ctrl_info &c) = 0;
+};
+
+/// Collects a streamed diff into a diff_info.
+class GDiffInfoSink : public GDiffSink
+{
+	diff_info &di;
+
+public:
+	GDiffInfoSink(diff_info &d) : di(d) {}
+
+	bool OnDiff(const uint8 *Data, int64 Len);
+	bool OnExtra(const uint8 *Data, int64 Len);
+	bool OnCtrl(const ctrl_info &c);
+};
+
+/// Diffs two streams of any size in bounded memory. Content defined chunks
+/// of the old stream that turn up in the new one are used as anchors and
+/// only the bytes between them are diffed with binary_diff.
+class GStreamDiff
+{
+public:
+	struct Chunk
+	{
+		uint64 Hash;
+		int64 Offset;
+		int32 Len;
+	};
+
+protected:
+	GStream *Old, *NewStream;
+	class GProgressDlg *Prog;
+	GDiffSink *Sink;
+	GArray<Chunk> Index;	// Old chunks sorted by hash, then offset
+	GArray<uint8> Gap;		// New bytes since the last anchor
+	GArray<uint8> OldBuf;
+	int64 GapMax;			// Longest gap diffed in one go
+	int64 MaxChunks;
+	int64 OldSize;
+	int64 OldEnd;			// Old offset after the last anchor
+	int64 NewDone;			// New bytes sent to the sink
+
+	// The control record being built
+	int64 CtrlOldStart;
+	int64 CtrlAdd, CtrlExtra;
+
+	Chunk *Find(uint64 Hash);
+	bool Copy(int64 OldOffset, int64 Len, const uint8 *DiffBytes);
+	bool Insert(const uint8 *Bytes, int64 Len);
+	bool FlushGap(int64 Anchor);
+
+public:
+	/// With 'Prog' the diffs of the gaps update it and stop if cancelled.
+	GStreamDiff(GStream *Old, GStream *New, class GProgressDlg *Prog = NULL);
+
+	/// Sizes the gaps and the chunk index to stay around 'Bytes' of
+	/// working memory.
+	void SetMemoryLimit(int64 Bytes);
+
+	/// Sends the diff of the streams to 'Sink' as it's found.
+	bool Diff(GDiffSink *Sink);
+};
+
+/// Sorts the suffixes of 'buf'. 'I' must have room for len+1 entries, on
+/// return I[0] is the empty suffix (len) and I[1..len] are in sorted order.
+/// If 'PeakBytes' is given it receives the peak working memory, including I.
+/// With 'Prog' the dialog is kept painting and the sort stops if cancelled.
+extern bool suffix_sort(int32 *I, const uint8 *buf, int32 len, int64 *PeakBytes = NULL, class GProgressDlg *Prog = NULL);
+
+/// Index of the first byte that differs between 'a' and 'b', or 'Len' if
+/// they're the same.
+extern int64 mem_mismatch(const uint8 *a, const uint8 *b, int64 Len);
+/// Index of the last byte that differs, or -1 if they're the same.
+extern int64 mem_mismatch_rev(const uint8 *a, const uint8 *b, int64 Len);
+/// Sets Flags[i] to 1 where a[i] != b[i], leaving the others as they are.
+/// Returns true if any byte differs.
+extern bool mem_diff_flags(const uint8 *a, const uint8 *b, int Len, uint8 *Flags);
+
+#define DIFF_BLOCK_SIZE		(64 << 10)
+
+/// Which blocks of two files differ, worked out on background threads by
+/// hashing each DIFF_BLOCK_SIZE block of both with xxHash64. Blocks past the
+/// end of the shorter file always differ.
+class GBlockDiffMap : public GMutex
+{
+	friend class GBlockDiffWorker;
+
+	GString File[2];
+	int64 Size[2];
+	int64 Blocks;
+	GArray<class GBlockDiffWorker*> Workers;
+
+	// Shared with the workers (under lock)
+	GArray<uint32> Known, Differs;	// A bit per block
+	int64 NextBlock;
+	int64 Done;
+	bool Cancelled;
+
+public:
+	enum BlockState
+	{
+		BlockUnknown,
+		BlockSame,
+		BlockDiffers
+	};
+
+	GBlockDiffMap(const char *FileA, const char *FileB);
+	~GBlockDiffMap();
+
+	bool Start(int Threads = 0);
+	bool IsRunning();
+	void Cancel();
+	int64 GetBlocks() { return Blocks; }
+	int64 GetDone() { return Done; }
+
+	BlockState GetState(int64 Block);
+	/// The nearest block at or after 'Block' (or at or before it if not
+	/// 'Forward') that isn't known to be the same, or -1 if there isn't one.
+	int64 Find(int64 Block, bool Forward);
+};
+
+/// Blocks that are in both files but at different offsets, found in the
+/// background. Both files are cut into content defined chunks, the first
+/// file's chunks go in a hash table and each chunk of the second is looked
+/// up in it, so it's linear in the size of the files. Runs of matching
+/// chunks with the same offset delta are joined into one move, which is
+/// then grown byte by byte past the chunk edges.
+class GMoveMap : public GMutex
+{
+	friend class GMoveWorker;
+
+public:
+	struct Move
+	{
+		int64 Offset[2];
+		int64 Len;
+	};
+
+private:
+	GString File[2];
+	int64 Size[2];
+	GAutoPtr<class GMoveWorker> Worker;
+	GArray<Move> Moves[2];	// The same moves in the order of each file
+	GArray<int64> Reach[2];	// The furthest end of the moves up to each one
+	int64 Done;				// Bytes of both files read
+	bool Cancelled, Finished;
+
+public:
+	GMoveMap(const char *FileA, const char *FileB);
+	~GMoveMap();
+
+	bool Start();
+	bool IsRunning();
+	void Cancel();
+	/// Percentage of the files read so far.
+	int GetProgress();
+
+	/// The number of moves, zero until they've all been found.
+	size_t Length();
+	/// The i'th move in the order of file 'Side'.
+	Move *Get(int Side, size_t i) { return Moves[Side].AddressOf(i); }
+	/// Index of the first move on 'Side' that may cover 'Offset' or later.
+	size_t First(int Side, int64 Offset);
+	/// The move covering 'Offset' on 'Side', or NULL.
+	Move *Find(int Side, int64 Offset);
+};
+
+/// Finds the offset of the data in 'a' within 'b' (a byte at 'n' in 'a' is at
+/// 'n + Delta' in 'b'). Blocks sampled from each file are looked for in all
+/// of the other with a rolling hash and each match votes for the offset
+/// between them, 'Score' is the winner's vote count. One pass over each file.
+extern bool find_offset(GStream *a, GStream *b, int64 &Delta, int &Score, class GProgressDlg *Prog = NULL);
+
+/// Times the suffix sort over synthetic and real inputs, for '-sortbench'.
+extern int SuffixSortBenchmark();
+
+/// Writes a diff as a bsdiff patch (BSDIFF40): a 32 byte header then the
+/// bzip2 compressed control, diff and extra blocks. The blocks are
+/// compressed in memory as the diff arrives.
+class GBsdiffWriter : public GDiffSink
+{
+	GAutoPtr<class GBzWriter> Ctrl, Db, Eb;
+	int64 NewSize;
+	int64 Done;				// Bytes of the new file covered so far
+	uint64 Ts;
+	class GProgressDlg *Prog;
+
+	bool OnProgress(int64 Len);
+
+public:
+	GBsdiffWriter(int64 NewSize, class GProgressDlg *Prog = NULL);
+	~GBsdiffWriter();
+
+	bool OnDiff(const uint8 *Data, int64 Len);
+	bool OnExtra(const uint8 *Data, int64 Len);
+	bool OnCtrl(const ctrl_info &c);
+
+	/// Writes the finished patch to 'Out'.
+	bool Write(GStream *Out);
+};
+
+/// Makes a BSDIFF40 patch that turns 'Old' into 'New'.
+extern bool bsdiff_create(GStream *Old, GStream *New, GStream *Patch, class GProgressDlg *Prog = NULL);
+
+/// Applies a BSDIFF40 patch as a stream: the new file is written in order
+/// as it's made and the old file is read where the patch points, so only
+/// a few small buffers are held in memory whatever the file sizes.
+class GBspatch
+{
+	GStream *Patch;
+	int64 CtrlLen, DiffLen, NewSize;
+
+public:
+	GBspatch(GStream *Patch);
+
+	/// Checks the header, false if it's not a BSDIFF40 patch.
+	bool ReadHeader();
+	int64 GetNewSize() { return NewSize; }
+	/// Writes the patched copy of 'Old' to 'New'.
+	bool Apply(GStream *Old, GStream *New, class GProgressDlg *Prog = NULL);
+};
+
+/// Makes or applies a patch without the UI, for '-bsdiff' and '-bspatch'.
+extern int PatchCommandLine();
+/// Times patch creation and application, for '-patchbench'.
+extern int PatchBenchmark();
+
+#define REPORT_DEFAULT_GAP		16
+#define REPORT_DEFAULT_MAX		100000
+
+/// A summary of how two files differ byte for byte, made in one sequential
+/// pass over both so it works on files of any size. Differing bytes that
+/// are at most 'Gap' equal bytes apart are joined into one region.
+class GDiffReport
+{
+public:
+	enum RegionType
+	{
+		RegionChanged,
+		RegionAdded,	// Past the end of the old file
+		RegionRemoved,	// Past the end of the new file
+	};
+
+	struct Region
+	{
+		RegionType Type;
+		int64 Offset;
+		int64 Len;
+		int64 Changed;	// Bytes in the region that differ
+	};
+
+private:
+	int64 Gap;
+	size_t MaxRegions;
+	int64 Size[2];
+	int64 Changed;
+	int64 RegionCount;
+	GArray<Region> Regions;
+	Region Cur;
+	bool Open;
+
+	void OnDiff(int64 Offset);
+	void Close();
+
+public:
+	GDiffReport(int64 Gap = REPORT_DEFAULT_GAP, size_t MaxRegions = REPORT_DEFAULT_MAX);
+
+	void Empty();
+	bool Compare(GStream *a, GStream *b, class GProgressDlg *Prog = NULL);
+
+	int64 GetSize(int i) { return Size[i]; }
+	int64 GetChanged() { return Changed; }
+	/// All the regions, including any not kept past 'MaxRegions'.
+	int64 GetRegionCount() { return RegionCount; }
+	GArray<Region> &GetRegions() { return Regions; }
+	/// Percentage of the bytes of the larger file that are the same.
+	double GetSimilarity();
+	/// Percentage of the bytes in 'r' that are the same.
+	double GetSimilarity(Region &r);
+
+	/// Writes the report as text or JSON.
+	bool Write(GStream *Out, bool Json, const char *NameA, const char *NameB);
+};
+
+/// Writes a diff report without the UI, for '-diffreport'.
+extern int DiffReportCommandLine();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,3150 @@
+#include "Lgi.h"
+#include "iHex.h"
+#include "Search.h"
+#include "LList.h"
+#include "Diff.h"
+#include "GProgressDlg.h"
+#include "GEdit.h"
+#include "GCheckBox.h"
+#include "GScrollBar.h"
+#include "GDisplayString.h"
+#include <sys/stat.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAS_SSE2					1
+#else
+#define HAS_SSE2					0
+#endif
+
+#define SCAN_MIN_RANGE				(4 << 20) // don't split the file into ranges smaller than this
+#define SCAN_MAX_THREADS			16
+#define RESULTS_MAX_LISTED			50000
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+bool ParseSearchPattern(GArray<uint8> &Out, const char *Str, bool IsHex)
+{
+	Out.Length(0);
+	if (!Str)
+		return false;
+
+	if (IsHex)
+	{
+		char h[3] = {0, 0, 0};
+		int i = 0;
+
+		for (const char *s=Str; *s; s++)
+		{
+			if
+			(
+				(*s >= '0' && *s <= '9')
+				||
+				(*s >= 'a' && *s <= 'f')
+				||
+				(*s >= 'A' && *s <= 'F')
+			)
+			{
+				h[i++] = *s;
+			}
+
+			if (i == 2)
+			{
+				Out.Add((uint8)htoi(h));
+				i = 0;
+			}
+		}
+	}
+	else
+	{
+		Out.Add((const uint8*)Str, strlen(Str));
+	}
+
+	return Out.Length() > 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+class GScanWorker : public GThread
+{
+	GFileScanner *Scanner;
+
+public:
+	int64 RangeStart, RangeEnd;
+	volatile int64 Done;
+
+	GScanWorker(GFileScanner *scanner, int64 start, int64 end) : GThread("GScanWorker")
+	{
+		Scanner = scanner;
+		RangeStart = start;
+		RangeEnd = end;
+		Done = 0;
+	}
+
+	int Main()
+	{
+		GScanEngine *Eng = Scanner->Engine;
+		GAutoPtr<GScanContext> Ctx(Eng->NewContext());
+
+		// Matches are reported by their last byte, so start early enough to
+		// see a match beginning at RangeStart and run on far enough to finish
+		// one beginning just before RangeEnd.
+		int Carry = MAX(Eng->MaxSpan() - 1, 0);
+		int64 s = MAX(0, RangeStart - Carry);
+		int64 e = MIN(Scanner->Size, RangeEnd + Carry);
+
+		GArray<uint8> Buf;
+		if (!Buf.Length(Carry + SCAN_BLOCK_SIZE))
+			return -1;
+		memset(&Buf[0], 0, Carry);
+
+		GFile f;
+		if (!Scanner->Mem.Length())
+		{
+			if (!f.Open(Scanner->File, O_READ) ||
+				f.SetPos(s) != s)
+			{
+				LgiTrace("%s:%i - Can't open '%s' at " LPrintfInt64 "\n", _FL, Scanner->File.Get(), s);
+				return -1;
+			}
+		}
+
+		GArray<SearchHit> Local;
+		uint8 *Data = &Buf[Carry];
+		int64 p;
+		for (p = s; p < e && !Scanner->Cancelled; )
+		{
+			ssize_t Len = (ssize_t)MIN(SCAN_BLOCK_SIZE, e - p);
+			ssize_t Rd;
+			if (Scanner->Mem.Length())
+			{
+				memcpy(Data, &Scanner->Mem[(size_t)p], Len);
+				Rd = Len;
+			}
+			else Rd = f.Read(Data, Len);
+			if (Rd <= 0)
+				break;
+
+			Eng->Scan(Ctx, Data, Rd, p, Local);
+			AddHits(Local);
+
+			p += Rd;
+			Done = MIN(MAX(p - RangeStart, 0), RangeEnd - RangeStart);
+
+			// Keep the tail of this block in front of the next one
+			if (Carry)
+				memmove(&Buf[0], &Buf[Rd], Carry);
+		}
+
+		if (!Scanner->Cancelled)
+		{
+			Eng->End(Ctx, p, Local);
+			AddHits(Local);
+		}
+
+		Done = RangeEnd - RangeStart;
+		return 0;
+	}
+
+	void AddHits(GArray<SearchHit> &Local)
+	{
+		if (!Local.Length())
+			return;
+
+		Scanner->Lock(_FL);
+		for (unsigned i=0; i<Local.Length(); i++)
+		{
+			SearchHit &h = Local[i];
+			if (h.Offset < RangeStart || h.Offset >= RangeEnd)
+				continue; // Another worker owns this one
+			if (Scanner->Hits.Length() >= SCAN_MAX_HITS)
+			{
+				Scanner->Overflow = true;
+				Scanner->Cancelled = true;
+				break;
+			}
+			Scanner->Hits.Add(h);
+		}
+		Scanner->Unlock();
+		Local.Length(0);
+	}
+};
+
+GFileScanner::GFileScanner(GScanEngine *engine) : GMutex("GFileScanner")
+{
+	Engine = engine;
+	Size = 0;
+	StartTs = EndTs = 0;
+	Overflow = false;
+	Cancelled = false;
+}
+
+GFileScanner::~GFileScanner()
+{
+	Cancel();
+	Wait();
+	Workers.DeleteObjects();
+}
+
+int HitCmp(SearchHit *a, SearchHit *b)
+{
+	if (a->Offset != b->Offset)
+		return a->Offset < b->Offset ? -1 : 1;
+	return a->Id - b->Id;
+}
+
+bool GFileScanner::StartWorkers(int Threads)
+{
+	if (!Engine || Workers.Length())
+		return false;
+
+	if (Threads <= 0)
+		Threads = LgiGetCpuCount();
+	Threads = (int) MIN(Threads, Size / SCAN_MIN_RANGE);
+	Threads = MAX(MIN(Threads, SCAN_MAX_THREADS), 1);
+
+	StartTs = LgiCurrentTime();
+	EndTs = 0;
+	int64 Range = Size / Threads;
+	for (int i=0; i<Threads; i++)
+	{
+		int64 s = Range * i;
+		int64 e = i == Threads - 1 ? Size : s + Range;
+		Workers.Add(new GScanWorker(this, s, e));
+	}
+	for (unsigned i=0; i<Workers.Length(); i++)
+		Workers[i]->Run();
+
+	return true;
+}
+
+bool GFileScanner::Start(const char *FileName, int Threads)
+{
+	Size = LgiFileSize(FileName);
+	if (Size < 0)
+		return false;
+
+	File = FileName;
+	return StartWorkers(Threads);
+}
+
+bool GFileScanner::Start(const uint8 *Data, int64 Len)
+{
+	if (!Data || Len <= 0)
+		return false;
+
+	Mem.Length(0);
+	Mem.Add(Data, (size_t)Len);
+	Size = Len;
+	return StartWorkers(1);
+}
+
+bool GFileScanner::IsRunning()
+{
+	for (unsigned i=0; i<Workers.Length(); i++)
+	{
+		if (!Workers[i]->IsExited())
+			return true;
+	}
+
+	if (!EndTs && Workers.Length())
+	{
+		EndTs = LgiCurrentTime();
+		Lock(_FL);
+		Hits.Sort(HitCmp);
+		Unlock();
+	}
+
+	return false;
+}
+
+void GFileScanner::Cancel()
+{
+	Cancelled = true;
+}
+
+void GFileScanner::Wait()
+{
+	while (IsRunning())
+		LgiSleep(10);
+}
+
+int64 GFileScanner::GetDone()
+{
+	int64 d = 0;
+	for (unsigned i=0; i<Workers.Length(); i++)
+		d += Workers[i]->Done;
+	return d;
+}
+
+double GFileScanner::GetRate()
+{
+	uint64 End = EndTs ? EndTs : LgiCurrentTime();
+	if (!StartTs || End <= StartTs)
+		return 0.0;
+	return (double)GetDone() * 1000.0 / (End - StartTs);
+}
+
+size_t GFileScanner::GetHits(GArray<SearchHit> &Out, size_t From, size_t Max)
+{
+	Lock(_FL);
+	size_t Total = Hits.Length();
+	if (From < Total && Max > 0)
+		Out.Add(&Hits[From], MIN(Total - From, Max));
+	Unlock();
+	return Total;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+class GBatchWorker : public GThread
+{
+	GBatchSearch *Batch;
+
+public:
+	GBatchWorker(GBatchSearch *batch) : GThread("GBatchWorker")
+	{
+		Batch = batch;
+	}
+
+	int Main()
+	{
+		GScanEngine *Eng = Batch->Engine;
+		int Carry = MAX(Eng->MaxSpan() - 1, 0);
+		GArray<uint8> Buf;
+		if (!Buf.Length(Carry + SCAN_BLOCK_SIZE))
+			return -1;
+
+		uint8 *Data = &Buf[Carry];
+		GArray<SearchHit> Local;
+		while (!Batch->Cancelled)
+		{
+			Batch->Lock(_FL);
+			int Idx = Batch->NextFile < Batch->Files.Length() ? (int)Batch->NextFile++ : -1;
+			Batch->Unlock();
+			if (Idx < 0)
+				break;
+
+			GFile f;
+			if (!f.Open(Batch->Files[Idx], O_READ))
+				LgiTrace("%s:%i - Can't open '%s'\n", _FL, Batch->Files[Idx].Get());
+
+			// Each file starts with fresh engine state and no history
+			GAutoPtr<GScanContext> Ctx(Eng->NewContext());
+			memset(&Buf[0], 0, Carry);
+			bool Found = false;
+			int64 p;
+			for (p = 0; f.IsOpen() && !Found && !Batch->Cancelled; )
+			{
+				ssize_t Rd = f.Read(Data, SCAN_BLOCK_SIZE);
+				if (Rd <= 0)
+					break;
+
+				Eng->Scan(Ctx, Data, Rd, p, Local);
+				p += Rd;
+				Found = AddHits(Idx, Local, Rd);
+
+				// Keep the tail of this block in front of the next one
+				if (Carry)
+					memmove(&Buf[0], &Buf[Rd], Carry);
+			}
+			if (f.IsOpen() && !Found && !Batch->Cancelled)
+			{
+				Eng->End(Ctx, p, Local);
+				AddHits(Idx, Local, 0);
+			}
+
+			Batch->Lock(_FL);
+			Batch->FilesDone++;
+			Batch->Unlock();
+		}
+
+		return 0;
+	}
+
+	/// Returns true if the file needs no more reading
+	bool AddHits(int Idx, GArray<SearchHit> &Local, ssize_t Rd)
+	{
+		bool Found = false;
+		Batch->Lock(_FL);
+		Batch->Bytes += Rd;
+		for (unsigned i=0; i<Local.Length(); i++)
+		{
+			if (Batch->Hits.Length() >= SCAN_MAX_HITS)
+			{
+				Batch->Overflow = true;
+				Batch->Cancelled = true;
+				break;
+			}
+
+			BatchHit &h = Batch->Hits.New();
+			h.File = Idx;
+			h.Hit = Local[i];
+			if ((Found = Batch->FirstOnly))
+				break;
+		}
+		Batch->Unlock();
+		Local.Length(0);
+		return Found;
+	}
+};
+
+GBatchSearch::GBatchSearch(GScanEngine *engine, bool firstOnly) : GMutex("GBatchSearch")
+{
+	Engine = engine;
+	FirstOnly = firstOnly;
+	StartTs = EndTs = 0;
+	Overflow = false;
+	NextFile = 0;
+	FilesDone = 0;
+	Bytes = 0;
+	Cancelled = false;
+}
+
+GBatchSearch::~GBatchSearch()
+{
+	Cancel();
+	Wait();
+	Workers.DeleteObjects();
+}
+
+bool GBatchSearch::AddPath(const char *Path)
+{
+	if (!Path || Workers.Length())
+		return false;
+
+	if (DirExists(Path))
+	{
+		GArray<char*> Found;
+		if (!LgiRecursiveFileSearch(Path, NULL, &Found))
+			return false;
+		for (unsigned i=0; i<Found.Length(); i++)
+			Files.New() = Found[i];
+		Found.DeleteArrays();
+		return true;
+	}
+
+	if (!FileExists(Path))
+		return false;
+
+	Files.New() = Path;
+	return true;
+}
+
+bool GBatchSearch::Start(int Threads)
+{
+	if (!Engine || Workers.Length() || !Files.Length())
+		return false;
+
+	if (Threads <= 0)
+		Threads = LgiGetCpuCount();
+	Threads = (int) MIN(Threads, Files.Length());
+	Threads = MAX(MIN(Threads, SCAN_MAX_THREADS), 1);
+
+	StartTs = LgiCurrentTime();
+	EndTs = 0;
+	for (int i=0; i<Threads; i++)
+		Workers.Add(new GBatchWorker(this));
+	for (unsigned i=0; i<Workers.Length(); i++)
+		Workers[i]->Run();
+
+	return true;
+}
+
+bool GBatchSearch::IsRunning()
+{
+	for (unsigned i=0; i<Workers.Length(); i++)
+	{
+		if (!Workers[i]->IsExited())
+			return true;
+	}
+
+	if (!EndTs && Workers.Length())
+		EndTs = LgiCurrentTime();
+
+	return false;
+}
+
+void GBatchSearch::Cancel()
+{
+	Cancelled = true;
+}
+
+void GBatchSearch::Wait()
+{
+	while (IsRunning())
+		LgiSleep(10);
+}
+
+double GBatchSearch::GetRate()
+{
+	uint64 End = EndTs ? EndTs : LgiCurrentTime();
+	if (!StartTs || End <= StartTs)
+		return 0.0;
+	return (double)Bytes * 1000.0 / (End - StartTs);
+}
+
+size_t GBatchSearch::GetHits(GArray<BatchHit> &Out, size_t From, size_t Max)
+{
+	Lock(_FL);
+	size_t Total = Hits.Length();
+	if (From < Total && Max > 0)
+		Out.Add(&Hits[From], MIN(Total - From, Max));
+	Unlock();
+	return Total;
+}
+
+int BatchSearchCommandLine()
+{
+	GAutoString Pattern, Path, Threads;
+	if (!LgiApp->GetOption("grep", Pattern) ||
+		!LgiApp->GetOption("path", Path))
+	{
+		fprintf(stderr, "Usage: iHex -grep <pattern> -path <file or folder> [-hex] [-i] [-l] [-threads <n>]\n"
+						"    -hex      the pattern is hex bytes, e.g. \"ff d8 ff\"\n"
+						"    -i        ignore case\n"
+						"    -l        only list the names of the files that match\n");
+		return 2;
+	}
+
+	bool IsHex = LgiApp->GetOption("hex");
+	bool FirstOnly = LgiApp->GetOption("l");
+	LgiApp->GetOption("threads", Threads);
+
+	GArray<uint8> Bytes;
+	GAhoCorasick Ac(IsHex || !LgiApp->GetOption("i"));
+	if (!ParseSearchPattern(Bytes, Pattern, IsHex) ||
+		Ac.Add(Pattern, &Bytes[0], Bytes.Length()) < 0 ||
+		!Ac.Compile())
+	{
+		fprintf(stderr, "Invalid pattern '%s'.\n", Pattern.Get());
+		return 2;
+	}
+
+	GBatchSearch Batch(&Ac, FirstOnly);
+	if (!Batch.AddPath(Path) ||
+		!Batch.Start(Threads ? atoi(Threads) : 0))
+	{
+		fprintf(stderr, "No files found at '%s'.\n", Path.Get());
+		return 2;
+	}
+
+	// Print the hits as they come in
+	size_t Shown = 0;
+	bool Running;
+	do
+	{
+		Running = Batch.IsRunning();
+
+		GArray<BatchHit> New;
+		Batch.GetHits(New, Shown);
+		for (unsigned i=0; i<New.Length(); i++)
+		{
+			const char *File = Batch.GetFile(New[i].File);
+			if (FirstOnly)
+				printf("%s\n", File);
+			else
+				printf("%s:0x%llx\n", File, (long long)New[i].Hit.Offset);
+		}
+		Shown += New.Length();
+		fflush(stdout);
+
+		if (Running)
+			LgiSleep(50);
+	}
+	while (Running);
+
+	fprintf(stderr, LPrintfSizeT " of " LPrintfSizeT " files searched, " LPrintfSizeT " hits%s, %.1f MB/s\n",
+			Batch.GetFilesDone(),
+			Batch.GetFiles(),
+			Shown,
+			Batch.HasOverflowed() ? " (limit reached)" : "",
+			Batch.GetRate() / 1024.0 / 1024.0);
+
+	return Shown ? 0 : 1;
+}
+
+struct SearchTestCase
+{
+	const char *Name;
+	const char *Text;	// Parsed like a search pattern, so may be hex
+	int64 Offset;		// Where the only hit should be
+	int Len;
+};
+
+// HELLOWORLD, 1 difference with insertions and deletions
+static SearchTestCase ApproxTests[] =
+{
+	// Name					Text								Offset	Len
+	{"middle",				"..........HELLOWXRLD..........",	10,		10},
+	{"substitution at end",	"..........HELLOWXRLD",				10,		10},
+	{"insertion at end",	"..........HELLOWOXRLD",			10,		11},
+	{"deletion at end",		"..........HELLOWRLD",				10,		9},
+	{"exact at end",		"HELLOWORLD",						0,		10},
+	{NULL, NULL, 0, 0}
+};
+
+static const char *TestSignatures[] =
+{
+	"4d 5a 90 00",
+	"50 4b 03 04",
+	"7f 45 4c 46",
+	"41 41 42",
+	NULL
+};
+
+// Hex, one hit each from TestSignatures
+static SearchTestCase SignatureTests[] =
+{
+	// Name					Text								Offset	Len
+	{"start",				"4d 5a 90 00 2e 2e",				0,		4},
+	{"end",					"2e 2e 7f 45 4c 46",				2,		4},
+	{"failure link",		"2e 41 41 41 42 2e",				2,		3},
+	{"prefix only",			"50 4b 03 2e 50 4b 03 04",			4,		4},
+	{NULL, NULL, 0, 0}
+};
+
+// Hex, little endian signed 32-bit values from -5 to -1
+static SearchTestCase NumericTests[] =
+{
+	// Name					Text								Offset	Len
+	{"unaligned",			"10 20 30 40 fe ff ff ff 50 60",	4,		4},
+	{"lower bound",			"00 fb ff ff ff 00 00 00",			1,		4},
+	{"outside range",		"fa ff ff ff 00 ff ff ff ff 00",	5,		4},
+	{NULL, NULL, 0, 0}
+};
+
+// Hex, "H\xc3\xa9" in each encoding it can be represented in
+static SearchTestCase EncodingTests[] =
+{
+	// Name					Text								Offset	Len
+	{"utf-8",				"2e 48 c3 a9 2e",					1,		3},
+	{"latin-1",				"2e 48 e9 2e",						1,		2},
+	{"utf-16le",			"2e 2e 48 00 e9 00",				2,		4},
+	{"utf-16be",			"2e 00 48 00 e9 2e",				1,		4},
+	{"utf-32le",			"48 00 00 00 e9 00 00 00",			0,		8},
+	{"utf-32be",			"2e 00 00 00 48 00 00 00 e9",		1,		8},
+	{NULL, NULL, 0, 0}
+};
+
+static int RunSearchTests(const char *Engine, GScanEngine *Eng, SearchTestCase *Tests, bool IsHex)
+{
+	int Failed = 0;
+	for (SearchTestCase *t = Tests; t->Name; t++)
+	{
+		GArray<uint8> Text;
+		GArray<SearchHit> Hits;
+		GFileScanner Scanner(Eng);
+		if (Eng &&
+			ParseSearchPattern(Text, t->Text, IsHex) &&
+			Scanner.Start(&Text[0], Text.Length()))
+		{
+			Scanner.Wait();
+			Scanner.GetHits(Hits);
+		}
+
+		if (Hits.Length() != 1 ||
+			Hits[0].Offset != t->Offset ||
+			Hits[0].Len != t->Len)
+		{
+			fprintf(stderr, "%s '%s': expected 1 hit at %i+%i, got " LPrintfSizeT " hit(s)",
+					Engine, t->Name, (int)t->Offset, (int)t->Len, Hits.Length());
+			if (Hits.Length())
+				fprintf(stderr, ", first at %i+%i", (int)Hits[0].Offset, (int)Hits[0].Len);
+			fprintf(stderr, "\n");
+			Failed++;
+		}
+	}
+
+	return Failed;
+}
+
+int SearchSelfTest()
+{
+	int Failed = 0;
+
+	const char *Pattern = "HELLOWORLD";
+	GApproxSearch Approx((const uint8*)Pattern, strlen(Pattern), 1, true, true);
+	Failed += RunSearchTests("approx", &Approx, ApproxTests, false);
+
+	GAhoCorasick Sigs;
+	for (const char **s = TestSignatures; *s; s++)
+	{
+		GArray<uint8> Bytes;
+		if (ParseSearchPattern(Bytes, *s, true))
+			Sigs.Add(*s, &Bytes[0], Bytes.Length());
+	}
+	Failed += RunSearchTests("signature", Sigs.Compile() ? &Sigs : NULL, SignatureTests, true);
+
+	GNumericSearch Num(NumInt32, true, true);
+	Failed += RunSearchTests("numeric", Num.SetRange("-5", "-1") ? &Num : NULL, NumericTests, true);
+
+	GAutoPtr<GAhoCorasick> Enc(NewEncodingSearch("H\xc3\xa9", true));
+	Failed += RunSearchTests("encoding", Enc, EncodingTests, true);
+
+	printf("%s\n", Failed ? "FAILED" : "OK");
+	return Failed ? 1 : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+struct GAhoCorasickContext : public GScanContext
+{
+	int State;
+	GAhoCorasickContext() { State = 0; }
+};
+
+GAhoCorasick::GAhoCorasick(bool matchCase)
+{
+	MatchCase = matchCase;
+	Classes = 0;
+	Span = 0;
+	ZeroObj(Class);
+	ZeroObj(Start);
+}
+
+int GAhoCorasick::Add(const char *Name, const uint8 *Bytes, size_t Len)
+{
+	if (!Bytes || !Len)
+		return -1;
+
+	Pattern &p = Patterns.New();
+	p.Name = Name;
+	p.Bytes.Add(Bytes, Len);
+	Delta.Length(0); // Needs recompiling
+	return (int)Patterns.Length() - 1;
+}
+
+static int UnescapeChar(const char *&s)
+{
+	if (*s != '\\')
+		return *s++;
+
+	s++;
+	switch (*s)
+	{
+		case 'n': s++; return '\n';
+		case 'r': s++; return '\r';
+		case 't': s++; return '\t';
+		case '0': s++; return 0;
+		case 'x':
+		{
+			char h[3] = {0, 0, 0};
+			for (int i=0; i<2 && isxdigit((uchar)s[1]); i++)
+				h[i] = *++s;
+			s++;
+			return htoi(h);
+		}
+		case 0: return '\\';
+	}
+	return *s++;
+}
+
+bool GAhoCorasick::LoadSignatures(const char *FileName, GString *Err)
+{
+	GFile f;
+	if (!f.Open(FileName, O_READ))
+	{
+		if (Err) Err->Printf("Can't open '%s'.", FileName);
+		return false;
+	}
+
+	GArray<char> Buf;
+	Buf.Length((size_t)f.GetSize());
+	if (!Buf.Length() || f.Read(&Buf[0], Buf.Length()) != Buf.Length())
+	{
+		if (Err) Err->Printf("Can't read '%s'.", FileName);
+		return false;
+	}
+
+	GString Txt(&Buf[0], Buf.Length());
+	GString::Array Lines = Txt.Split("\n");
+	for (unsigned i=0; i<Lines.Length(); i++)
+	{
+		GString Ln = Lines[i].Strip();
+		if (!Ln.Length() || Ln(0) == '#')
+			continue;
+
+		// The name ends at the first colon outside of quotes, so a bare
+		// quoted pattern may itself contain colons
+		GString Name, Value;
+		ssize_t Colon = -1;
+		bool Quoted = false;
+		for (const char *s = Ln.Get(); *s && Colon < 0; s++)
+		{
+			if (*s == '\\' && Quoted && s[1])
+				s++;
+			else if (*s == '\"')
+				Quoted = !Quoted;
+			else if (*s == ':' && !Quoted)
+				Colon = s - Ln.Get();
+		}
+		if (Colon > 0)
+		{
+			Name = Ln(0, Colon).Strip();
+			Value = Ln(Colon + 1, -1).Strip();
+		}
+		else
+		{
+			Name = Value = Ln;
+		}
+
+		GArray<uint8> Bytes;
+		if (Value(0) == '\"')
+		{
+			const char *End = strrchr(Value.Get() + 1, '\"');
+			for (const char *s = Value.Get() + 1; s < End; )
+				Bytes.Add((uint8)UnescapeChar(s));
+		}
+		else
+		{
+			ParseSearchPattern(Bytes, Value, true);
+		}
+
+		if (!Bytes.Length())
+		{
+			if (Err) Err->Printf("%s:%i - No pattern bytes for '%s'.", FileName, i + 1, Name.Get());
+			return false;
+		}
+
+		Add(Name, &Bytes[0], Bytes.Length());
+	}
+
+	if (!Patterns.Length())
+	{
+		if (Err) Err->Printf("No signatures in '%s'.", FileName);
+		return false;
+	}
+
+	return true;
+}
+
+bool GAhoCorasick::Compile()
+{
+	if (!Patterns.Length())
+		return false;
+
+	// Map the input bytes into classes, bytes not in any pattern share class 0
+	int Fold[256];
+	for (int c=0; c<256; c++)
+		Fold[c] = MatchCase ? c : tolower(c);
+
+	ZeroObj(Class);
+	Classes = 1;
+	Span = 0;
+	size_t Total = 0;
+	for (unsigned i=0; i<Patterns.Length(); i++)
+	{
+		GArray<uint8> &b = Patterns[i].Bytes;
+		for (unsigned n=0; n<b.Length(); n++)
+		{
+			int f = Fold[b[n]];
+			if (!Class[f])
+				Class[f] = Classes++;
+		}
+		Span = MAX(Span, (int)b.Length());
+		Total += b.Length();
+	}
+	for (int c=0; c<256; c++)
+		Class[c] = Class[Fold[c]];
+
+	if ((Total + 1) * Classes > (64 << 20))
+	{
+		LgiTrace("%s:%i - Too many patterns for the automaton.\n", _FL);
+		return false;
+	}
+
+	// Build the trie
+	Delta.Length(0);
+	Delta.Length(Classes);
+	Output.Length(0);
+	Output.Add(-1);
+	SameNext.Length(Patterns.Length());
+	Depth.Length(0);
+	Depth.Add(0);
+	for (int c=0; c<Classes; c++)
+		Delta[c] = -1;
+
+	int States = 1;
+	for (unsigned i=0; i<Patterns.Length(); i++)
+	{
+		GArray<uint8> &b = Patterns[i].Bytes;
+		int s = 0;
+		for (unsigned n=0; n<b.Length(); n++)
+		{
+			int32 &Next = Delta[s * Classes + Class[b[n]]];
+			if (Next < 0)
+			{
+				Next = States++;
+				Delta.Length(States * Classes);
+				for (int c=0; c<Classes; c++)
+					Delta[(States - 1) * Classes + c] = -1;
+				Output.Add(-1);
+				Depth.Add(Depth[s] + 1);
+			}
+			s = Delta[s * Classes + Class[b[n]]];
+		}
+
+		SameNext[i] = Output[s];
+		Output[s] = i;
+	}
+
+	// Breadth first pass to fill in the failure transitions
+	GArray<int32> Fail, Queue;
+	Fail.Length(States);
+	DictLink.Length(States);
+	Fail[0] = 0;
+	DictLink[0] = -1;
+	for (int c=0; c<Classes; c++)
+	{
+		int32 &u = Delta[c];
+		if (u < 0)
+			u = 0;
+		else
+		{
+			Fail[u] = 0;
+			DictLink[u] = -1;
+			Queue.Add(u);
+		}
+	}
+	for (unsigned q=0; q<Queue.Length(); q++)
+	{
+		int r = Queue[q];
+		for (int c=0; c<Classes; c++)
+		{
+			int32 &u = Delta[r * Classes + c];
+			if (u < 0)
+			{
+				u = Delta[Fail[r] * Classes + c];
+			}
+			else
+			{
+				int f = Delta[Fail[r] * Classes + c];
+				Fail[u] = f;
+				DictLink[u] = Output[f] >= 0 ? f : DictLink[f];
+				Queue.Add(u);
+			}
+		}
+	}
+
+	for (int c=0; c<256; c++)
+		Start[c] = Delta[Class[c]] != 0;
+
+	return true;
+}
+
+GScanContext *GAhoCorasick::NewContext()
+{
+	return new GAhoCorasickContext;
+}
+
+void GAhoCorasick::Report(int State, int64 End, GArray<SearchHit> &Hits)
+{
+	for (int s = Output[State] >= 0 ? State : DictLink[State]; s >= 0; s = DictLink[s])
+	{
+		for (int p = Output[s]; p >= 0; p = SameNext[p])
+		{
+			SearchHit &h = Hits.New();
+			h.Len = Depth[s];
+			h.Offset = End - h.Len + 1;
+			h.Id = p;
+			h.Extra = 0;
+			h.Value = 0;
+		}
+	}
+}
+
+void GAhoCorasick::Scan(GScanContext *Ctx, const uint8 *Data, size_t Len, int64 Pos, GArray<SearchHit> &Hits)
+{
+	GAhoCorasickContext *c = (GAhoCorasickContext*)Ctx;
+	if (!c || !Delta.Length())
+		return;
+
+	const int32 *d = &Delta[0];
+	const int32 *Out = &Output[0];
+	const int32 *Dict = &DictLink[0];
+	int s = c->State;
+	for (size_t i=0; i<Len; i++)
+	{
+		if (!s)
+		{
+			// Skip bytes that can't start a match
+			while (i < Len && !Start[Data[i]])
+				i++;
+			if (i >= Len)
+				break;
+		}
+
+		s = d[s * Classes + Class[Data[i]]];
+		if (Out[s] >= 0 || Dict[s] >= 0)
+			Report(s, Pos + i, Hits);
+	}
+	c->State = s;
+}
+
+GString GAhoCorasick::Describe(SearchHit &h)
+{
+	return GString(GetName(h.Id));
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+const char *SearchEncodingName(SearchEncoding Enc)
+{
+	switch (Enc)
+	{
+		case EncBytes:		return "UTF-8";
+		case EncLatin1:		return "Latin-1";
+		case EncUtf16Le:	return "UTF-16 LE";
+		case EncUtf16Be:	return "UTF-16 BE";
+		case EncUtf32Le:	return "UTF-32 LE";
+		case EncUtf32Be:	return "UTF-32 BE";
+		case EncAny:		return "Any encoding";
+	}
+	return NULL;
+}
+
+bool EncodeSearchText(GArray<uint8> &Out, const char *Utf8, SearchEncoding Enc)
+{
+	Out.Length(0);
+	if (!ValidStr(Utf8))
+		return false;
+
+	if (Enc == EncBytes || Enc == EncAny)
+	{
+		Out.Add((const uint8*)Utf8, strlen(Utf8));
+		return true;
+	}
+
+	for (GUtf8Ptr p(Utf8); p; p++)
+	{
+		uint32 c = p;
+		switch (Enc)
+		{
+			case EncLatin1:
+			{
+				if (c > 0xff)
+					return false;
+				Out.Add((uint8)c);
+				break;
+			}
+			case EncUtf16Le:
+			case EncUtf16Be:
+			{
+				uint16 w[2];
+				int Words = 1;
+				if (c > 0xffff)
+				{
+					// Surrogate pair
+					c -= 0x10000;
+					w[0] = (uint16)(0xd800 | (c >> 10));
+					w[1] = (uint16)(0xdc00 | (c & 0x3ff));
+					Words = 2;
+				}
+				else w[0] = (uint16)c;
+
+				for (int i=0; i<Words; i++)
+				{
+					uint8 b[2];
+					b[Enc == EncUtf16Le ? 0 : 1] = (uint8)(w[i] & 0xff);
+					b[Enc == EncUtf16Le ? 1 : 0] = (uint8)(w[i] >> 8);
+					Out.Add(b, 2);
+				}
+				break;
+			}
+			case EncUtf32Le:
+			case EncUtf32Be:
+			{
+				uint8 b[4];
+				for (int i=0; i<4; i++)
+					b[Enc == EncUtf32Le ? i : 3 - i] = (uint8)(c >> (i * 8));
+				Out.Add(b, 4);
+				break;
+			}
+			default:
+				return false;
+		}
+	}
+
+	return Out.Length() > 0;
+}
+
+GAhoCorasick *NewEncodingSearch(const char *Utf8, bool MatchCase)
+{
+	GAutoPtr<GAhoCorasick> Ac(new GAhoCorasick(MatchCase));
+	GArray< GArray<uint8> > Added;
+	for (int e=EncBytes; e<EncAny; e++)
+	{
+		GArray<uint8> b;
+		if (!EncodeSearchText(b, Utf8, (SearchEncoding)e))
+			continue;
+
+		// Plain ASCII is the same in utf-8 and Latin-1, only look for it once
+		bool Dupe = false;
+		for (unsigned i=0; i<Added.Length() && !Dupe; i++)
+			Dupe = Added[i].Length() == b.Length() && !memcmp(&Added[i][0], &b[0], b.Length());
+		if (Dupe)
+			continue;
+
+		bool Ascii = true;
+		for (const char *c = Utf8; *c && Ascii; c++)
+			Ascii = (uint8)*c < 0x80;
+		const char *Name = e == EncBytes && Ascii ? "ASCII" : SearchEncodingName((SearchEncoding)e);
+		if (Ac->Add(Name, &b[0], b.Length()) < 0)
+			return NULL;
+		Added.New() = b;
+	}
+
+	return Ac->Compile() ? Ac.Release() : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+GNumericSearch::GNumericSearch(NumericType type, bool isSigned, bool little, int align)
+{
+	Type = type;
+	Signed = isSigned || Type == NumFloat || Type == NumDouble;
+	Little = little;
+	switch (Type)
+	{
+		case NumInt16: Width = 2; break;
+		case NumInt32:
+		case NumFloat: Width = 4; break;
+		default: Width = 8; break;
+	}
+	Align = align > 0 ? align : 1;
+	IntMin = IntMax = 0;
+	FltMin = FltMax = 0.0;
+}
+
+const char *GNumericSearch::TypeName(NumericType t)
+{
+	switch (t)
+	{
+		case NumInt16: return "16 bit integer";
+		case NumInt32: return "32 bit integer";
+		case NumInt64: return "64 bit integer";
+		case NumFloat: return "Float";
+		case NumDouble: return "Double";
+	}
+	return NULL;
+}
+
+bool GNumericSearch::SetRange(const char *From, const char *To, GString *Err)
+{
+	if (!ValidStr(From))
+	{
+		if (Err) *Err = "No value to search for.";
+		return false;
+	}
+	if (!ValidStr(To))
+		To = From;
+
+	if (Type == NumFloat || Type == NumDouble)
+	{
+		FltMin = atof(From);
+		FltMax = atof(To);
+		if (Type == NumFloat)
+		{
+			// Compare at the precision stored in the file
+			FltMin = (float)FltMin;
+			FltMax = (float)FltMax;
+		}
+		if (FltMin > FltMax)
+		{
+			double t = FltMin;
+			FltMin = FltMax;
+			FltMax = t;
+		}
+		return true;
+	}
+
+	int Bits = Width << 3;
+	if (Signed)
+	{
+		int64 Lo = (int64)(~(uint64)0 << (Bits - 1));
+		int64 Hi = (int64)(((uint64)1 << (Bits - 1)) - 1);
+		IntMin = strtoll(From, NULL, 0);
+		IntMax = strtoll(To, NULL, 0);
+		if (IntMin > IntMax)
+		{
+			int64 t = IntMin;
+			IntMin = IntMax;
+			IntMax = t;
+		}
+		if (IntMax < Lo || IntMin > Hi)
+		{
+			if (Err) Err->Printf("The value is out of range for a signed %i bit integer.", Bits);
+			return false;
+		}
+		IntMin = MAX(IntMin, Lo);
+		IntMax = MIN(IntMax, Hi);
+	}
+	else
+	{
+		uint64 Hi = Bits < 64 ? ((uint64)1 << Bits) - 1 : ~(uint64)0;
+		uint64 a = *From == '-' ? 0 : strtoull(From, NULL, 0);
+		uint64 b = *To == '-' ? 0 : strtoull(To, NULL, 0);
+		if (a > b)
+		{
+			uint64 t = a;
+			a = b;
+			b = t;
+		}
+		if (a > Hi)
+		{
+			if (Err) Err->Printf("The value is out of range for an unsigned %i bit integer.", Bits);
+			return false;
+		}
+		IntMin = (int64)a;
+		IntMax = (int64)MIN(b, Hi);
+	}
+
+	return true;
+}
+
+uint64 GNumericSearch::Read(const uint8 *p)
+{
+	uint64 v = 0;
+	if (Little)
+	{
+		for (int i=Width-1; i>=0; i--)
+			v = (v << 8) | p[i];
+	}
+	else
+	{
+		for (int i=0; i<Width; i++)
+			v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+bool GNumericSearch::Match(uint64 v)
+{
+	switch (Type)
+	{
+		case NumFloat:
+		{
+			uint32 u = (uint32)v;
+			float f;
+			memcpy(&f, &u, sizeof(f));
+			return f >= FltMin && f <= FltMax;
+		}
+		case NumDouble:
+		{
+			double d;
+			memcpy(&d, &v, sizeof(d));
+			return d >= FltMin && d <= FltMax;
+		}
+		default:
+		{
+			if (Signed)
+			{
+				int Shift = 64 - (Width << 3);
+				int64 i = (int64)(v << Shift) >> Shift;
+				return i >= IntMin && i <= IntMax;
+			}
+			return v >= (uint64)IntMin && v <= (uint64)IntMax;
+		}
+	}
+}
+
+GString GNumericSearch::Format(uint64 v)
+{
+	GString s;
+	switch (Type)
+	{
+		case NumFloat:
+		{
+			uint32 u = (uint32)v;
+			float f;
+			memcpy(&f, &u, sizeof(f));
+			s.Printf("%g", f);
+			break;
+		}
+		case NumDouble:
+		{
+			double d;
+			memcpy(&d, &v, sizeof(d));
+			s.Printf("%g", d);
+			break;
+		}
+		default:
+		{
+			int Shift = 64 - (Width << 3);
+			if (Signed)
+				s.Printf(LPrintfInt64, (int64)(v << Shift) >> Shift);
+			else
+				s.Printf("%llu", (unsigned long long)v);
+			break;
+		}
+	}
+	return s;
+}
+
+#if HAS_SSE2
+// Byte swaps each lane of 'v' for big endian data
+static inline __m128i Swap16(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static inline __m128i Swap32(__m128i v)
+{
+	return Swap16(_mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16)));
+}
+
+static inline __m128i Swap64(__m128i v)
+{
+	return Swap32(_mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+#endif
+
+// Tests every candidate start offset in 16 byte super blocks beginning at
+// 'From'. Returns the offset the scalar code should carry on from.
+ssize_t GNumericSearch::ScanVector(const uint8 *Data, ssize_t From, size_t Len, int64 Pos, GArray<SearchHit> &Hits)
+{
+	#if HAS_SSE2
+	if (Type == NumInt64)
+		return From; // No 64 bit compares in SSE2
+
+	// Within a super block a value can start at any multiple of the alignment.
+	// Each phase of the value's width needs it's own load, and when the
+	// alignment is coarser than the width only some lanes count.
+	int Lanes = 16 / Width;
+	int MaxPhase = Align < Width ? Width - Align : 0;
+	int LaneMask[8];
+	for (int Ph=0; Ph<=MaxPhase; Ph+=Align)
+	{
+		LaneMask[Ph] = 0;
+		for (int k=0; k<Lanes; k++)
+		{
+			if ((Ph + k * Width) % Align == 0)
+				LaneMask[Ph] |= 1 << k;
+		}
+	}
+
+	__m128i IMin, IMax, Bias;
+	__m128 FMin, FMax;
+	__m128d DMin, DMax;
+	switch (Type)
+	{
+		case NumInt16:
+			Bias = _mm_set1_epi16(Signed ? 0 : (short)0x8000);
+			IMin = _mm_xor_si128(_mm_set1_epi16((short)IntMin), Bias);
+			IMax = _mm_xor_si128(_mm_set1_epi16((short)IntMax), Bias);
+			break;
+		case NumInt32:
+			Bias = _mm_set1_epi32(Signed ? 0 : (int)0x80000000);
+			IMin = _mm_xor_si128(_mm_set1_epi32((int)IntMin), Bias);
+			IMax = _mm_xor_si128(_mm_set1_epi32((int)IntMax), Bias);
+			break;
+		case NumFloat:
+			FMin = _mm_set1_ps((float)FltMin);
+			FMax = _mm_set1_ps((float)FltMax);
+			break;
+		case NumDouble:
+			DMin = _mm_set1_pd(FltMin);
+			DMax = _mm_set1_pd(FltMax);
+			break;
+		default:
+			return From;
+	}
+
+	ssize_t b;
+	for (b = From; b + MaxPhase + 16 <= (ssize_t)Len; b += 16)
+	{
+		for (int Ph=0; Ph<=MaxPhase; Ph+=Align)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(Data + b + Ph));
+			int m = 0;
+			switch (Type)
+			{
+				case NumInt16:
+				{
+					if (!Little) v = Swap16(v);
+					v = _mm_xor_si128(v, Bias);
+					__m128i Out = _mm_or_si128(_mm_cmplt_epi16(v, IMin), _mm_cmpgt_epi16(v, IMax));
+					int Bytes = ~_mm_movemask_epi8(Out) & 0xffff;
+					for (int k=0; Bytes && k<8; k++)
+						if (Bytes & (1 << (k << 1))) m |= 1 << k;
+					break;
+				}
+				case NumInt32:
+				{
+					if (!Little) v = Swap32(v);
+					v = _mm_xor_si128(v, Bias);
+					__m128i Out = _mm_or_si128(_mm_cmplt_epi32(v, IMin), _mm_cmpgt_epi32(v, IMax));
+					int Bytes = ~_mm_movemask_epi8(Out) & 0xffff;
+					for (int k=0; Bytes && k<4; k++)
+						if (Bytes & (1 << (k << 2))) m |= 1 << k;
+					break;
+				}
+				case NumFloat:
+				{
+					if (!Little) v = Swap32(v);
+					__m128 f = _mm_castsi128_ps(v);
+					m = _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(f, FMin), _mm_cmple_ps(f, FMax)));
+					break;
+				}
+				case NumDouble:
+				{
+					if (!Little) v = Swap64(v);
+					__m128d d = _mm_castsi128_pd(v);
+					m = _mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(d, DMin), _mm_cmple_pd(d, DMax)));
+					break;
+				}
+				default:
+					break;
+			}
+
+			m &= LaneMask[Ph];
+			for (int k=0; m; k++, m >>= 1)
+			{
+				if (m & 1)
+				{
+					const uint8 *p = Data + b + Ph + k * Width;
+					SearchHit &h = Hits.New();
+					h.Offset = Pos + (p - Data);
+					h.Len = Width;
+					h.Id = Type;
+					h.Extra = 0;
+					h.Value = Read(p);
+				}
+			}
+		}
+	}
+
+	return b;
+	#else
+	return From;
+	#endif
+}
+
+void GNumericSearch::Scan(GScanContext *Ctx, const uint8 *Data, size_t Len, int64 Pos, GArray<SearchHit> &Hits)
+{
+	// Candidate starts are those whose last byte is in this block, and
+	// not before the start of the file.
+	ssize_t From = 1 - Width;
+	ssize_t To = (ssize_t)Len - Width;
+	if (Pos + From < 0)
+		From = (ssize_t)-Pos;
+	int64 r = (Pos + From) % Align;
+	if (r)
+		From += (ssize_t)(Align - r);
+	if (From > To)
+		return;
+
+	From = ScanVector(Data, From, Len, Pos, Hits);
+	for (ssize_t i=From; i<=To; i+=Align)
+	{
+		uint64 v = Read(Data + i);
+		if (Match(v))
+		{
+			SearchHit &h = Hits.New();
+			h.Offset = Pos + i;
+			h.Len = Width;
+			h.Id = Type;
+			h.Extra = 0;
+			h.Value = v;
+		}
+	}
+}
+
+GString GNumericSearch::Describe(SearchHit &h)
+{
+	GString s;
+	s.Printf("%s: %s", TypeName(Type), Format(h.Value).Get());
+	return s;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+struct GApproxContext : public GScanContext
+{
+	// Hamming state, one word per error count
+	GArray<uint64> R;
+
+	// Myers state
+	uint64 Pv, Mv;
+	int Score;
+
+	// Current cluster of matching end positions
+	bool InRun;
+	int BestScore;
+	int64 BestEnd, RunStart;
+
+	// The bytes up to 'BestEnd', for reporting a cluster still open at the end
+	uint8 Tail[GApproxSearch::MaxPattern << 1];
+	int TailLen;
+};
+
+GApproxSearch::GApproxSearch(const uint8 *Bytes, size_t Len, int k, bool indels, bool matchCase)
+{
+	K = k;
+	Indels = indels;
+	ZeroObj(Peq);
+	if (Bytes && Len <= MaxPattern)
+	{
+		Pattern.Add(Bytes, Len);
+		for (size_t i=0; i<Len; i++)
+		{
+			uint64 Bit = (uint64)1 << i;
+			if (matchCase)
+			{
+				Peq[Bytes[i]] |= Bit;
+			}
+			else
+			{
+				Peq[tolower(Bytes[i])] |= Bit;
+				Peq[toupper(Bytes[i])] |= Bit;
+			}
+		}
+	}
+}
+
+int GApproxSearch::MaxSpan()
+{
+	int m = (int)Pattern.Length();
+	// With indels a cluster can be reported up to 'm' bytes after it's end,
+	// and it's start can be 'm + K' bytes before that.
+	return Indels ? (m << 1) + K + 1 : m;
+}
+
+GScanContext *GApproxSearch::NewContext()
+{
+	GApproxContext *c = new GApproxContext;
+	c->R.Length(K + 1);
+	for (int j=0; j<=K; j++)
+		c->R[j] = 0;
+	c->Pv = ~(uint64)0;
+	c->Mv = 0;
+	c->Score = (int)Pattern.Length();
+	c->InRun = false;
+	c->BestScore = 0;
+	c->BestEnd = c->RunStart = 0;
+	c->TailLen = 0;
+	return c;
+}
+
+// Finds the length of text ending at 'End' that best aligns with the whole
+// pattern, by edit distance over the reversed strings. Returns the distance.
+int GApproxSearch::Align(const uint8 *End, int64 Avail, int &Len)
+{
+	int m = (int)Pattern.Length();
+	int T = (int)MIN(m + K, Avail);
+	int Col[MaxPattern + 1];
+
+	for (int i=0; i<=m; i++)
+		Col[i] = i;
+
+	int Best = Col[m];
+	Len = 0;
+	for (int t=1; t<=T; t++)
+	{
+		uint8 c = End[1 - t];
+		int Diag = Col[0];
+		Col[0] = t;
+		for (int i=1; i<=m; i++)
+		{
+			int Up = Col[i];
+			int Cost = (Peq[c] >> (m - i)) & 1 ? 0 : 1;
+			Col[i] = MIN(MIN(Col[i] + 1, Col[i - 1] + 1), Diag + Cost);
+			Diag = Up;
+		}
+		if (Col[m] < Best || (Col[m] == Best && abs(t - m) < abs(Len - m)))
+		{
+			Best = Col[m];
+			Len = t;
+		}
+	}
+
+	return Best;
+}
+
+// Adds a hit for the best end of the current cluster, 'End' pointing at it's
+// last byte with 'Avail' bytes readable up to and including it.
+void GApproxSearch::Report(GApproxContext *c, const uint8 *End, int64 Avail, GArray<SearchHit> &Hits)
+{
+	int MatchLen;
+	int Dist = Align(End, Avail, MatchLen);
+	if (MatchLen > 0)
+	{
+		SearchHit &h = Hits.New();
+		h.Offset = c->BestEnd - MatchLen + 1;
+		h.Len = MatchLen;
+		h.Id = 0;
+		h.Extra = Dist;
+		h.Value = 0;
+	}
+	c->InRun = false;
+}
+
+void GApproxSearch::Scan(GScanContext *Ctx, const uint8 *Data, size_t Len, int64 Pos, GArray<SearchHit> &Hits)
+{
+	GApproxContext *c = (GApproxContext*)Ctx;
+	if (!c || !IsValid())
+		return;
+
+	int m = (int)Pattern.Length();
+	uint64 Hi = (uint64)1 << (m - 1);
+
+	if (!Indels)
+	{
+		uint64 *R = &c->R[0];
+		for (size_t i=0; i<Len; i++)
+		{
+			uint64 Eq = Peq[Data[i]];
+			uint64 Prev = R[0];
+			R[0] = ((R[0] << 1) | 1) & Eq;
+			int Dist = R[0] & Hi ? 0 : -1;
+			for (int j=1; j<=K; j++)
+			{
+				uint64 Tmp = R[j];
+				// Either the byte matches, or it's a substitution on top of j-1 errors
+				R[j] = (((R[j] << 1) | 1) & Eq) | ((Prev << 1) | 1);
+				Prev = Tmp;
+				if (Dist < 0 && (R[j] & Hi))
+					Dist = j;
+			}
+
+			if (Dist >= 0)
+			{
+				SearchHit &h = Hits.New();
+				h.Offset = Pos + i - m + 1;
+				h.Len = m;
+				h.Id = 0;
+				h.Extra = Dist;
+				h.Value = 0;
+			}
+		}
+		return;
+	}
+
+	uint64 Pv = c->Pv, Mv = c->Mv;
+	int Score = c->Score;
+	for (size_t i=0; i<Len; i++)
+	{
+		uint64 Eq = Peq[Data[i]];
+		uint64 Xv = Eq | Mv;
+		uint64 Xh = (((Eq & Pv) + Pv) ^ Pv) | Eq;
+		uint64 Ph = Mv | ~(Xh | Pv);
+		uint64 Mh = Pv & Xh;
+		if (Ph & Hi)
+			Score++;
+		else if (Mh & Hi)
+			Score--;
+		Ph <<= 1;
+		Mh <<= 1;
+		Pv = Mh | ~(Xv | Ph);
+		Mv = Ph & Xv;
+
+		// Neighbouring end positions match too, only report the best of them
+		int64 e = Pos + i;
+		if (Score <= K)
+		{
+			if (!c->InRun)
+			{
+				c->InRun = true;
+				c->RunStart = e;
+				c->BestScore = Score;
+				c->BestEnd = e;
+			}
+			else if (Score < c->BestScore)
+			{
+				c->BestScore = Score;
+				c->BestEnd = e;
+			}
+		}
+
+		if (c->InRun && (Score > K || e - c->RunStart >= m))
+			Report(c, Data + (c->BestEnd - Pos), c->BestEnd + 1, Hits);
+	}
+
+	if (c->InRun)
+	{
+		// The block before is gone by the time End() is called
+		c->TailLen = (int)MIN(m + K, c->BestEnd + 1);
+		memcpy(c->Tail, Data + (c->BestEnd - Pos) - c->TailLen + 1, c->TailLen);
+	}
+
+	c->Pv = Pv;
+	c->Mv = Mv;
+	c->Score = Score;
+}
+
+void GApproxSearch::End(GScanContext *Ctx, int64 End, GArray<SearchHit> &Hits)
+{
+	GApproxContext *c = (GApproxContext*)Ctx;
+	if (c && c->InRun && c->TailLen > 0)
+		Report(c, c->Tail + c->TailLen - 1, c->TailLen, Hits);
+}
+
+GString GApproxSearch::Describe(SearchHit &h)
+{
+	GString s;
+	s.Printf("%i difference%s", h.Extra, h.Extra == 1 ? "" : "s");
+	return s;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+struct GStringsRun
+{
+	int64 Start;
+	int Chars;
+	bool Skip;		// Run was cut at the maximum length, ignore the rest of it
+	char Text[STRINGS_MAX_LEN];
+};
+
+struct GStringsContext : public GScanContext
+{
+	GStringsSearch *Eng;
+	GArray<char> *Pool;
+	int PoolId;
+	GStringsRun Run[3];		// ASCII, then UTF-16 at even and odd offsets
+	int Prev;				// Last byte of the previous block, or -1
+
+	GStringsContext(GStringsSearch *eng)
+	{
+		Eng = eng;
+		Pool = new GArray<char>;
+		Eng->Lock(_FL);
+		PoolId = (int)Eng->Pools.Length();
+		Eng->Pools.Add(Pool);
+		Eng->Unlock();
+		for (int i=0; i<3; i++)
+		{
+			Run[i].Chars = 0;
+			Run[i].Skip = false;
+		}
+		Prev = -1;
+	}
+
+	void Emit(GStringsRun &r, int Enc, int Width, GArray<SearchHit> &Hits)
+	{
+		SearchHit &h = Hits.New();
+		h.Offset = r.Start;
+		h.Len = r.Chars * Width;
+		h.Id = Enc;
+		h.Extra = PoolId;
+		h.Value = Pool->Length();
+		Pool->Add(r.Text, r.Chars);
+		Pool->Add(0);
+	}
+
+	inline void Step(GStringsRun &r, bool Printable, uint8 c, int64 At, int Enc, int Width, GArray<SearchHit> &Hits)
+	{
+		if (Printable)
+		{
+			if (r.Skip)
+				return;
+			if (!r.Chars)
+				r.Start = At;
+			r.Text[r.Chars++] = c;
+			if (r.Chars * Width >= STRINGS_MAX_LEN)
+			{
+				Emit(r, Enc, Width, Hits);
+				r.Chars = 0;
+				r.Skip = true;
+			}
+		}
+		else
+		{
+			if (r.Chars >= Eng->MinLen)
+				Emit(r, Enc, Width, Hits);
+			r.Chars = 0;
+			r.Skip = false;
+		}
+	}
+};
+
+static bool StrPrintable[256];
+
+GStringsSearch::GStringsSearch(int minLen, bool utf16) : GMutex("GStringsSearch")
+{
+	MinLen = MAX(minLen, 1);
+	Utf16 = utf16;
+	for (int i=0; i<256; i++)
+		StrPrintable[i] = (i >= ' ' && i < 0x7f) || i == '\t';
+}
+
+GStringsSearch::~GStringsSearch()
+{
+	Pools.DeleteObjects();
+}
+
+const char *GStringsSearch::GetText(SearchHit &h)
+{
+	if (h.Extra < 0 || h.Extra >= (int)Pools.Length())
+		return NULL;
+	GArray<char> *p = Pools[h.Extra];
+	return h.Value < p->Length() ? &(*p)[(size_t)h.Value] : NULL;
+}
+
+GScanContext *GStringsSearch::NewContext()
+{
+	return new GStringsContext(this);
+}
+
+void GStringsSearch::Scan(GScanContext *Ctx, const uint8 *Data, size_t Len, int64 Pos, GArray<SearchHit> &Hits)
+{
+	GStringsContext *c = (GStringsContext*)Ctx;
+	GStringsRun &Ascii = c->Run[0];
+
+	for (size_t i=0; i<Len; i++)
+	{
+		uint8 b = Data[i];
+		bool p = StrPrintable[b];
+		if (p || Ascii.Chars || Ascii.Skip)
+			c->Step(Ascii, p, b, Pos + i, StrAscii, 1, Hits);
+
+		if (Utf16)
+		{
+			// The unit made of the previous byte and this one
+			if (c->Prev >= 0)
+			{
+				int64 At = Pos + i - 1;
+				GStringsRun &r = c->Run[1 + (At & 1)];
+				bool Unit = StrPrintable[c->Prev] && !b;
+				if (Unit || r.Chars || r.Skip)
+					c->Step(r, Unit, c->Prev, At, StrUtf16, 2, Hits);
+			}
+			c->Prev = b;
+		}
+	}
+}
+
+void GStringsSearch::End(GScanContext *Ctx, int64 End, GArray<SearchHit> &Hits)
+{
+	GStringsContext *c = (GStringsContext*)Ctx;
+	for (int i=0; i<3; i++)
+		c->Step(c->Run[i], false, 0, End, i ? StrUtf16 : StrAscii, i ? 2 : 1, Hits);
+}
+
+GString GStringsSearch::Describe(SearchHit &h)
+{
+	return GString(GetText(h));
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+#define REPLACE_BLOCK_SIZE			(4 << 20)
+#define UPDATE_MS					200
+
+GStreamReplace::GStreamReplace(const uint8 *find, size_t findLen, const uint8 *replace, size_t replaceLen, bool matchCase)
+{
+	Find.Add(find, findLen);
+	if (replace && replaceLen)
+		Replace.Add(replace, replaceLen);
+	for (int i=0; i<256; i++)
+		Fold[i] = matchCase ? i : tolower(i);
+	for (unsigned i=0; i<Find.Length(); i++)
+		Find[i] = Fold[Find[i]];
+	StartTs = EndTs = 0;
+	Count = Done = 0;
+}
+
+double GStreamReplace::GetRate()
+{
+	uint64 End = EndTs ? EndTs : LgiCurrentTime();
+	if (!StartTs || End <= StartTs)
+		return 0.0;
+	return (double)Done * 1000.0 / (End - StartTs);
+}
+
+// Returns the offset of the first match starting in [From, To), or -1.
+// There must be Find.Length()-1 bytes available after 'To'.
+ssize_t GStreamReplace::Next(const uint8 *Data, ssize_t From, ssize_t To)
+{
+	size_t Len = Find.Length();
+	const uint8 *f = &Find[0];
+	bool Folded = Fold['A'] != 'A';
+
+	for (ssize_t i=From; i<To; i++)
+	{
+		if (!Folded)
+		{
+			// Let memchr find the candidates
+			const uint8 *p = (const uint8*)memchr(Data + i, f[0], To - i);
+			if (!p)
+				break;
+			i = p - Data;
+			if (!memcmp(p + 1, f + 1, Len - 1))
+				return i;
+		}
+		else if (Fold[Data[i]] == f[0])
+		{
+			size_t n = 1;
+			while (n < Len && Fold[Data[i + n]] == f[n])
+				n++;
+			if (n == Len)
+				return i;
+		}
+	}
+
+	return -1;
+}
+
+bool GStreamReplace::InPlace(GFile &File, GProgressDlg *Prog)
+{
+	ssize_t Len = Find.Length();
+	if (!Len || Len > REPLACE_BLOCK_SIZE || !IsSameLength())
+		return false;
+
+	int64 Size = File.GetSize();
+	GArray<uint8> Buf;
+	if (!Buf.Length(REPLACE_BLOCK_SIZE + Len))
+		return false;
+
+	StartTs = LgiCurrentTime();
+	EndTs = 0;
+	Count = Done = 0;
+	uint64 Ts = StartTs;
+	bool Status = true;
+
+	// Blocks overlap by Len-1 bytes so matches straddling them are found,
+	// but a block never starts inside a match that has been replaced.
+	for (int64 Pos = 0; Pos < Size; )
+	{
+		ssize_t Rd = (ssize_t)MIN(REPLACE_BLOCK_SIZE + Len - 1, Size - Pos);
+		if (File.SetPos(Pos) != Pos ||
+			File.Read(&Buf[0], Rd) != Rd)
+		{
+			Status = false;
+			break;
+		}
+
+		ssize_t Starts = Rd - Len + 1;
+		ssize_t Changed = -1, i = 0;
+		while (i < Starts && (i = Next(&Buf[0], i, Starts)) >= 0)
+		{
+			memcpy(&Buf[i], &Replace[0], Len);
+			if (Changed < 0)
+				Changed = i;
+			i += Len;
+			Count++;
+		}
+
+		// One write for everything changed in the block
+		ssize_t Settled = MAX(i, Starts);
+		if (Changed >= 0)
+		{
+			ssize_t Bytes = MIN(Settled, Rd) - Changed;
+			if (File.SetPos(Pos + Changed) != Pos + Changed ||
+				File.Write(&Buf[Changed], Bytes) != Bytes)
+			{
+				LgiTrace("%s:%i - Write failed at " LPrintfInt64 "\n", _FL, Pos + Changed);
+				Status = false;
+				break;
+			}
+		}
+
+		if (Pos + Rd >= Size)
+		{
+			Done = Size;
+			break;
+		}
+		Done = Pos += Settled;
+
+		if (Prog && LgiCurrentTime() - Ts > UPDATE_MS)
+		{
+			Ts = LgiCurrentTime();
+			Prog->Value(Pos);
+			LgiYield();
+			if (Prog->IsCancelled())
+				break;
+		}
+	}
+
+	EndTs = LgiCurrentTime();
+	return Status;
+}
+
+// Buffers output so it's written in large pieces
+static bool BufferedWrite(GFile &Out, GArray<uint8> &Wr, size_t &Used, const uint8 *p, size_t Bytes)
+{
+	while (Bytes)
+	{
+		size_t c = MIN(Bytes, Wr.Length() - Used);
+		memcpy(&Wr[Used], p, c);
+		Used += c;
+		p += c;
+		Bytes -= c;
+		if (Used == Wr.Length())
+		{
+			if (Out.Write(&Wr[0], Used) != (ssize_t)Used)
+				return false;
+			Used = 0;
+		}
+	}
+
+	return true;
+}
+
+bool GStreamReplace::Copy(GFile &In, GFile &Out, GProgressDlg *Prog)
+{
+	ssize_t Len = Find.Length();
+	if (!Len || Len > REPLACE_BLOCK_SIZE)
+		return false;
+
+	int64 Size = In.GetSize();
+	GArray<uint8> Buf, Wr;
+	if (!Buf.Length(REPLACE_BLOCK_SIZE + Len) ||
+		!Wr.Length(REPLACE_BLOCK_SIZE))
+		return false;
+
+	StartTs = LgiCurrentTime();
+	EndTs = 0;
+	Count = Done = 0;
+	uint64 Ts = StartTs;
+	size_t Used = 0;
+	bool Status = In.SetPos(0) == 0;
+
+	// 'Keep' bytes at the start of Buf are carried over from the last block,
+	// they might be the start of a match. 'Pos' is the offset of Buf[0].
+	ssize_t Keep = 0;
+	for (int64 Pos = 0; Status && Pos < Size; )
+	{
+		ssize_t Rd = (ssize_t)MIN(REPLACE_BLOCK_SIZE, Size - Pos - Keep);
+		if (In.Read(&Buf[Keep], Rd) != Rd)
+		{
+			Status = false;
+			break;
+		}
+
+		ssize_t Avail = Keep + Rd;
+		ssize_t Starts = Avail - Len + 1;
+		ssize_t Copied = 0, i = 0;
+		while (Status && i < Starts && (i = Next(&Buf[0], i, Starts)) >= 0)
+		{
+			Status =	BufferedWrite(Out, Wr, Used, &Buf[Copied], i - Copied) &&
+						BufferedWrite(Out, Wr, Used, Replace.AddressOf(), Replace.Length());
+			Count++;
+			Copied = i += Len;
+		}
+
+		if (Pos + Avail >= Size)
+		{
+			Status = Status && BufferedWrite(Out, Wr, Used, &Buf[Copied], Avail - Copied);
+			Done = Size;
+			break;
+		}
+
+		// Everything before 'Settled' is done with, carry the rest forward
+		ssize_t Settled = MAX(i, Starts);
+		Status = Status && BufferedWrite(Out, Wr, Used, &Buf[Copied], Settled - Copied);
+		Keep = Avail - Settled;
+		memmove(&Buf[0], &Buf[Settled], Keep);
+		Done = Pos += Settled;
+
+		if (Prog && LgiCurrentTime() - Ts > UPDATE_MS)
+		{
+			Ts = LgiCurrentTime();
+			Prog->Value(Pos);
+			LgiYield();
+			if (Prog->IsCancelled())
+			{
+				Status = false;
+				break;
+			}
+		}
+	}
+
+	if (Status && Used)
+		Status = Out.Write(&Wr[0], Used) == (ssize_t)Used;
+
+	EndTs = LgiCurrentTime();
+	return Status;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+#define INDEX_MAGIC					"iHexIdx2"
+#define INDEX_SEGMENT				(256 << 20) // bytes of the file suffix sorted at once
+#define INDEX_OVERLAP				1024 // bytes past the end of a segment it's suffixes can see
+#define INDEX_SAMPLE				2048 // suffix array entries per sample kept in memory
+#define INDEX_MAX_RANGE				(64 << 10) // matches per segment before giving up on the index
+#define INDEX_EDGE					(64 << 10) // bytes at each end of the file hashed into the header
+#define INDEX_EXT					".ihexidx"
+
+struct GSearchIndexHdr
+{
+	char Magic[8];
+	int64 FileSize;
+	int64 ModTime;
+	uint64 EdgeHash;
+	int32 Segment;
+	int32 Overlap;
+	int32 Sample;
+	int32 Reserved;
+	// Followed by one uint32 per byte of the file, each segment's suffix
+	// array in turn, relative to the start of the segment. Then one
+	// GSearchIndexSample for every 'Sample'th entry of each array.
+};
+
+// In the file system's own units, which are finer than a second where
+// it has them, so a rewrite soon after the index was built is still seen.
+static int64 FileModTime(const char *File)
+{
+	#ifdef _MSC_VER
+	WIN32_FILE_ATTRIBUTE_DATA a;
+	GAutoWString w(Utf8ToWide(File));
+	if (!w || !GetFileAttributesExW(w, GetFileExInfoStandard, &a))
+		return -1;
+	return ((int64)a.ftLastWriteTime.dwHighDateTime << 32) | a.ftLastWriteTime.dwLowDateTime;
+	#else
+	struct stat s;
+	if (stat(File, &s))
+		return -1;
+	#ifdef MAC
+	return (int64)s.st_mtimespec.tv_sec * 1000000000 + s.st_mtimespec.tv_nsec;
+	#else
+	return (int64)s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+	#endif
+	#endif
+}
+
+// Hash of the first and last INDEX_EDGE bytes, to catch changes the
+// modification time doesn't.
+static uint64 FileEdgeHash(const char *File, int64 Size)
+{
+	GFile f;
+	GArray<uint8> Buf;
+	if (!f.Open(File, O_READ) ||
+		!Buf.Length(INDEX_EDGE))
+		return 0;
+
+	uint64 Hash = 14695981039346656037ULL;
+	int64 Start[2] = {0, MAX(Size - INDEX_EDGE, INDEX_EDGE)};
+	for (int i=0; i<2; i++)
+	{
+		ssize_t Len = (ssize_t)MIN(INDEX_EDGE, Size - Start[i]);
+		if (Len <= 0)
+			continue;
+		if (f.SetPos(Start[i]) != Start[i] ||
+			f.Read(&Buf[0], Len) != Len)
+			return 0;
+		for (ssize_t n=0; n<Len; n++)
+			Hash = (Hash ^ Buf[n]) * 1099511628211ULL;
+	}
+
+	return Hash;
+}
+
+// Where the sidecar goes when the file's folder isn't writable
+static GString FallbackIndexFile(const char *File)
+{
+	char p[MAX_PATH];
+	if (!LGetSystemPath(LSP_APP_ROOT, p, sizeof(p)))
+		return GString();
+	LgiMakePath(p, sizeof(p), p, "Index");
+	if (!DirExists(p))
+		FileDev->CreateFolder(p);
+
+	uint32 Hash = 2166136261U;
+	for (const char *s = File; *s; s++)
+		Hash = (Hash ^ (uint8)*s) * 16777619U;
+
+	const char *Leaf = strrchr(File, DIR_CHAR);
+	GString Name;
+	Name.Printf("%s-%08x%s", Leaf ? Leaf + 1 : File, Hash, INDEX_EXT);
+	LgiMakePath(p, sizeof(p), p, Name);
+	return p;
+}
+
+GSearchIndex::GSearchIndex(const char *file) : GThread("GSearchIndex")
+{
+	File = file;
+	Size = ModTime = -1;
+	EdgeHash = 0;
+	Segment = Overlap = Sample = 0;
+	Done = 0;
+	Building = false;
+	Cancelled = false;
+
+	GString Side;
+	Side.Printf("%s%s", File.Get(), INDEX_EXT);
+	if (!ReadHeader(Side))
+		ReadHeader(FallbackIndexFile(File));
+}
+
+GSearchIndex::~GSearchIndex()
+{
+	Cancel();
+	while (Building)
+		LgiSleep(10);
+}
+
+int64 GSearchIndex::SampleCount(int64 FileSize, int32 Seg, int32 Smp)
+{
+	int64 Full = FileSize / Seg;
+	int64 Rest = FileSize % Seg;
+	return Full * (Seg / Smp) + (Rest + Smp - 1) / Smp;
+}
+
+bool GSearchIndex::ReadHeader(const char *Path)
+{
+	GFile f;
+	GSearchIndexHdr h;
+	if (!Path ||
+		!f.Open(Path, O_READ) ||
+		f.Read(&h, sizeof(h)) != sizeof(h) ||
+		memcmp(h.Magic, INDEX_MAGIC, sizeof(h.Magic)) ||
+		h.Segment <= 0 ||
+		h.Overlap < 0 ||
+		h.Sample <= 0 ||
+		h.Segment % h.Sample != 0 ||
+		f.GetSize() != sizeof(h) +
+						h.FileSize * sizeof(uint32) +
+						SampleCount(h.FileSize, h.Segment, h.Sample) * sizeof(GSearchIndexSample))
+		return false;
+
+	IdxFile = Path;
+	Size = h.FileSize;
+	ModTime = h.ModTime;
+	EdgeHash = h.EdgeHash;
+	Segment = h.Segment;
+	Overlap = h.Overlap;
+	Sample = h.Sample;
+	Samples.Length(0);
+	return true;
+}
+
+bool GSearchIndex::LoadSamples()
+{
+	size_t Count = (size_t)SampleCount(Size, Segment, Sample);
+	if (Samples.Length() == Count)
+		return true;
+
+	GFile f;
+	ssize_t Bytes = Count * sizeof(GSearchIndexSample);
+	int64 Pos = sizeof(GSearchIndexHdr) + Size * sizeof(uint32);
+	if (!Count ||
+		!f.Open(IdxFile, O_READ) ||
+		!Samples.Length(Count) ||
+		f.SetPos(Pos) != Pos ||
+		f.Read(&Samples[0], Bytes) != Bytes)
+	{
+		Samples.Length(0);
+		return false;
+	}
+
+	return true;
+}
+
+bool GSearchIndex::IsValid()
+{
+	return	!Building &&
+			IdxFile.Length() > 0 &&
+			Size == LgiFileSize(File) &&
+			ModTime == FileModTime(File) &&
+			EdgeHash == FileEdgeHash(File, Size);
+}
+
+bool GSearchIndex::Update()
+{
+	if (Building || IsExited() || IsValid())
+		return false;
+
+	Building = true;
+	Cancelled = false;
+	Done = 0;
+	Size = LgiFileSize(File);
+	Samples.Length(0);
+	Run();
+	return true;
+}
+
+int GSearchIndex::Main()
+{
+	int64 FileSize = LgiFileSize(File);
+	int64 Mod = FileModTime(File);
+	uint64 Edges = FileEdgeHash(File, FileSize);
+	GString Out, Tmp;
+	Out.Printf("%s%s", File.Get(), INDEX_EXT);
+	Tmp.Printf("%s.tmp", Out.Get());
+	GFile In, Idx;
+	bool Status = false;
+
+	if (!In.Open(File, O_READ))
+	{
+		LgiTrace("%s:%i - Can't open '%s'\n", _FL, File.Get());
+		Building = false;
+		return -1;
+	}
+	if (!Idx.Open(Tmp, O_WRITE))
+	{
+		Out = FallbackIndexFile(File);
+		Tmp.Printf("%s.tmp", Out.Get());
+		if (!Out.Length() || !Idx.Open(Tmp, O_WRITE))
+		{
+			LgiTrace("%s:%i - Can't create '%s'\n", _FL, Tmp.Get());
+			Building = false;
+			return -1;
+		}
+	}
+	Idx.SetSize(0);
+
+	// The magic is written last so a partial index is never used
+	GSearchIndexHdr h;
+	ZeroObj(h);
+	h.FileSize = FileSize;
+	h.ModTime = Mod;
+	h.EdgeHash = Edges;
+	h.Segment = (int32)MIN(INDEX_SEGMENT, (FileSize + INDEX_SAMPLE - 1) / INDEX_SAMPLE * INDEX_SAMPLE);
+	h.Overlap = INDEX_OVERLAP;
+	h.Sample = INDEX_SAMPLE;
+
+	// Files up to a segment long get one array, the buffers are only as
+	// big as that needs.
+	GArray<uint8> Text;
+	GArray<int32> Sa;
+	if (h.Segment > 0 &&
+		Idx.Write(&h, sizeof(h)) == sizeof(h) &&
+		Text.Length(h.Segment + INDEX_OVERLAP) &&
+		Sa.Length(h.Segment + INDEX_OVERLAP + 1))
+	{
+		Status = true;
+		for (int64 Base = 0; Status && Base < FileSize; Base += h.Segment)
+		{
+			// Each segment is sorted with a little of the next one after it,
+			// so it's suffixes can be compared over at least 'Overlap' bytes.
+			int32 SegLen = (int32)MIN(h.Segment, FileSize - Base);
+			int32 TextLen = (int32)MIN(h.Segment + INDEX_OVERLAP, FileSize - Base);
+			if (Cancelled ||
+				In.SetPos(Base) != Base ||
+				In.Read(&Text[0], TextLen) != TextLen ||
+				!suffix_sort(&Sa[0], &Text[0], TextLen))
+			{
+				Status = false;
+				break;
+			}
+
+			// Keep the suffixes starting inside the segment, skipping the
+			// empty suffix at Sa[0].
+			int32 n = 0;
+			for (int32 i=1; i<=TextLen; i++)
+			{
+				if (Sa[i] < SegLen)
+					Sa[n++] = Sa[i];
+			}
+			LgiAssert(n == SegLen);
+
+			// The start of every 'Sample'th suffix is kept in memory, these
+			// are the top levels of each binary search.
+			for (int32 i=0; i<n; i+=INDEX_SAMPLE)
+			{
+				GSearchIndexSample &s = Samples.New();
+				ZeroObj(s);
+				s.Len = (uint8)MIN(GSearchIndexSample::MaxLen, TextLen - Sa[i]);
+				memcpy(s.Bytes, &Text[Sa[i]], s.Len);
+			}
+
+			ssize_t Bytes = n * sizeof(int32);
+			Status = Idx.Write(&Sa[0], Bytes) == Bytes;
+			Done = Base + SegLen;
+		}
+	}
+
+	if (Status)
+	{
+		ssize_t Bytes = Samples.Length() * sizeof(GSearchIndexSample);
+		Status = Samples.Length() == (size_t)SampleCount(FileSize, h.Segment, h.Sample) &&
+				 Idx.Write(&Samples[0], Bytes) == Bytes;
+	}
+
+	// Don't keep an index of a file that changed while we were reading it
+	if (Status &&
+		(LgiFileSize(File) != FileSize ||
+		 FileModTime(File) != Mod ||
+		 FileEdgeHash(File, FileSize) != Edges))
+		Status = false;
+
+	if (Status)
+	{
+		memcpy(h.Magic, INDEX_MAGIC, sizeof(h.Magic));
+		Status = Idx.SetPos(0) == 0 &&
+				 Idx.Write(&h, sizeof(h)) == sizeof(h);
+	}
+	Idx.Close();
+	In.Close();
+
+	if (Status)
+	{
+		if (FileExists(Out))
+			FileDev->Delete(Out, false);
+
+		// Keep the samples just built rather than reading them back
+		GArray<GSearchIndexSample> Built;
+		Built.Swap(Samples);
+		Status = FileDev->Move(Tmp, Out) && ReadHeader(Out);
+		Samples.Swap(Built);
+	}
+	if (!Status)
+	{
+		FileDev->Delete(Tmp, false);
+		Samples.Length(0);
+	}
+
+	Building = false;
+	return Status ? 0 : -1;
+}
+
+// Compares the suffix at 'Entry' in the index with the pattern. The suffix
+// ends at 'End' (the end of the segment's sorted text), so one shorter than
+// the pattern that matches what it has sorts before it. 'Cached' is the
+// entry's value if it has already been read.
+int GSearchIndex::Compare(GFile &Idx, GFile &Data, int64 Entry, int64 End, const uint8 *Pat, size_t Len, uint8 *Tmp, const uint32 *Cached)
+{
+	uint32 Rel;
+	int64 Base = Entry / Segment * Segment;
+	if (Cached)
+		Rel = *Cached;
+	else if (Idx.SetPos(sizeof(GSearchIndexHdr) + Entry * sizeof(uint32)) < 0 ||
+			 Idx.Read(&Rel, sizeof(Rel)) != sizeof(Rel))
+		return 0;
+
+	int64 Pos = Base + Rel;
+	ssize_t n = (ssize_t)MIN((int64)Len, End - Pos);
+	if (n > 0)
+	{
+		if (Data.SetPos(Pos) != Pos ||
+			Data.Read(Tmp, n) != n)
+			return 0;
+
+		int c = memcmp(Tmp, Pat, n);
+		if (c)
+			return c;
+	}
+
+	return n < (ssize_t)Len ? -1 : 0;
+}
+
+// Compares a sample with the pattern as far as the sample goes. Returns 0
+// if the suffix might start with the pattern: when it does, or when the
+// pattern is longer than the part of the suffix that was kept.
+static int SampleCompare(GSearchIndexSample &s, const uint8 *Pat, size_t Len)
+{
+	size_t n = MIN(Len, (size_t)s.Len);
+	int c = memcmp(s.Bytes, Pat, n);
+	if (c)
+		return c < 0 ? -1 : 1;
+	if (n < Len && s.Len < GSearchIndexSample::MaxLen)
+		return -1; // The suffix itself ends before the pattern
+	return 0;
+}
+
+static int PosCmp(uint32 *a, uint32 *b)
+{
+	return *a < *b ? -1 : (*a > *b ? 1 : 0);
+}
+
+int GSearchIndex::FindInSegment(GFile &Idx, GFile &Data, int64 Seg, const uint8 *Pat, size_t Len, int64 From, int64 &Hit)
+{
+	int64 Base = Seg * Segment;
+	int64 SegLen = MIN(Segment, Size - Base);
+	int64 End = MIN(Size, Base + SegLen + Overlap);
+	size_t Key = MIN(Len, (size_t)Overlap);
+
+	// The samples in memory narrow the search down to the entries after
+	// the last sample sorting before the key and up to the first sorting
+	// after it, usually less than two samples apart.
+	GSearchIndexSample *Smp = &Samples[(size_t)(Seg * (Segment / Sample))];
+	int64 Smps = (SegLen + Sample - 1) / Sample;
+	int64 Lo = 0, Hi = Smps;
+	while (Lo < Hi)
+	{
+		int64 Mid = (Lo + Hi) >> 1;
+		if (SampleCompare(Smp[Mid], Pat, Key) < 0)
+			Lo = Mid + 1;
+		else
+			Hi = Mid;
+	}
+	int64 Before = Lo;
+	for (Hi = Smps; Lo < Hi; )
+	{
+		int64 Mid = (Lo + Hi) >> 1;
+		if (SampleCompare(Smp[Mid], Pat, Key) <= 0)
+			Lo = Mid + 1;
+		else
+			Hi = Mid;
+	}
+	int64 RangeLo = Before ? (Before - 1) * Sample + 1 : 0;
+	int64 RangeHi = Lo < Smps ? Lo * Sample : SegLen;
+	if (RangeLo >= RangeHi)
+		return 0;
+
+	GArray<uint8> Tmp;
+	if (!Tmp.Length(MAX(Key, Len)))
+		return -1;
+
+	// Unless the key is common the entries left to search are read at once,
+	// then each step of the search is one read of the file.
+	GArray<uint32> Ents;
+	if (RangeHi - RangeLo <= INDEX_MAX_RANGE)
+	{
+		ssize_t Bytes = (ssize_t)((RangeHi - RangeLo) * sizeof(uint32));
+		if (!Ents.Length((size_t)(RangeHi - RangeLo)) ||
+			Idx.SetPos(sizeof(GSearchIndexHdr) + (Base + RangeLo) * sizeof(uint32)) < 0 ||
+			Idx.Read(&Ents[0], Bytes) != Bytes)
+			return -1;
+	}
+
+	// Find the range of suffixes starting with the key
+	for (Lo = RangeLo, Hi = RangeHi; Lo < Hi; )
+	{
+		int64 Mid = (Lo + Hi) >> 1;
+		if (Compare(Idx, Data, Base + Mid, End, Pat, Key, &Tmp[0], Ents.Length() ? &Ents[(size_t)(Mid - RangeLo)] : NULL) < 0)
+			Lo = Mid + 1;
+		else
+			Hi = Mid;
+	}
+	int64 First = Lo;
+	for (Hi = RangeHi; Lo < Hi; )
+	{
+		int64 Mid = (Lo + Hi) >> 1;
+		if (Compare(Idx, Data, Base + Mid, End, Pat, Key, &Tmp[0], Ents.Length() ? &Ents[(size_t)(Mid - RangeLo)] : NULL) <= 0)
+			Lo = Mid + 1;
+		else
+			Hi = Mid;
+	}
+	int64 Count = Lo - First;
+	if (Count == 0)
+		return 0;
+	if (Count > INDEX_MAX_RANGE)
+		return -1;
+
+	// The suffix array is in lexical order, we want the earliest position
+	GArray<uint32> Pos;
+	if (Ents.Length())
+	{
+		Pos.Add(&Ents[(size_t)(First - RangeLo)], (size_t)Count);
+	}
+	else
+	{
+		ssize_t Bytes = (ssize_t)(Count * sizeof(uint32));
+		if (!Pos.Length((size_t)Count) ||
+			Idx.SetPos(sizeof(GSearchIndexHdr) + (Base + First) * sizeof(uint32)) < 0 ||
+			Idx.Read(&Pos[0], Bytes) != Bytes)
+			return -1;
+	}
+	Pos.Sort(PosCmp);
+
+	for (unsigned i=0; i<Pos.Length(); i++)
+	{
+		int64 p = Base + Pos[i];
+		if (p < From)
+			continue;
+
+		// Patterns longer than the overlap only had their start matched
+		if (Len > Key)
+		{
+			ssize_t Rest = (ssize_t)(Len - Key);
+			if (Data.SetPos(p + Key) != p + (int64)Key ||
+				Data.Read(&Tmp[0], Rest) != Rest ||
+				memcmp(&Tmp[0], Pat + Key, Rest))
+				continue;
+		}
+
+		Hit = p;
+		return 1;
+	}
+
+	return 0;
+}
+
+int GSearchIndex::Find(const uint8 *Pat, size_t Len, int64 From, int64 &Hit)
+{
+	if (!Pat || !Len || !IsValid() || !LoadSamples())
+		return -1;
+
+	GFile Idx, Data;
+	if (!Idx.Open(IdxFile, O_READ) ||
+		!Data.Open(File, O_READ))
+		return -1;
+
+	int64 Segs = (Size + Segment - 1) / Segment;
+	for (int64 s = MAX(From, 0) / Segment; s < Segs; s++)
+	{
+		int r = FindInSegment(Idx, Data, s, Pat, Len, From, Hit);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+class GSearchHitItem : public LListItem
+{
+public:
+	SearchHit Hit;
+
+	GSearchHitItem(SearchHit &h, GScanEngine *Eng)
+	{
+		Hit = h;
+
+		GString s;
+		s.Printf("0x%llx", (long long)h.Offset);
+		SetText(s, 0);
+		s.Printf("%i", h.Len);
+		SetText(s, 1);
+		SetText(Eng->Describe(h), 2);
+	}
+};
+
+GSearchResults::GSearchResults(AppWnd *app, GScanEngine *engine, const char *desc)
+{
+	App = app;
+	Engine.Reset(engine);
+	Desc = desc;
+	Lst = NULL;
+	Shown = 0;
+	Finished = false;
+
+	Name(Desc);
+	GRect r(0, 0, 600, 500);
+	SetPos(r);
+	MoveSameScreen(App);
+	if (Attach(0))
+	{
+		Children.Insert(Lst = new LList(IDC_LIST, 0, 0, 100, 100));
+		Lst->AddColumn("Offset", 120);
+		Lst->AddColumn("Length", 60);
+		Lst->AddColumn("Match", 380);
+		AttachChildren();
+		OnPosChange();
+		Visible(true);
+	}
+}
+
+GSearchResults::~GSearchResults()
+{
+	Scanner.Reset();
+}
+
+bool GSearchResults::Start(const char *FileName, const uint8 *Mem, int64 MemLen)
+{
+	if (!Engine || !Scanner.Reset(new GFileScanner(Engine)))
+		return false;
+
+	bool Status = FileName ? Scanner->Start(FileName) : Scanner->Start(Mem, MemLen);
+	if (Status)
+		SetPulse(250);
+	else
+		LgiMsg(this, "Failed to start the scan.", AppName);
+
+	return Status;
+}
+
+void GSearchResults::OnPosChange()
+{
+	if (Lst)
+	{
+		GRect c = GetClient();
+		Lst->SetPos(c);
+	}
+}
+
+void GSearchResults::Update()
+{
+	if (!Scanner || !Lst || Finished)
+		return;
+
+	bool Running = Scanner->IsRunning();
+	if (!Running)
+	{
+		// Hits are now sorted, so relist them in order
+		Finished = true;
+		SetPulse(-1);
+		Lst->Empty();
+		Shown = 0;
+	}
+
+	// Only copy the hits that still fit in the list
+	GArray<SearchHit> New;
+	size_t Total = Scanner->GetHits(New, Shown, RESULTS_MAX_LISTED - Shown);
+	for (unsigned i=0; i<New.Length(); i++, Shown++)
+		Lst->Insert(new GSearchHitItem(New[i], Engine));
+
+	GString s;
+	double MbSec = Scanner->GetRate() / 1024.0 / 1024.0;
+	if (Running)
+	{
+		double Pc = Scanner->GetTotal() ? (double) Scanner->GetDone() * 100.0 / Scanner->GetTotal() : 0.0;
+		s.Printf("%s - %.1f%%, " LPrintfSizeT " hits, %.1f MB/s", Desc.Get(), Pc, Total, MbSec);
+	}
+	else
+	{
+		s.Printf("%s - " LPrintfSizeT " hits%s, %.1f MB/s%s",
+				Desc.Get(),
+				Total,
+				Scanner->HasOverflowed() ? " (limit reached)" : "",
+				MbSec,
+				Total > Shown ? ", list truncated" : "");
+	}
+	Name(s);
+}
+
+void GSearchResults::OnPulse()
+{
+	Update();
+}
+
+int GSearchResults::OnNotify(GViewI *c, int f)
+{
+	if (c->GetId() == IDC_LIST &&
+		f == GNotifyItem_DoubleClick)
+	{
+		GSearchHitItem *i = dynamic_cast<GSearchHitItem*>(Lst->GetSelected());
+		if (i)
+			App->GotoHit(i->Hit.Offset, i->Hit.Len);
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+#define STRINGS_DEF_MIN				4
+#define STRINGS_LABEL_X				40	// Width of the labels in front of the edits
+#define STRINGS_OPTIONS_X			160 // Width of the options to the right of the filter
+#define STRINGS_OFFSET_X			90	// Width of the offset column
+
+/// The rows of a GStringsView, drawn straight from it's arrays
+class GStringsList : public GLayout
+{
+	GStringsView *View;
+	int64 Cur;
+
+	int RowY() { return SysFont->GetHeight() + 2; }
+	int Rows() { return MAX(GetClient().Y() / RowY(), 1); }
+	int64 First() { return VScroll ? VScroll->Value() : 0; }
+
+public:
+	GStringsList(GStringsView *view)
+	{
+		View = view;
+		Cur = -1;
+		SetId(IDC_STRINGS_LIST);
+	}
+
+	void UpdateScrollBar()
+	{
+		int64 Len = View->Length();
+		SetScrollBars(false, Len > Rows());
+		if (VScroll)
+		{
+			VScroll->SetNotify(this);
+			VScroll->SetLimits(0, Len > 0 ? Len - 1 : 0);
+			VScroll->SetPage(Rows());
+		}
+	}
+
+	void Reset()
+	{
+		Cur = -1;
+		if (VScroll)
+			VScroll->Value(0);
+		UpdateScrollBar();
+		Invalidate();
+	}
+
+	void Select(int64 Row, bool Focus)
+	{
+		int64 Len = View->Length();
+		if (Len <= 0)
+			return;
+
+		Cur = MAX(0, MIN(Row, Len - 1));
+		if (VScroll)
+		{
+			if (Cur < First())
+				VScroll->Value(Cur);
+			else if (Cur >= First() + Rows())
+				VScroll->Value(Cur - Rows() + 1);
+		}
+		Invalidate();
+		View->OnSelect((size_t)Cur, Focus);
+	}
+
+	void OnPosChange()
+	{
+		UpdateScrollBar();
+		GLayout::OnPosChange();
+	}
+
+	int OnNotify(GViewI *c, int f)
+	{
+		if (c->GetId() == IDC_VSCROLL)
+			Invalidate();
+		return 0;
+	}
+
+	void OnPaint(GSurface *pDC)
+	{
+		GRect c = GetClient();
+		pDC->Colour(LC_WORKSPACE, 24);
+		pDC->Rectangle();
+
+		SysFont->Transparent(true);
+		int y = 0;
+		for (int64 Row = First(); Row < (int64)View->Length() && y <= c.y2; Row++, y += RowY())
+		{
+			SearchHit *h = View->GetHit((size_t)Row);
+			if (Row == Cur)
+			{
+				GRect r(0, y, c.x2, y + RowY() - 1);
+				pDC->Colour(LC_FOCUS_SEL_BACK, 24);
+				pDC->Rectangle(&r);
+				SysFont->Colour(LC_FOCUS_SEL_FORE, LC_FOCUS_SEL_BACK);
+			}
+			else SysFont->Colour(LC_TEXT, LC_WORKSPACE);
+
+			GString s;
+			s.Printf("%c %llx", h->Id == StrUtf16 ? 'U' : ' ', (long long)h->Offset);
+			GDisplayString Off(SysFont, s);
+			Off.Draw(pDC, 2, y + 1);
+
+			const char *Txt = View->GetText(*h);
+			if (Txt)
+			{
+				GDisplayString ds(SysFont, Txt);
+				ds.Draw(pDC, STRINGS_OFFSET_X, y + 1);
+			}
+		}
+	}
+
+	void OnMouseClick(GMouse &m)
+	{
+		if (m.Down() && m.Left())
+		{
+			Focus(true);
+			int64 Row = First() + m.y / RowY();
+			if (Row < (int64)View->Length())
+				Select(Row, m.Double());
+		}
+	}
+
+	bool OnMouseWheel(double Lines)
+	{
+		if (VScroll)
+		{
+			VScroll->Value(VScroll->Value() + (int)Lines);
+			Invalidate();
+		}
+		return true;
+	}
+
+	bool OnKey(GKey &k)
+	{
+		int64 Row = -1;
+		switch (k.vkey)
+		{
+			case VK_UP:			Row = Cur - 1; break;
+			case VK_DOWN:		Row = Cur + 1; break;
+			case VK_PAGEUP:		Row = Cur - Rows(); break;
+			case VK_PAGEDOWN:	Row = Cur + Rows(); break;
+			case VK_HOME:		Row = 0; break;
+			case VK_END:		Row = View->Length() - 1; break;
+			case VK_RETURN:
+			{
+				if (k.Down() && Cur >= 0)
+					View->OnSelect((size_t)Cur, true);
+				return true;
+			}
+			default:
+				return false;
+		}
+
+		if (k.Down())
+			Select(Row, false);
+		return true;
+	}
+};
+
+GStringsView::GStringsView(AppWnd *app)
+{
+	App = app;
+	Top = 0;
+	Children.Insert(Lst = new GStringsList(this));
+	Children.Insert(new GEdit(IDC_STRINGS_FILTER, 0, 0, 100, 20));
+	Children.Insert(new GEdit(IDC_STRINGS_MIN, 0, 0, 40, 20));
+	Children.Insert(new GCheckBox(IDC_STRINGS_UTF16, 0, 0, 70, 20, "UTF-16", true));
+}
+
+GStringsView::~GStringsView()
+{
+	// The workers use the engine, so they have to go first
+	Scanner.Reset();
+}
+
+void GStringsView::OnCreate()
+{
+	AttachChildren();
+	SetCtrlValue(IDC_STRINGS_MIN, STRINGS_DEF_MIN);
+}
+
+void GStringsView::OnPosChange()
+{
+	GRect c = GetClient();
+	int Ht = SysFont->GetHeight() + 8;
+	int x2 = MAX(c.x2 - STRINGS_OPTIONS_X, STRINGS_LABEL_X + 20);
+
+	GRect r(STRINGS_LABEL_X, 4, x2, 4 + Ht - 1);
+	GViewI *v = FindControl(IDC_STRINGS_FILTER);
+	if (v) v->SetPos(r);
+
+	r = GRect(x2 + STRINGS_LABEL_X, r.y1, x2 + STRINGS_LABEL_X + 30, r.y2);
+	if ((v = FindControl(IDC_STRINGS_MIN)))
+		v->SetPos(r);
+
+	r = GRect(r.x2 + 8, r.y1, c.x2, r.y2);
+	if ((v = FindControl(IDC_STRINGS_UTF16)))
+		v->SetPos(r);
+
+	// Then a line of status text, then the list
+	Top = r.y2 + SysFont->GetHeight() + 8;
+	r = GRect(0, Top, c.x2, c.y2);
+	Lst->SetPos(r);
+}
+
+void GStringsView::OnPaint(GSurface *pDC)
+{
+	pDC->Colour(LC_MED, 24);
+	pDC->Rectangle();
+
+	GRect c = GetClient();
+	int x2 = MAX(c.x2 - STRINGS_OPTIONS_X, STRINGS_LABEL_X + 20);
+	SysFont->Transparent(true);
+	SysFont->Colour(LC_TEXT, LC_MED);
+
+	GDisplayString f(SysFont, "Filter:");
+	f.Draw(pDC, 4, 8);
+	GDisplayString m(SysFont, "Min:");
+	m.Draw(pDC, x2 + 8, 8);
+	GDisplayString s(SysFont, Status);
+	s.Draw(pDC, 4, Top - SysFont->GetHeight() - 4);
+}
+
+bool GStringsView::Start(const char *FileName, const uint8 *Mem, int64 MemLen)
+{
+	Empty();
+
+	int Min = (int)GetCtrlValue(IDC_STRINGS_MIN);
+	if (Min < 2)
+		SetCtrlValue(IDC_STRINGS_MIN, Min = STRINGS_DEF_MIN);
+	Engine.Reset(new GStringsSearch(Min, GetCtrlValue(IDC_STRINGS_UTF16) != 0));
+	if (!Scanner.Reset(new GFileScanner(Engine)))
+		return false;
+
+	bool Status = FileName ? Scanner->Start(FileName) : Scanner->Start(Mem, MemLen);
+	if (Status)
+		SetPulse(250);
+	Update();
+	return Status;
+}
+
+void GStringsView::Empty()
+{
+	SetPulse(-1);
+	Scanner.Reset();
+	Engine.Reset();
+	Hits.Length(0);
+	Shown.Length(0);
+	Status = GString();
+	Lst->Reset();
+	Invalidate();
+}
+
+void GStringsView::Update()
+{
+	if (!Scanner)
+		return;
+
+	if (Scanner->IsRunning())
+	{
+		double Pc = Scanner->GetTotal() ? (double) Scanner->GetDone() * 100.0 / Scanner->GetTotal() : 0.0;
+		Status.Printf("Finding strings... %.1f%%", Pc);
+		Invalidate();
+	}
+	else
+	{
+		// The text is only safe to read once the workers have stopped
+		SetPulse(-1);
+		Scanner->GetHits(Hits);
+		ApplyFilter();
+	}
+}
+
+void GStringsView::ApplyFilter()
+{
+	if (!Scanner || Scanner->IsRunning())
+		return;
+
+	const char *Filter = GetCtrlName(IDC_STRINGS_FILTER);
+	if (Filter && !*Filter)
+		Filter = NULL;
+
+	Shown.Length(0);
+	for (unsigned i=0; i<Hits.Length(); i++)
+	{
+		if (!Filter)
+			Shown.Add(i);
+		else
+		{
+			const char *t = Engine->GetText(Hits[i]);
+			if (t && stristr(t, Filter))
+				Shown.Add(i);
+		}
+	}
+
+	if (Filter)
+		Status.Printf(LPrintfSizeT " of " LPrintfSizeT " strings%s", Shown.Length(), Hits.Length(), Scanner->HasOverflowed() ? " (limit reached)" : "");
+	else
+		Status.Printf(LPrintfSizeT " strings%s", Hits.Length(), Scanner->HasOverflowed() ? " (limit reached)" : "");
+	Lst->Reset();
+	Invalidate();
+}
+
+void GStringsView::OnSelect(size_t Row, bool Focus)
+{
+	SearchHit *h = GetHit(Row);
+	if (h)
+		App->GotoHit(h->Offset, h->Len, Focus);
+}
+
+void GStringsView::OnPulse()
+{
+	Update();
+}
+
+int GStringsView::OnNotify(GViewI *c, int f)
+{
+	switch (c->GetId())
+	{
+		case IDC_STRINGS_FILTER:
+		{
+			ApplyFilter();
+			break;
+		}
+		case IDC_STRINGS_MIN:
+		{
+			if (f == VK_RETURN)
+				App->StartStrings();
+			break;
+		}
+		case IDC_STRINGS_UTF16:
+		{
+			App->StartStrings();
+			break;
+		}
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+class GBatchHitItem : public LListItem
+{
+public:
+	BatchHit Hit;
+
+	GBatchHitItem(BatchHit &h, GBatchSearch *Batch)
+	{
+		Hit = h;
+
+		GString s;
+		SetText(Batch->GetFile(h.File), 0);
+		s.Printf("0x%llx", (long long)h.Hit.Offset);
+		SetText(s, 1);
+		SetText(Batch->GetEngine()->Describe(h.Hit), 2);
+	}
+};
+
+GBatchResults::GBatchResults(AppWnd *app, GScanEngine *engine, const char *desc, bool firstOnly)
+{
+	App = app;
+	Engine.Reset(engine);
+	Batch.Reset(new GBatchSearch(engine, firstOnly));
+	Desc = desc;
+	Lst = NULL;
+	Shown = 0;
+
+	Name(Desc);
+	GRect r(0, 0, 700, 500);
+	SetPos(r);
+	MoveSameScreen(App);
+	if (Attach(0))
+	{
+		Children.Insert(Lst = new LList(IDC_LIST, 0, 0, 100, 100));
+		Lst->AddColumn("File", 440);
+		Lst->AddColumn("Offset", 120);
+		Lst->AddColumn("Match", 120);
+		AttachChildren();
+		OnPosChange();
+		Visible(true);
+	}
+}
+
+GBatchResults::~GBatchResults()
+{
+	// The search uses the engine, so it has to go first
+	Batch.Reset();
+}
+
+bool GBatchResults::Start(const char *Path)
+{
+	if (!Batch->AddPath(Path) ||
+		!Batch->Start())
+	{
+		LgiMsg(this, "No files found at '%s'.", AppName, MB_OK, Path);
+		return false;
+	}
+
+	SetPulse(250);
+	return true;
+}
+
+void GBatchResults::OnPosChange()
+{
+	if (Lst)
+	{
+		GRect c = GetClient();
+		Lst->SetPos(c);
+	}
+}
+
+void GBatchResults::Update()
+{
+	if (!Lst)
+		return;
+
+	bool Running = Batch->IsRunning();
+	if (!Running)
+		SetPulse(-1);
+
+	GArray<BatchHit> New;
+	size_t Total = Batch->GetHits(New, Shown, RESULTS_MAX_LISTED - Shown);
+	for (unsigned i=0; i<New.Length(); i++, Shown++)
+		Lst->Insert(new GBatchHitItem(New[i], Batch));
+
+	GString s;
+	s.Printf("%s - " LPrintfSizeT "/" LPrintfSizeT " files, " LPrintfSizeT " hits%s, %.1f MB/s%s",
+			Desc.Get(),
+			Batch->GetFilesDone(),
+			Batch->GetFiles(),
+			Total,
+			Batch->HasOverflowed() ? " (limit reached)" : "",
+			Batch->GetRate() / 1024.0 / 1024.0,
+			Total > Shown ? ", list truncated" : "");
+	Name(s);
+}
+
+void GBatchResults::OnPulse()
+{
+	Update();
+}
+
+int GBatchResults::OnNotify(GViewI *c, int f)
+{
+	if (c->GetId() == IDC_LIST &&
+		f == GNotifyItem_DoubleClick)
+	{
+		GBatchHitItem *i = dynamic_cast<GBatchHitItem*>(Lst->GetSelected());
+		const char *File = i ? Batch->GetFile(i->Hit.File) : NULL;
+		if (File && App->OpenFile((char*)File, false))
+			App->GotoHit(i->Hit.Hit.Offset, i->Hit.Hit.Len);
+	}
+
+	return 0;
+}
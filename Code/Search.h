@@ -0,0 +1,528 @@
+/*hdr
+**      FILE:           Search.h
+**      AUTHOR:         Matthew Allen
+**      DESCRIPTION:    Multi-threaded file scanning
+**
+**      Copyright (C) 2005, Matthew Allen
+**              fret@memecode.com
+*/
+
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include "GThread.h"
+#include "GMutex.h"
+
+#define SCAN_BLOCK_SIZE				(1 << 20) // bytes read per worker per call
+#define SCAN_MAX_HITS				(1 << 20) // stop collecting after this many hits
+
+/// Converts the user's search string into raw bytes. In hex mode any non-hex
+/// characters are ignored, so "ff aa 00", "ffaa00" and "ff,aa,00" are equivalent.
+extern bool ParseSearchPattern(GArray<uint8> &Out, const char *Str, bool IsHex);
+
+struct SearchHit
+{
+	int64 Offset;	// Start of the match in the file
+	int Len;		// Length of the match in bytes
+	int Id;			// Engine specific: pattern index etc
+	int Extra;		// Engine specific: edit distance etc
+	uint64 Value;	// Engine specific: the raw value found etc
+};
+
+/// Per worker scanning state, created by the engine
+class GScanContext
+{
+public:
+	virtual ~GScanContext() {}
+};
+
+/// A matcher that can be run over a stream of bytes.
+///
+/// The scanner feeds each worker's range through Scan() in order. Before
+/// 'Data' there are always at least MaxSpan()-1 bytes of the previous
+/// block available (unless at the start of the file), so an engine that
+/// doesn't carry state between calls can still see matches that straddle
+/// a block boundary. Either way Scan() must report exactly the matches
+/// whose LAST byte lies in [Pos, Pos+Len).
+class GScanEngine
+{
+public:
+	virtual ~GScanEngine() {}
+
+	/// The longest match in bytes the engine can report
+	virtual int MaxSpan() = 0;
+	/// Create per thread state, or NULL if none is needed
+	virtual GScanContext *NewContext() { return NULL; }
+	/// Scan a block, 'Pos' is the file offset of Data[0]
+	virtual void Scan(GScanContext *Ctx, const uint8 *Data, size_t Len, int64 Pos, GArray<SearchHit> &Hits) = 0;
+	/// Called once the last block of a range has been scanned, 'End' being
+	/// the offset just past it. For engines that only report a match once
+	/// they've seen the byte after it.
+	virtual void End(GScanContext *Ctx, int64 End, GArray<SearchHit> &Hits) {}
+	/// Describe a hit for the results list
+	virtual GString Describe(SearchHit &h) { return GString(); }
+};
+
+/// Splits a file into one range per CPU and runs an engine over each
+/// range in the background. Each worker has it's own file handle and
+/// reads sequentially, so the OS read ahead stays effective.
+class GFileScanner : public GMutex
+{
+	friend class GScanWorker;
+
+	GScanEngine *Engine;
+	GArray<class GScanWorker*> Workers;
+	GArray<uint8> Mem;
+	GString File;
+	int64 Size;
+	uint64 StartTs, EndTs;
+	bool Overflow;
+
+	// Shared with the workers (under lock)
+	GArray<SearchHit> Hits;
+	bool Cancelled;
+
+	bool StartWorkers(int Threads);
+
+public:
+	GFileScanner(GScanEngine *engine);
+	~GFileScanner();
+
+	/// Scan a file on disk
+	bool Start(const char *FileName, int Threads = 0);
+	/// Scan a memory buffer (copied)
+	bool Start(const uint8 *Data, int64 Len);
+
+	GScanEngine *GetEngine() { return Engine; }
+	bool IsRunning();
+	void Cancel();
+	void Wait();
+	/// Bytes processed so far and the total to process
+	int64 GetDone();
+	int64 GetTotal() { return Size; }
+	/// Throughput in bytes/sec
+	double GetRate();
+	/// True if hits were dropped because SCAN_MAX_HITS was reached
+	bool HasOverflowed() { return Overflow; }
+	/// Copy up to 'Max' hits from index 'From' onwards, returns the total
+	/// hit count. Hits arrive in no particular order until the scan has
+	/// finished, after which they are sorted by offset.
+	size_t GetHits(GArray<SearchHit> &Out, size_t From = 0, size_t Max = -1);
+};
+
+/// Finds any number of byte patterns in one pass using an Aho-Corasick
+/// automaton. The transition table is stored densely over equivalence
+/// classes of the input bytes, so the hot loop is one table lookup per byte.
+class GAhoCorasick : public GScanEngine
+{
+	struct Pattern
+	{
+		GString Name;
+		GArray<uint8> Bytes;
+	};
+
+	GArray<Pattern> Patterns;
+	bool MatchCase;
+
+	// Automaton
+	uint8 Class[256];			// Byte -> equivalence class
+	int Classes;
+	GArray<int32> Delta;		// States * Classes
+	GArray<int32> Output;		// State -> first pattern ending here, or -1
+	GArray<int32> DictLink;		// State -> nearest suffix state with output, or -1
+	GArray<int32> SameNext;		// Pattern -> next pattern with identical bytes, or -1
+	GArray<int32> Depth;		// State -> depth in the trie
+	bool Start[256];			// Bytes that leave the root state
+	int Span;
+
+	void Report(int State, int64 End, GArray<SearchHit> &Hits);
+
+public:
+	GAhoCorasick(bool matchCase = true);
+
+	/// Add a pattern, returns it's index or -1
+	int Add(const char *Name, const uint8 *Bytes, size_t Len);
+	/// Load a signature file:
+	///		# comment
+	///		Name: 4D 5A 90 00
+	///		Name: "text"
+	bool LoadSignatures(const char *FileName, GString *Err = NULL);
+	/// Build the automaton, call after adding all the patterns
+	bool Compile();
+	size_t Length() { return Patterns.Length(); }
+	const char *GetName(int Id) { return Id >= 0 && Id < (int)Patterns.Length() ? Patterns[Id].Name.Get() : NULL; }
+
+	int MaxSpan() { return Span; }
+	GScanContext *NewContext();
+	void Scan(GScanContext *Ctx, const uint8 *Data, size_t Len, int64 Pos, GArray<SearchHit> &Hits);
+	GString Describe(SearchHit &h);
+};
+
+enum SearchEncoding
+{
+	EncBytes,		// The text as typed (utf-8)
+	EncLatin1,
+	EncUtf16Le,
+	EncUtf16Be,
+	EncUtf32Le,
+	EncUtf32Be,
+	EncAny,			// All of the above at once
+};
+
+extern const char *SearchEncodingName(SearchEncoding Enc);
+/// Converts utf-8 text to the bytes it would be in 'Enc'. Fails if the text
+/// can't be represented, e.g. characters above 0xff in Latin-1.
+extern bool EncodeSearchText(GArray<uint8> &Out, const char *Utf8, SearchEncoding Enc);
+/// Creates a matcher that finds the text in every encoding it can be
+/// represented in, in one pass. Each pattern is named after it's encoding.
+extern GAhoCorasick *NewEncodingSearch(const char *Utf8, bool MatchCase);
+
+enum NumericType
+{
+	NumInt16,
+	NumInt32,
+	NumInt64,
+	NumFloat,
+	NumDouble,
+};
+
+/// Finds integer or floating point values within a range. Each block is
+/// tested 16 bytes at a time with SSE2 compares where available, one load
+/// per possible phase of the value within the vector.
+class GNumericSearch : public GScanEngine
+{
+	NumericType Type;
+	int Width;
+	int Align;
+	bool Signed;
+	bool Little;
+
+	// Range, inclusive. Unsigned ints store the uint64 bit pattern.
+	int64 IntMin, IntMax;
+	double FltMin, FltMax;
+
+	uint64 Read(const uint8 *p);
+	bool Match(uint64 v);
+	ssize_t ScanVector(const uint8 *Data, ssize_t From, size_t Len, int64 Pos, GArray<SearchHit> &Hits);
+
+public:
+	GNumericSearch(NumericType type, bool isSigned, bool little, int align = 1);
+
+	static const char *TypeName(NumericType t);
+	/// Sets the range to look for, 'To' can be empty for an exact match.
+	/// Fails if the range can't be represented by the type.
+	bool SetRange(const char *From, const char *To, GString *Err = NULL);
+	GString Format(uint64 v);
+
+	int MaxSpan() { return Width; }
+	void Scan(GScanContext *Ctx, const uint8 *Data, size_t Len, int64 Pos, GArray<SearchHit> &Hits);
+	GString Describe(SearchHit &h);
+};
+
+/// Finds matches within 'k' differences of a pattern of up to 64 bytes.
+/// Substitutions only (Hamming distance) uses the Wu-Manber extension of
+/// shift-and, one machine word per allowed error. With insertions and
+/// deletions (edit distance) Myers' bit-vector algorithm is used and the
+/// best end of each cluster of matches is reported, with it's start found
+/// by a small alignment over the bytes before it.
+class GApproxSearch : public GScanEngine
+{
+	GArray<uint8> Pattern;
+	uint64 Peq[256];	// Byte -> bit mask of pattern positions it matches
+	int K;
+	bool Indels;
+
+	int Align(const uint8 *End, int64 Avail, int &Len);
+	void Report(struct GApproxContext *c, const uint8 *End, int64 Avail, GArray<SearchHit> &Hits);
+
+public:
+	enum { MaxPattern = 64 };
+
+	GApproxSearch(const uint8 *Bytes, size_t Len, int k, bool indels, bool matchCase = true);
+
+	bool IsValid() { return Pattern.Length() > 0 && Pattern.Length() <= MaxPattern && K > 0 && K < (int)Pattern.Length(); }
+
+	int MaxSpan();
+	GScanContext *NewContext();
+	void Scan(GScanContext *Ctx, const uint8 *Data, size_t Len, int64 Pos, GArray<SearchHit> &Hits);
+	void End(GScanContext *Ctx, int64 End, GArray<SearchHit> &Hits);
+	GString Describe(SearchHit &h);
+};
+
+#define STRINGS_MAX_LEN				2048 // longer runs are cut to their first 'n' bytes
+
+enum StringsEncoding
+{
+	StrAscii,
+	StrUtf16,		// Little endian
+};
+
+/// Finds runs of printable ASCII, and optionally UTF-16 characters, like the
+/// unix 'strings' tool. Each worker keeps the text of it's strings in it's own
+/// pool, so once the scan has finished the list can be shown and filtered
+/// without going back to the file: a hit's 'Extra' is the pool and 'Value'
+/// the offset of the nul terminated text in it.
+class GStringsSearch : public GScanEngine, public GMutex
+{
+	friend struct GStringsContext;
+
+	int MinLen;		// In characters
+	bool Utf16;
+	GArray<GArray<char>*> Pools;
+
+public:
+	GStringsSearch(int minLen, bool utf16);
+	~GStringsSearch();
+
+	int GetMinLen() { return MinLen; }
+	bool IsUtf16() { return Utf16; }
+	/// The text of a hit, only valid once the scan has finished
+	const char *GetText(SearchHit &h);
+
+	int MaxSpan() { return STRINGS_MAX_LEN; }
+	GScanContext *NewContext();
+	void Scan(GScanContext *Ctx, const uint8 *Data, size_t Len, int64 Pos, GArray<SearchHit> &Hits);
+	void End(GScanContext *Ctx, int64 End, GArray<SearchHit> &Hits);
+	GString Describe(SearchHit &h);
+};
+
+struct BatchHit
+{
+	int File;		// Index into the batch's file list
+	SearchHit Hit;
+};
+
+/// Runs an engine over many files at once, for finding which files in a
+/// folder tree contain something. A fixed number of worker threads each take
+/// the next file off the list and stream it through the engine, so memory use
+/// doesn't depend on the number or size of the files.
+class GBatchSearch : public GMutex
+{
+	friend class GBatchWorker;
+
+	GScanEngine *Engine;
+	GArray<class GBatchWorker*> Workers;
+	GString::Array Files;
+	bool FirstOnly;
+	uint64 StartTs, EndTs;
+	bool Overflow;
+
+	// Shared with the workers (under lock)
+	GArray<BatchHit> Hits;
+	size_t NextFile;
+	size_t FilesDone;
+	int64 Bytes;
+	bool Cancelled;
+
+public:
+	/// If 'firstOnly' is set each file is only read up to it's first hit
+	GBatchSearch(GScanEngine *engine, bool firstOnly = false);
+	~GBatchSearch();
+
+	/// Adds a file, or all the files under a folder
+	bool AddPath(const char *Path);
+	size_t GetFiles() { return Files.Length(); }
+	const char *GetFile(int i) { return i >= 0 && i < (int)Files.Length() ? Files[i].Get() : NULL; }
+	GScanEngine *GetEngine() { return Engine; }
+
+	bool Start(int Threads = 0);
+	bool IsRunning();
+	void Cancel();
+	void Wait();
+	size_t GetFilesDone() { return FilesDone; }
+	/// Throughput in bytes/sec
+	double GetRate();
+	bool HasOverflowed() { return Overflow; }
+	/// Copy up to 'Max' hits from index 'From' onwards, in the order they
+	/// were found. Returns the total hit count.
+	size_t GetHits(GArray<BatchHit> &Out, size_t From = 0, size_t Max = -1);
+};
+
+/// Headless batch search, run from LgiMain when the "-grep" option is given:
+///		iHex -grep <pattern> -path <file or folder> [-hex] [-i] [-l] [-threads <n>]
+/// Hits are printed as "file:offset" lines as they are found. Returns the
+/// process exit code: 0 if anything was found, 1 if not and 2 on error.
+extern int BatchSearchCommandLine();
+
+/// Checks the approximate, signature, numeric and encoding search engines
+/// against known answers, for '-searchtest'. Returns the process exit
+/// code: 0 if they all pass.
+extern int SearchSelfTest();
+
+/// Non-modal window listing the results of a batch search as they arrive.
+/// Double clicking a hit opens the file at that offset.
+class GBatchResults : public GWindow
+{
+	class AppWnd *App;
+	class LList *Lst;
+	GAutoPtr<GScanEngine> Engine;
+	GAutoPtr<GBatchSearch> Batch;
+	GString Desc;
+	size_t Shown;
+
+	void Update();
+
+public:
+	GBatchResults(AppWnd *app, GScanEngine *engine, const char *desc, bool firstOnly);
+	~GBatchResults();
+
+	bool Start(const char *Path);
+
+	void OnPosChange();
+	void OnPulse();
+	int OnNotify(GViewI *c, int f);
+};
+
+/// Replaces every occurrence of one byte pattern with another in a single
+/// sequential pass over a file. Matches don't overlap, the search carries on
+/// after the end of each one.
+class GStreamReplace
+{
+	GArray<uint8> Find, Replace;
+	uint8 Fold[256];	// Byte -> byte compared, lower cased if not matching case
+	uint64 StartTs, EndTs;
+
+	ssize_t Next(const uint8 *Data, ssize_t From, ssize_t To);
+
+public:
+	int64 Count;		// Matches replaced so far
+	int64 Done;			// Bytes of input processed so far
+
+	GStreamReplace(const uint8 *find, size_t findLen, const uint8 *replace, size_t replaceLen, bool matchCase = true);
+
+	bool IsSameLength() { return Find.Length() == Replace.Length(); }
+	/// Patches 'File' where it is, only for patterns of the same length.
+	/// Each block is written back with one write covering all it's changes.
+	bool InPlace(GFile &File, class GProgressDlg *Prog = NULL);
+	/// Writes a copy of 'In' with the replacements made to 'Out'
+	bool Copy(GFile &In, GFile &Out, class GProgressDlg *Prog = NULL);
+	/// Throughput in bytes/sec
+	double GetRate();
+};
+
+/// The start of one suffix in a GSearchIndex, kept in memory
+struct GSearchIndexSample
+{
+	enum { MaxLen = 15 };
+	uint8 Len;				// Bytes kept, less than MaxLen if the suffix is shorter
+	uint8 Bytes[MaxLen];
+};
+
+/// An on disk index for exact searches of large files that don't change
+/// often. The file gets one 32-bit suffix array, or one per 256MB segment
+/// if it's bigger than that, so a search is a couple of binary searches
+/// per segment rather than a read of the whole file. The top levels of
+/// those searches are kept in memory, one sample of the first bytes of
+/// every 2048th suffix, so only the last few steps read the disk. The
+/// arrays are built in the background and kept in a sidecar file, next to
+/// the file if possible or in the app's folder if not. An index for an
+/// older version of the file (size, modification time or the bytes at
+/// either end differ) is never used.
+class GSearchIndex : public GThread
+{
+	GString File, IdxFile;
+	int64 Size, ModTime;
+	uint64 EdgeHash;
+	int32 Segment, Overlap, Sample;
+	GArray<GSearchIndexSample> Samples;
+	volatile int64 Done;
+	volatile bool Building;
+	volatile bool Cancelled;
+
+	static int64 SampleCount(int64 FileSize, int32 Seg, int32 Smp);
+	bool ReadHeader(const char *Path);
+	bool LoadSamples();
+	int Compare(GFile &Idx, GFile &Data, int64 Entry, int64 End, const uint8 *Pat, size_t Len, uint8 *Tmp, const uint32 *Cached = NULL);
+	int FindInSegment(GFile &Idx, GFile &Data, int64 Seg, const uint8 *Pat, size_t Len, int64 From, int64 &Hit);
+
+public:
+	GSearchIndex(const char *file);
+	~GSearchIndex();
+
+	const char *GetFile() { return File; }
+	/// True if a sidecar exists, even if it's out of date
+	bool Exists() { return IdxFile.Length() > 0; }
+	/// True if the sidecar matches the file as it is on disk now
+	bool IsValid();
+	bool IsBuilding() { return Building; }
+	/// Starts building the sidecar in the background. Each object only
+	/// builds once, create a new one to rebuild.
+	bool Update();
+	void Cancel() { Cancelled = true; }
+	int64 GetDone() { return Done; }
+	int64 GetTotal() { return Size; }
+	/// Finds the first match starting at or after 'From'. Returns 1 for a
+	/// hit, 0 if there are no more matches and -1 if the index can't answer
+	/// the query (out of date, or the pattern is too common to be worth it).
+	int Find(const uint8 *Pat, size_t Len, int64 From, int64 &Hit);
+
+	int Main();
+};
+
+/// Non-modal window that runs a scan in the background and lists the hits as
+/// they arrive. Double clicking a hit moves the hex view's selection to it.
+class GSearchResults : public GWindow
+{
+	class AppWnd *App;
+	class LList *Lst;
+	GAutoPtr<GScanEngine> Engine;
+	GAutoPtr<GFileScanner> Scanner;
+	GString Desc;
+	size_t Shown;
+	bool Finished;
+
+	void Update();
+
+public:
+	GSearchResults(AppWnd *app, GScanEngine *engine, const char *desc);
+	~GSearchResults();
+
+	/// Starts scanning the file or memory buffer
+	bool Start(const char *FileName, const uint8 *Mem = NULL, int64 MemLen = 0);
+
+	void OnPosChange();
+	void OnPulse();
+	int OnNotify(GViewI *c, int f);
+};
+
+/// Pane listing the strings in the file, found in the background. Only the
+/// rows on screen are drawn, so it copes with millions of strings, and the
+/// list can be cut down to the strings containing some text. Selecting a
+/// string moves the hex view's cursor to it.
+class GStringsView : public GLayout
+{
+	friend class GStringsList;
+
+	class AppWnd *App;
+	class GStringsList *Lst;
+	GAutoPtr<GStringsSearch> Engine;
+	GAutoPtr<GFileScanner> Scanner;
+	GArray<SearchHit> Hits;		// All the strings, by offset
+	GArray<uint32> Shown;		// Indexes of the strings that pass the filter
+	GString Status;
+	int Top;					// Height of the controls above the list
+
+	void Update();
+	void ApplyFilter();
+
+public:
+	GStringsView(AppWnd *app);
+	~GStringsView();
+
+	/// Finds the strings in a file or memory buffer, replacing any current list
+	bool Start(const char *FileName, const uint8 *Mem = NULL, int64 MemLen = 0);
+	void Empty();
+
+	size_t Length() { return Shown.Length(); }
+	SearchHit *GetHit(size_t Row) { return Row < Shown.Length() ? &Hits[Shown[Row]] : NULL; }
+	const char *GetText(SearchHit &h) { return Engine ? Engine->GetText(h) : NULL; }
+	void OnSelect(size_t Row, bool Focus);
+
+	void OnCreate();
+	void OnPosChange();
+	void OnPaint(GSurface *pDC);
+	void OnPulse();
+	int OnNotify(GViewI *c, int f);
+};
+
+#endif
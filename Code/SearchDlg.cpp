@@ -1,6 +1,8 @@
 #include "Lgi.h"
 #include "iHex.h"
 #include "resdefs.h"
+#include "Search.h"
+#include "GCombo.h"
 
 SearchDlg::SearchDlg(AppWnd *app)
 {
@@ -9,12 +11,23 @@ SearchDlg::SearchDlg(AppWnd *app)
 	MatchWord = false;
 	MatchCase = false;
 	SearchUp = false;
+	MaxDiff = 0;
+	AllowIndels = false;
+	Encoding = EncBytes;
 	Bin = 0;
 	Length = 0;
 
 	if (LoadFromResource(IDD_SEARCH))
 	{
 		SetCtrlValue(IDC_SEARCH_TXT, 1);
+
+		GCombo *Enc = dynamic_cast<GCombo*>(FindControl(IDC_ENCODING));
+		if (Enc)
+		{
+			for (int e=EncBytes; e<=EncAny; e++)
+				Enc->Insert(SearchEncodingName((SearchEncoding)e));
+			SetCtrlValue(IDC_ENCODING, Encoding);
+		}
 		MoveToCenter();
 	}
 }
@@ -35,6 +48,7 @@ int SearchDlg::OnNotify(GViewI *c, int f)
 	switch (c->GetId())
 	{
 		case IDC_TEXT:
+		case IDC_ENCODING:
 		{
 			SetCtrlValue(IDC_SEARCH_TXT, 1);
 			break;
@@ -50,47 +64,213 @@ int SearchDlg::OnNotify(GViewI *c, int f)
 			MatchWord = GetCtrlValue(IDC_MATCH_WORD);
 			MatchCase = GetCtrlValue(IDC_MATCH_CASE);
 			SearchUp = GetCtrlValue(IDC_SEARCH_UP);
+			MaxDiff = (int)MAX(0, GetCtrlValue(IDC_MAX_DIFF));
+			AllowIndels = GetCtrlValue(IDC_ALLOW_INDELS) != 0;
+
+			Encoding = ForHex ? EncBytes : (int)GetCtrlValue(IDC_ENCODING);
+			Text = GetCtrlName(IDC_TEXT);
+
+			GArray<uint8> Pattern;
+			bool Valid = ForHex ?
+				ParseSearchPattern(Pattern, GetCtrlName(IDC_HEX), true) :
+				EncodeSearchText(Pattern, Text, (SearchEncoding)Encoding);
+			if (!Valid && !ForHex && Text.Length())
+			{
+				LgiMsg(this, "The text can't be represented in %s.", AppName, MB_OK, SearchEncodingName((SearchEncoding)Encoding));
+				break;
+			}
+
+			DeleteArray(Bin);
+			Length = 0;
+			if (Valid)
+			{
+				Length = Pattern.Length();
+				Bin = new uchar[(size_t)Length];
+				memcpy(Bin, &Pattern[0], (size_t)Length);
+			}
+		}
+		case IDCANCEL:
+		{
+			EndModal(c->GetId());
+			break;
+		}
+	}
+
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+static int NumAlign[] = {1, 2, 4, 8};
+
+NumericSearchDlg::NumericSearchDlg(AppWnd *app, bool little, bool isSigned)
+{
+	SetParent(App = app);
+	Little = little;
+	Signed = isSigned;
+
+	if (LoadFromResource(IDD_NUMERIC_SEARCH))
+	{
+		GCombo *Type = dynamic_cast<GCombo*>(FindControl(IDC_NUM_TYPE));
+		if (Type)
+		{
+			for (int t=NumInt16; t<=NumDouble; t++)
+				Type->Insert(GNumericSearch::TypeName((NumericType)t));
+			SetCtrlValue(IDC_NUM_TYPE, NumInt32);
+		}
+
+		GCombo *Align = dynamic_cast<GCombo*>(FindControl(IDC_NUM_ALIGN));
+		if (Align)
+		{
+			Align->Insert("Any");
+			for (int i=1; i<(int)CountOf(NumAlign); i++)
+			{
+				char s[16];
+				sprintf_s(s, sizeof(s), "%i", NumAlign[i]);
+				Align->Insert(s);
+			}
+			SetCtrlValue(IDC_NUM_ALIGN, 0);
+		}
+
+		// The byte order and sign come from the information bar
+		char s[128];
+		sprintf_s(s, sizeof(s), "Using %s endian, %s integers.", Little ? "little" : "big", Signed ? "signed" : "unsigned");
+		SetCtrlName(IDC_NUM_INFO, s);
+
+		MoveToCenter();
+	}
+}
+
+int NumericSearchDlg::OnNotify(GViewI *c, int f)
+{
+	switch (c->GetId())
+	{
+		case IDOK:
+		{
+			NumericType Type = (NumericType)GetCtrlValue(IDC_NUM_TYPE);
+			int Align = NumAlign[MAX(0, MIN((int)GetCtrlValue(IDC_NUM_ALIGN), (int)CountOf(NumAlign) - 1))];
+			char *From = GetCtrlName(IDC_NUM_FROM);
+			char *To = GetCtrlName(IDC_NUM_TO);
+
+			GString Err;
+			Engine.Reset(new GNumericSearch(Type, Signed, Little, Align));
+			if (!Engine->SetRange(From, To, &Err))
+			{
+				LgiMsg(this, "%s", AppName, MB_OK, Err.Get());
+				Engine.Reset();
+				break;
+			}
+
+			if (ValidStr(To))
+				Desc.Printf("%s %s to %s", GNumericSearch::TypeName(Type), From, To);
+			else
+				Desc.Printf("%s %s", GNumericSearch::TypeName(Type), From);
+			// Fall through
+		}
+		case IDCANCEL:
+		{
+			EndModal(c->GetId());
+			break;
+		}
+	}
+
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+ReplaceDlg::ReplaceDlg(AppWnd *app)
+{
+	SetParent(App = app);
+	MatchCase = true;
+
+	if (LoadFromResource(IDD_REPLACE))
+	{
+		SetCtrlValue(IDC_MATCH_CASE, MatchCase);
+		MoveToCenter();
+	}
+}
+
+int ReplaceDlg::OnNotify(GViewI *c, int f)
+{
+	switch (c->GetId())
+	{
+		case IDOK:
+		{
+			bool IsHex = GetCtrlValue(IDC_REPLACE_HEX) != 0;
+			MatchCase = IsHex || GetCtrlValue(IDC_MATCH_CASE) != 0;
+			if (!ParseSearchPattern(Find, GetCtrlName(IDC_REPLACE_FIND), IsHex))
+			{
+				LgiMsg(this, "Enter something to find.", AppName);
+				break;
+			}
+
+			// An empty replacement deletes the matches
+			ParseSearchPattern(Replace, GetCtrlName(IDC_REPLACE_WITH), IsHex);
+			// Fall through
+		}
+		case IDCANCEL:
+		{
+			EndModal(c->GetId());
+			break;
+		}
+	}
+
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+BatchSearchDlg::BatchSearchDlg(AppWnd *app)
+{
+	SetParent(App = app);
+	FirstOnly = false;
 
-			char *Str = GetCtrlName(ForHex ? IDC_HEX : IDC_TEXT);
-			if (Str)
+	if (LoadFromResource(IDD_BATCH_SEARCH))
+	{
+		SetCtrlValue(IDC_MATCH_CASE, true);
+		MoveToCenter();
+	}
+}
+
+int BatchSearchDlg::OnNotify(GViewI *c, int f)
+{
+	switch (c->GetId())
+	{
+		case IDC_BATCH_BROWSE:
+		{
+			GFileSelect s;
+			s.Parent(this);
+			if (s.OpenFolder())
+				SetCtrlName(IDC_BATCH_PATH, s.Name());
+			break;
+		}
+		case IDOK:
+		{
+			Path = GString(GetCtrlName(IDC_BATCH_PATH)).Strip();
+			if (!Path.Length())
 			{
-				if (ForHex)
-				{
-					GStringPipe p;
-					char h[3] = {0, 0, 0};
-					int i = 0;
-
-					for (char *s=Str; *s; s++)
-					{
-						if
-						(
-							(*s >= '0' && *s <= '9')
-							||
-							(*s >= 'a' && *s <= 'f')
-							||
-							(*s >= 'A' && *s <= 'F')
-						)
-						{
-							h[i++] = *s;
-						}
-
-						if (i == 2)
-						{
-							char c = htoi(h);
-							i = 0;
-							p.Push(&c, 1);
-						}
-					}
-
-					Length = p.GetSize();
-					Bin = (uchar*)p.NewStr();
-				}
-				else
-				{
-					Length = strlen(Str);
-					Bin = (uchar*)NewStr(Str);
-				}
+				LgiMsg(this, "Choose a file or folder to search.", AppName);
+				break;
 			}
+
+			bool IsHex = GetCtrlValue(IDC_BATCH_HEX) != 0;
+			char *Find = GetCtrlName(IDC_BATCH_FIND);
+			GArray<uint8> Pattern;
+			if (!ParseSearchPattern(Pattern, Find, IsHex))
+			{
+				LgiMsg(this, "Enter something to find.", AppName);
+				break;
+			}
+
+			Engine.Reset(new GAhoCorasick(IsHex || GetCtrlValue(IDC_MATCH_CASE)));
+			if (Engine->Add(Find, &Pattern[0], Pattern.Length()) < 0 ||
+				!Engine->Compile())
+			{
+				Engine.Reset();
+				break;
+			}
+
+			FirstOnly = GetCtrlValue(IDC_BATCH_FIRST) != 0;
+			Desc.Printf("Files containing '%s'", Find);
+			// Fall through
 		}
 		case IDCANCEL:
 		{
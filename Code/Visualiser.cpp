@@ -3,6 +3,7 @@
 #include "iHex.h"
 #include "LList.h"
 #include "GLexCpp.h"
+#include "GTextView3.h"
 #include "resdefs.h"
 #ifndef INT32_MAX
 #define INT32_MAX 0x7fffffff
@@ -14,7 +15,15 @@
 
 // #define MAX_ARRAY				1000
 // #define MAX_EXECUTION_TIME		1000 // ms
-#define MAX_OUTPUT_SIZE			(256 << 10) // 256 kb
+#define MAX_DECODE_NODES		50000
+
+// Arrays show this many elements at a time
+#define ARRAY_PAGE				256
+
+// Parsing the whole file reads it a window at a time
+#define PARSE_WINDOW			(4 << 20)
+#define PARSE_MAX_WINDOW		(64 << 20)	// Records bigger than this are cut short
+#define PARSE_KEEP				(64 << 10)	// Bytes kept of members that leave the window
 
 enum BaseType
 {
@@ -200,13 +209,263 @@ struct BitReference
 	}
 };
 
+/// One line of a decode: a member, an array element, a condition or an error.
+/// Offsets are relative to the start of the decoded data.
+struct DecodeNode
+{
+	enum NodeType
+	{
+		NodeValue,
+		NodeStruct,
+		NodeArray,
+		NodeComment,
+		NodeError,
+	};
+
+	NodeType Type;
+	GString Name;
+	GString Value;			// The formatted value, or the type of a struct
+	int64 Offset;
+	int64 Len;				// -1 until worked out from the children
+	DecodeNode *Parent;
+	GArray<DecodeNode*> Children;
+	void *Item;				// The view's item for this node, if it has one
+
+	// Arrays make their elements when first expanded, the elements are
+	// either a basic type or a struct:
+	Basic Elem;
+	class StructDef *Struct;
+	int ElemSize;			// Bytes per element, or 0 when 'Offsets' is used
+	GArray<int64> *Offsets;	// Of each element then the end, owned by the tree
+	struct DecodeScope *Scope; // That the 'Offsets' array was in, owned by the tree
+	ssize_t First;			// Index of the first element
+	ssize_t Lazy;			// Elements not made into nodes yet
+	bool Little;
+
+	DecodeNode(NodeType type = NodeValue, DecodeNode *parent = NULL)
+	{
+		Type = type;
+		Offset = 0;
+		Len = Type == NodeStruct || Type == NodeArray ? -1 : 0;
+		Parent = parent;
+		Item = NULL;
+		Struct = NULL;
+		ElemSize = 0;
+		Offsets = NULL;
+		Scope = NULL;
+		First = 0;
+		Lazy = 0;
+		Little = true;
+	}
+
+	~DecodeNode()
+	{
+		Children.DeleteObjects();
+	}
+
+	DecodeNode *Add(NodeType type, const char *name, int64 offset)
+	{
+		DecodeNode *n = new DecodeNode(type, this);
+		n->Name = name;
+		n->Offset = offset;
+		Children.Add(n);
+		return n;
+	}
+
+	bool HasChildren()
+	{
+		return Children.Length() > 0 || Lazy > 0;
+	}
+
+	/// \returns the offset of element 'Index' of an array
+	int64 ElemOffset(ssize_t Index)
+	{
+		if (Offsets)
+			return (*Offsets)[Index];
+		return Offset + (Index - First) * ElemSize;
+	}
+
+	/// Sets 'Value' to a summary of the size of the node
+	void SetSizeValue()
+	{
+		char s[64];
+		LgiFormatSize(s, sizeof(s), Len);
+		Value = s;
+	}
+
+	/// Sets the length of any container that doesn't know it yet to cover
+	/// its children.
+	void Finish()
+	{
+		int64 End = Offset;
+		for (unsigned i=0; i<Children.Length(); i++)
+		{
+			DecodeNode *c = Children[i];
+			c->Finish();
+			End = MAX(End, c->Offset + c->Len);
+		}
+		if (Len < 0)
+			Len = End - Offset;
+	}
+
+	GString GetText()
+	{
+		GString s;
+		switch (Type)
+		{
+			case NodeStruct:
+			case NodeArray:
+			{
+				if (Value)
+					s.Printf("%s (%s @ %i/0x%x)", Name.Get(), Value.Get(), (int)Offset, (int)Offset);
+				else
+					s.Printf("%s (@ %i/0x%x)", Name.Get(), (int)Offset, (int)Offset);
+				break;
+			}
+			case NodeComment:
+			{
+				s.Printf("// %s", Name.Get());
+				break;
+			}
+			case NodeError:
+			{
+				s = Name;
+				break;
+			}
+			default:
+			{
+				s.Printf("%s = %s", Name.Get(), Value.Get());
+				break;
+			}
+		}
+		return s;
+	}
+};
+
+/// The result of decoding some data with a structure map.
+struct DecodeTree
+{
+	GArray<uint8> Data;			// A copy of the decoded bytes, for expanding later
+	int64 Start;				// Where 'Data' is in the file
+	GVisualiseSource *Src;		// Reads the file past 'Data', can be NULL
+	uint64 Generation;			// Of the file data
+	class StructureMap *Map;	// That made the tree, NULL once deleted
+	uint32 MapGeneration;
+	DecodeNode Root;
+	GArray<GArray<int64>*> OffsetTables;
+	GArray<DecodeScope*> Scopes;
+
+	DecodeTree() : Root(DecodeNode::NodeStruct)
+	{
+		Start = 0;
+		Src = NULL;
+		Generation = 0;
+		Map = NULL;
+		MapGeneration = 0;
+	}
+
+	~DecodeTree();
+
+	/// Copies the bytes at 'Offset' (relative to 'Data') to 'Out'
+	bool Read(int64 Offset, uint8 *Out, int Len)
+	{
+		if (Offset >= 0 && Offset + Len <= (int64)Data.Length())
+		{
+			memcpy(Out, Data.AddressOf(Offset), Len);
+			return true;
+		}
+
+		return	Src &&
+				Src->GetDataGeneration() == Generation &&
+				Src->ReadAt(Start + Offset, Out, Len);
+	}
+
+	/// Makes the element nodes of a lazy array. Big arrays get the first
+	/// page of elements and then nodes for ranges of the rest.
+	void Expand(DecodeNode *n);
+	void MakeElements(DecodeNode *n, ssize_t From, ssize_t Count);
+
+	/// \returns the innermost node covering 'Offset', expanding lazy
+	/// arrays as needed.
+	DecodeNode *Find(int64 Offset)
+	{
+		DecodeNode *Best = NULL;
+		for (DecodeNode *n = &Root; n; )
+		{
+			if (n->Lazy > 0)
+				Expand(n);
+
+			DecodeNode *In = NULL;
+			for (unsigned i=0; i<n->Children.Length() && !In; i++)
+			{
+				DecodeNode *c = n->Children[i];
+				if (Offset >= c->Offset && Offset < c->Offset + c->Len)
+					In = c;
+			}
+			if (In)
+				Best = In;
+			n = In;
+		}
+		return Best;
+	}
+};
+
 struct ViewContext : public BitReference
 {
-	GStream &Out;
+	DecodeTree &Tree;
+	DecodeNode *Parent;		// Where new nodes are added, NULL to not keep them
+	DecodeNode Scratch;		// Stands in for nodes that aren't kept
+	int Nodes;
 	uint8 *Base, *End;
+	GString LastError;
+	bool Truncated;			// A length was clamped or a read ran out of data
+	bool *Cancelled;		// Set by another thread to stop the decode, or NULL
 	
-	ViewContext(GStream &o) : Out(o)
+	ViewContext(DecodeTree &t) : Tree(t)
+	{
+		Parent = &Tree.Root;
+		Nodes = 0;
+		Truncated = false;
+		Cancelled = NULL;
+	}
+
+	bool IsCancelled()
+	{
+		return Cancelled && *Cancelled;
+	}
+
+	/// True if nodes aren't being kept, so values needn't be formatted
+	bool Muted()
+	{
+		return !Parent || Parent == &Scratch;
+	}
+
+	/// Adds a node for the current position to 'Parent'
+	DecodeNode *Add(DecodeNode::NodeType Type, const char *Fmt, ...)
+	{
+		if (Muted())
+			return &Scratch;
+
+		char Name[512];
+		va_list Arg;
+		va_start(Arg, Fmt);
+		vsnprintf(Name, sizeof(Name), Fmt, Arg);
+		va_end(Arg);
+
+		Nodes++;
+		return Parent->Add(Type, Name, Offset());
+	}
+
+	void Error(const char *Fmt, ...)
 	{
+		char Msg[512];
+		va_list Arg;
+		va_start(Arg, Fmt);
+		vsnprintf(Msg, sizeof(Msg), Fmt, Arg);
+		va_end(Arg);
+
+		LastError = Msg;
+		Add(DecodeNode::NodeError, "%s", Msg);
 	}
 	
 	uint32 Offset()
@@ -340,23 +599,398 @@ uint64 IfSwap(uint64 i, bool Little)
 	return i;
 }
 
+#define MAX_EXPRESSION_STACK	32
+
+/// An expression from a structure map, compiled once into a postfix program.
+///
+/// Integer arithmetic over constants and variables is run directly against
+/// the GDom context. Anything the compiler doesn't understand (strings,
+/// floats, function calls etc) falls back to the script engine using the
+/// original source text.
+class MapExpression
+{
+	enum OpCode
+	{
+		OpConst,
+		OpVar,
+		OpNeg,
+		OpNot,
+		OpBitNot,
+		OpMul,
+		OpDiv,
+		OpMod,
+		OpAdd,
+		OpSub,
+		OpShl,
+		OpShr,
+		OpLt,
+		OpLe,
+		OpGt,
+		OpGe,
+		OpEq,
+		OpNe,
+		OpBitAnd,
+		OpBitXor,
+		OpBitOr,
+		OpAnd,
+		OpOr,
+	};
+
+	struct Instruction
+	{
+		OpCode Op;
+		int64 Val; // OpConst: the value, OpVar: index into 'Vars'
+	};
+
+	struct BinaryOp
+	{
+		const char *Tok;
+		OpCode Op;
+		int Prec;
+	};
+
+	GString Source;
+	bool Native;
+	GArray<Instruction> Code;
+	GArray<GString::Array*> Vars;
+
+	// Compile state
+	const char *Cur;
+	int Depth, MaxDepth;
+
+	void Emit(OpCode Op, int64 Val = 0)
+	{
+		Instruction &i = Code.New();
+		i.Op = Op;
+		i.Val = Val;
+
+		if (Op == OpConst || Op == OpVar)
+			Depth++;
+		else if (Op > OpBitNot)
+			Depth--;
+		MaxDepth = MAX(MaxDepth, Depth);
+	}
+
+	void SkipWs()
+	{
+		while (*Cur && strchr(WhiteSpace, *Cur))
+			Cur++;
+	}
+
+	const BinaryOp *PeekBinary()
+	{
+		// Two character operators first so that '<<' isn't read as '<'
+		static const BinaryOp Ops[] =
+		{
+			{"||", OpOr, 1},
+			{"&&", OpAnd, 2},
+			{"==", OpEq, 6},
+			{"!=", OpNe, 6},
+			{"<=", OpLe, 7},
+			{">=", OpGe, 7},
+			{"<<", OpShl, 8},
+			{">>", OpShr, 8},
+			{"|", OpBitOr, 3},
+			{"^", OpBitXor, 4},
+			{"&", OpBitAnd, 5},
+			{"<", OpLt, 7},
+			{">", OpGt, 7},
+			{"+", OpAdd, 9},
+			{"-", OpSub, 9},
+			{"*", OpMul, 10},
+			{"/", OpDiv, 10},
+			{"%", OpMod, 10},
+			{NULL, OpConst, 0}
+		};
+
+		SkipWs();
+		for (const BinaryOp *b = Ops; b->Tok; b++)
+		{
+			size_t Len = strlen(b->Tok);
+			if (!strncmp(Cur, b->Tok, Len))
+				return b;
+		}
+
+		return NULL;
+	}
+
+	bool ParseUnary()
+	{
+		SkipWs();
+		char c = *Cur;
+		if (c == '(')
+		{
+			Cur++;
+			if (!ParseBinary(1))
+				return false;
+			SkipWs();
+			if (*Cur != ')')
+				return false;
+			Cur++;
+		}
+		else if (c == '-' || c == '!' || c == '~' || c == '+')
+		{
+			Cur++;
+			if (!ParseUnary())
+				return false;
+			if (c == '-')
+				Emit(OpNeg);
+			else if (c == '!')
+				Emit(OpNot);
+			else if (c == '~')
+				Emit(OpBitNot);
+		}
+		else if (IsDigit(c))
+		{
+			char *End = NULL;
+			int64 Val = (int64) strtoull(Cur, &End, 0);
+			if (!End || End == Cur || IsAlpha(*End) || *End == '.' || *End == '_')
+				return false; // Floats and suffixed literals go to the script engine
+			Cur = End;
+			Emit(OpConst, Val);
+		}
+		else if (IsAlpha(c) || c == '_')
+		{
+			// Variable, possibly a path through nested structures: 'a.b.c'
+			GString::Array *Path = new GString::Array;
+			Vars.Add(Path);
+			while (true)
+			{
+				const char *Start = Cur;
+				while (IsAlpha(*Cur) || IsDigit(*Cur) || *Cur == '_')
+					Cur++;
+				if (Cur == Start)
+					return false;
+				Path->New() = GString(Start, Cur - Start);
+				if (*Cur != '.')
+					break;
+				Cur++;
+			}
+
+			SkipWs();
+			if (*Cur == '(' || *Cur == '[')
+				return false; // Function calls and arrays go to the script engine
+
+			Emit(OpVar, Vars.Length() - 1);
+		}
+		else return false;
+
+		return true;
+	}
+
+	bool ParseBinary(int MinPrec)
+	{
+		if (!ParseUnary())
+			return false;
+
+		const BinaryOp *b;
+		while ((b = PeekBinary()) && b->Prec >= MinPrec)
+		{
+			Cur += strlen(b->Tok);
+			if (!ParseBinary(b->Prec + 1))
+				return false;
+			Emit(b->Op);
+		}
+
+		return true;
+	}
+
+	void Compile()
+	{
+		Cur = Source;
+		Depth = MaxDepth = 0;
+		Native = Cur && ParseBinary(1);
+		if (Native)
+		{
+			SkipWs();
+			Native = *Cur == 0 && MaxDepth <= MAX_EXPRESSION_STACK;
+		}
+		if (!Native)
+		{
+			Code.Length(0);
+			Vars.DeleteObjects();
+		}
+	}
+
+	/// Looks up a variable, returns false if the value isn't an integer.
+	bool Resolve(GString::Array &Path, GDom *Ctx, int64 &Out)
+	{
+		GVariant v;
+		for (unsigned i=0; i<Path.Length(); i++)
+		{
+			if (i)
+			{
+				if (v.Type != GV_DOM || !v.Value.Dom)
+					return false;
+				Ctx = v.Value.Dom;
+			}
+
+			GVariant Member;
+			if (!Ctx->GetVariant(Path[i], Member))
+				return false;
+			v = Member;
+		}
+
+		switch (v.Type)
+		{
+			case GV_INT32:
+			case GV_INT64:
+			case GV_BOOL:
+				Out = v.CastInt64();
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	bool Run(GDom *Ctx, int64 &Result)
+	{
+		int64 Stack[MAX_EXPRESSION_STACK];
+		int Sp = 0;
+
+		Instruction *i = Code.AddressOf(), *End = i + Code.Length();
+		for (; i < End; i++)
+		{
+			switch (i->Op)
+			{
+				case OpConst:
+					Stack[Sp++] = i->Val;
+					continue;
+				case OpVar:
+					if (!Resolve(*Vars[(size_t)i->Val], Ctx, Stack[Sp]))
+						return false;
+					Sp++;
+					continue;
+				case OpNeg:
+					Stack[Sp-1] = -Stack[Sp-1];
+					continue;
+				case OpNot:
+					Stack[Sp-1] = !Stack[Sp-1];
+					continue;
+				case OpBitNot:
+					Stack[Sp-1] = ~Stack[Sp-1];
+					continue;
+				default:
+					break;
+			}
+
+			int64 b = Stack[--Sp];
+			int64 &a = Stack[Sp-1];
+			switch (i->Op)
+			{
+				case OpMul:		a *= b; break;
+				case OpDiv:		if (!b) return false; a /= b; break;
+				case OpMod:		if (!b) return false; a %= b; break;
+				case OpAdd:		a += b; break;
+				case OpSub:		a -= b; break;
+				case OpShl:		a <<= b; break;
+				case OpShr:		a >>= b; break;
+				case OpLt:		a = a < b; break;
+				case OpLe:		a = a <= b; break;
+				case OpGt:		a = a > b; break;
+				case OpGe:		a = a >= b; break;
+				case OpEq:		a = a == b; break;
+				case OpNe:		a = a != b; break;
+				case OpBitAnd:	a &= b; break;
+				case OpBitXor:	a ^= b; break;
+				case OpBitOr:	a |= b; break;
+				case OpAnd:		a = a && b; break;
+				case OpOr:		a = a || b; break;
+				default:		LgiAssert(!"Unknown op."); return false;
+			}
+		}
+
+		if (Sp != 1)
+			return false;
+
+		Result = Stack[0];
+		return true;
+	}
+
+public:
+	MapExpression(const char *src)
+	{
+		Source = src;
+		Compile();
+	}
+
+	MapExpression(GArray<char16*> &Tokens)
+	{
+		GStringPipe p;
+		for (unsigned n=0; n<Tokens.Length(); n++)
+			p.Print(" %S", Tokens[n]);
+		Source = p.NewGStr();
+		Compile();
+	}
+
+	~MapExpression()
+	{
+		Vars.DeleteObjects();
+	}
+
+	const char *GetSource()
+	{
+		return Source;
+	}
+
+	bool IsEmpty()
+	{
+		return !ValidStr(Source.Get());
+	}
+
+	/// True if the expression doesn't use any variables, 'Value' is set to
+	/// the result.
+	bool IsConstant(int64 &Value)
+	{
+		return Native && Vars.Length() == 0 && Run(NULL, Value);
+	}
+
+	/// Evaluates the expression with variables resolved by 'Ctx'
+	bool Evaluate(GVariant &Result, GDom *Ctx, AppWnd *App = NULL)
+	{
+		if (Native)
+		{
+			int64 i;
+			if (Run(Ctx, i))
+			{
+				Result = i;
+				return true;
+			}
+		}
+
+		// Not an integer expression, fall back to the script engine
+		GScriptEngine e(App, App, NULL);
+		return e.EvaluateExpression(&Result, Ctx, Source);
+	}
+};
+
 struct ArrayDimension
 {
 	GArray<char16*> Expression;
+	MapExpression *Exp; // Compiled version of 'Expression'
 	
+	ArrayDimension()
+	{
+		Exp = NULL;
+	}
+
 	~ArrayDimension()
 	{
 		Expression.DeleteArrays();
+		DeleteObj(Exp);
 	}
 	
 	ArrayDimension &operator =(const ArrayDimension &a)
 	{
 		Expression.DeleteArrays();
-		for (unsigned i=0; i<Expression.Length(); i++)
+		DeleteObj(Exp);
+		for (unsigned i=0; i<a.Expression.Length(); i++)
 		{
 			char16 *s = a.Expression.ItemAt(i);
 			Expression.Add(NewStrW(s));
 		}
+		if (a.Exp)
+			Exp = new MapExpression(Expression);
 		return *this;
 	}
 };
@@ -402,47 +1036,221 @@ uint64 DeNibble(uint8 *ptr, int size)
 	return n;
 }
 
-struct ConditionDef;
-struct VarDef;
-struct Member
-{
-	enum MemberType
-	{
-		MemberNone,
-		MemberCondition,
-		MemberVar
-	}	Type;
-	
-	Member(MemberType t) : Type(t)
-	{
-	}
-	
-	virtual ~Member()
-	{
-	}
-	
-	virtual void Sizeof(BitReference &sz) = 0;
-	virtual VarDef *IsVar() = 0;
-	virtual ConditionDef *IsCondition() = 0;
-};
-
-struct ConditionDef : public Member
+/// Formats the integer, float or nibble value at 'r'
+bool FormatBasic(GString &s, Basic &b, BitReference r, bool Little)
 {
-	bool Little;
-	int Eval;
-	GArray<char16*> Expression;
-	GArray<Member*> Members;
-	AddressRef Addr;
-	
-	ConditionDef() : Member(MemberCondition)
+	switch (b.Type)
 	{
-		Little = true;
-		Eval = -1;
+		case TypeInteger:
+		{
+			switch (b.Bytes)
+			{
+				case 1:
+				{
+					uint8 Byte;
+					if (!r.ReadBits(Byte, b.Bits))
+						return false;
+					if (b.Signed)
+						s.Printf("%i (0x%02.2x)", (int8)Byte, Byte);
+					else
+						s.Printf("%u (0x%02.2x)", Byte, Byte);
+					break;
+				}
+				case 2:
+				{
+					uint16 Short;
+					if (!r.ReadBits(Short, b.Bits))
+						return false;
+					if (b.Signed)
+					{
+						int16 n = IfSwap(((int16)Short), Little);
+						s.Printf("%i (0x%04.4x)", n, (uint16)n);
+					}
+					else
+					{
+						uint16 n = IfSwap(Short, Little);
+						s.Printf("%u (0x%04.4x)", n, n);
+					}
+					break;
+				}
+				case 4:
+				{
+					uint32 Int;
+					if (!r.ReadBits(Int, b.Bits))
+						return false;
+					if (b.Signed)
+					{
+						int32 n = IfSwap((int32)Int, Little);
+						s.Printf("%i (0x%08.8x)", n, n);
+					}
+					else
+					{
+						uint32 n = IfSwap(Int, Little);
+						s.Printf("%u (0x%08.8x)", n, n);
+					}
+					break;
+				}
+				case 8:
+				{
+					uint64 Long;
+					if (!r.ReadBits(Long, b.Bits))
+						return false;
+					if (b.Signed)
+					{
+						int64 n = IfSwap((int64)Long, Little);
+						s.Printf(LPrintfInt64 " (0x%16.16llx)", n, (unsigned long long)n);
+					}
+					else
+					{
+						uint64 n = IfSwap(Long, Little);
+						s.Printf("%llu (0x%16.16llx)", (unsigned long long)n, (unsigned long long)n);
+					}
+					break;
+				}
+				default:
+					return false;
+			}
+			break;
+		}
+		case TypeFloat:
+		{
+			#define Swap(a, b) { uint8 t = a; a = b; b = t; }
+			if (b.Bytes == 4)
+			{
+				LgiAssert(sizeof(float) == 4);
+				float flt = *((float*)r.Aligned());
+				if (!Little)
+				{
+					uint8 *c = (uint8*)&flt;
+					Swap(c[0], c[3]);
+					Swap(c[1], c[2]);
+				}
+				s.Printf("%g", (double)flt);
+			}
+			else if (b.Bytes == 8)
+			{
+				LgiAssert(sizeof(double) == 8);
+				double dbl = *((double*)r.Aligned());
+				if (!Little)
+				{
+					uint8 *c = (uint8*)&dbl;
+					Swap(c[0], c[7]);
+					Swap(c[1], c[6]);
+					Swap(c[2], c[5]);
+					Swap(c[3], c[4]);
+				}
+				s.Printf("%g", dbl);
+			}
+			else return false;
+			break;
+		}
+		case TypeNibble:
+		{
+			uint64 v = DeNibble(r.Aligned(), b.Bytes);
+			switch (b.Bytes)
+			{
+				case 2:
+					s.Printf("%u (0x%02.2x)", (uint8)v, (uint8)v);
+					break;
+				case 4:
+				{
+					uint16 n = IfSwap((uint16)v, Little);
+					s.Printf("%u (0x%04.4x)", n, n);
+					break;
+				}
+				case 8:
+				{
+					uint32 n = IfSwap((uint32)v, Little);
+					s.Printf("%u (0x%08.8x)", n, n);
+					break;
+				}
+				case 16:
+				{
+					uint64 n = IfSwap(v, Little);
+					s.Printf("%llu (0x%016.16llx)", (unsigned long long)n, (unsigned long long)n);
+					break;
+				}
+				default:
+					return false;
+			}
+			break;
+		}
+		default:
+			return false;
+	}
+
+	return true;
+}
+
+struct ConditionDef;
+struct VarDef;
+struct Member
+{
+	enum MemberType
+	{
+		MemberNone,
+		MemberCondition,
+		MemberVar
+	}	Type;
+	
+	Member(MemberType t) : Type(t)
+	{
+	}
+	
+	virtual ~Member()
+	{
+	}
+	
+	virtual void Sizeof(BitReference &sz) = 0;
+	virtual VarDef *IsVar() = 0;
+	virtual ConditionDef *IsCondition() = 0;
+};
+
+/// Maps member names to the slots that declare them in one scope, so that
+/// resolving a variable doesn't have to walk and compare every member.
+/// Names declared inside a condition map to the condition's slot.
+class MemberIndex
+{
+	LHashTbl<StrKey<char>, GArray<int>*> Map;
+
+	void Add(Member *m, int Slot);
+
+public:
+	~MemberIndex()
+	{
+		Map.DeleteObjects();
+	}
+
+	void Build(GArray<Member*> &Members);
+
+	/// \returns the slots declaring 'Name' in ascending order, or NULL
+	GArray<int> *Find(const char *Name)
+	{
+		return Name ? Map.Find(Name) : NULL;
+	}
+};
+
+struct ConditionDef : public Member
+{
+	bool Little;
+	int Eval;
+	GArray<char16*> Expression;
+	MapExpression *Exp; // Compiled version of 'Expression'
+	GArray<Member*> Members;
+	MemberIndex Index;
+	AddressRef Addr;
+	
+	ConditionDef() : Member(MemberCondition)
+	{
+		Little = true;
+		Eval = -1;
+		Exp = NULL;
 	}
 	
 	~ConditionDef()
 	{
 		Expression.DeleteArrays();
+		DeleteObj(Exp);
 	}
 
 	VarDef *IsVar() { return NULL; }
@@ -787,6 +1595,35 @@ struct VarDef : public Member
 	}
 };
 
+void MemberIndex::Add(Member *m, int Slot)
+{
+	VarDef *v = m->IsVar();
+	ConditionDef *c = NULL;
+	if (v)
+	{
+		if (!v->Name)
+			return;
+
+		GArray<int> *Slots = Map.Find(v->Name);
+		if (!Slots)
+			Map.Add(v->Name, Slots = new GArray<int>);
+		if (!Slots->Length() || Slots->Last() != Slot)
+			Slots->Add(Slot);
+	}
+	else if ((c = m->IsCondition()))
+	{
+		for (unsigned i=0; i<c->Members.Length(); i++)
+			Add(c->Members[i], Slot);
+	}
+}
+
+void MemberIndex::Build(GArray<Member*> &Members)
+{
+	Map.DeleteObjects();
+	for (unsigned i=0; i<Members.Length(); i++)
+		Add(Members[i], i);
+}
+
 bool ConditionDef::GetVariant(const char *Name, GVariant &Value, char *Array)
 {
 	if (Eval <= 0)
@@ -794,19 +1631,23 @@ bool ConditionDef::GetVariant(const char *Name, GVariant &Value, char *Array)
 		return false;
 	}
 	
+	GArray<int> *Slots = Index.Find(Name);
+	if (!Slots)
+		return false;
+
 	int Len = MIN(Members.Length(), Addr.Length());
 	ConditionDef *c = NULL;
-	for (int i=0; i<Len; i++)
+	for (int *i = NULL; Slots->Iterate(i); )
 	{
-		Member *m = Members[i];
+		if (*i >= Len)
+			break;
+
+		Member *m = Members[*i];
 		VarDef *v = m->IsVar();
 		if (v)
 		{
-			if (v->Name && strcmp(v->Name, Name) == 0)
-			{
-				Value = v->CastInt(Addr[i], Little);
-				return true;
-			}
+			Value = v->CastInt(Addr[*i], Little);
+			return true;
 		}
 		else if ((c = m->IsCondition()))
 		{
@@ -818,6 +1659,41 @@ bool ConditionDef::GetVariant(const char *Name, GVariant &Value, char *Array)
 	return false;
 }
 
+/// A copy of the scopes a lazy struct array was decoded in, so that its
+/// elements can still refer to the members before the array when they're
+/// decoded later. The addresses point into the tree's 'Data'.
+struct DecodeScope
+{
+	struct Saved
+	{
+		int Pos;
+		GArray<Member*> *Members;
+		MemberIndex *Index;
+		AddressRef Addr;
+	};
+
+	struct Cond
+	{
+		ConditionDef *Def;
+		int Eval;
+		AddressRef Addr;
+	};
+
+	GArray<Saved*> Scopes;		// Outermost first
+	GArray<Cond*> Conds;		// The state of the conditions in them
+
+	~DecodeScope()
+	{
+		Scopes.DeleteObjects();
+		Conds.DeleteObjects();
+	}
+};
+
+DecodeTree::~DecodeTree()
+{
+	OffsetTables.DeleteObjects();
+	Scopes.DeleteObjects();
+}
 
 class StructDef : public GDom
 {
@@ -828,7 +1704,9 @@ public:
 	GString Name;
 	GString Base;
 	GString Address;
+	GAutoPtr<MapExpression> AddressExp;
 	GArray<Member*> Members;
+	MemberIndex Index;
 	GArray<StructDef*> Children;
 
 	StructDef()
@@ -845,6 +1723,46 @@ public:
 		}
 	}
 
+	/// \returns the size in bytes if every instance of the struct is the
+	/// same size and decodes the same way wherever it is, otherwise -1.
+	/// Arrays of these can find any element without decoding the others.
+	int FixedSize()
+	{
+		if (AddressExp || Children.Length())
+			return -1;
+
+		int Bytes = 0;
+		for (unsigned i=0; i<Members.Length(); i++)
+		{
+			VarDef *d = Members[i]->IsVar();
+			if (!d || !d->Type || !d->Value.IsNull())
+				return -1;
+
+			int64 Count = 1;
+			if (d->Type->Length.Length())
+			{
+				MapExpression *Exp = d->Type->Length[0].Exp;
+				if (!Exp || !Exp->IsConstant(Count) || Count < 0)
+					return -1;
+			}
+
+			int Sz;
+			Basic *b = d->Type->Base;
+			if (b)
+			{
+				if (b->Bits || b->Type == TypeStrZ)
+					return -1;
+				Sz = b->Bytes;
+			}
+			else if (!d->Type->Cmplex || (Sz = d->Type->Cmplex->FixedSize()) < 0)
+				return -1;
+
+			Bytes += (int)(Count * Sz);
+		}
+
+		return Bytes;
+	}
+
 	bool GetVariant(const char *Name, GVariant &Value, char *Array = NULL)
 	{
 		if (!Name || !EvalAddr.IsValid())
@@ -1022,26 +1940,11 @@ public:
 					if (d->Type->Length.Length() > 0)
 					{
 						ArrayDimension &ad = d->Type->Length.First();
-						if (ad.Expression.Length() == 1)
-						{
-							d->Type->ResolvedLength = AtoiW(ad.Expression[0]);
-						}
-						else
-						{
-							// Use the script engine to evaluate the expression...
-							GString::Array a;
-							for (unsigned i=0; i<ad.Expression.Length(); i++)
-								a.New() = ad.Expression[i];
-							GString Exp = GString(" ").Join(a);
-
-							GScriptEngine Eng(NULL, NULL, NULL);
-							GVariant Result;
-							bool Status = Eng.EvaluateExpression(&Result, this, Exp);
-							if (!Status)
-								return false;
+						GVariant Result;
+						if (!ad.Exp || !ad.Exp->Evaluate(Result, this))
+							return false;
 
-							d->Type->ResolvedLength = Result.CastInt32();
-						}
+						d->Type->ResolvedLength = Result.CastInt32();
 					}						
 					if (d->Type->ResolvedLength < 0)
 					{
@@ -1082,6 +1985,148 @@ void VarDefType::Sizeof(BitReference &sz)
 	}
 }
 
+/// The part of the file a whole file parse has in memory
+struct ParseWindow
+{
+	GFile &File;
+	int64 Size;							// Of the file
+	int64 Start;						// Where 'Buf' is in the file
+	GArray<uint8> Buf;
+	GArray<GArray<uint8>*> Kept;		// Copies of members that left the window
+
+	ParseWindow(GFile &f) : File(f)
+	{
+		Size = f.GetSize();
+		Start = 0;
+	}
+
+	~ParseWindow()
+	{
+		Kept.DeleteObjects();
+	}
+
+	int64 End()
+	{
+		return Start + Buf.Length() - 1;
+	}
+
+	/// Copies the start of any member 'Addr' points at in the window, so
+	/// the members after it can still refer to it once the window moves.
+	void Keep(AddressRef &Addr, GArray<Member*> &Members)
+	{
+		uint8 *From = Buf.AddressOf(), *To = From + Buf.Length();
+		for (unsigned i=0; i<Addr.Length() && i<Members.Length(); i++)
+		{
+			BitReference &r = Addr[i];
+			if (From && r.Ptr >= From && r.Ptr < To)
+			{
+				GArray<uint8> *k = new GArray<uint8>;
+				int Bytes = (int)MIN(To - r.Ptr, PARSE_KEEP);
+				k->Length(Bytes);
+				memcpy(k->AddressOf(), r.Ptr, Bytes);
+				Kept.Add(k);
+				r.Ptr = k->AddressOf();
+				r.Len = Bytes;
+			}
+
+			ConditionDef *c = Members[i]->IsCondition();
+			if (c)
+				Keep(c->Addr, c->Members);
+		}
+	}
+
+	/// Reads up to 'Bytes' of the file from 'Pos' and points 'View' at them.
+	/// 'Addr' and 'Members' are the scope of "Main".
+	bool Move(int64 Pos, int64 Bytes, ViewContext &View, AddressRef &Addr, GArray<Member*> &Members)
+	{
+		Keep(Addr, Members);
+
+		Bytes = MAX(MIN(Bytes, Size - Pos), 0);
+		if (!Buf.Length((size_t)Bytes + 1)) // Plus a terminator for StrZ's running off the end
+			return false;
+		Buf[(size_t)Bytes] = 0;
+		if (Bytes > 0 &&
+			(File.SetPos(Pos) != Pos ||
+			File.Read(Buf.AddressOf(), (ssize_t)Bytes) != Bytes))
+			return false;
+
+		Start = Pos;
+		View.Base = View.Ptr = Buf.AddressOf();
+		View.End = View.Base + Bytes;
+		View.Len = (int)Bytes;
+		View.Bit = 0;
+		return true;
+	}
+
+	/// Moves the window up to the view's position when it's nearly used up
+	bool Slide(ViewContext &View, AddressRef &Addr, GArray<Member*> &Members)
+	{
+		int64 Pos = Start + View.Offset();
+		if (View.Bit ||
+			End() >= Size ||
+			End() - Pos >= PARSE_WINDOW / 4)
+			return true;
+
+		return Move(Pos, PARSE_WINDOW, View, Addr, Members);
+	}
+};
+
+/// A top level record found by parsing the whole file
+struct ParseRecord
+{
+	int64 Offset;
+	int64 Len;
+	const char *Type;		// Name of the struct that matched, NULL for basic types
+	ssize_t Index;			// In the array it's an element of, or -1
+};
+
+/// The records for one member of "Main"
+struct ParseGroup
+{
+	GString Name;
+	size_t First;			// Index of the first record
+	size_t Count;
+};
+
+/// Parses the whole of a file with a structure map in the background,
+/// keeping where each top level record is and which struct matched it.
+/// The map is a copy only used by the worker.
+class GStructParse
+{
+	friend class StructureMap;
+	friend class GStructParseWorker;
+
+	GString File;
+	bool Little;
+	int64 Size;
+	GAutoPtr<class StructureMap> Map;
+	GAutoPtr<class GStructParseWorker> Worker;
+	int64 Done;				// Bytes parsed so far
+	size_t Found;			// Records so far
+	bool Cancelled;
+
+	// Filled in by the worker
+	GArray<ParseGroup> Groups;
+	GArray<ParseRecord> Records;
+	GString Msg;			// Why the parse stopped early, if it did
+
+public:
+	GStructParse(StructureMap *map, const char *file, bool little);
+	~GStructParse();
+
+	bool Start();
+	bool IsRunning();
+	void Cancel();
+	/// Percentage of the file parsed so far.
+	int GetProgress();
+	size_t GetFound() { return Found; }
+
+	// These can only be used once the parse is no longer running
+	GArray<ParseGroup> &GetGroups() { return Groups; }
+	ParseRecord *GetRecord(size_t i) { return Records.AddressOf(i); }
+	const char *GetMsg() { return Msg; }
+};
+
 class StructureMap : public LListItem, public GDom
 {
 	AppWnd *App;
@@ -1090,19 +2135,20 @@ class StructureMap : public LListItem, public GDom
 	GStringPipe Errs;
 
 	bool Little;
-	char Tabs[256];
 	uint64 StartTs;
+	uint32 Generation; // Changes each compile
 
 	struct ScopeType
 	{
 		int Pos;
 		GArray<Member*> *Members;
-		AddressRef Addr;
+		MemberIndex *Index;
+		AddressRef *Addr;
 	};	
-	GArray<ScopeType> Stack;
+	GArray<ScopeType*> Stack; // The scopes live on the call stack of DoStruct/DoMember
 
 public:
-	LHashTbl<ConstStrKey<char>, char16*> Defines;
+	LHashTbl<StrKey<char>, MapExpression*> Defines;
 	GArray<StructDef*> Compiled;
 
 	StructDef *GetStruct(const char *Name)
@@ -1124,14 +2170,21 @@ public:
 		App = app;
 		File = 0;
 		Body = 0;
+		Generation = 0;
 		SetFile(file);
 	}
 
+	uint32 GetGeneration()
+	{
+		return Generation;
+	}
+
 	~StructureMap()
 	{
 		DeleteArray(File);
 		DeleteArray(Body);
 		Compiled.DeleteObjects();
+		Defines.DeleteObjects();
 	}
 
 	bool GetVariant(const char *Name, GVariant &Value, char *Array = 0)
@@ -1142,32 +2195,34 @@ public:
 		// Walk up the stack of scopes looking for a variable matching 'Name'
 		for (int Scope = Stack.Length() - 1; Scope >= 0; Scope--)
 		{
-			ScopeType &s = Stack[Scope];
-			int n = 0;
+			ScopeType &s = *Stack[Scope];
+			GArray<int> *Slots = s.Index->Find(Name);
+			if (!Slots)
+				continue;
 			
 			VarDef *Var = NULL;
 			ConditionDef *Cond = NULL;
-			for (; n<s.Pos; n++)
+			for (int *n = NULL; Slots->Iterate(n) && *n < s.Pos; )
 			{
-				Member *Mem = (*s.Members)[n];
+				Member *Mem = (*s.Members)[*n];
 				Var = Mem->IsVar();
 				if (Var)
 				{
-					if (Var->Name && strcmp(Var->Name, Name) == 0)
-					{
-						LgiAssert(s.Addr.Length() > n);
+					BitReference *Addr = s.Addr->AddressOf(*n);
+					LgiAssert(Addr != NULL);
+					if (!Addr)
+						return false;
 
-						if (Var->Type &&
-							Var->Type->Cmplex)
-						{
-							Value = Var->Type->Cmplex->GetReference(s.Addr[n], Little);
-						}
-						else
-						{
-							Value = Var->CastInt(s.Addr[n], Little);
-						}
-						return true;
+					if (Var->Type &&
+						Var->Type->Cmplex)
+					{
+						Value = Var->Type->Cmplex->GetReference(*Addr, Little);
+					}
+					else
+					{
+						Value = Var->CastInt(*Addr, Little);
 					}
+					return true;
 				}
 				else if ((Cond = Mem->IsCondition()))
 				{
@@ -1179,14 +2234,9 @@ public:
 		}
 		
 		// If it's not in any scope, check the #defines as well
-		char16 *v = Defines.Find(Name);
-		if (v)
-		{
-			GAutoString u(WideToUtf8(v));
-			GScriptEngine e(App, App, NULL);
-			bool Status = e.EvaluateExpression(&Value, this, u);
-			return Status;
-		}
+		MapExpression *Def = Defines.Find(Name);
+		if (Def)
+			return Def->Evaluate(Value, this, App);
 
 		return false;
 	}
@@ -1229,337 +2279,148 @@ public:
 		return out.Release();
 	}
 
-	/// This function reads an arbitrary number of bits from 'View' to 'Out'	
-	template<typename T>
-	bool Read
-	(
-		/// The output type (integer only)
-		T &Out,
-		/// The input stream of bytes. A copy is used to avoid
-		/// changing the contents of the source View. Updating
-		/// the position is separate to reading the data.
-		BitReference Ref,
-		/// The number of bits to read
-		int Bits
-	)
-	{
-		return Ref.ReadBits(Out, Bits);
-	}
-	
-	bool DoInt(VarDef *d, ViewContext &View, ssize_t &ArrayLength)
+	/// Checks the value at 'Ref' against the one the map requires, if any
+	bool CheckValue(VarDef *d, BitReference Ref)
 	{
 		Basic *b = d->Type->Base;
-		if (!d->Hidden)
+		if (b->Type == TypeFloat)
 		{
-			View.Out.Print("%s%s", Tabs, d->Name);
-			if (ArrayLength < 1)
+			if (b->Bytes == 4)
 			{
-				View.Out.Print("[0]\n");
-				return true;
+				float Val = 0;
+				if (d->HasValue(Val))
+					return d->CastFloat(Ref, Little) == Val;
 			}
-			else if (ArrayLength > 1)
-				View.Out.Print("[%i]:\n", ArrayLength);
 			else
-				View.Out.Print(" = ");
+			{
+				double Val = 0;
+				if (d->HasValue(Val))
+					return d->CastDouble(Ref, Little) == Val;
+			}
 		}
-		
-		for (int n=0; n<ArrayLength && View.Len >= b->Bytes; n++)
+		else
 		{
-			if (!View.AlignForBasic(b))
-				return false;
-			
-			if (!d->Hidden)
-			{
-				if (ArrayLength > 1)
-					View.Out.Print("  %s[%i] = ", Tabs, n);
-				char *LeadIn = ArrayLength > 1 ? Tabs : (char*)"";
-
-				/*
-				if (b->Bits)
-					View.Trace(d->Name);
-				*/
-
-				switch (b->Bytes)
-				{
-					case 1:
-					{
-						uint8 Byte;
-						if (!Read(Byte, View, b->Bits))
-							return false;
-						if (b->Signed)
-							View.Out.Print("%s%i (0x%02.2x)\n", LeadIn, (int8)Byte, (int8)Byte);
-						else
-							View.Out.Print("%s%u (0x%02.2x)\n", LeadIn, (uint8)Byte, (uint8)Byte);
-						break;
-					}
-					case 2:
-					{
-						uint16 Short;
-						if (!Read(Short, View, b->Bits))
-							return false;
-						
-						if (b->Signed)
-						{
-							int16 n = IfSwap(((int16)Short), Little);
-							View.Out.Print("%s%i (0x%04.4x)\n", LeadIn, n, n);
-						}
-						else
-						{
-							uint16 n = IfSwap(Short, Little);
-							View.Out.Print("%s%u (0x%04.4x)\n", LeadIn, n, n);
-						}
-						break;
-					}
-					case 4:
-					{
-						uint32 Int;
-						if (!Read(Int, View, b->Bits))
-							return false;
-						
-						if (b->Signed)
-						{
-							int32 n = IfSwap((int32)Int, Little);
-							View.Out.Print("%s%i (0x%08.8x)\n", LeadIn, n, n);
-						}
-						else
-						{
-							uint32 n = IfSwap(Int, Little);
-							View.Out.Print("%s%u (0x%08.8x)\n", LeadIn, n, n);
-						}
-						break;
-					}
-					case 8:
-					{
-						uint64 Long;
-						if (!Read(Long, View, b->Bits))
-							return false;
-
-						if (b->Signed)
-						{
-							int64 n = IfSwap((int64)Long, Little);
-							#ifdef WIN32
-							View.Out.Print("%s%I64i (0x%16.16lI64x)\n", LeadIn, n, n);
-							#else
-							View.Out.Print("%s%li (0x%16.16lx)\n", LeadIn, n, n);
-							#endif
-						}
-						else
-						{
-							uint64 n = IfSwap(Long, Little);
-							#ifdef WIN32
-							View.Out.Print("%s%I64u (0x%16.16lI64x)\n", LeadIn, n, n);
-							#else
-							View.Out.Print("%s%lu (0x%16.16lx)\n", LeadIn, n, n);
-							#endif
-						}
-						break;
-					}
-				}
-			}
-
 			int Val = 0;
 			if (d->HasValue(Val))
-			{
-				BitReference Ref;
-				Ref = View;
-				auto a = d->CastInt(Ref, Little);
-				if (a != Val)
-				{
-					View.Out.Print("%sValue Mismatch!\n", Tabs);
-					return false;
-				}
-			}
-
-			if (!View.Seek(b))
-				return false;
+				return d->CastInt(Ref, Little) == Val;
 		}
-		
+
 		return true;
 	}
-	
-	bool DoFloat(VarDef *d, ViewContext &View, ssize_t &ArrayLength)
+
+	/// Decodes integer, float and nibble members. Arrays of whole bytes with
+	/// no value to check are stepped over in one go, their elements are made
+	/// when the node is expanded. These can run past the end of the data if
+	/// there is a source to read the rest of the file from.
+	bool DoBasic(VarDef *d, ViewContext &View, ssize_t ArrayLength)
 	{
 		Basic *b = d->Type->Base;
-		if (!d->Hidden)
+		if (ArrayLength < 1)
 		{
-			View.Out.Print("%s%s", Tabs, d->Name);
-			if (ArrayLength > 1)
-				View.Out.Print("[%i]:\n", ArrayLength);
-			else
-				View.Out.Print(" = ");
+			if (!d->Hidden)
+				View.Add(DecodeNode::NodeArray, "%s[0]", d->Name);
+			return true;
 		}
-		
-		for (int n=0; n<ArrayLength && View.Len >= b->Bytes; n++)
+
+		if (!b->Bits &&
+			b->Bytes > 0 &&
+			d->Value.IsNull() &&
+			(ArrayLength > 1 || d->Hidden))
 		{
+			if (!View.AlignForBasic(b))
+				return false;
+
+			ssize_t Count = View.Tree.Src ? ArrayLength : MIN(ArrayLength, View.Len / b->Bytes);
+			int64 Bytes = (int64)Count * b->Bytes;
 			if (!d->Hidden)
 			{
-				if (ArrayLength > 1)
-					View.Out.Print("\t%s[%i] = ", Tabs, n);
-				char *LeadIn = ArrayLength > 1 ? Tabs : (char*)"";
-
-				switch (b->Bytes)
-				{
-					case 4:
-					{
-						LgiAssert(sizeof(float) == 4);
-						
-						float flt = *((float*)View.Ptr);
-						#define Swap(a, b) { uint8 t = a; a = b; b = t; }
-						
-						if (!Little)
-						{
-							uint8 *c = (uint8*)&flt;
-							Swap(c[0], c[3]);
-							Swap(c[1], c[2]);
-						}
-
-						double dbl = flt;
-
-						View.Out.Print("%s%g\n", LeadIn, dbl);
-
-						float Val = 0;
-						if (d->HasValue(Val))
-						{
-							if (d->CastFloat(View, Little) != Val)
-							{
-								View.Out.Print("%sValue Mismatch!\n", Tabs);
-								return false;
-							}
-						}
-						break;
-					}
-					case 8:
-					{
-						LgiAssert(sizeof(double) == 8);
-
-						double dbl = *((double*)View.Aligned());
-
-						if (!Little)
-						{
-							uint8 *c = (uint8*)&dbl;
-							Swap(c[0], c[7]);
-							Swap(c[1], c[6]);
-							Swap(c[2], c[5]);
-							Swap(c[3], c[4]);
-						}
-
-						View.Out.Print("%s%g\n", LeadIn, dbl);
-
-						double Val = 0;
-						if (d->HasValue(Val))
-						{
-							if (d->CastDouble(View, Little) != Val)
-							{
-								View.Out.Print("%sValue Mismatch!\n", Tabs);
-								return false;
-							}
-						}
-						break;
-					}
-					default:
-					{
-						View.Out.Print("#error (%s:%i)\n", LeadIn, __FILE__, __LINE__);
-						break;										
-					}
-				}
+				DecodeNode *Arr = View.Add(DecodeNode::NodeArray, "%s[%i]", d->Name, (int)ArrayLength);
+				Arr->Elem = *b;
+				Arr->ElemSize = b->Bytes;
+				Arr->Little = Little;
+				Arr->Lazy = Count;
+				Arr->Len = Bytes;
+				Arr->SetSizeValue();
 			}
 
-			View.Seek(b);
-		}
-		
-		return true;
-	}
-
-	bool DoNibble(VarDef *d, ViewContext &View, ssize_t &ArrayLength)
-	{
-		Basic *b = d->Type->Base;
-		if (!d->Hidden)
-		{
-			View.Out.Print("%s%s", Tabs, d->Name);
-			if (ArrayLength > 1)
-				View.Out.Print("[%i]:\n", ArrayLength);
+			if (Bytes < View.Len)
+			{
+				View.SeekBytes((int)Bytes);
+			}
 			else
-				View.Out.Print(" = ");
+			{
+				// Nothing after the array is in the data
+				if (Bytes > View.Len)
+					View.Truncated = true;
+				View.Ptr = View.End;
+				View.Len = 0;
+			}
+			return true;
 		}
-		
-		for (int n=0; n<ArrayLength && View.Len >= b->Bytes; n++)
+
+		DecodeNode *Parent = View.Parent;
+		if (!d->Hidden && ArrayLength > 1)
+			View.Parent = View.Add(DecodeNode::NodeArray, "%s[%i]", d->Name, (int)ArrayLength);
+
+		bool Status = true;
+		int n;
+		for (n=0; Status && n<ArrayLength && View.Len >= b->Bytes; n++)
 		{
-			if (!d->Hidden)
+			if (!View.AlignForBasic(b))
 			{
-				if (ArrayLength > 1)
-					View.Out.Print("\t%s[%i] = ", Tabs, n);
-				char *LeadIn = ArrayLength > 1 ? Tabs : (char*)"";
-
-				switch (b->Bytes)
-				{
-					case 2:
-					{
-						uint8 n = DeNibble(View.Aligned(), b->Bytes);
-						View.Out.Print("%s%u (0x%02.2x)\n", LeadIn, n, n);
-						break;
-					}
-					case 4:
-					{
-						uint16 v = DeNibble(View.Aligned(), b->Bytes);
-						uint16 n = IfSwap(v, Little);
-						View.Out.Print("%s%u (0x%04.4x)\n", LeadIn, n, n);
-						break;
-					}
-					case 8:
-					{
-						uint32 v = (uint32)DeNibble(View.Aligned(), b->Bytes);
-						uint32 n = IfSwap(v, Little);
-						View.Out.Print("%s%i (0x%08.8x)\n", LeadIn, n, n);
-						break;
-					}
-					case 16:
-					{
-						uint64 v = DeNibble(View.Aligned(), b->Bytes);
-						uint64 n = IfSwap(v, Little);
-						View.Out.Print("%s%I64u (0x%016.16I64x)\n", LeadIn, n, n);
-						break;
-					}
-					default:
-						LgiAssert(!"Not impl.");
-						break;
-				}
+				Status = false;
+				break;
 			}
 
-			int Val = 0;
-			if (d->HasValue(Val))
+			if (!d->Hidden && !View.Muted())
 			{
-				if (d->CastInt(View, Little) != Val)
+				DecodeNode *v = ArrayLength > 1 ?
+								View.Add(DecodeNode::NodeValue, "[%i]", n) :
+								View.Add(DecodeNode::NodeValue, "%s", d->Name);
+				v->Len = b->Bytes;
+				if (!FormatBasic(v->Value, *b, View, Little))
 				{
-					View.Out.Print("%sValue Mismatch!\n", Tabs);
-					return false;
+					Status = false;
+					break;
 				}
 			}
 
-			View.Seek(b);
+			if (!CheckValue(d, View))
+			{
+				View.Error("Value Mismatch!");
+				Status = false;
+			}
+			else
+			{
+				Status = View.Seek(b);
+			}
 		}
-		
-		return true;
+		if (Status && n < ArrayLength)
+			View.Truncated = true;
+
+		View.Parent = Parent;
+		return Status;
 	}
 	
 	bool DoString(VarDef *d, ViewContext &View, ssize_t &ArrayLength)
 	{
-		if (!d->Hidden)
+		if (!d->Hidden && (!View.Muted() || !d->Value.IsNull()))
 		{
 			if (d->Type->Base->Bytes == 1)
 			{
 				GAutoString u(DisplayString((char*)View.Aligned(), ArrayLength, d->Type->Base->Signed));
 
-				View.Out.Print("%s%s[%i] = '%.*s'%s\n",
-								Tabs, d->Name,
-								ArrayLength,
-								MIN(MAX_STR_DISPLAY, ArrayLength),
-								u.Get(),
-								ArrayLength>MAX_STR_DISPLAY?"...":"");
+				DecodeNode *Node = View.Add(DecodeNode::NodeValue, "%s[%i]", d->Name, (int)ArrayLength);
+				Node->Len = ArrayLength;
+				Node->Value.Printf("'%.*s'%s",
+									(int)MIN(MAX_STR_DISPLAY, ArrayLength),
+									u.Get(),
+									ArrayLength>MAX_STR_DISPLAY?"...":"");
 				if (u && d->Value.Str())
 				{
 					if (strnicmp(u, d->Value.Str(), ArrayLength) != 0)
 					{
-						View.Out.Print("%sValue Mismatch!\n", Tabs);
+						View.Error("Value Mismatch!");
 						return false;
 					}
 				}
@@ -1577,17 +2438,19 @@ public:
 					}
 					w[ArrayLength] = 0;
 
-					// u = WideToUtf8(w);
 					u = DisplayString(w, ArrayLength);
 				}
 				DeleteArray(w);
 
-				View.Out.Print("%s%s = '%s'\n", Tabs, d->Name, u);
+				GAutoString Utf(WideToUtf8(u));
+				DecodeNode *Node = View.Add(DecodeNode::NodeValue, "%s", d->Name);
+				Node->Len = ArrayLength * 2;
+				Node->Value.Printf("'%s'", Utf.Get());
 				if (d->Value.WStr())
 				{
 					if (StrnicmpW(u, d->Value.WStr(), ArrayLength) != 0)
 					{
-						View.Out.Print("%sValue Mismatch!\n", Tabs);
+						View.Error("Value Mismatch!");
 						DeleteArray(u);
 						return false;
 					}
@@ -1596,53 +2459,57 @@ public:
 			}
 		}
 
+		if (ArrayLength * d->Type->Base->Bytes > View.Len)
+			View.Truncated = true;
 		View.SeekBytes(ArrayLength * d->Type->Base->Bytes);		
 		return true;
 	}
 	
 	bool DoStrZ(VarDef *d, ViewContext &View, ssize_t &ArrayLength)
 	{
-		if (!d->Hidden && (d->Type->Base->Bytes < 8))
-		{
-			View.Out.Print("%s%s", Tabs, d->Name);
-			if (ArrayLength > 1)
-				View.Out.Print("[%i]:\n", ArrayLength);
-			else
-				View.Out.Print(" = ");
-		}
-		for (int n=0; n<ArrayLength && View.Len >= d->Type->Base->Bytes; n++)
+		int Bytes = d->Type->Base->Bytes;
+		bool Show = !d->Hidden && Bytes < 8;
+		DecodeNode *Parent = View.Parent;
+		if (Show && ArrayLength > 1)
+			View.Parent = View.Add(DecodeNode::NodeArray, "%s[%i]", d->Name, (int)ArrayLength);
+
+		bool Status = true;
+		int n;
+		for (n=0; Status && n<ArrayLength && View.Len >= Bytes; n++)
 		{
-			if (!d->Hidden && (d->Type->Base->Bytes < 8))
-			{
-				if (ArrayLength > 1)
-					View.Out.Print("\t%s[%i] = ", Tabs, n);
-			}
+			DecodeNode *Node = NULL;
+			if (Show)
+				Node = ArrayLength > 1 ?
+						View.Add(DecodeNode::NodeValue, "[%i]", n) :
+						View.Add(DecodeNode::NodeValue, "%s", d->Name);
+
+			// The data isn't terminated, so the scan stops at the end of it
 			int zstringLen = 0;
-			if (d->Type->Base->Bytes == 1)
+			int MaxLen = (View.Len - (View.Bit ? 1 : 0)) / Bytes;
+			if (Bytes == 1)
 			{
-				while (*(View.Aligned() + zstringLen))
+				while (zstringLen < MaxLen && *(View.Aligned() + zstringLen))
 				{
 					zstringLen++;
 				}
 				char *u = (char*) LgiNewConvertCp("utf-8", View.Aligned(), "iso-8859-1", zstringLen);
-				if (!d->Hidden)
+				if (Node)
 				{
-					View.Out.Print("'%s'\n", u);
+					Node->Value.Printf("'%s'", u);
 					if (u && d->Value.Str())
 					{
 						if (strnicmp(u, d->Value.Str(), zstringLen) != 0)
 						{
-							View.Out.Print("%sValue Mismatch!\n", Tabs);
-							DeleteArray(u);
-							return false;
+							View.Error("Value Mismatch!");
+							Status = false;
 						}
 					}
 				}
 				DeleteArray(u);
 			}
-			else if (d->Type->Base->Bytes == 2)
+			else if (Bytes == 2)
 			{
-				while ((char16)*(View.Aligned() + zstringLen * d->Type->Base->Bytes))
+				while (zstringLen < MaxLen && (char16)*(View.Aligned() + zstringLen * Bytes))
 				{
 					zstringLen++;
 				}
@@ -1661,128 +2528,282 @@ public:
 				}
 				DeleteArray(w);
 
-				if (!d->Hidden)
+				if (Node)
 				{
-					View.Out.Print("'%s'\n", u);
+					Node->Value.Printf("'%s'", u);
 					if (d->Value.Str())
 					{
 						if (strnicmp(u, d->Value.Str(), zstringLen) != 0)
 						{
-							View.Out.Print("%sValue Mismatch!\n", Tabs);
-							DeleteArray(u);
-							return false;
+							View.Error("Value Mismatch!");
+							Status = false;
 						}
 					}
 				}
 				DeleteArray(u);
 			}
-			else if (d->Type->Base->Bytes == 8)
+			else if (Bytes == 8)
 			{
 				// Just skip passed the string
-				while ((uint64)*(View.Aligned() + zstringLen * d->Type->Base->Bytes))
+				while (zstringLen < MaxLen && (uint64)*(View.Aligned() + zstringLen * Bytes))
 				{
 					zstringLen++;
 				}
 			}
 			
-			zstringLen += 1; // Take null terminator into account
-			View.SeekBytes(zstringLen * d->Type->Base->Bytes);
+			if (zstringLen < MaxLen)
+				zstringLen += 1; // Take null terminator into account
+			else
+				View.Truncated = true;
+			if (Node)
+				Node->Len = zstringLen * Bytes;
+			if (Status)
+				View.SeekBytes(zstringLen * Bytes);
 		}
+		if (Status && n < ArrayLength)
+			View.Truncated = true;
 		
-		return true;
+		View.Parent = Parent;
+		return Status;
+	}
+
+	/// Copies the state of the conditions in the first 'Count' of 'Members'
+	void SaveConditions(DecodeScope *Scope, GArray<Member*> &Members, size_t Count)
+	{
+		for (size_t i=0; i<Count && i<Members.Length(); i++)
+		{
+			ConditionDef *c = Members[i]->IsCondition();
+			if (!c)
+				continue;
+
+			DecodeScope::Cond *s = new DecodeScope::Cond;
+			s->Def = c;
+			s->Eval = c->Eval;
+			if (c->Addr.Length())
+				s->Addr.Add(c->Addr.AddressOf(), c->Addr.Length());
+			Scope->Conds.Add(s);
+
+			if (c->Eval > 0)
+				SaveConditions(Scope, c->Members, c->Addr.Length());
+		}
+	}
+
+	/// Copies the current stack of scopes, for decoding the elements of a
+	/// lazy struct array later.
+	DecodeScope *SaveScope()
+	{
+		DecodeScope *Scope = new DecodeScope;
+		for (unsigned i=0; i<Stack.Length(); i++)
+		{
+			ScopeType &s = *Stack[i];
+			DecodeScope::Saved *v = new DecodeScope::Saved;
+			v->Pos = s.Pos;
+			v->Members = s.Members;
+			v->Index = s.Index;
+			if (s.Addr->Length())
+				v->Addr.Add(s.Addr->AddressOf(), s.Addr->Length());
+			Scope->Scopes.Add(v);
+
+			SaveConditions(Scope, *s.Members, s.Pos);
+		}
+		return Scope;
 	}
 
-	bool DoMember(Member *Mem, ViewContext &View, ScopeType &Scope, int Depth)
+	/// Decodes a member that is a struct or array of structs. Elements of a
+	/// fixed size aren't decoded until the array is expanded. Otherwise the
+	/// first page of elements is decoded and just the offsets of the rest are
+	/// kept, with the scopes around the array, so they can be decoded when
+	/// expanded.
+	bool DoStructArray(VarDef *d, ViewContext &View)
+	{
+		StructDef *s = d->Type->Cmplex;
+		ssize_t Count = d->Type->ResolvedLength;
+		DecodeNode *Parent = View.Parent, *Node;
+
+		int Size = Count != 1 && View.Bit == 0 ? s->FixedSize() : -1;
+		if (Size > 0)
+		{
+			ssize_t Avail = View.Len / Size;
+			if (Count < 0 || Count > Avail)
+				View.Truncated = true;
+			Count = Count < 0 ? Avail : MIN(Count, Avail);
+
+			Node = View.Add(DecodeNode::NodeArray, "%s[%i]", d->Name, (int)Count);
+			Node->Struct = s;
+			Node->ElemSize = Size;
+			Node->Little = Little;
+			Node->Lazy = Count;
+			Node->Len = (int64)Count * Size;
+			Node->SetSizeValue();
+
+			View.SeekBytes(Count * Size);
+			return true;
+		}
+
+		StructDef *sub = s->MatchChild(View, Little);
+		if (Count == 1)
+		{
+			Node = View.Add(DecodeNode::NodeStruct, "%s", d->Name);
+			Node->Value = (sub ? sub : s)->Name;
+		}
+		else if (Count < 0)
+			Node = View.Add(DecodeNode::NodeArray, "%s[]", d->Name);
+		else
+			Node = View.Add(DecodeNode::NodeArray, "%s[%i]", d->Name, (int)Count);
+		
+		bool Status = true;
+		GArray<int64> *Offsets = NULL;
+		DecodeScope *Saved = NULL;
+		int i;
+		for (i=0; Status && (Count < 0 || i < Count) && View.Len > 0; i++)
+		{
+			s = d->Type->Cmplex;
+			if (i)
+				sub = s->MatchChild(View, Little);
+			if (sub)
+				s = sub;
+
+			if (i == ARRAY_PAGE && Node != &View.Scratch)
+			{
+				// Past the first page just keep where each element starts
+				Offsets = new GArray<int64>;
+				View.Tree.OffsetTables.Add(Offsets);
+				for (unsigned n=0; n<Node->Children.Length(); n++)
+					Offsets->Add(Node->Children[n]->Offset);
+				View.Tree.Scopes.Add(Saved = SaveScope());
+			}
+
+			if (Offsets)
+			{
+				Offsets->Add(View.Offset());
+				View.Parent = NULL;
+			}
+			else
+			{
+				View.Parent = Node;
+				if (Count != 1)
+				{
+					View.Parent = View.Add(DecodeNode::NodeStruct, "[%i]", i);
+					View.Parent->Value = s->Name;
+				}
+			}
+
+			Status = DoStruct(s, View, Little);
+		}
+		if (Status && (Count < 0 || i < Count))
+			View.Truncated = true;
+		
+		View.Parent = Parent;
+		if (Offsets)
+		{
+			Offsets->Add(View.Offset());
+			Node->Struct = d->Type->Cmplex;
+			Node->Offsets = Offsets;
+			Node->Scope = Saved;
+			Node->Little = Little;
+			Node->First = ARRAY_PAGE;
+			Node->Lazy = i - ARRAY_PAGE;
+			Node->Len = View.Offset() - Node->Offset;
+		}
+		if (Count != 1)
+		{
+			if (Node->Len < 0)
+				Node->Finish();
+			Node->SetSizeValue();
+		}
+
+		return Status;
+	}
+
+	/// Sets the length of the array 'd' from its expression, limited to the
+	/// elements that fit in 'Avail' bytes.
+	void ResolveLength(VarDef *d, ViewContext &View, int64 Avail)
+	{
+		d->Type->ResolvedLength = 1;
+		if (!d->Type->Length.Length())
+			return;
+
+		d->Type->ResolvedLength = -1; // Unknown
+		LgiAssert(d->Type->Length.Length() == 1);
+		
+		MapExpression *Exp = d->Type->Length[0].Exp;
+		if (!Exp || Exp->IsEmpty())
+			return;
+
+		GVariant v;
+		if (Exp->Evaluate(v, this, App))
+		{
+			d->Type->ResolvedLength = v.CastInt32();
+			#ifdef MAX_ARRAY
+			if (ArrayLength > MAX_ARRAY)
+				ArrayLength = MAX_ARRAY;
+			#endif
+
+			if (d->Type->ResolvedLength < 0)
+				d->Type->ResolvedLength = 0;
+
+			BitReference Sz;
+			Sz.Len = INT32_MAX;
+			d->Sizeof(Sz);
+
+			if ((int64)(d->Type->ResolvedLength * Sz.AlignedSize()) > Avail)
+			{
+				d->Type->ResolvedLength = (ssize_t)(Avail / Sz.AlignedSize());
+				View.Truncated = true;
+			}
+		}
+		else
+		{
+			View.Error("Error: evaluating the expression '%s'", Exp->GetSource());
+		}
+	}
+
+	bool DoMember(Member *Mem, ViewContext &View, ScopeType &Scope)
 	{
-		int64 Sz = View.Out.GetSize();
 		// uint64 Time = LgiCurrentTime() - StartTs;
 		if (!Mem ||
 			#ifdef MAX_EXECUTION_TIME
 			Time >= MAX_EXECUTION_TIME ||
 			#endif
-			#ifdef MAX_OUTPUT_SIZE
-			Sz >= MAX_OUTPUT_SIZE
+			#ifdef MAX_DECODE_NODES
+			View.Nodes >= MAX_DECODE_NODES
 			#endif
 			)
 			return false;
+		if (View.IsCancelled())
+		{
+			View.Error("Cancelled.");
+			return false;
+		}
 
 		ConditionDef *c;
 		VarDef *d = Mem->IsVar();
 		if (d)
 		{
-			d->Type->ResolvedLength = 1;
-			if (d->Type->Length.Length())
+			int64 Avail = View.Len;
+			Basic *b = d->Type->Base;
+			if (View.Tree.Src &&
+				b &&
+				!b->Bits &&
+				(b->Type == TypeInteger || b->Type == TypeFloat || b->Type == TypeNibble))
 			{
-				GArray<char*> DimStr;
-				d->Type->ResolvedLength = -1; // Unknown
-				for (unsigned dim = 0; dim < d->Type->Length.Length(); dim++)
-				{
-					GStringPipe p;
-					ArrayDimension &ad = d->Type->Length[dim];
-					for (unsigned n=0; n<ad.Expression.Length(); n++)
-					{
-						p.Print(" %S", ad.Expression[n]);
-					}
-					DimStr.Add(p.NewStr());
-				}
-				
-				LgiAssert(DimStr.Length() == 1);
-				
-				if (ValidStr(DimStr[0]))
-				{
-					// Resolve the array length of this var
-					// Evaluate expression
-					GScriptEngine e(App, App, NULL);
-					GVariant v;
-					if (e.EvaluateExpression(&v, this, DimStr[0]))
-					{
-						d->Type->ResolvedLength = v.CastInt32();
-						#ifdef MAX_ARRAY
-						if (ArrayLength > MAX_ARRAY)
-							ArrayLength = MAX_ARRAY;
-						#endif
-
-						if (d->Type->ResolvedLength < 0)
-							d->Type->ResolvedLength = 0;
-
-						BitReference Sz;
-						Sz.Len = INT32_MAX;
-						d->Sizeof(Sz);
-						if (d->Type->ResolvedLength * Sz.AlignedSize() > View.Len)
-							d->Type->ResolvedLength = View.Len / Sz.AlignedSize();
-					}
-					else
-					{
-						View.Out.Print("Error: evaluating the expression '%s'\n", DimStr[0]);
-					}
-				}
-				
-				DimStr.DeleteArrays();
+				// Their elements can be read from the file later
+				Avail = MAX(View.Tree.Src->GetFileSize() - View.Tree.Start - View.Offset(), 0);
 			}
+			ResolveLength(d, View, Avail);
 
-			if (d->Type->Base)
+			if (b)
 			{
-				Basic *b = d->Type->Base;
 				switch (b->Type)
 				{
 					default:
 						LgiAssert(!"Not impl");
 						break;
 					case TypeInteger:
-					{
-						if (!DoInt(d, View, d->Type->ResolvedLength))
-							return false;
-						break;
-					}
 					case TypeFloat:
-					{
-						if (!DoFloat(d, View, d->Type->ResolvedLength))
-							return false;
-						break;
-					}
 					case TypeNibble:
 					{
-						if (!DoNibble(d, View, d->Type->ResolvedLength))
+						if (!DoBasic(d, View, d->Type->ResolvedLength))
 							return false;
 						break;
 					}
@@ -1802,72 +2823,29 @@ public:
 			}
 			else if (d->Type->Cmplex)
 			{
-				StructDef *s = d->Type->Cmplex;
-				StructDef *sub = s->MatchChild(View, Little);
-
-				int Offset = View.Offset();
-				if (sub && d->Type->ResolvedLength == 1)
-					View.Out.Print("%s%s.%s", Tabs, sub->Name.Get(), d->Name);
-				else
-					View.Out.Print("%s%s", Tabs, d->Name);
-				if (d->Type->ResolvedLength > 1 || d->Type->ResolvedLength == 0)
-					View.Out.Print("[%i]", d->Type->ResolvedLength);
-				else if (d->Type->ResolvedLength < 0)
-					View.Out.Print("[]");
-				View.Out.Print(" (@ %i/0x%x) =\n", Offset, Offset);
-				
-				if (d->Type->ResolvedLength == 1)
-					View.Out.Print("%s{\n", Tabs);
-				
-				for (int i=0; (d->Type->ResolvedLength < 0 || i < d->Type->ResolvedLength) && View.Len > 0; i++)
-				{
-					s = d->Type->Cmplex;
-					if (i)
-						sub = s->MatchChild(View, Little);
-					if (sub)
-						s = sub;
-
-					if (d->Type->ResolvedLength != 1)
-					{
-						Offset = View.Offset();
-						View.Out.Print("%s  [%i] (%s @ %i/0x%x)\n", Tabs, i, s->Name.Get(), Offset, Offset);
-					}
-
-					if (!DoStruct(s, View, Little, Depth + 1 + (d->Type->ResolvedLength != 1 ? 1 : 0)))
-					{
-						return false;
-					}
-					
-					SetTabs(Depth);
-				}
-				
-				if (d->Type->ResolvedLength == 1)
-					View.Out.Print("%s}\n", Tabs);
+				if (!DoStructArray(d, View))
+					return false;
 			}
 		}
 		else if ((c = Mem->IsCondition()))
 		{
-			GStringPipe p;
-			for (unsigned n=0; n<c->Expression.Length(); n++)
-			{
-				p.Print(" %S", c->Expression[n]);
-			}
-			GAutoString Exp(p.NewStr());
-			GScriptEngine e(App, App, NULL);
 			GVariant v;
-			if (!e.EvaluateExpression(&v, this, Exp))
+			if (!c->Exp || !c->Exp->Evaluate(v, this, App))
 			{
-				View.Out.Print("Error: Couldn't evaluate '%s'\n", Exp.Get());
+				View.Error("Error: Couldn't evaluate '%s'", c->Exp ? c->Exp->GetSource() : "");
 				return false;
 			}
 
 			c->Eval = v.CastInt32() != 0;
-			View.Out.Print("%s// Expression:%s = %i\n", Tabs, Exp.Get(), c->Eval);
+			View.Add(DecodeNode::NodeComment, "Expression:%s = %i", c->Exp->GetSource(), c->Eval);
 			if (c->Eval)
 			{
 				int InitLen = Stack.Length();
-				ScopeType &Sub = Stack.New();
+				ScopeType Sub;
 				Sub.Members = &c->Members;
+				Sub.Index = &c->Index;
+				Sub.Addr = &c->Addr;
+				Stack.Add(&Sub);
 				for (Sub.Pos=0; Sub.Pos<c->Members.Length(); Sub.Pos++)
 				{
 					Member *Mem = c->Members[Sub.Pos];
@@ -1876,8 +2854,11 @@ public:
 					// one of the members to an array index.
 					c->Addr[Sub.Pos] = View;
 
-					if (!DoMember(Mem, View, Sub, Depth))
+					if (!DoMember(Mem, View, Sub))
+					{
+						Stack.Length(InitLen);
 						return false;
+					}
 				}
 				Stack.Length(InitLen);
 			}						
@@ -1886,74 +2867,345 @@ public:
 		return true;
 	}
 
-	void SetTabs(int Depth)
+	bool DoStruct(StructDef *s, ViewContext &View, bool little)
 	{
-		ZeroObj(Tabs);
-		memset(Tabs, ' ', Depth * 2);
-	}
-
-	bool DoStruct(StructDef *s, ViewContext &View, bool little, int Depth = 0)
-	{
-		SetTabs(Depth);
-		
 		uint32 InitLen = Stack.Length();
-		ScopeType &Scope = Stack.New();
+		AddressRef Addr;
+		ScopeType Scope;
+		Scope.Pos = 0;
 		Scope.Members = &s->Members;
+		Scope.Index = &s->Index;
+		Scope.Addr = &Addr;
+		Stack.Add(&Scope);
 		Little = little;
 
-		if (s->Address)
+		if (s->AddressExp)
 		{
 			// Resolve the address and seek to the right location...
-			GScriptEngine e(App, App, NULL);
 			GVariant v;
-			if (e.EvaluateExpression(&v, this, s->Address))
+			if (s->AddressExp->Evaluate(v, this, App))
 			{
 				auto Addr = v.CastInt64();
 				if (Addr > 0)
 				{
 					if (!View.GotoAddress(Addr))
-						View.Out.Print("Error: Can't goto adddres: " LPrintfInt64 " .\n", Addr);
+						View.Error("Error: Can't goto adddres: " LPrintfInt64 " .", Addr);
 				}
-				else View.Out.Print("Error: '%s' doesn't evaluate to an adddres.\n", s->Address.Get());
+				else View.Error("Error: '%s' doesn't evaluate to an adddres.", s->Address.Get());
 			}
-			else View.Out.Print("Error: evaluating the expression '%s'\n", s->Address.Get());
+			else View.Error("Error: evaluating the expression '%s'", s->Address.Get());
 		}
 
 		bool Error = false;
 		for (Scope.Pos=0; Scope.Pos<s->Members.Length() && View.Len > 0; Scope.Pos++)
 		{
 			Member *Mem = s->Members[Scope.Pos];
-			Scope.Addr[Scope.Pos] = View;
-			if (!DoMember(Mem, View, Scope, Depth))
+			Addr[Scope.Pos] = View;
+			if (!DoMember(Mem, View, Scope))
+			{
+				Error = true;
+				break;
+			}			
+		}
+
+		Stack.Length(InitLen);
+		return !Error;
+	}
+
+	/// Decodes 'Data' as the "Main" struct into 'Tree'
+	/// \returns the number of bytes decoded
+	int64 Visualise(char *Data, int Len, DecodeTree &Tree, bool Little)
+	{
+		StartTs = LgiCurrentTime();
+
+		StructDef *Main = GetStruct("Main");
+		if (!Main)
+		{
+			Tree.Root.Add(DecodeNode::NodeError, "No main defined.", 0);
+			return 0;
+		}
+		if (!Data || Len <= 0)
+			return 0;
+
+		// Lazy arrays read their elements from this copy when expanded
+		Tree.Data.Length(Len);
+		memcpy(Tree.Data.AddressOf(), Data, Len);
+		Tree.Map = this;
+		Tree.MapGeneration = Generation;
+
+		ViewContext Ctx(Tree);
+		Ctx.Base = Tree.Data.AddressOf();
+		Ctx.Ptr = Ctx.Base;
+		Ctx.Len = Len;
+		Ctx.End = Ctx.Base + Len;
+		Ctx.Bit = 0;
+		DoStruct(Main, Ctx, Little);
+
+		#ifdef MAX_DECODE_NODES
+		if (Ctx.Nodes >= MAX_DECODE_NODES)
+			Ctx.Error("Stopped after %i items.", Ctx.Nodes);
+		#endif
+		Tree.Root.Finish();
+
+		return Ctx.Offset();
+	}
+
+	/// Decodes element 'Index' of the lazy struct array 'Arr'
+	void DecodeElement(DecodeTree &Tree, DecodeNode *Arr, ssize_t Index)
+	{
+		int64 Offset = Arr->ElemOffset(Index);
+
+		ViewContext View(Tree);
+		View.Parent = Arr;
+		View.Base = Tree.Data.AddressOf();
+		View.End = View.Base + Tree.Data.Length();
+		if (!View.Base || !View.GotoAddress(Offset))
+		{
+			Arr->Add(DecodeNode::NodeError, "Error: The element is past the end of the data.", Offset);
+			return;
+		}
+
+		// Put back the scopes the array was in, for the members before it
+		GArray<ScopeType> Outer;
+		Stack.Length(0);
+		if (Arr->Scope)
+		{
+			DecodeScope *Saved = Arr->Scope;
+			Outer.Length(Saved->Scopes.Length());
+			for (unsigned i=0; i<Saved->Scopes.Length(); i++)
+			{
+				DecodeScope::Saved *v = Saved->Scopes[i];
+				ScopeType &s = Outer[i];
+				s.Pos = v->Pos;
+				s.Members = v->Members;
+				s.Index = v->Index;
+				s.Addr = &v->Addr;
+				Stack.Add(&s);
+			}
+			for (unsigned i=0; i<Saved->Conds.Length(); i++)
+			{
+				DecodeScope::Cond *c = Saved->Conds[i];
+				c->Def->Eval = c->Eval;
+				c->Def->Addr.Length(0);
+				if (c->Addr.Length())
+					c->Def->Addr.Add(c->Addr.AddressOf(), c->Addr.Length());
+			}
+		}
+
+		StructDef *s = Arr->Struct;
+		StructDef *sub = s->MatchChild(View, Arr->Little);
+		if (sub)
+			s = sub;
+
+		DecodeNode *Elem = View.Parent = View.Add(DecodeNode::NodeStruct, "[%i]", (int)Index);
+		Elem->Value = s->Name;
+		DoStruct(s, View, Arr->Little);
+		Elem->Finish();
+		Stack.Length(0);
+	}
+
+	/// Decodes one record at the view's position for ParseFile, either an
+	/// element of the struct 'Elem' or the member 'Mem' of "Main". A record
+	/// that had a length clamped or ran out of data at the end of the window
+	/// may have been cut short, so it's decoded again with a bigger window,
+	/// up to PARSE_MAX_WINDOW.
+	bool ParseOne(ParseWindow &Win, ViewContext &View, ScopeType &Scope, Member *Mem, StructDef *Elem, ParseRecord &r)
+	{
+		int64 Window = PARSE_WINDOW;
+		while (true)
+		{
+			bool Aligned = View.Bit == 0;
+			bool Status;
+			r.Offset = Win.Start + View.Offset();
+			r.Type = NULL;
+			View.LastError = GString();
+			View.Truncated = false;
+
+			if (Elem)
+			{
+				StructDef *s = Elem->MatchChild(View, Little);
+				if (!s)
+					s = Elem;
+				r.Type = s->Name;
+				Status = DoStruct(s, View, Little);
+			}
+			else
+			{
+				Status = DoMember(Mem, View, Scope);
+			}
+
+			r.Len = Win.Start + View.Offset() - r.Offset;
+			if (View.IsCancelled() ||
+				!View.Truncated ||
+				Win.End() >= Win.Size ||
+				Window >= PARSE_MAX_WINDOW ||
+				!Aligned)
+				return Status;
+
+			Window <<= 1;
+			if (!Win.Move(r.Offset, Window, View, *Scope.Addr, *Scope.Members))
+			{
+				View.LastError = "Error: Couldn't read the file.";
+				return false;
+			}
+			if (!Elem)
+				(*Scope.Addr)[Scope.Pos] = View;
+		}
+	}
+
+	/// Decodes "Main" over the whole of 'f' for 'Job', a window at a time and
+	/// without making any nodes. Each member of Main is a record, except for
+	/// arrays of structs where each element is one.
+	void ParseFile(GFile &f, GStructParse *Job, GArray<ParseGroup> &Groups, GArray<ParseRecord> &Records, GString &Msg)
+	{
+		StructDef *Main = GetStruct("Main");
+		if (!Main)
+		{
+			Msg = "No main defined.";
+			return;
+		}
+
+		DecodeTree Tree;
+		ViewContext View(Tree);
+		View.Parent = NULL;
+		View.Cancelled = &Job->Cancelled;
+
+		AddressRef Addr;
+		ScopeType Scope;
+		Scope.Pos = 0;
+		Scope.Members = &Main->Members;
+		Scope.Index = &Main->Index;
+		Scope.Addr = &Addr;
+		Stack.Length(0);
+		Stack.Add(&Scope);
+		Little = Job->Little;
+
+		ParseWindow Win(f);
+		if (!Win.Move(0, PARSE_WINDOW, View, Addr, Main->Members))
+		{
+			Msg = "Error: Couldn't read the file.";
+			Stack.Length(0);
+			return;
+		}
+
+		for (Scope.Pos=0; Scope.Pos<Main->Members.Length() && !Msg; Scope.Pos++)
+		{
+			if (Win.Start + View.Offset() >= Win.Size)
+				break;
+			if (!Win.Slide(View, Addr, Main->Members))
+			{
+				Msg = "Error: Couldn't read the file.";
+				break;
+			}
+
+			Member *Mem = Main->Members[Scope.Pos];
+			Addr[Scope.Pos] = View;
+
+			VarDef *d = Mem->IsVar();
+			ConditionDef *c = Mem->IsCondition();
+			ParseGroup &g = Groups.New();
+			g.First = Records.Length();
+			g.Count = 0;
+			if (d)
+				g.Name = d->Name;
+			else if (c && c->Exp)
+				g.Name.Printf("Expression:%s", c->Exp->GetSource());
+
+			Basic *b = d ? d->Type->Base : NULL;
+			if (d && d->Type->Cmplex)
+			{
+				ResolveLength(d, View, Win.Size - Win.Start - View.Offset());
+				ssize_t Count = d->Type->ResolvedLength;
+				if (Count < 0)
+					g.Name.Printf("%s[]", d->Name);
+				else if (Count != 1)
+					g.Name.Printf("%s[%i]", d->Name, (int)Count);
+
+				for (ssize_t i=0; Count < 0 || i < Count; i++)
+				{
+					if (Job->Cancelled)
+					{
+						Msg = "Cancelled.";
+						break;
+					}
+					if (Win.Start + View.Offset() >= Win.Size)
+						break;
+					if (i && !Win.Slide(View, Addr, Main->Members))
+					{
+						Msg = "Error: Couldn't read the file.";
+						break;
+					}
+
+					ParseRecord &r = Records.New();
+					r.Index = Count == 1 ? -1 : i;
+					bool Status = ParseOne(Win, View, Scope, NULL, d->Type->Cmplex, r);
+					Job->Done = r.Offset + r.Len;
+					Job->Found = Records.Length();
+
+					if (!Status || r.Len <= 0)
+					{
+						if (r.Len <= 0)
+							Records.Length(Records.Length() - 1);
+						if (Job->Cancelled)
+							Msg = "Cancelled.";
+						else
+							Msg.Printf("Stopped at %s[%i] (@ " LPrintfInt64 "/0x%llx): %s",
+										d->Name,
+										(int)i,
+										r.Offset,
+										(unsigned long long)r.Offset,
+										Status ? "It has no length." :
+										View.LastError ? View.LastError.Get() : "It couldn't be decoded.");
+						break;
+					}
+				}
+			}
+			else if (b &&
+					!b->Bits &&
+					b->Bytes > 0 &&
+					d->Value.IsNull() &&
+					!View.Bit &&
+					(b->Type == TypeInteger || b->Type == TypeFloat || b->Type == TypeNibble))
+			{
+				// Step over these without reading them, they can be any size
+				int64 Pos = Win.Start + View.Offset();
+				ResolveLength(d, View, Win.Size - Pos);
+				if (d->Type->Length.Length())
+					g.Name.Printf("%s[%i]", d->Name, (int)MAX(d->Type->ResolvedLength, 0));
+
+				ParseRecord &r = Records.New();
+				r.Offset = Pos;
+				r.Len = (int64)MAX(d->Type->ResolvedLength, 0) * b->Bytes;
+				r.Type = NULL;
+				r.Index = -1;
+				if (r.Len < View.Len)
+					View.SeekBytes((int)r.Len);
+				else if (!Win.Move(Pos + r.Len, PARSE_WINDOW, View, Addr, Main->Members))
+					Msg = "Error: Couldn't read the file.";
+			}
+			else
 			{
-				Error = true;
-				break;
-			}			
-		}
-
-		Stack.Length(InitLen);
-		return !Error;
-	}
-
-	void Visualise(char *Data, int Len, GStream &Out, bool Little)
-	{
-		StartTs = LgiCurrentTime();
+				ParseRecord &r = Records.New();
+				r.Index = -1;
+				bool Status = ParseOne(Win, View, Scope, Mem, NULL, r);
+				if (r.Len <= 0)
+					Records.Length(Records.Length() - 1);
+				if (Job->Cancelled)
+					Msg = "Cancelled.";
+				else if (!Status)
+					Msg.Printf("Stopped at %s (@ " LPrintfInt64 "/0x%llx): %s",
+								g.Name.Get(),
+								r.Offset,
+								(unsigned long long)r.Offset,
+								View.LastError ? View.LastError.Get() : "It couldn't be decoded.");
+			}
 
-		StructDef *Main = GetStruct("Main");
-		if (Main)
-		{
-			ViewContext Ctx(Out);
-			Ctx.Base = (uint8*)Data;
-			Ctx.Ptr = (uint8*)Data;
-			Ctx.Len = Len;
-			Ctx.End = Ctx.Base + Len;
-			Ctx.Bit = 0;
-			DoStruct(Main, Ctx, Little);
-		}
-		else
-		{
-			Out.Print("No main defined.");
+			g.Count = Records.Length() - g.First;
+			Job->Done = Win.Start + View.Offset();
+			Job->Found = Records.Length();
 		}
+
+		Stack.Length(0);
 	}
 
 	char *GetFile()
@@ -2306,6 +3558,7 @@ public:
 					ad.Expression.Add(t);
 				}
 			}
+			ad.Exp = new MapExpression(ad.Expression);
 			
 			t = State.NextW();
 		}
@@ -2349,7 +3602,10 @@ public:
 		GAutoWString Value(NewStrW(State.s, Eol - State.s));		
 		State.s = *Eol ? Eol + 1 : Eol;
 		
-		Defines.Add(Name, Value.Release());
+		GAutoString u(WideToUtf8(Value));
+		MapExpression *Old = Defines.Find(Name);
+		DeleteObj(Old);
+		Defines.Add(Name, new MapExpression(u));
 		return true;
 	}
 
@@ -2357,6 +3613,8 @@ public:
 	{
 		CompileState State(GetBody());
 		Compiled.DeleteObjects();
+		Defines.DeleteObjects();
+		Generation++;
 		if (State.Base)
 		{
 			#define CheckTok(lit) \
@@ -2405,6 +3663,7 @@ public:
 							else if (XCmp(t, "@") == 0)
 							{
 								Def->Address = State.NextA();
+								Def->AddressExp.Reset(new MapExpression(Def->Address));
 								t = State.NextW();
 							}
 							else
@@ -2450,6 +3709,7 @@ public:
 									}
 									c->Expression.Add(t);
 								}
+								c->Exp = new MapExpression(c->Expression);
 								
 								t = State.NextW();
 								CheckTok("{");
@@ -2469,6 +3729,7 @@ public:
 									}
 								}
 								
+								c->Index.Build(c->Members);
 								Def->Members.Add(c.Release());
 							}
 							else if (!XCmp(t,"}"))
@@ -2486,6 +3747,7 @@ public:
 							}
 						}
 
+						Def->Index.Build(Def->Members);
 						if (Def->Base)
 						{
 							StructDef *Parent = GetStruct(Def->Base);
@@ -2511,6 +3773,154 @@ public:
 	}
 };
 
+void DecodeTree::MakeElements(DecodeNode *n, ssize_t From, ssize_t Count)
+{
+	if (n->Struct)
+	{
+		if (!Map || Map->GetGeneration() != MapGeneration)
+		{
+			n->Add(DecodeNode::NodeError, "Error: The map has changed since this was decoded.", n->ElemOffset(From));
+			return;
+		}
+
+		for (ssize_t i=0; i<Count; i++)
+			Map->DecodeElement(*this, n, From + i);
+		return;
+	}
+
+	GArray<uint8> Buf;
+	int64 Offset = n->ElemOffset(From);
+	int Bytes = n->ElemSize;
+	if (!Buf.Length(Count * Bytes) ||
+		!Read(Offset, Buf.AddressOf(), (int)Buf.Length()))
+	{
+		n->Add(DecodeNode::NodeError, "Error: Couldn't read the elements.", Offset);
+		return;
+	}
+
+	for (ssize_t i=0; i<Count; i++)
+	{
+		BitReference r;
+		r.Ptr = Buf.AddressOf(i * Bytes);
+		r.Len = Bytes;
+
+		DecodeNode *c = n->Add(DecodeNode::NodeValue, NULL, Offset + i * Bytes);
+		c->Name.Printf("[%i]", (int)(From + i));
+		c->Len = Bytes;
+		FormatBasic(c->Value, n->Elem, r, n->Little);
+	}
+}
+
+void DecodeTree::Expand(DecodeNode *n)
+{
+	if (!n || n->Lazy <= 0)
+		return;
+
+	ssize_t Count = n->Lazy;
+	n->Lazy = 0;
+	if (Count <= ARRAY_PAGE)
+	{
+		MakeElements(n, n->First, Count);
+		return;
+	}
+
+	// Show the first page, then split the rest into at most ARRAY_PAGE
+	// ranges that each expand the same way.
+	MakeElements(n, n->First, ARRAY_PAGE);
+
+	ssize_t Span = ARRAY_PAGE;
+	while (Count / Span > ARRAY_PAGE)
+		Span *= ARRAY_PAGE;
+
+	ssize_t End = n->First + Count;
+	for (ssize_t From = n->First + ARRAY_PAGE; From < End; )
+	{
+		ssize_t To = MIN(End, (From / Span + 1) * Span);
+		int64 Offset = n->ElemOffset(From);
+
+		DecodeNode *r = n->Add(DecodeNode::NodeArray, NULL, Offset);
+		r->Name.Printf("[%i..%i]", (int)From, (int)(To - 1));
+		r->Elem = n->Elem;
+		r->Struct = n->Struct;
+		r->ElemSize = n->ElemSize;
+		r->Offsets = n->Offsets;
+		r->Scope = n->Scope;
+		r->Little = n->Little;
+		r->First = From;
+		r->Lazy = To - From;
+		r->Len = n->ElemOffset(To) - Offset;
+		From = To;
+	}
+}
+
+class GStructParseWorker : public GThread
+{
+	GStructParse *Job;
+
+public:
+	GStructParseWorker(GStructParse *job) : GThread("GStructParseWorker")
+	{
+		Job = job;
+	}
+
+	int Main()
+	{
+		// The results aren't looked at until this thread has exited
+		GFile f;
+		if (f.Open(Job->File, O_READ))
+			Job->Map->ParseFile(f, Job, Job->Groups, Job->Records, Job->Msg);
+		else
+			Job->Msg.Printf("Error: Couldn't open '%s'.", Job->File.Get());
+		Job->Found = Job->Records.Length();
+
+		return 0;
+	}
+};
+
+GStructParse::GStructParse(StructureMap *map, const char *file, bool little)
+{
+	Map.Reset(map);
+	File = file;
+	Little = little;
+	Size = MAX(LgiFileSize(File), 0);
+	Done = 0;
+	Found = 0;
+	Cancelled = false;
+}
+
+GStructParse::~GStructParse()
+{
+	Cancel();
+	while (IsRunning())
+		LgiSleep(10);
+}
+
+bool GStructParse::Start()
+{
+	if (Worker || !Map || !Size)
+		return false;
+
+	if (!Worker.Reset(new GStructParseWorker(this)))
+		return false;
+	Worker->Run();
+	return true;
+}
+
+bool GStructParse::IsRunning()
+{
+	return Worker && !Worker->IsExited();
+}
+
+void GStructParse::Cancel()
+{
+	Cancelled = true;
+}
+
+int GStructParse::GetProgress()
+{
+	return Size > 0 ? (int) (Done * 100 / Size) : 0;
+}
+
 class MapEditor : public GWindow, public GLgiRes
 {
 	AppWnd *App;
@@ -2634,6 +4044,7 @@ public:
 		Cmds->AppendButton("New", IDM_NEW, TBT_PUSH);
 		Cmds->AppendButton("Delete", IDM_DELETE, TBT_PUSH);
 		Cmds->AppendButton("Compile", IDM_COMPILE, TBT_PUSH);
+		Cmds->AppendButton("Parse File", IDM_PARSE_FILE, TBT_PUSH);
 		Cmds->AppendButton("Lock Content", IDM_LOCK, TBT_TOGGLE);
 		Cmds->Raised(false);
 		Lst->SetPourLargest(true);
@@ -2693,14 +4104,321 @@ GString MapFld()
 }
 #endif
 
+class GVisualiseCache
+{
+public:
+	bool Little;
+	int64 End;				// File offset of the end of the decode
+	DecodeTree Tree;
+
+	GVisualiseCache()
+	{
+		Little = true;
+		End = -1;
+	}
+
+	bool IsCurrent(StructureMap *m, bool little, int64 Offset, uint64 Gen)
+	{
+		return	Tree.Map == m &&
+				Tree.MapGeneration == m->GetGeneration() &&
+				Little == little &&
+				Tree.Generation == Gen &&
+				Offset >= Tree.Start &&
+				(Offset < End || Offset == Tree.Start);
+	}
+};
+
+/// Shows a DecodeNode in the visualiser's tree. The items for the children
+/// (and lazy array elements) aren't made until the item is first expanded.
+class DecodeItem : public GTreeItem
+{
+	DecodeTree *Tree;
+	DecodeNode *Node;
+	GString Text;
+	bool Populated;
+
+public:
+	DecodeItem(DecodeTree *tree, DecodeNode *node)
+	{
+		Tree = tree;
+		Node = node;
+		Node->Item = this;
+		Populated = false;
+		if (Node->HasChildren())
+			Insert(new GTreeItem); // Placeholder so the item can be expanded
+	}
+
+	const char *GetText(int i = 0)
+	{
+		if (!Text)
+			Text = Node->GetText();
+		return Text;
+	}
+
+	void Populate()
+	{
+		if (Populated)
+			return;
+		Populated = true;
+
+		GTreeItem *Placeholder = GetChild();
+		if (Placeholder)
+		{
+			Placeholder->Remove();
+			delete Placeholder;
+		}
+
+		Tree->Expand(Node);
+		for (unsigned i=0; i<Node->Children.Length(); i++)
+			Insert(new DecodeItem(Tree, Node->Children[i]));
+	}
+
+	void OnExpand(bool b)
+	{
+		if (b)
+			Populate();
+		GTreeItem::OnExpand(b);
+	}
+};
+
+/// An item in the outline of a parse: a member of "Main", a range of an
+/// array's records or a single record. Big arrays page their records the
+/// same way the decode tree does.
+class ParseItem : public GTreeItem
+{
+public:
+	enum ItemKind
+	{
+		KindMember,
+		KindRange,
+		KindRecord,
+	};
+
+private:
+	AppWnd *App;
+	GStructParse *Job;
+	ParseGroup *Group;
+	size_t First, Count;	// The records covered
+	ItemKind Kind;
+	GString Text;
+	bool Populated;
+
+public:
+	ParseItem(AppWnd *app, GStructParse *job, ParseGroup *group, size_t first, size_t count, ItemKind kind)
+	{
+		App = app;
+		Job = job;
+		Group = group;
+		First = first;
+		Count = count;
+		Kind = kind;
+		Populated = false;
+		if (Kind != KindRecord)
+			Insert(new GTreeItem); // Placeholder so the item can be expanded
+	}
+
+	const char *GetText(int i = 0)
+	{
+		if (!Text)
+		{
+			ParseRecord *a = Job->GetRecord(First);
+			ParseRecord *b = Job->GetRecord(First + Count - 1);
+			char Sz[64];
+			LgiFormatSize(Sz, sizeof(Sz), b->Offset + b->Len - a->Offset);
+
+			GString Name;
+			if (Kind == KindRecord)
+			{
+				if (a->Index >= 0)
+					Name.Printf("[%i]", (int)a->Index);
+				else
+					Name = Group->Name;
+				if (a->Type)
+					Text.Printf("%s (%s, %s @ " LPrintfInt64 "/0x%llx)", Name.Get(), a->Type, Sz, a->Offset, (unsigned long long)a->Offset);
+				else
+					Text.Printf("%s (%s @ " LPrintfInt64 "/0x%llx)", Name.Get(), Sz, a->Offset, (unsigned long long)a->Offset);
+			}
+			else
+			{
+				if (Kind == KindRange)
+					Name.Printf("[%i..%i]", (int)a->Index, (int)b->Index);
+				else
+					Name = Group->Name;
+				Text.Printf("%s (%i records, %s @ " LPrintfInt64 "/0x%llx)", Name.Get(), (int)Count, Sz, a->Offset, (unsigned long long)a->Offset);
+			}
+		}
+		return Text;
+	}
+
+	void Populate()
+	{
+		if (Populated || Kind == KindRecord)
+			return;
+		Populated = true;
+
+		GTreeItem *Placeholder = GetChild();
+		if (Placeholder)
+		{
+			Placeholder->Remove();
+			delete Placeholder;
+		}
+
+		// The first page of records, then at most ARRAY_PAGE ranges of the rest
+		size_t End = First + Count;
+		for (size_t i = First; i < End && i < First + ARRAY_PAGE; i++)
+			Insert(new ParseItem(App, Job, Group, i, 1, KindRecord));
+
+		size_t Span = ARRAY_PAGE;
+		while (Count / Span > ARRAY_PAGE)
+			Span *= ARRAY_PAGE;
+
+		for (size_t From = First + ARRAY_PAGE; From < End; )
+		{
+			size_t To = MIN(End, Group->First + ((From - Group->First) / Span + 1) * Span);
+			Insert(new ParseItem(App, Job, Group, From, To - From, KindRange));
+			From = To;
+		}
+	}
+
+	void OnExpand(bool b)
+	{
+		if (b)
+			Populate();
+		GTreeItem::OnExpand(b);
+	}
+
+	void OnSelect()
+	{
+		ParseRecord *a = Job->GetRecord(First);
+		ParseRecord *b = Job->GetRecord(First + Count - 1);
+		App->GotoHit(a->Offset, b->Offset + b->Len - a->Offset, false);
+	}
+};
+
+/// Non-modal window that parses the whole file with a map in the background,
+/// then shows an outline of the records found. Selecting one moves the hex
+/// view's cursor to it.
+class GParseResults : public GWindow
+{
+	AppWnd *App;
+	GTree *Outline;
+	GAutoPtr<GStructParse> Job;
+	GString Desc;
+
+	void AddMessage(const char *Msg)
+	{
+		GString::Array Lines = GString(Msg).Split("\n");
+		for (unsigned i=0; i<Lines.Length(); i++)
+		{
+			GString Ln = Lines[i].Strip();
+			if (Ln)
+			{
+				GTreeItem *t = new GTreeItem;
+				t->SetText(Ln);
+				Outline->Insert(t);
+			}
+		}
+	}
+
+public:
+	GParseResults(AppWnd *app, StructureMap *Map, const char *File, bool Little)
+	{
+		App = app;
+		Outline = NULL;
+
+		const char *Leaf = strrchr(File, DIR_CHAR);
+		Desc.Printf("%s - %s", Map->GetText(0), Leaf ? Leaf + 1 : File);
+		Name(Desc);
+		GRect r(0, 0, 500, 600);
+		SetPos(r);
+		MoveSameScreen(App);
+		if (Attach(0))
+		{
+			Children.Insert(Outline = new GTree(IDC_DECODE_TREE, 0, 0, 100, 100));
+			AttachChildren();
+			OnPosChange();
+			Visible(true);
+		}
+		if (!Outline)
+			return;
+
+		// The worker has its own copy of the map, so this one can be edited
+		StructureMap *Copy = new StructureMap(App);
+		Copy->SetBody(Map->GetBody());
+		if (!Copy->Compile())
+		{
+			char *Err = Copy->GetErrors();
+			AddMessage(Err);
+			DeleteArray(Err);
+			delete Copy;
+		}
+		else if (Job.Reset(new GStructParse(Copy, File, Little)) && Job->Start())
+		{
+			SetPulse(250);
+		}
+		else
+		{
+			AddMessage("Failed to start the parse.");
+		}
+	}
+
+	~GParseResults()
+	{
+		// The items point at the job's records
+		if (Outline)
+			Outline->Empty();
+		Job.Reset();
+	}
+
+	void OnPosChange()
+	{
+		if (Outline)
+		{
+			GRect c = GetClient();
+			Outline->SetPos(c);
+		}
+	}
+
+	void OnPulse()
+	{
+		if (!Job)
+			return;
+
+		GString s;
+		if (Job->IsRunning())
+		{
+			s.Printf("%s - %i%%, " LPrintfSizeT " records", Desc.Get(), Job->GetProgress(), Job->GetFound());
+			Name(s);
+			return;
+		}
+
+		SetPulse(-1);
+		GArray<ParseGroup> &Groups = Job->GetGroups();
+		for (unsigned i=0; i<Groups.Length(); i++)
+		{
+			ParseGroup &g = Groups[i];
+			if (!g.Count)
+				continue;
+
+			bool Single = g.Count == 1 && Job->GetRecord(g.First)->Index < 0;
+			Outline->Insert(new ParseItem(App, Job, &g, g.First, g.Count, Single ? ParseItem::KindRecord : ParseItem::KindMember));
+		}
+		AddMessage(Job->GetMsg());
+
+		s.Printf("%s - " LPrintfSizeT " records", Desc.Get(), Job->GetFound());
+		Name(s);
+	}
+};
+
 GVisualiseView::GVisualiseView(AppWnd *app, char *DefVisual)
 {
 	App = app;
+	Cache = NULL;
 	Value(150);
 	IsVertical(false);
 	Raised(false);
 	SetViewA(Map = new GMapWnd, false);
-	SetViewB(Txt = new GTextView3(80, 0, 0, 100, 100), true);
+	SetViewB(Tree = new GTree(IDC_DECODE_TREE, 0, 0, 100, 100), true);
 	
 	#ifdef MAC
 	auto Res = ResourcesFld();
@@ -2747,6 +4465,35 @@ GVisualiseView::GVisualiseView(AppWnd *app, char *DefVisual)
 	}
 }
 
+GVisualiseView::~GVisualiseView()
+{
+	ClearDecode();
+}
+
+void GVisualiseView::ClearDecode()
+{
+	// The items point at the cache's nodes, so they go first
+	Tree->Empty();
+	DeleteObj(Cache);
+}
+
+void GVisualiseView::ShowMessage(const char *Msg)
+{
+	ClearDecode();
+
+	GString::Array Lines = GString(Msg).Split("\n");
+	for (unsigned i=0; i<Lines.Length(); i++)
+	{
+		GString Ln = Lines[i].Strip();
+		if (Ln)
+		{
+			GTreeItem *t = new GTreeItem;
+			t->SetText(Ln);
+			Tree->Insert(t);
+		}
+	}
+}
+
 int GVisualiseView::OnNotify(GViewI *c, int f)
 {
 	switch (c->GetId())
@@ -2778,6 +4525,8 @@ int GVisualiseView::OnNotify(GViewI *c, int f)
 					StructureMap *m = dynamic_cast<StructureMap*>(i);
 					if (m)
 					{
+						if (Cache && Cache->Tree.Map == m)
+							Cache->Tree.Map = NULL;
 						FileDev->Delete(m->GetFile());
 						DeleteObj(m);
 					}
@@ -2785,6 +4534,29 @@ int GVisualiseView::OnNotify(GViewI *c, int f)
 			}
 			break;
 		}
+		case IDM_PARSE_FILE:
+		{
+			StructureMap *m = dynamic_cast<StructureMap*>(Map->Lst->GetSelected());
+			if (!m)
+			{
+				LgiMsg(this, "Select a map to parse the file with.", AppName);
+				break;
+			}
+			if (m->Compiled.Length() == 0 && !m->Compile())
+			{
+				char *e = m->GetErrors();
+				ShowMessage(e);
+				DeleteArray(e);
+				break;
+			}
+
+			GString File = App->GetScanFile();
+			if (File)
+				new GParseResults(App, m, File, App->GetCtrlValue(IDC_LITTLE) != 0);
+			else
+				LgiMsg(this, "The parse reads the file from disk, save it first.", AppName);
+			break;
+		}
 		case IDM_COMPILE:
 		{
 			List<LListItem> Sel;
@@ -2797,14 +4569,14 @@ int GVisualiseView::OnNotify(GViewI *c, int f)
 					{
 						if (m->Compile())
 						{
-							Txt->Name("Compile OK.");
+							ShowMessage("Compile OK.");
 						}
 						else
 						{
 							char *Err = m->GetErrors();
 							if (Err)
 							{
-								Txt->Name(Err);
+								ShowMessage(Err);
 								DeleteArray(Err);
 							}
 						}
@@ -2818,7 +4590,35 @@ int GVisualiseView::OnNotify(GViewI *c, int f)
 	return 0;
 }
 
-void GVisualiseView::Visualise(char *Data, int Len, bool Little)
+void GVisualiseView::Highlight(int64 Offset)
+{
+	DecodeNode *n = Cache ? Cache->Tree.Find(Offset - Cache->Tree.Start) : NULL;
+	if (!n)
+		return;
+
+	// Make the items down to the node
+	GArray<DecodeNode*> Path;
+	for (DecodeNode *p = n; p && p != &Cache->Tree.Root; p = p->Parent)
+		Path.Add(p);
+
+	DecodeItem *Item = NULL;
+	for (ssize_t i = Path.Length() - 1; i >= 0; i--)
+	{
+		if (Item)
+		{
+			Item->Populate();
+			Item->Expanded(true);
+		}
+		Item = (DecodeItem*)Path[i]->Item;
+		if (!Item)
+			return;
+	}
+
+	Item->Select(true);
+	Item->ScrollTo();
+}
+
+void GVisualiseView::Visualise(char *Data, int Len, bool Little, int64 Offset, uint64 Generation, GVisualiseSource *Src)
 {
 	if (!GetCtrlValue(IDM_LOCK))
 	{
@@ -2835,25 +4635,41 @@ void GVisualiseView::Visualise(char *Data, int Len, bool Little)
 				if (!m->Compile())
 				{
 					char *e = m->GetErrors();
-					if (e)
-					{
-						Txt->Name(e);
-						DeleteArray(e);
-					}
+					ShowMessage(e);
+					DeleteArray(e);
 					return;
 				}
 			}
 
+			// Moving around inside the last decode of unchanged data
+			// just shows which member the cursor is in.
+			if (Offset >= 0 &&
+				Cache &&
+				Cache->IsCurrent(m, Little, Offset, Generation))
+			{
+				Highlight(Offset);
+				return;
+			}
+
 			if (m->Compiled.Length())
 			{
-				GStringPipe p(4 << 10);
-				m->Visualise(Data, Len, p, Little);
-				char *s = p.NewStr();
-				if (s)
-				{
-					Txt->Name(s);
-					DeleteArray(s);
-				}
+				ClearDecode();
+				Cache = new GVisualiseCache;
+				Cache->Little = Little;
+				Cache->Tree.Start = Offset;
+				Cache->Tree.Src = Offset >= 0 ? Src : NULL;
+				Cache->Tree.Generation = Generation;
+
+				int64 Used = m->Visualise(Data, Len, Cache->Tree, Little);
+				Used = MAX(Used, Cache->Tree.Root.Len);
+
+				DecodeNode &Root = Cache->Tree.Root;
+				for (unsigned i=0; i<Root.Children.Length(); i++)
+					Tree->Insert(new DecodeItem(&Cache->Tree, Root.Children[i]));
+
+				// Only a decode at a known offset can be reused
+				if (Offset >= 0)
+					Cache->End = Offset + Used;
 			}
 		}
 	}
@@ -34,6 +34,7 @@ Hex view line format:
 #include "Diff.h"
 #include "LgiRes.h"
 #include "iHexView.h"
+#include "Search.h"
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 // Application identification
@@ -45,6 +46,8 @@ bool CancelSearch = false;
 
 #define ColourSelectionFore			Rgb24(255, 255, 0)
 #define ColourSelectionBack			Rgb24(0, 0, 255)
+#define ColourMovedBack				Rgb24(166, 206, 240)
+#define ColourMovedLink				Rgb24(32, 96, 192)
 #define	CursorColourBack			Rgb24(192, 192, 192)
 
 #define HEX_COLUMN					13 // characters, location of first files hex column
@@ -53,7 +56,12 @@ bool CancelSearch = false;
 #define GAP_FILES					6 // characters, this is the gap between 2 files when comparing
 
 #define FILE_BUFFER_SIZE			1024
+#define HEX_PAGE_SIZE				(64 << 10) // bytes per page of the compare page cache
+#define HEX_PAGE_COUNT				64
 #define	UI_UPDATE_SPEED				500 // ms
+#define ALIGN_MAX_SIZE				(16 << 20) // larger files are compared byte for byte
+#define ALIGN_MEM_LIMIT				(64 << 20) // above this the alignment diff is done in windows
+#define ALIGN_PROGRESS_SIZE			(1 << 20) // show progress aligning files larger than this
 
 GColour ChangedFore(0xf1, 0xe2, 0xad);
 GColour ChangedBack(0xef, 0xcb, 0x05);
@@ -631,16 +639,33 @@ bool GHexBuffer::Save()
 	}
 
 	IsDirty = false;
+	FlushPages();
+	View->StartMoves();
 	return true;
 }
 
+void GHexBuffer::FlushPages()
+{
+	if (View)
+	{
+		View->Pages.Invalidate(this);
+		View->DataGeneration++;
+	}
+}
+
 void GHexBuffer::SetDirty(bool Dirty)
 {
+	if (Dirty)
+		View->DataGeneration++;
+
 	if (IsDirty ^ Dirty)
 	{
 		IsDirty = Dirty;
 		if (Dirty)
 		{
+			// The difference and move maps describe the file on disk
+			View->DiffMap.Reset();
+			View->Moves.Reset();
 			View->App->SetDirty(true);
 		}
 	}
@@ -663,7 +688,7 @@ bool GHexBuffer::GetData(int64 Start, size_t Len)
 		if (!Buf)
 		{
 			BufLen = FILE_BUFFER_SIZE << 10;
-			BufPos = 1;
+			BufPos = Size; // Nothing loaded yet
 			Buf = new uchar[BufLen];
 			LgiAssert(Buf);
 		}
@@ -688,7 +713,7 @@ bool GHexBuffer::GetData(int64 Start, size_t Len)
 						memset(Buf, 0xcc, BufLen);
 						BufUsed = File->Read(Buf, BufLen);
 						Status =	(Start >= BufPos) &&
-									((Start + Len) < (BufPos + BufUsed));
+									((Start + Len) <= (BufPos + BufUsed));
 					}
 					else
 					{
@@ -711,27 +736,173 @@ bool GHexBuffer::GetData(int64 Start, size_t Len)
 	return Status;
 }
 
+//////////////////////////////////////////////////////////////////////////////////////
+GHexPageCache::GHexPageCache()
+{
+	Last = NULL;
+	Clock = 0;
+	Pages.Length(HEX_PAGE_COUNT);
+	for (unsigned i=0; i<Pages.Length(); i++)
+	{
+		Page &p = Pages[i];
+		p.Buf = NULL;
+		p.Index = -1;
+		p.Used = 0;
+		p.Stamp = 0;
+		p.Data = NULL;
+	}
+}
+
+GHexPageCache::~GHexPageCache()
+{
+	for (unsigned i=0; i<Pages.Length(); i++)
+		DeleteArray(Pages[i].Data);
+}
+
+void GHexPageCache::Invalidate(GHexBuffer *b)
+{
+	for (unsigned i=0; i<Pages.Length(); i++)
+	{
+		Page &p = Pages[i];
+		if (!b || p.Buf == b)
+		{
+			p.Buf = NULL;
+			p.Stamp = 0;
+		}
+	}
+	Last = NULL;
+}
+
+GHexPageCache::Page *GHexPageCache::GetPage(GHexBuffer *b, int64 Index)
+{
+	// Painting reads each line from the same page as the last
+	if (Last && Last->Buf == b && Last->Index == Index)
+	{
+		Last->Stamp = ++Clock;
+		return Last;
+	}
+
+	Page *Oldest = &Pages[0];
+	for (unsigned i=0; i<Pages.Length(); i++)
+	{
+		Page *p = &Pages[i];
+		if (p->Buf == b && p->Index == Index)
+		{
+			p->Stamp = ++Clock;
+			return Last = p;
+		}
+		if (p->Stamp < Oldest->Stamp)
+			Oldest = p;
+	}
+
+	if (!Oldest->Data && !(Oldest->Data = new uchar[HEX_PAGE_SIZE]))
+		return NULL;
+
+	int64 Pos = Index * HEX_PAGE_SIZE;
+	Oldest->Buf = NULL;
+	Oldest->Stamp = 0;
+	if (Last == Oldest)
+		Last = NULL;
+	if (b->File->SetPos(Pos) != Pos)
+		return NULL;
+	Oldest->Used = (int) b->File->Read(Oldest->Data, HEX_PAGE_SIZE);
+	if (Oldest->Used <= 0)
+		return NULL;
+
+	Oldest->Buf = b;
+	Oldest->Index = Index;
+	Oldest->Stamp = ++Clock;
+	return Last = Oldest;
+}
+
+bool GHexPageCache::Read(GHexBuffer *b, int64 Offset, uchar *Out, int Len)
+{
+	if (!b || Offset < 0 || Len < 0 || Offset + Len > b->Size)
+		return false;
+
+	// The buffer's window holds any edits, so it has the last word
+	int64 WinEnd = b->Buf ? b->BufPos + (int64)b->BufUsed : 0;
+	if (b->Buf && Offset >= b->BufPos && Offset + Len <= WinEnd)
+	{
+		memcpy(Out, b->Buf + (Offset - b->BufPos), Len);
+		return true;
+	}
+	if (!b->File)
+		return false;
+
+	for (int Done = 0; Done < Len; )
+	{
+		int64 Pos = Offset + Done;
+		Page *p = GetPage(b, Pos / HEX_PAGE_SIZE);
+		if (!p)
+			return false;
+
+		int Off = (int) (Pos % HEX_PAGE_SIZE);
+		int Part = MIN(Len - Done, p->Used - Off);
+		if (Part <= 0)
+			return false;
+		memcpy(Out + Done, p->Data + Off, Part);
+		Done += Part;
+	}
+
+	// Part of the range may still be in the window
+	if (b->Buf && b->IsDirty)
+	{
+		int64 Start = MAX(Offset, b->BufPos);
+		int64 End = MIN(Offset + Len, WinEnd);
+		if (Start < End)
+			memcpy(Out + (Start - Offset), b->Buf + (Start - b->BufPos), (size_t)(End - Start));
+	}
+
+	return true;
+}
+
+const uchar *GHexPageCache::Map(GHexBuffer *b, int64 Offset, int Len, uchar *Tmp)
+{
+	if (!b || Offset < 0 || Len < 0 || Offset + Len > b->Size)
+		return NULL;
+
+	int64 WinEnd = b->Buf ? b->BufPos + (int64)b->BufUsed : 0;
+	if (b->Buf && Offset >= b->BufPos && Offset + Len <= WinEnd)
+		return b->Buf + (Offset - b->BufPos);
+
+	// Unsaved edits overlapping the range have to be merged by Read
+	bool Edited = b->Buf && b->IsDirty && Offset < WinEnd && Offset + Len > b->BufPos;
+	int Off = (int) (Offset % HEX_PAGE_SIZE);
+	if (b->File && !Edited && Off + Len <= HEX_PAGE_SIZE)
+	{
+		Page *p = GetPage(b, Offset / HEX_PAGE_SIZE);
+		if (p && Off + Len <= p->Used)
+			return p->Data + Off;
+	}
+
+	return Read(b, Offset, Tmp, Len) ? Tmp : NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
 bool GHexBuffer::GetLocationOfByte(GArray<GRect> &Loc, int64 Offset, const char16 *LineBuf)
 {
 	if (Offset < 0)
 		return false;
 
-	int64 X = Offset % View->BytesPerLine;
-	int64 Y = Offset / View->BytesPerLine;
+	int X;
+	int64 Y = View->GetLineOfByte(this, Offset, X);
 	
-	int YPos = (int)(View->VScroll ? View->VScroll->Value() : 0);
+	int64 YPos = View->VScroll ? View->VScroll->Value() : 0;
 	int YPx = (int)((Y - YPos) * View->CharSize.y);
 
 	GAutoWString w;
-	int HexLen = (int)X * 3;
-	int AsciiLen = (int)((View->BytesPerLine * 3) + GAP_HEX_ASCII + X);
+	int HexLen = X * 3;
+	int AsciiLen = (View->BytesPerLine * 3) + GAP_HEX_ASCII + X;
 	if (!LineBuf)
 	{
-		if (!Content[Y])
+		// Content only holds the lines on screen
+		int Row = (int)(Y - YPos);
+		if (Row < 0 || Row >= (int)Content.Length() || !Content[Row])
 		{
 			return false;
 		}
-		if (!w.Reset(Utf8ToWide(Content[Y])))
+		if (!w.Reset(Utf8ToWide(Content[Row])))
 		{
 			LgiAssert(!"Conversion failed");
 			return false;
@@ -772,22 +943,18 @@ enum ColourFlags
 	SelectedCol = 2,
 	ChangedCol = 4,
 	CursorCol = 8,
+	MovedCol = 16,
 };
 
 #define Int2Hex(c)		( (c) < 10 ? '0' + (c) : (c) - 10 + 'A' )
 
-void GHexBuffer::OnPaint(GSurface *pDC, int64 Start, int64 Len, GHexBuffer *Compare)
+void GHexBuffer::OnPaint(GSurface *pDC, int64 FirstLine, int Lines, GArray<GHexBuffer*> &Compare)
 {
-	// First position the layout
-	int64 BufOff = Start - BufPos;
-	int64 Bytes = MIN(Len, BufUsed - BufOff);
-	int Lines = (int)((Bytes + View->BytesPerLine - 1) / View->BytesPerLine);
-
 	// Colour setup
 	bool SelectedBuf = View->Cursor.Buf == this;
 	GColour WkSp(LC_WORKSPACE, 24);
 	float Mix = 0.85f;
-	COLOUR Colours[16];
+	COLOUR Colours[32];
 	// memset(&Colours, 0xaa, sizeof(Colours));
 	Colours[ForeCol] = LC_TEXT;
 	Colours[BackCol] = LC_WORKSPACE;
@@ -808,6 +975,14 @@ void GHexBuffer::OnPaint(GSurface *pDC, int64 Start, int64 Len, GHexBuffer *Comp
 			b = GColour::White.Mix(a, 0.5);
 		Colours[i | CursorCol] = b.c24();
 	}
+	Colours[ForeCol | MovedCol] = LC_TEXT;
+	Colours[BackCol | MovedCol] = ColourMovedBack;
+	Colours[ForeCol | MovedCol | SelectedCol] = Colours[ForeCol | ChangedCol | SelectedCol];
+	Colours[BackCol | MovedCol | SelectedCol] = GColour(Colours[BackCol | SelectedCol], 24).Mix(GColour(ColourMovedBack, 24)).c24();
+	Colours[ForeCol | MovedCol | CursorCol] = LC_TEXT;
+	Colours[BackCol | MovedCol | CursorCol] = GColour::Black.Mix(GColour(ColourMovedBack, 24), 0.75).c24();
+	Colours[ForeCol | MovedCol | SelectedCol | CursorCol] = Colours[ForeCol | ChangedCol | SelectedCol | CursorCol];
+	Colours[BackCol | MovedCol | SelectedCol | CursorCol] = GColour::Black.Mix(GColour(Colours[BackCol | MovedCol | SelectedCol], 24), 0.75).c24();
 
 	#if 0
 	static bool First = true;
@@ -816,12 +991,13 @@ void GHexBuffer::OnPaint(GSurface *pDC, int64 Start, int64 Len, GHexBuffer *Comp
 		First = false;
 		for (int i=0; i<CountOf(Colours); i++)
 		{
-			LgiTrace("%i: %s %s %s %s = <div style='background:#%02.2x%02.2x%02.2x;width: 50px'>&nbsp;</div><br>\n",
+			LgiTrace("%i: %s %s %s %s %s = <div style='background:#%02.2x%02.2x%02.2x;width: 50px'>&nbsp;</div><br>\n",
 				i,
 				i & BackCol ? "Back" : "Fore",
 				i & SelectedCol ? "Selected" : "Unselected",
 				i & ChangedCol ? "Changed" : "Unchanged",
 				i & CursorCol ? "Cursor" : "NonCursor",
+				i & MovedCol ? "Moved" : "NotMoved",
 				R24(Colours[i]),
 				G24(Colours[i]),
 				B24(Colours[i]));
@@ -834,9 +1010,14 @@ void GHexBuffer::OnPaint(GSurface *pDC, int64 Start, int64 Len, GHexBuffer *Comp
 	char s[256] = {0};
 	uint8 ForeFlags[256];
 	uint8 BackFlags[256];
-	int EndY = Pos.y1 + (Lines * View->CharSize.y);
-	EndY = MAX(EndY, Pos.y1);
+	uint8 Differs[256];
+	uint8 CompareBuf[256];
+	int EndY = Pos.y1;
 	
+	// Blocks that moved between the 2 compared files
+	GMoveMap *Moves = View->GetMoves();
+	int Side = Moves ? (int)View->Buf.IndexOf(this) : -1;
+
 	Content.Length(0);
 	
 	for (int Line=0; Line<Lines; Line++)
@@ -844,48 +1025,82 @@ void GHexBuffer::OnPaint(GSurface *pDC, int64 Start, int64 Len, GHexBuffer *Comp
 		int CurY = Pos.y1 + (Line * View->CharSize.y);
 		int Ch = 0;
 
+		// Absolute file position and length of this line
+		int64 AbsPos;
+		int LineLen;
+		if (!View->GetLine(this, FirstLine + Line, AbsPos, LineLen))
+			break;
+		EndY = CurY + View->CharSize.y;
+		if (LineLen == 0 || !GetData(AbsPos, LineLen))
+		{
+			// Gap where the other file has bytes this one doesn't
+			Content[Line] = "";
+			pDC->Colour(LC_MED, 24);
+			pDC->Rectangle(Pos.x1, CurY, Pos.x2, EndY - 1);
+			continue;
+		}
+
 		// This is relative to the start of the buffer.
-		int64 LineStart = BufOff + (Line * View->BytesPerLine);
-		// Absolute file position
-		int64 AbsPos = BufPos + LineStart;
+		int64 LineStart = AbsPos - BufPos;
 		
-		// Setup comparison stuff
-		uint8 *CompareBuf = NULL;
-		int CompareLen = 0;
-		if (Compare &&
-			Compare->GetData(AbsPos, View->BytesPerLine))
+		// Flag the bytes that differ from any of the compared files, bytes
+		// without a counterpart count as changed. Their data comes from the
+		// shared page cache so it doesn't move their windows. The flags are
+		// worked out once per line and used by both the hex and ascii loops.
+		memset(Differs, 0, LineLen);
+		for (unsigned c=0; c<Compare.Length(); c++)
 		{
-			CompareBuf = Compare->Buf + (AbsPos - Compare->BufPos);
-			CompareLen = View->BytesPerLine;
+			int CompareLen = 0;
+			int64 CmpPos;
+			const uchar *Cmp = NULL;
+			if (View->GetLine(Compare[c], FirstLine + Line, CmpPos, CompareLen) &&
+				CompareLen > 0)
+				Cmp = View->Pages.Map(Compare[c], CmpPos, CompareLen, CompareBuf);
+			if (!Cmp)
+				CompareLen = 0;
+
+			int Common = MIN(LineLen, CompareLen);
+			mem_diff_flags(Buf + LineStart, Cmp, Common, Differs);
+			if (Common < LineLen)
+				memset(Differs + Common, 1, LineLen - Common);
 		}
-		else
+		
+		// Bytes inside a moved block get their own colour instead
+		if (Moves && Side >= 0)
 		{
-			CompareBuf = NULL;
-			CompareLen = 0;
+			for (size_t m = Moves->First(Side, AbsPos); m < Moves->Length(); m++)
+			{
+				GMoveMap::Move *mv = Moves->Get(Side, m);
+				if (mv->Offset[Side] >= AbsPos + LineLen)
+					break;
+
+				int64 Start = MAX(mv->Offset[Side], AbsPos) - AbsPos;
+				int64 End = MIN(mv->Offset[Side] + mv->Len, AbsPos + LineLen) - AbsPos;
+				for (int64 i=Start; i<End; i++)
+					Differs[i] = MovedCol;
+			}
 		}
-			
+
 		// Clear the colours for this line
 		memset(&ForeFlags, ForeCol, sizeof(ForeFlags));
 		memset(&BackFlags, BackCol, sizeof(BackFlags));
 
 		// Print the hex bytes to the line
 		int64 n;
-		int64 FromStart = BufOff + (Line * View->BytesPerLine);
+		int64 FromStart = LineStart;
 		int64 From = FromStart, To = FromStart + View->BytesPerLine;
+		int64 Valid = FromStart + LineLen;
 		for (n=From; n<To; n++)
 		{
-			if (n < BufUsed)
+			if (n < Valid)
 			{
-				if (CompareBuf)
+				if (Differs[n - FromStart])
 				{
-					int64 Idx = n - FromStart;
-					if (Buf[n] != CompareBuf[Idx])
-					{
-						BackFlags[Ch] |= ChangedCol;
-						BackFlags[Ch+1] |= ChangedCol;
-						if (n < To-1)
-							BackFlags[Ch+2] |= ChangedCol;
-					}
+					uint8 Flag = Differs[n - FromStart] == MovedCol ? MovedCol : ChangedCol;
+					BackFlags[Ch] |= Flag;
+					BackFlags[Ch+1] |= Flag;
+					if (n < To-1)
+						BackFlags[Ch+2] |= Flag;
 				}
 
 				s[Ch++] = Int2Hex(Buf[n] >> 4);
@@ -907,18 +1122,12 @@ void GHexBuffer::OnPaint(GSurface *pDC, int64 Start, int64 Len, GHexBuffer *Comp
 		int StartOfAscii = Ch;
 		for (n=From; n<To; n++)
 		{
-			if (n < BufUsed)
+			if (n < Valid)
 			{
 				uchar c = Buf[n];
 
-				if (CompareBuf)
-				{
-					int64 Idx = n - FromStart;
-					if (Buf[n] != CompareBuf[Idx])
-					{
-						BackFlags[p - s] |= ChangedCol;
-					}
-				}
+				if (Differs[n - FromStart])
+					BackFlags[p - s] |= Differs[n - FromStart] == MovedCol ? MovedCol : ChangedCol;
 
 				*p++ = (c >= ' ' && c < 0x7f) ? c : '.';
 			}
@@ -937,7 +1146,7 @@ void GHexBuffer::OnPaint(GSurface *pDC, int64 Start, int64 Len, GHexBuffer *Comp
 				View->Cursor.Index < BufPos + BufUsed)
 			{
 				CursorOff = View->Cursor.Index - BufPos;
-				if ((CursorOff >= From) && (CursorOff < To))
+				if ((CursorOff >= From) && (CursorOff < Valid))
 					CursorOff -= From;
 				else
 					CursorOff = -1;
@@ -955,7 +1164,7 @@ void GHexBuffer::OnPaint(GSurface *pDC, int64 Start, int64 Len, GHexBuffer *Comp
 			int64 DocPos = BufPos + LineStart;
 			int64 Min = View->HasSelection() ? MIN(View->Selection.Index, View->Cursor.Index) : -1;
 			int64 Max = View->HasSelection() ? MAX(View->Selection.Index, View->Cursor.Index) : -1;
-			if (Min < DocPos + View->BytesPerLine &&
+			if (Min < DocPos + LineLen &&
 				Max >= DocPos)
 			{
 				// Part or all of this line is selected
@@ -969,8 +1178,8 @@ void GHexBuffer::OnPaint(GSurface *pDC, int64 Start, int64 Len, GHexBuffer *Comp
 				}
 				if (s < 0)
 					s = 0;
-				if (e > View->BytesPerLine * 3 - 2)
-					e = View->BytesPerLine * 3 - 2;
+				if (e > LineLen * 3 - 2)
+					e = LineLen * 3 - 2;
 
 				for (int64 i=s; i<=e; i++)
 				{
@@ -1087,6 +1296,7 @@ GHexView::GHexView(AppWnd *app, IHexBar *bar)
 	
 	BytesPerLine = 16;
 	IntWidth = 1;
+	DataGeneration = 0;
 	
 	SetId(IDC_HEX_VIEW);
 
@@ -1122,6 +1332,7 @@ GHexView::~GHexView()
 bool GHexView::Empty()
 {
 	Buf.DeleteObjects();
+	AlignCompare();
 	Cursor.Empty();
 	Selection.Empty();
 	return true;
@@ -1162,6 +1373,7 @@ bool GHexView::SetFileSize(int64 size)
 		Cursor.Buf->BufPos++;
 		Cursor.Buf->GetData(p, 1);
 
+		AlignCompare();
 		UpdateScrollBar();
 		Invalidate();
 	}
@@ -1350,7 +1562,7 @@ void GHexView::Paste(FormatType Fmt)
 		if (b)
 		{
 			memcpy(b->Buf + Cursor.Index - b->BufPos, Ptr, Len);
-			App->SetDirty(true);
+			b->SetDirty();
 			Invalidate();
 			DoInfo();
 		}
@@ -1360,13 +1572,7 @@ void GHexView::Paste(FormatType Fmt)
 void GHexView::UpdateScrollBar()
 {
 	int Lines = GetClient().Y() / CharSize.y;
-	int64 DocLines = 0;
-	for (unsigned i=0; i<Buf.Length(); i++)
-	{
-		GHexBuffer *b = Buf[i];
-		auto BufLines = (b->Size + 15) / 16;
-		DocLines = MAX(DocLines, BufLines);
-	}
+	int64 DocLines = GetLines();
 
 	SetScrollBars(false, DocLines > Lines);
 	if (VScroll)
@@ -1390,20 +1596,27 @@ void GHexView::SwapBytes(void *p, int Len)
 	}
 }
 
-bool GHexView::GetDataAtCursor(char *&Data, size_t &Len)
+bool GHexView::GetDataAtCursor(char *&Data, size_t &Len, int64 *Offset)
 {
 	GHexBuffer *b = Buf.Length() ? Buf.First() : NULL;
 	if (b && b->Buf)
 	{
-		size_t Offset = (size_t)(Cursor.Index - b->BufPos);
-		Data = (char*)b->Buf + Offset;
-		Len = MIN(b->BufUsed, b->BufLen) - Offset;
+		size_t Pos = (size_t)(Cursor.Index - b->BufPos);
+		Data = (char*)b->Buf + Pos;
+		Len = MIN(b->BufUsed, b->BufLen) - Pos;
+		if (Offset)
+			*Offset = Cursor.Index;
 		return true;
 	}
 
 	return false;
 }
 
+bool GHexView::ReadAt(int64 Offset, uchar *Out, int Len)
+{
+	return Pages.Read(Buf.Length() ? Buf.First() : NULL, Offset, Out, Len);
+}
+
 bool GHexView::HasSelection()
 {
 	return Selection.Index >= 0;
@@ -1514,20 +1727,20 @@ void GHexView::SetCursor(GHexBuffer *b, int64 cursor, int nibble, bool Selecting
 		// Make sure the cursor is in the viewable area?
 		if (VScroll)
 		{
-			int64 Start = (uint64) (VScroll ? VScroll->Value() : 0) * 16;
+			int64 YPos = VScroll->Value();
 			int Lines = GetClient().Y() / CharSize.y;
-			int64 End = MIN(b->Size, Start + (Lines * 16));
-			if (Cursor.Index < Start)
+			int Col;
+			int64 Line = GetLineOfByte(b, Cursor.Index, Col);
+			if (Line < YPos)
 			{
 				// Scroll up
-				VScroll->Value((Cursor.Index - (Cursor.Index%16)) / 16);
+				VScroll->Value(Line);
 				Invalidate();
 			}
-			else if (Cursor.Index >= End)
+			else if (Line >= YPos + Lines)
 			{
 				// Scroll down
-				int64 NewVal = (Cursor.Index - (Cursor.Index%16) - ((Lines-1) * 16)) / 16;
-				VScroll->Value(NewVal);
+				VScroll->Value(Line - Lines + 1);
 				Invalidate();
 			}
 		}
@@ -1604,8 +1817,122 @@ int64 GHexView::Search(SearchDlg *For, uchar *Bytes, int Len)
 	return Hit;
 }
 
+GSearchIndex *GHexView::GetIndex(GHexBuffer *b)
+{
+	if (!b || !b->File)
+		return NULL;
+
+	const char *Name = b->File->GetName();
+	if (!Index || stricmp(Index->GetFile(), Name))
+		Index.Reset(new GSearchIndex(Name));
+
+	return Index;
+}
+
+int GHexView::IndexSearch(SearchDlg *For, int64 &Hit)
+{
+	GHexBuffer *b = Cursor.Buf;
+	if (!b || b->IsDirty || !For->Bin || For->Length <= 0)
+		return -1;
+
+	// The index is of the raw bytes, so a case insensitive search can only
+	// use it when there is no case to ignore.
+	if (!For->MatchCase && !For->ForHex)
+	{
+		for (int64 i=0; i<For->Length; i++)
+		{
+			if (isalpha(For->Bin[i]))
+				return -1;
+		}
+	}
+
+	GSearchIndex *Idx = GetIndex(b);
+	if (!Idx)
+		return -1;
+
+	if (!Idx->IsValid())
+	{
+		// The file has changed since it was indexed, rebuild in the background
+		if (Idx->Exists() && !Idx->IsBuilding())
+			BuildIndex();
+		return -1;
+	}
+
+	int r = Idx->Find(For->Bin, (size_t)For->Length, Cursor.Index + 1, Hit);
+	if (r == 0)
+		r = Idx->Find(For->Bin, (size_t)For->Length, 0, Hit); // Wrap around
+	if (r == 0)
+		Hit = -1;
+
+	return r;
+}
+
+bool GHexView::BuildIndex()
+{
+	GHexBuffer *b = Cursor.Buf;
+	if (!b || !b->File)
+		return false;
+
+	GSearchIndex *Idx = GetIndex(b);
+	if (!Idx || Idx->IsBuilding())
+		return false;
+	if (Idx->IsValid())
+		return true;
+
+	// Each index object builds once
+	if (Idx->IsExited())
+	{
+		Index.Reset(new GSearchIndex(b->File->GetName()));
+		Idx = Index;
+	}
+	if (!Idx->Update())
+		return false;
+
+	App->SetPulse(500);
+	return true;
+}
+
+bool GHexView::GetIndexStatus(GString &s)
+{
+	if (!Index || !Index->IsBuilding())
+		return false;
+
+	int64 Total = Index->GetTotal();
+	s.Printf("Indexing: %i%%", Total > 0 ? (int)(Index->GetDone() * 100 / Total) : 0);
+	return true;
+}
+
 void GHexView::DoSearch(SearchDlg *For)
 {
+	if (For->MaxDiff > 0)
+	{
+		// Approximate matches are all listed in the background
+		GAutoPtr<GApproxSearch> Approx(new GApproxSearch(For->Bin, (size_t)For->Length, For->MaxDiff, For->AllowIndels, For->MatchCase || For->ForHex));
+		if (!Approx->IsValid())
+		{
+			LgiMsg(this, "Approximate search needs a pattern of 1 to %i bytes, longer than the number of differences.", AppName, MB_OK, GApproxSearch::MaxPattern);
+			return;
+		}
+
+		GString Desc;
+		Desc.Printf("Within %i difference%s of " LPrintfInt64 " bytes", For->MaxDiff, For->MaxDiff == 1 ? "" : "s", For->Length);
+		App->StartScan(Approx.Release(), Desc);
+		return;
+	}
+
+	if (For->Encoding == EncAny && !For->ForHex)
+	{
+		// All the encodings in one pass, listed in the background
+		GAhoCorasick *Ac = NewEncodingSearch(For->Text, For->MatchCase);
+		if (!Ac)
+			return;
+
+		GString Desc;
+		Desc.Printf("'%s' in any encoding", For->Text.Get());
+		App->StartScan(Ac, Desc);
+		return;
+	}
+
 	size_t Block = 32 << 10;
 	int64 Hit = -1, c;
 	int64 Time = LgiCurrentTime();
@@ -1614,8 +1941,10 @@ void GHexView::DoSearch(SearchDlg *For)
 	if (!b)
 		return;
 
+	int Indexed = IndexSearch(For, Hit);
+
 	// Search through to the end of the file...
-	for (c = Cursor.Index + 1; c < b->Size; c += Block)
+	for (c = Cursor.Index + 1; Indexed < 0 && c < b->Size; c += Block)
 	{
 		size_t Actual = (size_t)MIN(Block, GetFileSize() - c);
 		if (b->GetData(c, Actual))
@@ -1651,7 +1980,7 @@ void GHexView::DoSearch(SearchDlg *For)
 		else break;
 	}
 
-	if (Hit < 0)
+	if (Hit < 0 && Indexed < 0)
 	{
 		// Now search from the start of the file to the original cursor
 		for (c = 0; c < Cursor.Index; c += Block)
@@ -1700,6 +2029,86 @@ void GHexView::DoSearch(SearchDlg *For)
 	DeleteObj(Prog);
 }
 
+void GHexView::ReplaceAll(GArray<uint8> &Find, GArray<uint8> &Replace, bool MatchCase)
+{
+	GHexBuffer *b = Cursor.Buf;
+	if (!b || !Find.Length())
+		return;
+	if (!b->File)
+	{
+		LgiMsg(this, "Save the document to a file before replacing.", AppName);
+		return;
+	}
+	if (!App->SetDirty(false))
+		return;
+
+	// Same length replacements are patched in place, anything else (or a
+	// read only file) is written out to a new file.
+	GStreamReplace Rep(&Find[0], Find.Length(), Replace.AddressOf(), Replace.Length(), MatchCase);
+	GString Name = b->File->GetName();
+	GString OutName;
+	bool InPlace = Rep.IsSameLength() && !b->IsReadOnly;
+	if (!InPlace)
+	{
+		GFileSelect s;
+		s.Parent(this);
+		if (!s.Save())
+			return;
+		OutName = s.Name();
+		if (!stricmp(OutName, Name))
+		{
+			LgiMsg(this, "The output has to be a different file.", AppName);
+			return;
+		}
+	}
+
+	bool Status, Cancelled;
+	{
+		GProgressDlg Prog(this);
+		Prog.SetDescription("Replacing...");
+		Prog.SetLimits(0, b->Size);
+		Prog.SetScale(1.0 / 1024.0 / 1024.0);
+		Prog.SetType("MB");
+
+		if (InPlace)
+		{
+			GFile f;
+			Status = f.Open(Name, O_READWRITE) && Rep.InPlace(f, &Prog);
+			b->Reload();
+		}
+		else
+		{
+			GFile In, Out;
+			Status =	In.Open(Name, O_READ) &&
+						Out.Open(OutName, O_WRITE) &&
+						Out.SetSize(0) == 0 &&
+						Rep.Copy(In, Out, &Prog);
+		}
+		Cancelled = Prog.IsCancelled();
+	}
+	if (!InPlace && !Status)
+		FileDev->Delete(OutName, false); // Don't leave half a file around
+
+	Invalidate();
+	DoInfo();
+
+	double Mb = (double)Rep.Done / 1024.0 / 1024.0;
+	double Rate = Rep.GetRate() / 1024.0 / 1024.0;
+	if (!Status && !Cancelled)
+	{
+		LgiMsg(this, "Replace failed after " LPrintfInt64 " replacements.", AppName, MB_OK, Rep.Count);
+	}
+	else if (InPlace)
+	{
+		LgiMsg(this, "%s " LPrintfInt64 " replacements in %.1f MB (%.1f MB/s).", AppName, MB_OK, Cancelled ? "Cancelled after" : "Made", Rep.Count, Mb, Rate);
+	}
+	else if (!Cancelled)
+	{
+		if (LgiMsg(this, "Wrote '%s' with " LPrintfInt64 " replacements in %.1f MB (%.1f MB/s).\n\nOpen it now?", AppName, MB_YESNO, OutName.Get(), Rep.Count, Mb, Rate) == IDYES)
+			App->OpenFile(OutName, false);
+	}
+}
+
 void GHexView::SetBit(uint8 Bit, bool On)
 {
 	GHexBuffer *b = Cursor.Buf;
@@ -1717,7 +2126,7 @@ void GHexView::SetBit(uint8 Bit, bool On)
 			b->Buf[Cursor.Index - b->BufPos] &= ~Bit;
 		}
 
-		App->SetDirty(true);
+		b->SetDirty();
 		Invalidate();
 		DoInfo();
 	}	
@@ -1734,7 +2143,7 @@ void GHexView::SetByte(uint8 Byte)
 		if (b->Buf[Cursor.Index - b->BufPos] != Byte)
 		{
 			b->Buf[Cursor.Index - b->BufPos] = Byte;
-			App->SetDirty(true);
+			b->SetDirty();
 			Invalidate();
 			DoInfo();
 		}
@@ -1755,7 +2164,7 @@ void GHexView::SetShort(uint16 Short)
 		if (*p != Short)
 		{
 			*p = Short;
-			App->SetDirty(true);
+			b->SetDirty();
 			Invalidate();
 			DoInfo();
 		}
@@ -1776,7 +2185,7 @@ void GHexView::SetInt(uint32 Int)
 		if (*p != Int)
 		{
 			*p = Int;
-			App->SetDirty(true);
+			b->SetDirty();
 			Invalidate();
 			DoInfo();
 		}
@@ -1838,68 +2247,878 @@ void GHexView::DoInfo()
 				sHex.Printf("%04.4X", c);
 			}
 
-			Dec->Name(Valid ? sDec : NULL);
-			Hex->Name(Valid ? sHex : NULL);
+			Dec->Name(Valid ? sDec : NULL);
+			Hex->Name(Valid ? sHex : NULL);
+
+			Dec->Enabled(Valid);
+			Hex->Enabled(Valid);
+		}
+
+		if (w->GetViewById(IDC_HEX_4, Hex) &&
+			w->GetViewById(IDC_DEC_4, Dec))
+		{
+			bool Valid = b->GetData(Cursor.Index, 4);
+			GString sHex, sDec;
+			if (Valid)
+			{
+				uint32 *lp = (uint32*)(b->Buf + (Cursor.Index - b->BufPos));
+				uint32 c = *lp;
+				SwapBytes(&c, sizeof(c));
+
+				sDec.Printf(IsSigned ? "%i" : "%u", c);
+				sHex.Printf("%08.8X", c);
+			}
+
+			Dec->Name(Valid ? sDec : NULL);
+			Hex->Name(Valid ? sHex : NULL);
+
+			Dec->Enabled(Valid);
+			Hex->Enabled(Valid);
+		}
+	}
+}
+
+bool FileToArray(GArray<uint8> &a, const char *File)
+{
+	GFile f;
+	if (!f.Open(File, O_READ))
+		return false;
+	
+	if (!a.Length((size_t)f.GetSize()))
+		return false;
+	
+	int rd = f.Read(&a[0], a.Length());
+	if (rd != a.Length())
+		return false;
+	
+	return true;	
+}
+
+void GHexView::CompareFile(char *CmpFile)
+{
+	if (FileExists(CmpFile))
+	{
+		GAutoPtr<GHexBuffer> b(new GHexBuffer(this));
+		if (b)
+		{
+			if (b->Open(CmpFile, false))
+			{
+				Buf.Add(b.Release());
+				AlignCompare();
+				UpdateScrollBar();
+				Invalidate();
+			}
+		}
+	}
+}
+
+static bool ReadBuffer(GHexBuffer *b, GArray<uint8> &Out)
+{
+	if (!Out.Length((size_t)b->Size))
+		return b->Size == 0;
+
+	if (!b->File)
+	{
+		memcpy(&Out[0], b->Buf, (size_t)b->Size);
+		return true;
+	}
+
+	return	b->File->SetPos(0) == 0 &&
+			b->File->Read(&Out[0], (ssize_t)b->Size) == (ssize_t)b->Size;
+}
+
+void GHexView::AddLayout(int Len0, int Len1, bool Matched, GArray<uint8> &Old, GArray<uint8> &New)
+{
+	if (!Len0 && !Len1)
+		return;
+
+	Layout *Prev = CmpLayout.Length() ? &CmpLayout.Last() : NULL;
+	int64 Off0 = Prev ? Prev->Offset[0] + Prev->Len[0] : 0;
+	int64 Off1 = Prev ? Prev->Offset[1] + Prev->Len[1] : 0;
+	bool Same = Matched && !memcmp(Old.AddressOf((size_t)Off0), New.AddressOf((size_t)Off1), Len0);
+
+	if (Prev && Prev->Matched == Matched)
+	{
+		// Extend the last block
+		Prev->Len[0] += Len0;
+		Prev->Len[1] += Len1;
+		Prev->Same &= Same;
+		return;
+	}
+
+	Layout &l = CmpLayout.New();
+	l.Offset[0] = Off0;
+	l.Offset[1] = Off1;
+	l.Len[0] = Len0;
+	l.Len[1] = Len1;
+	l.Matched = Matched;
+	l.Same = Same;
+}
+
+void GHexView::AlignCompare()
+{
+	DiffMap.Reset();
+	Moves.Reset();
+	CmpLayout.Length(0);
+	DiffInfo.ctrl.Length(0);
+	DiffInfo.db.Length(0);
+	DiffInfo.eb.Length(0);
+
+	if (Buf.Length() != 2 ||
+		!App->SetDirty(false))
+		return;
+
+	StartMoves();
+
+	if (Buf[0]->Base || Buf[1]->Base)
+	{
+		// Line the files up at their bases, whatever their size
+		int64 Base0 = MIN(Buf[0]->Base, Buf[0]->Size);
+		int64 Base1 = MIN(Buf[1]->Base, Buf[1]->Size);
+		int64 Common = MIN(Buf[0]->Size - Base0, Buf[1]->Size - Base1);
+		AddBaseLayout(Base0, Base1, false);
+		AddBaseLayout(Common, Common, true);
+		AddBaseLayout(Buf[0]->Size - Base0 - Common, Buf[1]->Size - Base1 - Common, false);
+		NumberLayout();
+		return;
+	}
+
+	if (Buf[0]->Size > ALIGN_MAX_SIZE ||
+		Buf[1]->Size > ALIGN_MAX_SIZE)
+	{
+		// Too big to align, start finding the differing blocks instead
+		StartDiffMap();
+		return;
+	}
+
+	GArray<uint8> Old, New;
+	if (!ReadBuffer(Buf[0], Old) ||
+		!ReadBuffer(Buf[1], New))
+		return;
+
+	if (!Old.Length() || !New.Length())
+	{
+		// Nothing to match up
+		AddLayout((int)Old.Length(), (int)New.Length(), false, Old, New);
+	}
+	else
+	{
+		bool Diffed;
+		{
+			GAutoPtr<GProgressDlg> Prog;
+			if (New.Length() > ALIGN_PROGRESS_SIZE &&
+				Prog.Reset(new GProgressDlg(this)))
+			{
+				Prog->SetDescription("Aligning files...");
+				Prog->SetLimits(0, New.Length());
+				Prog->SetScale(1.0 / 1024.0 / 1024.0);
+				Prog->SetType("MB");
+			}
+			Diffed = binary_diff(DiffInfo, &Old[0], (int)Old.Length(), &New[0], (int)New.Length(), Prog, ALIGN_MEM_LIMIT);
+		}
+		if (!Diffed)
+		{
+			// Cancelled or out of memory, compare byte for byte instead
+			DiffInfo.ctrl.Length(0);
+			StartDiffMap();
+			return;
+		}
+
+		// binary_diff describes the new file as runs copied from anywhere in
+		// the old one (with some bytes changed) and runs of new bytes. Walk
+		// that in order, showing old bytes skipped over as removed and runs
+		// copied from old bytes already shown as inserted.
+		int64 OldPos = 0, Shown = 0;
+		for (unsigned i=0; i<DiffInfo.ctrl.Length(); i++)
+		{
+			ctrl_info &c = DiffInfo.ctrl[i];
+			int64 Add = c.a[0], Extra = c.a[1], Seek = c.a[2];
+			if (Add > 0)
+			{
+				if (OldPos > Shown)
+				{
+					AddLayout((int)(OldPos - Shown), 0, false, Old, New);
+					Shown = OldPos;
+				}
+
+				int64 Dup = MIN(Shown - OldPos, Add);
+				if (Dup > 0)
+					AddLayout(0, (int)Dup, false, Old, New);
+				else
+					Dup = 0;
+				if (Add > Dup)
+				{
+					AddLayout((int)(Add - Dup), (int)(Add - Dup), true, Old, New);
+					Shown = OldPos + Add;
+				}
+			}
+			if (Extra > 0)
+				AddLayout(0, (int)Extra, false, Old, New);
+			OldPos += Add + Seek;
+		}
+		if (Shown < (int64)Old.Length())
+			AddLayout((int)(Old.Length() - Shown), 0, false, Old, New);
+	}
+
+	NumberLayout();
+}
+
+void GHexView::AddBaseLayout(int64 Len0, int64 Len1, bool Matched)
+{
+	if (!Len0 && !Len1)
+		return;
+
+	// Matched blocks aren't checked for being the same, finding the
+	// differences reads them as needed.
+	Layout *Prev = CmpLayout.Length() ? &CmpLayout.Last() : NULL;
+	Layout &l = CmpLayout.New();
+	l.Offset[0] = Prev ? Prev->Offset[0] + Prev->Len[0] : 0;
+	l.Offset[1] = Prev ? Prev->Offset[1] + Prev->Len[1] : 0;
+	l.Len[0] = Len0;
+	l.Len[1] = Len1;
+	l.Matched = Matched;
+	l.Same = false;
+}
+
+void GHexView::NumberLayout()
+{
+	// Give each block it's lines
+	int64 Line = 0;
+	for (unsigned i=0; i<CmpLayout.Length(); i++)
+	{
+		Layout &l = CmpLayout[i];
+		l.Line = Line;
+		l.Lines = MAX((MAX(l.Len[0], l.Len[1]) + BytesPerLine - 1) / BytesPerLine, 1);
+		Line += l.Lines;
+	}
+}
+
+GHexView::Layout *GHexView::FindLayout(int64 Line)
+{
+	// First block ending after 'Line'
+	size_t Lo = 0, Hi = CmpLayout.Length();
+	while (Lo < Hi)
+	{
+		size_t Mid = (Lo + Hi) >> 1;
+		Layout &l = CmpLayout[Mid];
+		if (l.Line + l.Lines <= Line)
+			Lo = Mid + 1;
+		else
+			Hi = Mid;
+	}
+
+	return Line >= 0 && Lo < CmpLayout.Length() ? &CmpLayout[Lo] : NULL;
+}
+
+int64 GHexView::GetLines()
+{
+	if (CmpLayout.Length())
+	{
+		Layout &l = CmpLayout.Last();
+		return l.Line + l.Lines;
+	}
+
+	int64 Lines = 0;
+	for (unsigned i=0; i<Buf.Length(); i++)
+		Lines = MAX(Lines, (Buf[i]->Size + BytesPerLine - 1) / BytesPerLine);
+	return Lines;
+}
+
+bool GHexView::GetLine(GHexBuffer *b, int64 Line, int64 &Offset, int &Len)
+{
+	int Idx = (int)Buf.IndexOf(b);
+	if (CmpLayout.Length() && Idx >= 0 && Idx < 2)
+	{
+		Layout *l = FindLayout(Line);
+		if (!l)
+			return false;
+
+		int64 Skip = (Line - l->Line) * BytesPerLine;
+		Offset = l->Offset[Idx] + MIN(Skip, l->Len[Idx]);
+		Len = (int) MAX(0, MIN(BytesPerLine, l->Len[Idx] - Skip));
+		return true;
+	}
+
+	Offset = Line * BytesPerLine;
+	if (!b || Line < 0 || Offset >= b->Size)
+		return false;
+	Len = (int) MIN(BytesPerLine, b->Size - Offset);
+	return true;
+}
+
+int64 GHexView::GetLineOfByte(GHexBuffer *b, int64 Offset, int &Col)
+{
+	int Idx = (int)Buf.IndexOf(b);
+	if (CmpLayout.Length() && Idx >= 0 && Idx < 2)
+	{
+		// First block on this side ending after 'Offset'
+		size_t Lo = 0, Hi = CmpLayout.Length();
+		while (Lo < Hi)
+		{
+			size_t Mid = (Lo + Hi) >> 1;
+			Layout &l = CmpLayout[Mid];
+			if (l.Offset[Idx] + l.Len[Idx] <= Offset)
+				Lo = Mid + 1;
+			else
+				Hi = Mid;
+		}
+
+		Layout &l = CmpLayout[MIN(Lo, CmpLayout.Length() - 1)];
+		int64 Rel = MAX(Offset - l.Offset[Idx], 0);
+		Col = (int) (Rel % BytesPerLine);
+		return l.Line + Rel / BytesPerLine;
+	}
+
+	Col = (int) (Offset % BytesPerLine);
+	return Offset / BytesPerLine;
+}
+
+// Copies bytes out of a buffer, through it's cache
+static bool ReadBytes(GHexBuffer *b, int64 Offset, uint8 *Ptr, int Len)
+{
+	while (Len > 0)
+	{
+		int Part = MIN(Len, DIFF_BLOCK_SIZE);
+		if (!b->GetData(Offset, Part))
+			return false;
+
+		memcpy(Ptr, b->Buf + (Offset - b->BufPos), Part);
+		Offset += Part;
+		Ptr += Part;
+		Len -= Part;
+	}
+
+	return true;
+}
+
+// Looks at 'Len' bytes from 'OffA' in 'a' against the same number from 'OffB'
+// in 'b' for the first (or last, if not 'Forward') that differs, or that is
+// the same if not 'WantDiff'. Returns it's index or -1.
+static int64 FindMismatch(GHexBuffer *a, int64 OffA, GHexBuffer *b, int64 OffB, int64 Len, bool Forward, bool WantDiff)
+{
+	GArray<uint8> Da, Db;
+	if (Len <= 0 ||
+		!Da.Length(DIFF_BLOCK_SIZE) ||
+		!Db.Length(DIFF_BLOCK_SIZE))
+		return -1;
+
+	for (int64 Done = 0; Done < Len; )
+	{
+		int Part = (int) MIN(Len - Done, DIFF_BLOCK_SIZE);
+		int64 Rel = Forward ? Done : Len - Done - Part;
+		if (!ReadBytes(a, OffA + Rel, &Da[0], Part) ||
+			!ReadBytes(b, OffB + Rel, &Db[0], Part))
+			return -1;
+
+		int64 i;
+		if (WantDiff)
+		{
+			i = Forward ? mem_mismatch(&Da[0], &Db[0], Part) : mem_mismatch_rev(&Da[0], &Db[0], Part);
+		}
+		else
+		{
+			for (i = Forward ? 0 : Part - 1; i >= 0 && i < Part && Da[(size_t)i] != Db[(size_t)i]; i += Forward ? 1 : -1)
+				;
+		}
+		if (i >= 0 && i < Part)
+			return Rel + i;
+
+		Done += Part;
+	}
+
+	return -1;
+}
+
+void GHexView::SetBase(GHexBuffer *b, int64 Base)
+{
+	if (Buf.Length() != 2 ||
+		Buf.IndexOf(b) < 0 ||
+		Base < 0 ||
+		Base > b->Size)
+		return;
+
+	// The other file starts at it's first byte
+	Buf[0]->Base = Buf[1]->Base = 0;
+	b->Base = Base;
+
+	AlignCompare();
+	UpdateScrollBar();
+	SetCursor(b, Base);
+	Invalidate();
+}
+
+void GHexView::AlignAtCursor()
+{
+	if (Buf.Length() != 2)
+		LgiMsg(this, "Compare two files to align them.", AppName);
+	else
+		SetBase(Cursor.Buf, Cursor.Index);
+}
+
+bool GHexView::AutoAlign()
+{
+	if (Buf.Length() != 2)
+	{
+		LgiMsg(this, "Compare two files to align them.", AppName);
+		return false;
+	}
+	if (!App->SetDirty(false))
+		return false;
+	if (!Buf[0]->File || !Buf[1]->File)
+	{
+		LgiMsg(this, "Both files need to be saved first.", AppName);
+		return false;
+	}
+
+	GFile a, b;
+	if (!a.Open(Buf[0]->File->GetName(), O_READ) ||
+		!b.Open(Buf[1]->File->GetName(), O_READ))
+	{
+		LgiMsg(this, "Can't open the files.", AppName);
+		return false;
+	}
+
+	int64 Delta;
+	int Score;
+	bool Found;
+	{
+		GProgressDlg Prog(this);
+		Prog.SetDescription("Finding the offset...");
+		Prog.SetLimits(0, a.GetSize() + b.GetSize());
+		Prog.SetScale(1.0 / 1024.0 / 1024.0);
+		Prog.SetType("MB");
+		Found = find_offset(&a, &b, Delta, Score, &Prog);
+		if (!Found && Prog.IsCancelled())
+			return false;
+	}
+	if (!Found)
+	{
+		LgiMsg(this, "The files have no data in common.", AppName);
+		return false;
+	}
+
+	if (Delta < 0)
+		SetBase(Buf[0], -Delta);
+	else
+		SetBase(Buf[1], Delta);
+	return true;
+}
+
+bool GHexView::StartDiffMap()
+{
+	if (Buf.Length() != 2 ||
+		CmpLayout.Length() ||
+		!Buf[0]->File ||
+		!Buf[1]->File ||
+		Buf[0]->IsDirty ||
+		Buf[1]->IsDirty)
+		return false;
+
+	if (!DiffMap)
+	{
+		if (!DiffMap.Reset(new GBlockDiffMap(Buf[0]->File->GetName(), Buf[1]->File->GetName())) ||
+			!DiffMap->Start())
+		{
+			DiffMap.Reset();
+			return false;
+		}
+
+		App->SetPulse(500);
+	}
+
+	return true;
+}
+
+bool GHexView::StartMoves()
+{
+	if (Moves)
+		return true;
+	if (Buf.Length() != 2 ||
+		!Buf[0]->File ||
+		!Buf[1]->File ||
+		Buf[0]->IsDirty ||
+		Buf[1]->IsDirty)
+		return false;
+
+	if (!Moves.Reset(new GMoveMap(Buf[0]->File->GetName(), Buf[1]->File->GetName())) ||
+		!Moves->Start())
+	{
+		Moves.Reset();
+		return false;
+	}
+
+	App->SetPulse(500);
+	return true;
+}
+
+GMoveMap *GHexView::GetMoves()
+{
+	return Moves && Buf.Length() == 2 && Moves->Length() ? Moves : NULL;
+}
+
+bool GHexView::GetMoveStatus(GString &s)
+{
+	if (!Moves || !Moves->IsRunning())
+		return false;
+
+	s.Printf("Finding moved blocks: %i%%", Moves->GetProgress());
+	return true;
+}
+
+void GHexView::PaintMoves(GSurface *pDC, GRect &r, int64 YPos)
+{
+	GMoveMap *m = GetMoves();
+	if (!m)
+		return;
+
+	// A line across the gap from the start of each move in the first file
+	// to its new place in the second, the cursor's move is drawn darker.
+	int x1 = Buf[0]->Pos.x2 + 1;
+	int x2 = Buf[1]->Pos.x1 - 1;
+	int Side = (int)Buf.IndexOf(Cursor.Buf);
+	GMoveMap::Move *Cur = Side >= 0 ? m->Find(Side, Cursor.Index) : NULL;
+	for (size_t i=0; i<m->Length(); i++)
+	{
+		GMoveMap::Move *mv = m->Get(1, i);
+		int y[2], Col;
+		bool Visible = false;
+		for (int n=0; n<2; n++)
+		{
+			int64 Line = GetLineOfByte(Buf[n], mv->Offset[n], Col) - YPos;
+			if (Line < -1)
+				Line = -1;
+			else if (Line > r.Y() / CharSize.y + 1)
+				Line = r.Y() / CharSize.y + 1;
+			y[n] = r.y1 + (int)Line * CharSize.y + (CharSize.y >> 1);
+			Visible |= y[n] >= r.y1 && y[n] <= r.y2;
+		}
+		if (!Visible)
+			continue;
+
+		pDC->Colour(mv == Cur ? ColourMovedLink : ColourMovedBack, 24);
+		pDC->Line(x1, y[0], x2, y[1]);
+	}
+}
+
+bool GHexView::GetDiffMapStatus(GString &s)
+{
+	if (!DiffMap || !DiffMap->IsRunning())
+		return false;
+
+	int64 Blocks = DiffMap->GetBlocks();
+	s.Printf("Comparing: %i%%", Blocks > 0 ? (int)(DiffMap->GetDone() * 100 / Blocks) : 0);
+	return true;
+}
+
+int64 GHexView::FindDiff(int Idx, int64 From, bool Forward, bool WantDiff)
+{
+	GHexBuffer *Me = Buf[Idx], *Other = Buf[!Idx];
+
+	if (CmpLayout.Length())
+	{
+		// Blocks that weren't matched up differ all the way through. A block
+		// with no bytes on this side still counts as a difference at the
+		// byte after the gap, so insertions on the other side can be found.
+		size_t Lo = 0, Hi = CmpLayout.Length();
+		while (Lo < Hi)
+		{
+			size_t Mid = (Lo + Hi) >> 1;
+			Layout &l = CmpLayout[Mid];
+			if (l.Offset[Idx] + l.Len[Idx] <= From)
+				Lo = Mid + 1;
+			else
+				Hi = Mid;
+		}
+		while (Forward && Lo > 0 && !CmpLayout[Lo-1].Len[Idx] && CmpLayout[Lo-1].Offset[Idx] >= From)
+			Lo--;
+
+		for (int64 i = Forward ? (int64)Lo : (int64)MIN(Lo, CmpLayout.Length() - 1);
+			i >= 0 && i < (int64)CmpLayout.Length();
+			i += Forward ? 1 : -1)
+		{
+			Layout &l = CmpLayout[(size_t)i];
+			int64 Start = l.Offset[Idx], End = Start + l.Len[Idx];
+			if (Forward)
+				Start = MAX(Start, From);
+			else
+				End = MIN(End, From + 1);
+
+			if (!l.Len[Idx])
+			{
+				if (WantDiff && !l.Matched && (Forward ? Start >= From : Start <= From))
+					return Start;
+				continue;
+			}
+			if (Start >= End)
+				continue;
+
+			if (!l.Matched || l.Same)
+			{
+				if (WantDiff == !l.Matched)
+					return Forward ? Start : End - 1;
+				continue;
+			}
+
+			int64 r = FindMismatch(Me, Start, Other, Start - l.Offset[Idx] + l.Offset[!Idx], End - Start, Forward, WantDiff);
+			if (r >= 0)
+				return Start + r;
+		}
+
+		return -1;
+	}
+
+	// Byte for byte, anything past the end of the other file differs
+	int64 Common = MIN(Me->Size, Other->Size);
+	if (Forward)
+	{
+		for (int64 Pos = From; Pos < Common; )
+		{
+			// Skip the blocks already known to be the same
+			int64 End = Common;
+			if (WantDiff && DiffMap)
+			{
+				int64 b = DiffMap->Find(Pos / DIFF_BLOCK_SIZE, true);
+				if (b < 0)
+					break;
+				Pos = MAX(Pos, b * DIFF_BLOCK_SIZE);
+				End = MIN(Common, (b + 1) * DIFF_BLOCK_SIZE);
+				if (Pos >= End)
+					break;
+			}
+
+			int64 r = FindMismatch(Me, Pos, Other, Pos, End - Pos, true, WantDiff);
+			if (r >= 0)
+				return Pos + r;
+			Pos = End;
+		}
 
-			Dec->Enabled(Valid);
-			Hex->Enabled(Valid);
+		if (WantDiff && Me->Size > Common)
+			return MAX(From, Common);
+	}
+	else
+	{
+		if (From >= Common)
+		{
+			if (WantDiff)
+				return From;
+			From = Common - 1;
 		}
 
-		if (w->GetViewById(IDC_HEX_4, Hex) &&
-			w->GetViewById(IDC_DEC_4, Dec))
+		for (int64 Pos = From; Pos >= 0; )
 		{
-			bool Valid = b->GetData(Cursor.Index, 4);
-			GString sHex, sDec;
-			if (Valid)
+			int64 Start = 0;
+			if (WantDiff && DiffMap)
 			{
-				uint32 *lp = (uint32*)(b->Buf + (Cursor.Index - b->BufPos));
-				uint32 c = *lp;
-				SwapBytes(&c, sizeof(c));
-
-				sDec.Printf(IsSigned ? "%i" : "%u", c);
-				sHex.Printf("%08.8X", c);
+				int64 b = DiffMap->Find(Pos / DIFF_BLOCK_SIZE, false);
+				if (b < 0)
+					break;
+				Pos = MIN(Pos, (b + 1) * DIFF_BLOCK_SIZE - 1);
+				Start = b * DIFF_BLOCK_SIZE;
 			}
 
-			Dec->Name(Valid ? sDec : NULL);
-			Hex->Name(Valid ? sHex : NULL);
+			int64 r = FindMismatch(Me, Start, Other, Start, Pos - Start + 1, false, WantDiff);
+			if (r >= 0)
+				return Start + r;
+			Pos = Start - 1;
+		}
+	}
 
-			Dec->Enabled(Valid);
-			Hex->Enabled(Valid);
+	return -1;
+}
+
+void GHexView::NextDifference(bool Forward)
+{
+	GHexBuffer *b = Cursor.Buf;
+	int Idx = (int)Buf.IndexOf(b);
+	if (Buf.Length() != 2 || Idx < 0 || !b->Size)
+		return;
+
+	StartDiffMap();
+
+	// Moves to the start of the next (or previous) run of differing bytes
+	int64 Cur = Cursor.Index, Hit = -1;
+	if (Forward)
+	{
+		int64 From = Cur + 1;
+		if (Cur >= 0 && FindDiff(Idx, Cur, true, true) == Cur)
+		{
+			// Skip the run the cursor is in
+			int64 Same = FindDiff(Idx, Cur, true, false);
+			From = Same == Cur ? Cur + 1 : Same;
+		}
+		if (From >= 0)
+			Hit = FindDiff(Idx, From, true, true);
+	}
+	else
+	{
+		int64 Last = FindDiff(Idx, (Cur < 0 ? b->Size : Cur) - 1, false, true);
+		if (Last >= 0)
+		{
+			int64 Same = FindDiff(Idx, Last, false, false);
+			Hit = Same == Last ? Last : Same + 1;
 		}
 	}
+
+	Hit = MIN(Hit, b->Size - 1);
+	if (Hit < 0 || Hit == Cur)
+	{
+		LgiMsg(this, "No more differences.", AppName);
+		return;
+	}
+
+	SetCursor(b, Hit);
 }
 
-bool FileToArray(GArray<uint8> &a, const char *File)
+bool GHexView::CreatePatch(char *PatchFile)
 {
-	GFile f;
-	if (!f.Open(File, O_READ))
+	if (Buf.Length() != 2)
+	{
+		LgiMsg(this, "Compare two files to make a patch between them.", AppName);
 		return false;
-	
-	if (!a.Length((size_t)f.GetSize()))
+	}
+	if (!PatchFile || !App->SetDirty(false))
 		return false;
-	
-	int rd = f.Read(&a[0], a.Length());
-	if (rd != a.Length())
+	if (!Buf[0]->File || !Buf[1]->File)
+	{
+		LgiMsg(this, "Both files need to be saved first.", AppName);
 		return false;
-	
-	return true;	
+	}
+
+	// The patch turns the first file into the second
+	GFile Old, New, Patch;
+	if (!Old.Open(Buf[0]->File->GetName(), O_READ) ||
+		!New.Open(Buf[1]->File->GetName(), O_READ) ||
+		!Patch.Open(PatchFile, O_WRITE))
+	{
+		LgiMsg(this, "Can't open the files.", AppName);
+		return false;
+	}
+	Patch.SetSize(0);
+
+	GProgressDlg Prog(this);
+	Prog.SetDescription("Creating patch...");
+	Prog.SetLimits(0, New.GetSize());
+	Prog.SetScale(1.0 / 1024.0 / 1024.0);
+	Prog.SetType("MB");
+
+	if (!bsdiff_create(&Old, &New, &Patch, &Prog))
+	{
+		Patch.Close();
+		FileDev->Delete(PatchFile, false);
+		if (!Prog.IsCancelled())
+			LgiMsg(this, "Creating the patch failed.", AppName);
+		return false;
+	}
+
+	return true;
 }
 
-void GHexView::CompareFile(char *CmpFile)
+bool GHexView::SaveDiffReport(char *ReportFile)
 {
-	if (FileExists(CmpFile))
+	if (Buf.Length() != 2)
 	{
-		GAutoPtr<GHexBuffer> b(new GHexBuffer(this));
-		if (b)
+		LgiMsg(this, "Compare two files to report on their differences.", AppName);
+		return false;
+	}
+	if (!ReportFile || !App->SetDirty(false))
+		return false;
+	if (!Buf[0]->File || !Buf[1]->File)
+	{
+		LgiMsg(this, "Both files need to be saved first.", AppName);
+		return false;
+	}
+
+	GFile a, b, Out;
+	if (!a.Open(Buf[0]->File->GetName(), O_READ) ||
+		!b.Open(Buf[1]->File->GetName(), O_READ))
+	{
+		LgiMsg(this, "Can't open the files.", AppName);
+		return false;
+	}
+
+	GDiffReport Report;
+	{
+		GProgressDlg Prog(this);
+		Prog.SetDescription("Comparing...");
+		Prog.SetLimits(0, MIN(a.GetSize(), b.GetSize()));
+		Prog.SetScale(1.0 / 1024.0 / 1024.0);
+		Prog.SetType("MB");
+		if (!Report.Compare(&a, &b, &Prog))
 		{
-			if (b->Open(CmpFile, false))
-			{
-				Buf.Add(b.Release());
-				UpdateScrollBar();
-				Invalidate();
-			}
+			if (!Prog.IsCancelled())
+				LgiMsg(this, "Reading the files failed.", AppName);
+			return false;
 		}
 	}
+
+	if (!Out.Open(ReportFile, O_WRITE))
+	{
+		LgiMsg(this, "Can't create '%s'.", AppName, MB_OK, ReportFile);
+		return false;
+	}
+	Out.SetSize(0);
+
+	size_t Len = strlen(ReportFile);
+	bool Json = Len > 5 && !stricmp(ReportFile + Len - 5, ".json");
+	return Report.Write(&Out, Json, Buf[0]->File->GetName(), Buf[1]->File->GetName());
+}
+
+bool GHexView::ApplyPatch(char *PatchFile, char *OutFile)
+{
+	GHexBuffer *b = Cursor.Buf ? Cursor.Buf : Buf.Length() ? Buf[0] : NULL;
+	if (!b || !PatchFile || !OutFile || !App->SetDirty(false))
+		return false;
+	if (!b->File)
+	{
+		LgiMsg(this, "The file needs to be saved first.", AppName);
+		return false;
+	}
+	if (!stricmp(OutFile, b->File->GetName()))
+	{
+		LgiMsg(this, "The patched file can't replace the original.", AppName);
+		return false;
+	}
+
+	GFile Old, Patch, New;
+	if (!Old.Open(b->File->GetName(), O_READ) ||
+		!Patch.Open(PatchFile, O_READ))
+	{
+		LgiMsg(this, "Can't open the files.", AppName);
+		return false;
+	}
+
+	GBspatch p(&Patch);
+	if (!p.ReadHeader())
+	{
+		LgiMsg(this, "'%s' isn't a bsdiff patch.", AppName, MB_OK, PatchFile);
+		return false;
+	}
+	if (!New.Open(OutFile, O_WRITE))
+	{
+		LgiMsg(this, "Can't create '%s'.", AppName, MB_OK, OutFile);
+		return false;
+	}
+	New.SetSize(0);
+
+	GProgressDlg Prog(this);
+	Prog.SetDescription("Applying patch...");
+	Prog.SetLimits(0, p.GetNewSize());
+	Prog.SetScale(1.0 / 1024.0 / 1024.0);
+	Prog.SetType("MB");
+
+	if (!p.Apply(&Old, &New, &Prog))
+	{
+		New.Close();
+		FileDev->Delete(OutFile, false);
+		if (!Prog.IsCancelled())
+			LgiMsg(this, "Applying the patch failed, it may be corrupt or for a different file.", AppName);
+		return false;
+	}
+
+	// Show the result next to the original
+	New.Close();
+	CompareFile(OutFile);
+	return true;
 }
 
 bool GHexView::CreateFile(int64 Len)
@@ -1922,6 +3141,7 @@ bool GHexView::CreateFile(int64 Len)
 	memset(b->Buf, 0, (size_t)Len);
 	b->BufUsed = (size_t)Len;
 	b->Size = Len;
+	DataGeneration++;
 
 	Focus(true);
 	SetCursor(b, 0);
@@ -1989,6 +3209,7 @@ bool GHexView::CloseFile(int Index)
 
 	delete Buf[Index];
 	Buf.DeleteAt(Index, true);
+	AlignCompare();
 	
 	Cursor.Empty();
 	Selection.Empty();
@@ -2058,6 +3279,7 @@ bool GHexView::SaveFile(GHexBuffer *b, char *FileName)
 			{
 				size_t Len = (size_t)MIN(b->BufLen, b->Size - b->BufPos);
 				Status = b->File->Write(b->Buf, Len) == Len;
+				b->FlushPages();
 			}
 		}
 	}
@@ -2188,6 +3410,7 @@ void GHexView::SelectionFillRandom(GStream *Rnd)
 		{
 			b->BufUsed = b->File->Read(b->Buf, b->BufLen);
 		}
+		b->FlushPages();
 	
 		Invalidate();
 	}
@@ -2242,18 +3465,13 @@ void GHexView::OnPaint(GSurface *pDC)
 	}
 
 	int64 YPos = VScroll ? VScroll->Value() : 0;
-	int64 Start = YPos * BytesPerLine;
 	
 	int Columns = (3 * BytesPerLine) + GAP_HEX_ASCII + (BytesPerLine);
 	int Lines = (r.Y() + CharSize.y -1) / CharSize.y;
 	
 	Cursor.Pos.Length(0);
 
-	int64 MaxSize = 0;
-	for (unsigned int BufIdx = 0; BufIdx < Buf.Length(); BufIdx++)
-		MaxSize = MAX(MaxSize, Buf[BufIdx]->Size);
-	int64 AddrLines = (MaxSize + BytesPerLine - 1) / BytesPerLine;
-	int64 Addrs = AddrLines - YPos;
+	int64 Addrs = GetLines() - YPos;
 
 	// Draw all the addresses
 	Font->Transparent(false);
@@ -2265,10 +3483,16 @@ void GHexView::OnPaint(GSurface *pDC)
 		CurrentY = r.y1 + (Line * CharSize.y);
 		if (CurrentY > r.y2)
 			break;
-		int64 LineAddr = Start + (Line * BytesPerLine);
+		// Aligned the addresses are those of the first file, blank on it's gaps
+		int64 LineAddr = (YPos + Line) * BytesPerLine;
+		int LineLen = BytesPerLine;
+		if (CmpLayout.Length())
+			GetLine(Buf[0], YPos + Line, LineAddr, LineLen);
 			
 		GString p;
-		if (IsHex)
+		if (LineLen == 0)
+			p.Printf("%13s", "");
+		else if (IsHex)
 			p.Printf("%02.2x:%08.8X  ", (uint)(LineAddr >> 32), (uint)LineAddr);
 		else
 			#ifdef WIN32
@@ -2319,12 +3543,15 @@ void GHexView::OnPaint(GSurface *pDC)
 		Ds.Draw(pDC, r.x1, r.y1);
 		TopMargin.Subtract(&r);
 	
-		int64 End = MIN(b->Size, Start + (Lines * BytesPerLine));
-		if (b->GetData(Start, (size_t)(End-Start)))
-		{
-			GHexBuffer *Comp = Buf.Length() > 1 ? Buf[!BufIdx] : NULL;
-			b->OnPaint(pDC, Start, End - Start, Comp);
-		}
+		// The reference is compared to all the other files, they are only
+		// compared to the reference.
+		GArray<GHexBuffer*> Comp;
+		if (BufIdx)
+			Comp.Add(Buf[0]);
+		else
+			for (unsigned i=1; i<Buf.Length(); i++)
+				Comp.Add(Buf[i]);
+		b->OnPaint(pDC, YPos, Lines, Comp);
 
 		CurrentX = b->Pos.x2;
 	}
@@ -2335,6 +3562,7 @@ void GHexView::OnPaint(GSurface *pDC)
 		pDC->Colour(LC_WORKSPACE, 24);
 		pDC->Rectangle(CurrentX + 1, r.y1, r.x2, r.y2);
 	}
+	PaintMoves(pDC, r, YPos);
 	if (TopMargin.Length() > 0)
 	{
 		for (unsigned i=0; i<TopMargin.Length(); i++)
@@ -2358,7 +3586,7 @@ bool GHexView::OnMouseWheel(double Lines)
 
 bool GHexView::GetCursorFromLoc(int x, int y, GHexCursor &c)
 {
-	uint64 Start = ((uint64)(VScroll ? VScroll->Value() : 0)) * BytesPerLine;
+	int64 YPos = VScroll ? VScroll->Value() : 0;
 	int HexCols = BytesPerLine * 3;
 	int AsciiCols = HexCols + GAP_HEX_ASCII;
 
@@ -2368,6 +3596,13 @@ bool GHexView::GetCursorFromLoc(int x, int y, GHexCursor &c)
 		if (b->Pos.Overlap(x, y))
 		{
 			int row = (y - b->Pos.y1) / CharSize.y;
+			int64 Start;
+			int Len;
+			if (!GetLine(b, YPos + row, Start, Len) || !Len)
+			{
+				// Past the end of the file or on a gap
+				return false;
+			}
 			if (b->Content[row])
 			{
 				GDisplayString Ds(Font, b->Content[row]);
@@ -2379,7 +3614,7 @@ bool GHexView::GetCursorFromLoc(int x, int y, GHexCursor &c)
 					int Bit = col % 3;
 
 					c.Buf = b;
-					c.Index = Start + (row * BytesPerLine) + Byte;
+					c.Index = Start + MIN(Byte, Len - 1);
 					c.Nibble = Bit > 0;
 					c.Pane = HexPane;
 					return true;
@@ -2387,10 +3622,10 @@ bool GHexView::GetCursorFromLoc(int x, int y, GHexCursor &c)
 				else if (col >= AsciiCols)
 				{
 					int Asc = col - AsciiCols;
-					if (Asc < BytesPerLine)
+					if (Asc < Len)
 					{
 						c.Buf = b;
-						c.Index = Start + (row * BytesPerLine) + Asc;
+						c.Index = Start + Asc;
 						c.Nibble = 0;
 						c.Pane = AsciiPane;
 						return true;
@@ -2759,7 +3994,7 @@ AppWnd::AppWnd() : GDocApp<GOptionsFile>(AppName, "MAIN")
 	Bar = 0;
 	Split = 0;
 	Visual = 0;
-	TextView = 0;
+	Strings = 0;
 
 	if (_Create())
 	{
@@ -2787,7 +4022,7 @@ AppWnd::AppWnd() : GDocApp<GOptionsFile>(AppName, "MAIN")
 			CmdFind.ToolButton = Tools->AppendButton("Search", IDM_SEARCH, TBT_PUSH, false, 3);
 			Tools->AppendSeparator();
 			CmdVisualise.ToolButton = Tools->AppendButton("Visualise", IDM_VISUALISE, TBT_TOGGLE, false, 4);
-			CmdText.ToolButton = Tools->AppendButton("Text", IDM_TEXTVIEW, TBT_TOGGLE, false, 5);
+			CmdText.ToolButton = Tools->AppendButton("Strings", IDM_TEXTVIEW, TBT_TOGGLE, false, 5);
 		}
 
 		PourAll();
@@ -2833,10 +4068,10 @@ void AppWnd::OnReceiveFiles(GArray<char*> &Files)
 {
 	if (Files.Length() > 0)
 	{
-		if (OpenFile(Files[0], false) &&
-			Files.Length() > 1)
+		if (OpenFile(Files[0], false))
 		{
-			Doc->CompareFile(Files[1]);
+			for (unsigned i=1; i<Files.Length(); i++)
+				Doc->CompareFile(Files[i]);
 		}
 	}
 }
@@ -2863,6 +4098,10 @@ void AppWnd::OnDirty(bool NewValue)
 	CmdSave.Enabled(NewValue);
 	CmdSaveAs.Enabled(NewValue);
 	
+	// Opened or saved, either way the strings on disk have changed
+	if (!NewValue)
+		StartStrings();
+
 	// CmdClose.Enabled(Doc && Doc->HasFile());
 	// CmdChangeSize.Enabled(Doc && Doc->HasFile());
 }
@@ -2887,26 +4126,10 @@ int AppWnd::OnNotify(GViewI *Ctrl, int Flags)
 			{
 				char *Data;
 				size_t Len;
-				if (Visual && Doc->GetDataAtCursor(Data, Len))
-				{
-					Visual->Visualise(Data, Len, GetCtrlValue(IDC_LITTLE) );
-				}
-				if (TextView && Doc->GetDataAtCursor(Data, Len))
+				int64 Offset;
+				if (Visual && Doc->GetDataAtCursor(Data, Len, &Offset))
 				{
-					GStringPipe p(1024);
-					for (char *s = Data; s < Data + Len && s < Data + (4 << 10) && *s; s++)
-					{
-						if (*s >= ' ' || *s == '\n' || *s == '\t')
-						{
-							p.Push(s, 1);
-						}
-					}
-					char *t = p.NewStr();
-					if (t)
-					{
-						TextView->Name(t);
-						DeleteArray(t);
-					}
+					Visual->Visualise(Data, Len, GetCtrlValue(IDC_LITTLE), Offset, Doc->GetDataGeneration(), Doc);
 				}
 				
 				auto SelLen = Doc->GetSelectedNibbles();
@@ -2922,6 +4145,20 @@ int AppWnd::OnNotify(GViewI *Ctrl, int Flags)
 
 void AppWnd::OnPulse()
 {
+	// Report on a search index or compare running in the background
+	GString s;
+	if (Doc && (Doc->GetIndexStatus(s) || Doc->GetDiffMapStatus(s) || Doc->GetMoveStatus(s)))
+	{
+		SetStatus(0, s);
+	}
+	else
+	{
+		// Show anything that was found
+		if (Doc)
+			Doc->Invalidate();
+		SetStatus(0, (char*)"");
+		SetPulse(-1);
+	}
 }
 
 GMessage::Result AppWnd::OnEvent(GMessage *Msg)
@@ -2968,7 +4205,7 @@ void AppWnd::ToggleVisualise()
 	PourAll();
 }
 
-void AppWnd::ToggleTextView()
+void AppWnd::ToggleStrings()
 {
 	if (GetCtrlValue(IDM_TEXTVIEW))
 	{
@@ -2984,7 +4221,7 @@ void AppWnd::ToggleTextView()
 			Split->Raised(false);
 			Split->Attach(this);
 			Split->SetViewA(Doc, false);
-			Split->SetViewB(TextView = new GTextView3(100, 0, 0, 100, 100, 0), false);
+			Split->SetViewB(Strings = new GStringsView(this), false);
 		}
 	}
 	else
@@ -2992,10 +4229,11 @@ void AppWnd::ToggleTextView()
 		Doc->Detach();
 		DeleteObj(Split);
 		Doc->Attach(this);
-		TextView = 0;
+		Strings = 0;
 	}
 
 	PourAll();
+	StartStrings();
 }
 
 int Cmp(char **a, char **b)
@@ -3108,7 +4346,7 @@ int AppWnd::OnCommand(int Cmd, int Event, OsView Wnd)
 			if (GetCtrlValue(IDM_TEXTVIEW))
 			{
 				SetCtrlValue(IDM_TEXTVIEW, false);
-				ToggleTextView();
+				ToggleStrings();
 			}
 			ToggleVisualise();
 			OnNotify(Doc, GNotifyCursorChanged);
@@ -3121,7 +4359,7 @@ int AppWnd::OnCommand(int Cmd, int Event, OsView Wnd)
 				SetCtrlValue(IDM_VISUALISE, false);
 				ToggleVisualise();
 			}
-			ToggleTextView();
+			ToggleStrings();
 			OnNotify(Doc, GNotifyCursorChanged);
 			break;
 		}
@@ -3169,6 +4407,47 @@ int AppWnd::OnCommand(int Cmd, int Event, OsView Wnd)
 			}
 			break;
 		}
+		case IDM_CREATE_PATCH:
+		{
+			if (Doc)
+			{
+				GFileSelect s;
+				s.Parent(this);
+				if (s.Save())
+					Doc->CreatePatch(s.Name());
+			}
+			break;
+		}
+		case IDM_DIFF_REPORT:
+		{
+			if (Doc)
+			{
+				GFileSelect s;
+				s.Parent(this);
+				s.Type("Text", "*.txt");
+				s.Type("JSON", "*.json");
+				if (s.Save())
+					Doc->SaveDiffReport(s.Name());
+			}
+			break;
+		}
+		case IDM_APPLY_PATCH:
+		{
+			if (Doc && Doc->HasFile())
+			{
+				GFileSelect p;
+				p.Parent(this);
+				if (!p.Open())
+					break;
+				GAutoString PatchFile(NewStr(p.Name()));
+
+				GFileSelect s;
+				s.Parent(this);
+				if (s.Save())
+					Doc->ApplyPatch(PatchFile, s.Name());
+			}
+			break;
+		}
 		case IDM_FILL_RND:
 		{
 			if (!Doc)
@@ -3199,16 +4478,103 @@ int AppWnd::OnCommand(int Cmd, int Event, OsView Wnd)
 			}
 			break;
 		}
+		case IDM_NEXT_DIFF:
+		case IDM_PREV_DIFF:
+		{
+			if (Doc)
+				Doc->NextDifference(Cmd == IDM_NEXT_DIFF);
+			break;
+		}
+		case IDM_AUTO_ALIGN:
+		{
+			if (Doc)
+				Doc->AutoAlign();
+			break;
+		}
+		case IDM_ALIGN_CURSOR:
+		{
+			if (Doc)
+				Doc->AlignAtCursor();
+			break;
+		}
+		case IDM_NUMERIC_SEARCH:
+		{
+			if (!Doc || !Doc->HasFile() || !Bar)
+				break;
+
+			NumericSearchDlg Dlg(this, Bar->IsLittleEndian(), Bar->IsSigned());
+			if (Dlg.DoModal() == IDOK && Dlg.Engine)
+				StartScan(Dlg.Engine.Release(), Dlg.Desc);
+			break;
+		}
+		case IDM_REPLACE:
+		{
+			if (!Doc || !Doc->HasFile())
+				break;
+
+			ReplaceDlg Dlg(this);
+			if (Dlg.DoModal() == IDOK)
+				Doc->ReplaceAll(Dlg.Find, Dlg.Replace, Dlg.MatchCase);
+			break;
+		}
+		case IDM_BATCH_SEARCH:
+		{
+			BatchSearchDlg Dlg(this);
+			if (Dlg.DoModal() == IDOK && Dlg.Engine)
+			{
+				GBatchResults *r = new GBatchResults(this, Dlg.Engine.Release(), Dlg.Desc, Dlg.FirstOnly);
+				if (!r->Start(Dlg.Path))
+					r->Quit();
+			}
+			break;
+		}
+		case IDM_BUILD_INDEX:
+		{
+			if (!Doc || !Doc->HasFile())
+				break;
+
+			// Edits have to be on disk before they can be indexed
+			if (SetDirty(false) && !Doc->BuildIndex())
+				LgiMsg(this, "The search index is already being built.", AppName);
+			break;
+		}
+		case IDM_SIGNATURE_SCAN:
+		{
+			if (!Doc || !Doc->HasFile())
+				break;
+
+			GFileSelect s;
+			s.Parent(this);
+			s.Type("Signature Lists", "*.sig;*.txt");
+			s.Type("All Files", LGI_ALL_FILES);
+			if (s.Open())
+			{
+				GAutoPtr<GAhoCorasick> Ac(new GAhoCorasick);
+				GString Err;
+				if (!Ac->LoadSignatures(s.Name(), &Err) ||
+					!Ac->Compile())
+				{
+					LgiMsg(this, "Failed to load signatures: %s", AppName, MB_OK, Err.Length() ? Err.Get() : "too many patterns");
+					break;
+				}
+
+				GString Desc;
+				Desc.Printf("Signatures (" LPrintfSizeT ")", Ac->Length());
+				StartScan(Ac.Release(), Desc);
+			}
+			break;
+		}
 		case IDM_FILE_COMPARE:
 		{
 			if (Doc && Doc->HasFile())
 			{
 				GFileSelect s;
 				s.Parent(this);
+				s.MultiSelect(true);
 				if (s.Open())
 				{
-					char *Sn = s.Name();
-					Doc->CompareFile(Sn);
+					for (unsigned i=0; i<s.Length(); i++)
+						Doc->CompareFile(s[i]);
 				}
 			}
 			break;
@@ -3290,6 +4656,62 @@ void AppWnd::Help(const char *File)
 	}
 }
 
+void AppWnd::GotoHit(int64 Offset, int64 Len, bool Focus)
+{
+	GHexBuffer *b = Doc ? Doc->GetCursorBuffer() : NULL;
+	if (!b || Offset < 0 || Offset >= b->Size)
+		return;
+
+	Doc->SetCursor(b, Offset);
+	if (Len > 1)
+		Doc->SetCursor(b, Offset + Len - 1, 1, true);
+	if (Focus)
+		Doc->Focus(true);
+}
+
+bool AppWnd::StartScan(GScanEngine *Engine, const char *Desc)
+{
+	GAutoPtr<GScanEngine> Eng(Engine);
+	GHexBuffer *b = Doc ? Doc->GetCursorBuffer() : NULL;
+	if (!b || !Eng)
+		return false;
+
+	// The workers read from disk, so any edits have to be there first
+	if (!SetDirty(false))
+		return false;
+
+	GSearchResults *r = new GSearchResults(this, Eng.Release(), Desc);
+	bool Status = b->File ? r->Start(b->File->GetName()) : r->Start(NULL, b->Buf, b->BufUsed);
+	if (!Status)
+		r->Quit();
+
+	return Status;
+}
+
+GString AppWnd::GetScanFile()
+{
+	GHexBuffer *b = Doc ? Doc->GetCursorBuffer() : NULL;
+	if (!b || !b->File || !SetDirty(false))
+		return GString();
+
+	return b->File->GetName();
+}
+
+void AppWnd::StartStrings()
+{
+	if (!Strings)
+		return;
+
+	// Unsaved edits aren't listed until they're saved
+	GHexBuffer *b = Doc ? Doc->GetCursorBuffer() : NULL;
+	if (!b)
+		Strings->Empty();
+	else if (b->File)
+		Strings->Start(b->File->GetName());
+	else
+		Strings->Start(NULL, b->Buf, b->BufUsed);
+}
+
 void AppWnd::SetStatus(int Pos, char *Text)
 {
 	if (Pos >= 0 && Pos < 3 && StatusInfo[Pos] && Text)
@@ -3368,6 +4790,20 @@ int LgiMain(OsAppArguments &AppArgs)
 	GApp a(AppArgs, "i.Hex");
 	if (a.IsOk())
 	{
+		// Batch search from the command line, no UI
+		if (a.GetOption("grep"))
+			return BatchSearchCommandLine();
+		if (a.GetOption("searchtest"))
+			return SearchSelfTest();
+		if (a.GetOption("sortbench"))
+			return SuffixSortBenchmark();
+		if (a.GetOption("bsdiff") || a.GetOption("bspatch"))
+			return PatchCommandLine();
+		if (a.GetOption("patchbench"))
+			return PatchBenchmark();
+		if (a.GetOption("diffreport"))
+			return DiffReportCommandLine();
+
 		a.AppWnd = new AppWnd;
 		a.Run();
 	}
@@ -39,12 +39,18 @@ enum Commands
 	IDM_COMPILE,
 	IDM_TEXTVIEW,
 	IDM_LOCK,
+	IDM_PARSE_FILE,
 };
 
 enum Controls
 {
 	IDC_HEX_VIEW = 1000,
 	IDC_LIST,
+	IDC_STRINGS_LIST,
+	IDC_STRINGS_FILTER,
+	IDC_STRINGS_MIN,
+	IDC_STRINGS_UTF16,
+	IDC_DECODE_TREE,
 };
 
 #define MAX_SIZES					8
@@ -75,7 +81,7 @@ class AppWnd : public GDocApp<GOptionsFile>, public GScriptContext
 	class GHexView *Doc;
 	class IHexBar *Bar;
 	class GVisualiseView *Visual;
-	class GTextView3 *TextView;
+	class GStringsView *Strings;
 	GCommand CmdSave;
 	GCommand CmdSaveAs;
 	GCommand CmdClose;
@@ -92,7 +98,7 @@ class AppWnd : public GDocApp<GOptionsFile>, public GScriptContext
 	GStatusPane *StatusInfo[3];
 
 	void ToggleVisualise();
-	void ToggleTextView();
+	void ToggleStrings();
 
 	GHostFunc *GetCommands() { return 0; }
 	void SetEngine(GScriptEngine *Eng) {}
@@ -121,6 +127,14 @@ public:
 	void OnDirty(bool NewValue);
 	void Help(const char *File);
 	void OnReceiveFiles(GArray<char*> &Files);
+
+	// Search
+	void GotoHit(int64 Offset, int64 Len, bool Focus = true);
+	bool StartScan(class GScanEngine *Engine, const char *Desc);
+	void StartStrings();
+	/// Saves any edits and returns the file background workers should
+	/// read, or an empty string if the data isn't in a file.
+	GString GetScanFile();
 };
 
 class SearchDlg : public GDialog
@@ -132,6 +146,10 @@ public:
 	bool MatchWord;
 	bool MatchCase;
 	bool SearchUp;
+	int MaxDiff;		// >0 for an approximate search
+	bool AllowIndels;
+	int Encoding;		// SearchEncoding of the text
+	GString Text;
 	
 	uchar *Bin;
 	int64 Length;
@@ -143,18 +161,85 @@ public:
 	void OnCreate();
 };
 
-#include "GTextView3.h"
+class NumericSearchDlg : public GDialog
+{
+	AppWnd *App;
+	bool Little;
+	bool Signed;
+
+public:
+	GAutoPtr<class GNumericSearch> Engine;
+	GString Desc;
+
+	NumericSearchDlg(AppWnd *app, bool little, bool isSigned);
+
+	int OnNotify(GViewI *c, int f);
+};
+
+class ReplaceDlg : public GDialog
+{
+	AppWnd *App;
+
+public:
+	GArray<uint8> Find, Replace;
+	bool MatchCase;
+
+	ReplaceDlg(AppWnd *app);
+
+	int OnNotify(GViewI *c, int f);
+};
+
+class BatchSearchDlg : public GDialog
+{
+	AppWnd *App;
+
+public:
+	GString Path;
+	GString Desc;
+	GAutoPtr<class GAhoCorasick> Engine;
+	bool FirstOnly;
+
+	BatchSearchDlg(AppWnd *app);
+
+	int OnNotify(GViewI *c, int f);
+};
+
+/// Gives the visualiser the rest of the file, so arrays can be shown past
+/// the end of the data it was given.
+class GVisualiseSource
+{
+public:
+	virtual ~GVisualiseSource() {}
+
+	virtual int64 GetFileSize() = 0;
+	/// Changes whenever the bytes of the file do
+	virtual uint64 GetDataGeneration() = 0;
+	virtual bool ReadAt(int64 Offset, uchar *Out, int Len) = 0;
+};
+
+#include "GTree.h"
 class GVisualiseView : public GSplitter
 {
 	AppWnd *App;
 	class GMapWnd *Map;
-	GTextView3 *Txt;
+	GTree *Tree;
 	char Base[MAX_PATH];
+	class GVisualiseCache *Cache; // The last decode
+
+	void Highlight(int64 Offset);
+	void ClearDecode();
+	void ShowMessage(const char *Msg);
 
 public:
 	GVisualiseView(AppWnd *app, char *DefVisual = NULL);
+	~GVisualiseView();
 	int OnNotify(GViewI *c, int f);
-	void Visualise(char *Data, int Len, bool Little);
+	/// Decodes 'Data' with the selected map. 'Offset' is where 'Data' is in
+	/// the file and 'Generation' changes whenever the file's bytes do. If
+	/// both match the last decode and 'Offset' is inside it, the member at
+	/// 'Offset' is selected instead of decoding again. Arrays running past
+	/// the end of 'Data' are read from 'Src' when expanded.
+	void Visualise(char *Data, int Len, bool Little, int64 Offset = -1, uint64 Generation = 0, GVisualiseSource *Src = NULL);
 };
 
 #endif
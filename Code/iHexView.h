@@ -38,6 +38,7 @@ public:
 
 	// Position
 	GRect Pos;
+	int64 Base;			// Lined up with the other file's Base when comparing
 
 	// Layout
 	GString::Array Content;
@@ -53,6 +54,7 @@ public:
 		BufPos = 0;
 		Size = 0;
 		Used = 0;
+		Base = 0;
 		IsDirty = false;
 		IsReadOnly = false;
 		Content.SetFixedLength(false);
@@ -68,6 +70,7 @@ public:
 		if (File)
 		{
 			Size = File->SetSize(sz);
+			FlushPages();
 		}
 		else // Memory buffer... resize the memory
 		{
@@ -122,6 +125,7 @@ public:
 
 	void Empty()
 	{
+		FlushPages();
 		DeleteObj(File);
 		DeleteArray(Buf);
 		BufLen = 0;
@@ -129,6 +133,7 @@ public:
 		BufPos = 0;
 		Used = 0;
 		Size = 0;
+		Base = 0;
 	}
 
 	bool HasData()
@@ -137,11 +142,21 @@ public:
 			(Buf != 0 &&  BufUsed > 0);
 	}
 
+	/// Forget the cached data so it's read from the file again
+	void Reload()
+	{
+		BufPos = Size;
+		BufUsed = 0;
+		FlushPages();
+	}
+
+	/// Drops this file's data from the view's page cache
+	void FlushPages();
 	bool Save();
 	void SetDirty(bool Dirty = true);
 	bool GetData(int64 Start, size_t Len);
 	bool GetLocationOfByte(GArray<GRect> &Loc, int64 Offset, const char16 *LineBuf);
-	void OnPaint(GSurface *pDC, int64 Start, int64 Len, GHexBuffer *Compare);
+	void OnPaint(GSurface *pDC, int64 FirstLine, int Lines, GArray<GHexBuffer*> &Compare);
 };
 
 struct GHexCursor
@@ -180,7 +195,41 @@ struct GHexCursor
 	}
 };
 
-class GHexView : public GLayout
+// Pages of file data shared by all the columns of a compare, so the bytes
+// of one file are read once however many other columns compare against it.
+class GHexPageCache
+{
+	struct Page
+	{
+		GHexBuffer *Buf;	// NULL if the page is free
+		int64 Index;		// Offset in the file / HEX_PAGE_SIZE
+		int Used;
+		uint64 Stamp;		// Last use, the oldest page is replaced
+		uchar *Data;
+	};
+
+	GArray<Page> Pages;
+	Page *Last;			// The most recently used page
+	uint64 Clock;
+
+	Page *GetPage(GHexBuffer *b, int64 Index);
+
+public:
+	GHexPageCache();
+	~GHexPageCache();
+
+	/// Copies 'Len' bytes of 'b' at 'Offset' to 'Out'. Bytes in the
+	/// buffer's own window come from there, as it may have unsaved edits.
+	bool Read(GHexBuffer *b, int64 Offset, uchar *Out, int Len);
+	/// Like Read but points straight into the window or a cached page when
+	/// the range is all in one, otherwise the bytes are copied to 'Tmp'. The
+	/// pointer is good until the next call.
+	const uchar *Map(GHexBuffer *b, int64 Offset, int Len, uchar *Tmp);
+	/// Drops the pages of 'b', or all pages if NULL.
+	void Invalidate(GHexBuffer *b = NULL);
+};
+
+class GHexView : public GLayout, public GVisualiseSource
 {
 	friend class GHexBuffer;
 
@@ -195,35 +244,73 @@ class GHexView : public GLayout
 		int BytesPerLine; // Number of bytes to display on each line
 		int IntWidth; // Number of bytes to display in one contiguous number
 
-	// Data buffers
+	// Data buffers, when comparing Buf[0] is the reference the others are
+	// compared to.
 	GArray<GHexBuffer*> Buf;
-
-	// Comparison file
+	GHexPageCache Pages;
+
+	// Comparison file, aligned with binary_diff when both files are small
+	// enough. Each block of the layout starts on a new line. Matched blocks
+	// have the same length on both sides (some bytes may still differ),
+	// other blocks are bytes inserted, removed or replaced, so the shorter
+	// side gets gap lines and the data after the block lines up again.
+	// If either file has a base offset the layout lines the bases up
+	// instead, with the bytes before them side by side above.
 	diff_info DiffInfo;
 	
 	struct Layout
 	{
-		int Len[2];
+		int64 Len[2];
 		int64 Offset[2];
-		uint8 *Data[2];
-		GRect Pos[2];
-		bool Same;
+		int64 Line;			// First display line of the block
+		int64 Lines;
+		bool Matched;
+		bool Same;			// Matched and no bytes differ
 		
 		Layout()
 		{
-			Same = false;
+			Matched = Same = false;
 			Len[0] = Len[1] = 0;
 			Offset[0] = Offset[1] = 0;
-			Data[0] = Data[1] = NULL;
+			Line = Lines = 0;
 		}
 	};
 	GArray<Layout> CmpLayout;
+	void AlignCompare();
+	void AddLayout(int Len0, int Len1, bool Matched, GArray<uint8> &Old, GArray<uint8> &New);
+	void AddBaseLayout(int64 Len0, int64 Len1, bool Matched);
+	void NumberLayout();
+	Layout *FindLayout(int64 Line);
+
+	// Which blocks differ when the files are compared byte for byte, built
+	// in the background so differences can be found without reading it all.
+	GAutoPtr<class GBlockDiffMap> DiffMap;
+	bool StartDiffMap();
+	/// The nearest byte of Buf[Idx] from 'From' that differs from the other
+	/// file (or is the same, if not 'WantDiff'), or -1.
+	int64 FindDiff(int Idx, int64 From, bool Forward, bool WantDiff);
+
+	// Blocks of the first file found at a different offset in the second,
+	// drawn with their own colour and linked across the gap between files.
+	GAutoPtr<class GMoveMap> Moves;
+	bool StartMoves();
+	GMoveMap *GetMoves();
+	void PaintMoves(GSurface *pDC, GRect &r, int64 YPos);
+
+	// Search index for the cursor's file, if one has been built
+	GAutoPtr<class GSearchIndex> Index;
+	GSearchIndex *GetIndex(GHexBuffer *b);
+	int IndexSearch(SearchDlg *For, int64 &Hit);
 	
 	// void PaintLayout(GSurface *pDC, Layout &l, GRect &client);
 
 	// Cursors
 	GHexCursor Cursor, Selection;
 
+	// Changes whenever the bytes of any file do, so views of the data can
+	// tell if what they showed is still current.
+	uint64 DataGeneration;
+
 	void SwapBytes(void *p, int Len);
 	void InvalidateByte(int64 Idx);
 
@@ -243,11 +330,33 @@ public:
 	void SelectionFillRandom(GStream *Rnd);
 	void SelectAll();
 	void CompareFile(char *File);
+	void NextDifference(bool Forward);
+	/// Lines 'Base' in 'b' up with the start of the other compared file.
+	void SetBase(GHexBuffer *b, int64 Base);
+	void AlignAtCursor();
+	/// Finds where the data of one compared file is in the other and lines
+	/// them up there.
+	bool AutoAlign();
+	/// Writes a bsdiff patch from the first compared file to the second.
+	bool CreatePatch(char *PatchFile);
+	/// Patches the cursor's file, writing the result to 'OutFile'.
+	bool ApplyPatch(char *PatchFile, char *OutFile);
+	/// Writes a report of how the two compared files differ, as JSON if
+	/// the file name ends in '.json' otherwise as text.
+	bool SaveDiffReport(char *ReportFile);
+	bool GetDiffMapStatus(GString &s);
+	bool GetMoveStatus(GString &s);
 
 	void Copy(FormatType Fmt);
 	void Paste(FormatType Fmt);
 
 	bool HasSelection();
+	/// Display lines and the bytes of a buffer on each. Without an aligned
+	/// compare line 'n' starts at byte n * BytesPerLine, with one it comes
+	/// from the layout and 'Len' is 0 on gap lines.
+	int64 GetLines();
+	bool GetLine(GHexBuffer *b, int64 Line, int64 &Offset, int &Len);
+	int64 GetLineOfByte(GHexBuffer *b, int64 Offset, int &Col);
 	int64 GetSelectedNibbles();
 	void UpdateScrollBar();
 	GHexBuffer *GetCursorBuffer();
@@ -258,8 +367,14 @@ public:
 	void DoInfo();
 	int64 Search(SearchDlg *For, uchar *Bytes, int Len);
 	void DoSearch(SearchDlg *For);
+	void ReplaceAll(GArray<uint8> &Find, GArray<uint8> &Replace, bool MatchCase);
+	bool BuildIndex();
+	bool GetIndexStatus(GString &s);
 	bool GetCursorFromLoc(int x, int y, GHexCursor &c);
-	bool GetDataAtCursor(char *&Data, size_t &Len);
+	bool GetDataAtCursor(char *&Data, size_t &Len, int64 *Offset = NULL);
+	uint64 GetDataGeneration() { return DataGeneration; }
+	/// Reads from the cursor's file, including any unsaved changes
+	bool ReadAt(int64 Offset, uchar *Out, int Len);
 	void SetBit(uint8 Bit, bool On);
 	void SetByte(uint8 Byte);
 	void SetShort(uint16 Byte);
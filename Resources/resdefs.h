@@ -67,6 +67,37 @@
 #define IDM_NEW_BUFFER							533
 #define IDM_MENU_534							534
 #define IDM_PASTE_BINARY						535
+#define IDM_SIGNATURE_SCAN						536
+#define IDD_NUMERIC_SEARCH						537
+#define IDC_NUM_TYPE							538
+#define IDC_NUM_FROM							539
+#define IDC_NUM_TO								540
+#define IDC_NUM_ALIGN							541
+#define IDC_NUM_INFO							542
+#define IDM_NUMERIC_SEARCH						543
+#define IDC_MAX_DIFF							544
+#define IDC_ALLOW_INDELS						545
+#define IDM_BUILD_INDEX							546
+#define IDD_REPLACE								547
+#define IDC_REPLACE_FIND						548
+#define IDC_REPLACE_WITH						549
+#define IDC_REPLACE_HEX							550
+#define IDM_REPLACE								551
+#define IDD_BATCH_SEARCH						552
+#define IDC_BATCH_PATH							553
+#define IDC_BATCH_BROWSE						554
+#define IDC_BATCH_FIND							555
+#define IDC_BATCH_HEX							556
+#define IDC_BATCH_FIRST							557
+#define IDM_BATCH_SEARCH						558
+#define IDC_ENCODING							559
+#define IDM_NEXT_DIFF							560
+#define IDM_PREV_DIFF							561
+#define IDM_CREATE_PATCH						562
+#define IDM_APPLY_PATCH							563
+#define IDM_AUTO_ALIGN							564
+#define IDM_ALIGN_CURSOR						565
+#define IDM_DIFF_REPORT							566
 #define IDM_OPEN								15000
 #define IDM_SAVE								15002
 #define IDM_CLOSE								15003